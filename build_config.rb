@@ -12,6 +12,10 @@ MRuby::Build.new do |conf|
 
   enable_debug
 
+  # Instruction fetch hook for the hook watchdog, the Rakefile compiles the
+  # plugin with MRuby's defines as this one changes mrb_state
+  conf.cc.defines << 'MRB_ENABLE_DEBUG_HOOK'
+
   # Use mrbgems
   # conf.gem 'examples/mrbgems/ruby_extension_example'
   # conf.gem 'examples/mrbgems/c_extension_example' do |g|
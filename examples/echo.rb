@@ -0,0 +1,28 @@
+# Talks to a local echo server through HexChat::Socket, for example
+#   socat TCP-LISTEN:7000,fork,reuseaddr EXEC:cat
+# or a Unix one
+#   socat UNIX-LISTEN:/tmp/echo.sock,fork EXEC:cat
+class Echo < HexChat::Plugin
+  # /echo <text> sends the text and prints it when it comes back
+  on :command, 'echo', help: 'ECHO <text> round trip text through the echo server' do |_word, word_eol|
+    connect unless @sock && @sock.state != :closed
+    puts 'Echo: queue full, waiting for it to drain' unless @sock.write(word_eol[1] || '')
+    EAT_ALL
+  end
+
+  cleanup do
+    puts "Echo: #{@sock.stats.inspect}" if @sock
+  end
+
+  private
+
+  def connect
+    @sock = tcp_connect('127.0.0.1', 7000, framing: :line)
+    @sock.on(:connect) { puts 'Echo: connected' }
+    @sock.on(:frame) { |line| puts "Echo: #{line}" }
+    @sock.on(:drain) { puts 'Echo: drained' }
+    @sock.on(:close) { |error| puts "Echo: closed (#{error || 'by peer'})" }
+  end
+
+  register
+end
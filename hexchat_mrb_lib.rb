@@ -106,9 +106,42 @@ module HexChat
     "#{COLOR}#{f}#{t}"
   end
 
+  # Emit many print events in one call.  Each event is an array of
+  # [event_name, [args...], server_time, context], the last three optional.
+  # server_time is seconds since the epoch, context a HexChat::Context.
+  def self.emit_print_batch(events)
+    HexChat::Internal.emit_print_batch(events)
+  end
+
+  # Configure the hook watchdog, which is off until this is called or a
+  # plugin sets a budget.  budget: is the time in seconds a hook callback
+  # may run unless its plugin sets its own (default 1, 0 for no limit),
+  # strikes: the overruns after which a hook is unhooked (default 3, 0 for
+  # never).  Returns true if runaway callbacks are interrupted with
+  # HexChat::BudgetExceeded, false if overruns are only counted.
+  def self.watchdog(opts = {})
+    HexChat::Internal.watchdog(((opts[:budget] || 1) * 1000).to_i, opts[:strikes] || 3)
+  end
+
   # Internal functions that should not be called by the user
   # The C code also defines methods here
   class Internal
+    # Event attributes passed to hooks registered with attrs: true
+    # Values are read from the C structure when asked for
+    class EventAttrs
+      # Server time as a Time if available, otherwise seconds since the epoch
+      # nil if the server did not send one
+      def server_time
+        t = server_time_utc
+        return nil if t.nil? || t == 0
+        Object.const_defined?('Time') ? Time.at(t) : t
+      end
+
+      def to_h
+        { server_time_utc: server_time_utc }
+      end
+    end
+
     class << self
       # Called by C for /mrb command
       def mrb_command(word, _word_eol)
@@ -121,13 +154,32 @@ module HexChat
           print('  /MRB EVAL <ruby code> - evaluate the given code')
           print('  /MRB LOAD <file> - Load the given file')
           print('  /MRB UNLOAD <class> - Unregister the given plugin class')
+          print('  /MRB RELOAD <class> - Load the file of the given plugin class again, keeping its state')
+          print('  /MRB WATCH [ON|OFF] - Show or switch reloading scripts when they are written')
           print('  /MRB LIST - List plugin classes')
+          print('  /MRB STARTUP - Show time spent in each startup phase and autoloaded script')
+          print('  /MRB MEM - Show heap use per plugin class')
+          print('  /MRB POOL [ON|OFF] - Show small block pool use, or turn the pool on or off')
+          print('  /MRB TRACE START - Start recording hook, load, eval and GC spans')
+          print('  /MRB TRACE STOP <file> - Write the spans as Chrome trace JSON and stop')
         when 'load'
           HexChat::Plugin::Registry.load(arg) if arg
         when 'unload'
           HexChat::Plugin::Registry.unload(arg) if arg
+        when 'reload'
+          HexChat::Plugin::Registry.reload(arg) if arg
+        when 'watch'
+          watch_command(arg)
         when 'list'
           HexChat::Plugin::Registry.list
+        when 'startup'
+          startup_command
+        when 'mem'
+          mem_command
+        when 'pool'
+          pool_command(arg)
+        when 'trace'
+          trace_command(arg, word[3])
         else
           print("Unknown command: #{command}")
         end
@@ -143,6 +195,73 @@ module HexChat
 
       private
 
+      # /mrb startup
+      def startup_command
+        (phases, scripts, pending) = startup_stats
+        print(format('%-24s %10s', 'Phase', 'ms'))
+        phases.each { |(name, ms)| print(format('%-24s %10.2f', name, ms)) }
+        print('Autoload has not run yet') if pending
+        return if scripts.empty?
+        print(format('%-24s %10s', 'Script', 'ms'))
+        scripts.sort_by { |(_, ms, _)| -ms }.each do |(file, ms, ok)|
+          print(format('%-24s %10.2f%s', file, ms, ok ? '' : ' (error)'))
+        end
+      end
+
+      # /mrb watch [on|off]
+      def watch_command(action)
+        case (action || '').downcase
+        when 'on' then HexChat::Plugin::Registry.watch(true)
+        when 'off' then HexChat::Plugin::Registry.watch(false)
+        end
+        dir = scripts_watched
+        print(dir ? "Reloading scripts written in #{dir}" : 'Not watching scripts')
+      end
+
+      # /mrb mem
+      def mem_command
+        print(format('%-24s %12s %12s %10s %10s %12s', 'Plugin', 'Live', 'Peak', 'Allocs', 'Frees', 'Limit'))
+        mem_stats.each do |(name, live, peak, allocs, frees, limit)|
+          print(format('%-24s %12d %12d %10d %10d %12s', name || '(core)', live, peak, allocs, frees,
+                       limit > 0 ? limit.to_s : '-'))
+        end
+      end
+
+      # /mrb pool [on|off]
+      def pool_command(action)
+        case (action || '').downcase
+        when 'on' then pool(true)
+        when 'off' then pool(false)
+        end
+        (on, large, large_bytes, classes) = pool_stats
+        print("Pool #{on ? 'on' : 'off'}, #{large} blocks (#{large_bytes} bytes) from malloc")
+        print(format('%6s %6s %10s %10s %12s %12s', 'Size', 'Pages', 'Used', 'Free', 'Asked', 'Waste'))
+        classes.each do |(size, pages, used, free, asked)|
+          next if pages == 0
+          # Waste is what the pages hold beyond what mruby asked for
+          waste = pages * 65_536 - asked
+          print(format('%6d %6d %10d %10d %12d %12d', size, pages, used, free, asked, waste))
+        end
+      end
+
+      # /mrb trace start|stop <file>
+      def trace_command(action, file)
+        case (action || '').downcase
+        when 'start'
+          if trace_start
+            print('Tracing started')
+          else
+            print('Already tracing')
+          end
+        when 'stop'
+          return print('Usage: /MRB TRACE STOP <file>') unless file
+          n = trace_stop(file)
+          print(n ? "Wrote #{n} spans to #{file}" : 'Not tracing')
+        else
+          print('Usage: /MRB TRACE START|STOP <file>')
+        end
+      end
+
       # Free all open lists
       def free_lists
         u_count = 0
@@ -178,11 +297,12 @@ module HexChat
   end
 
   # Wraps a HexChat::Internal::Context into something useful
+  # The C code interns contexts, so there is one instance per HexChat context
   class Context
     class << self
       # Retrieve the current context
       def current
-        new(HexChat::Internal::Context.current)
+        wrap(HexChat::Internal::Context.current)
       end
 
       # Retrieve the focused context
@@ -192,8 +312,13 @@ module HexChat
 
       # Retrieve an arbitrary context
       def find(server = nil, channel = nil)
-        c = HexChat::Internal::Context.find(server, channel)
-        c ? new(c) : nil
+        wrap(HexChat::Internal::Context.find(server, channel))
+      end
+
+      # Return the one HexChat::Context for a HexChat::Internal::Context
+      def wrap(c)
+        return nil unless c
+        c.wrapper ||= new(c)
       end
     end
 
@@ -211,21 +336,753 @@ module HexChat
 
     # Compare this context to another context
     def ==(other)
-      other.is_a?(HexChat::Context) ? @context.ptr == other.context.ptr : false
+      other.is_a?(HexChat::Context) ? @context == other.context : false
     end
 
     # Temporarily set this context and execute the block
     def with(&_block)
+      return yield if @context.current?
       c = HexChat::Internal::Context.current
       set
-      result = yield
-      c.set
-      result
+      begin
+        yield
+      ensure
+        c.set if c
+      end
+    end
+  end
+
+  class Internal::Context
+    # The HexChat::Context wrapping this one
+    attr_accessor :wrapper
+  end
+
+  # Outbound command queue with flood control.  Items are queued per server
+  # and sent by the C code as the token bucket allows, highest priority first.
+  module Queue
+    class << self
+      # Queue a command (without leading /), returns an id for cancel
+      def command(cmd, priority = HexChat::QUEUE_NORM)
+        HexChat::Internal.queue_command(cmd.to_s, priority)
+      end
+
+      # Queue a mode change such as '+o' for each target, returns the ids
+      # Adjacent changes are sent together, as many per line as the server allows
+      def mode(targets, change, priority = HexChat::QUEUE_NORM)
+        targets = [targets] unless targets.is_a?(Array)
+        targets.map { |t| HexChat::Internal.queue_mode(t.to_s, change.to_s, priority) }
+      end
+
+      # Drop a queued item, true if it was still waiting
+      def cancel(id)
+        HexChat::Internal.queue_cancel(id)
+      end
+
+      # Drop everything queued, returns the number of items dropped
+      def clear
+        HexChat::Internal.queue_clear
+      end
+
+      # Number of items waiting to be sent
+      def pending
+        HexChat::Internal.queue_pending
+      end
+
+      # Set the burst size (lines) and the rate (seconds per line)
+      def configure(opts = {})
+        @burst = opts[:burst] || @burst || 5
+        @interval = opts[:interval] || @interval || 2
+        HexChat::Internal.queue_configure(@burst, (@interval * 1000).to_i)
+      end
+    end
+  end
+
+  # Shared strings for nicks, channels and hosts, and case-insensitive
+  # keys for them following the server's CASEMAPPING
+  module Intern
+    class << self
+      # Return the shared String equal to s.  Do not modify it.
+      def string(s)
+        HexChat::Internal.intern(s.to_s)
+      end
+
+      # Return a Symbol that is the same for every spelling of the name
+      # on the current server, e.g. key('Foo[1]') == key('foo{1}')
+      def key(name)
+        HexChat::Internal.intern_key(name.to_s)
+      end
+
+      # Compare names, or a name against an array of names
+      def casecmp(name, other)
+        HexChat::Internal.nickcmp(name.to_s, other)
+      end
+
+      # The current server's casemapping (:rfc1459, :strict_rfc1459 or :ascii)
+      def casemapping
+        HexChat::Internal.casemapping
+      end
+
+      # Number of shared strings
+      def size
+        HexChat::Internal.intern_size
+      end
+
+      # Forget all shared strings, returns how many there were
+      def clear
+        HexChat::Internal.intern_clear
+      end
+    end
+  end
+
+  # WHOIS lookups answered from a cache kept by the C code.  Lookups of a
+  # nick while a query for it is outstanding wait on that query, and the
+  # reply is parsed once and handed to all of them.  Entries expire after
+  # a TTL, are dropped on NICK and QUIT, and WHO replies keep them fresh.
+  module Whois
+    class << self
+      # Call the block with a Hash about nick on the current server (or
+      # opts[:context]'s), nil if there is no such nick or no reply came.
+      # A cached reply is passed right away.  Our queries are not printed
+      # unless opts[:quiet] is false.
+      def lookup(nick, opts = {}, &block)
+        fail ArgumentError, 'Whois.lookup needs a block' unless block
+        inst = opts[:plugin]
+        cb = inst ? proc { |info| inst.instance_exec(info, &block) } : block
+        ask = proc { HexChat::Internal.whois_lookup(nick.to_s, cb, opts[:quiet] != false) }
+        info = opts[:context] ? opts[:context].with(&ask) : ask.call
+        deliver([cb], info) if info
+        nil
+      end
+
+      # What is known about nick without asking the server, or nil.
+      # :complete is false when it only came from WHO replies.
+      def cached(nick)
+        HexChat::Internal.whois_cached(nick.to_s)
+      end
+
+      # Drop nick from the cache, or every entry
+      def forget(nick = nil)
+        HexChat::Internal.whois_forget(nick && nick.to_s)
+      end
+
+      # Set the entries kept, how long (seconds) a reply is used and how
+      # long to wait for one
+      def configure(opts = {})
+        @size = opts[:size] || @size || 512
+        @ttl = opts[:ttl] || @ttl || 300
+        @timeout = opts[:timeout] || @timeout || 30
+        HexChat::Internal.whois_configure(@size, (@ttl * 1000).to_i, (@timeout * 1000).to_i)
+      end
+
+      def stats
+        (entries, pending, hits, joined, queries, timeouts) = HexChat::Internal.whois_stats
+        { entries: entries, pending: pending, hits: hits, joined: joined, queries: queries, timeouts: timeouts }
+      end
+
+      # Called from C with every block waiting on a reply
+      def deliver(waiters, info)
+        waiters.each do |cb|
+          begin
+            cb.call(info)
+          rescue => e
+            HexChat::Internal.print("MRuby: error in whois block: #{e.inspect}")
+          end
+        end
+      end
+    end
+
+    # The blocks a plugin is waiting on replies with.  Whois.lookup holds
+    # only a proc that looks its block up here, so unloading the plugin
+    # drops the blocks and the late reply finds nothing to run.
+    class Waiters
+      def initialize(inst)
+        @inst = inst
+        @blocks = {}
+        @next = 0
+      end
+
+      # A block for Whois.lookup that runs in the plugin instance
+      def wrap(block)
+        id = (@next += 1)
+        @blocks[id] = block
+        proc do |info|
+          block = @blocks.delete(id)
+          @inst.instance_exec(info, &block) if block
+        end
+      end
+
+      # Plugins unhook everything they own when unloaded
+      def unhook
+        @blocks.clear
+      end
+    end
+  end
+
+  # A set of nick!user@host masks with * and ? wildcards, indexed by
+  # the C code so matching does not try every mask
+  class MaskSet
+    # casemapping is :rfc1459, :strict_rfc1459, :ascii or nil for the
+    # current server's
+    def initialize(masks = [], casemapping = nil)
+      @set = HexChat::Internal::MaskSet.new(casemapping)
+      masks.each { |m| add(m) }
+    end
+
+    # Add a mask, false if it was already there
+    def add(mask)
+      @set.add(mask.to_s)
+    end
+
+    alias << add
+
+    # Remove a mask, false if it wasn't there
+    def remove(mask)
+      @set.remove(mask.to_s)
+    end
+
+    alias delete remove
+
+    def include?(mask)
+      @set.include?(mask.to_s)
+    end
+
+    # Masks matching a nick!user@host, in no particular order
+    def match(hostmask)
+      @set.match(hostmask.to_s)
+    end
+
+    def match?(hostmask)
+      @set.match?(hostmask.to_s)
+    end
+
+    alias === match?
+
+    def each(&block)
+      @set.masks.each(&block)
+      self
+    end
+
+    def to_a
+      @set.masks
+    end
+
+    def size
+      @set.size
+    end
+
+    def empty?
+      @set.size == 0
+    end
+
+    def clear
+      @set.clear
+      self
+    end
+
+    # Number of masks in each index
+    def stats
+      @set.stats
+    end
+  end
+
+  # Counts hits per key (nick, host, ...) over a sliding window, for flood
+  # detection.  The window is split into buckets kept as a ring of counters
+  # in C, so hits and counts cost the same however busy a key is.
+  class RateTracker
+    attr_reader :window
+
+    # window: longest window in seconds that will be asked about
+    # buckets: resolution of the window
+    # sketch: { width:, depth: } to share a fixed number of counters between
+    #         all keys (count-min sketch), counts may then be overestimated
+    def initialize(opts = {})
+      @window = opts[:window] || 60
+      buckets = opts[:buckets] || 60
+      sketch = opts[:sketch]
+      if sketch
+        @tracker = HexChat::Internal::RateTracker.new(ms(@window), buckets, sketch[:width] || 1024, sketch[:depth] || 4)
+      else
+        @tracker = HexChat::Internal::RateTracker.new(ms(@window), buckets)
+      end
+    end
+
+    # Record a hit, returns the number of hits over the window
+    def hit(key, hits = 1)
+      @tracker.hit(key.to_s, hits)
+    end
+
+    # Number of hits over the last window seconds
+    def rate(key, window = nil)
+      @tracker.count(key.to_s, window ? ms(window) : 0)
+    end
+
+    # Has the key been hit more than limit times over the last window seconds
+    def over?(key, limit, window = nil)
+      rate(key, window) > limit
+    end
+
+    # Forget a key, not possible in sketch mode
+    def delete(key)
+      @tracker.delete(key.to_s)
+    end
+
+    # Number of keys tracked, nil in sketch mode
+    def size
+      @tracker.size
+    end
+
+    def clear
+      @tracker.clear
+      self
+    end
+
+    private
+
+    def ms(secs)
+      (secs * 1000).to_i
+    end
+  end
+
+  # Shared scrollback of messages, kept and indexed by the C code
+  module History
+    class << self
+      # Start recording.  lines and bytes size the history of each context.
+      def enable(opts = {})
+        HexChat::Internal.history_enable(opts[:lines] || 5000, opts[:bytes] || 512 * 1024)
+      end
+
+      # Stop recording and forget everything
+      def disable
+        HexChat::Internal.history_disable
+      end
+
+      # Find lines containing every word of query, newest first
+      # Options: nick:, since:, until: (Time or seconds since the epoch),
+      # limit: (default 100), context: (HexChat::Context, default current,
+      # or :all)
+      def search(query = nil, opts = {})
+        limit = opts[:limit] || 100
+        contexts = case opts[:context]
+                   when :all
+                     HexChat::Internal.history_contexts
+                   when nil
+                     [nil]
+                   else
+                     [opts[:context]]
+                   end
+        result = []
+        contexts.each do |c|
+          rows = HexChat::Internal.history_search(c, query, opts[:nick], opts[:since].to_i, opts[:until].to_i, limit)
+          cxt = c.nil? ? HexChat::Context.current : HexChat::Context.wrap(c.is_a?(HexChat::Context) ? c.context : c)
+          rows.each do |(t, nick, text)|
+            result.push(time: Object.const_defined?('Time') ? Time.at(t) : t, nick: nick, text: text, context: cxt)
+          end
+        end
+        result.sort_by! { |r| -r[:time].to_i } if contexts.size > 1
+        result.first(limit)
+      end
+
+      # The last n lines of a context
+      def last(n = 10, context = nil)
+        search(nil, limit: n, context: context)
+      end
+
+      # Contexts, lines, index terms and bytes held
+      def stats
+        (contexts, lines, terms, bytes) = HexChat::Internal.history_stats
+        { contexts: contexts, lines: lines, terms: terms, bytes: bytes }
+      end
+    end
+  end
+
+  # On-disk archive of messages per network and channel, written in
+  # compressed blocks by a background thread in the C code
+  module Archive
+    class << self
+      # Start archiving, by default into <configdir>/mruby/archive
+      def enable(opts = {})
+        dir = opts[:dir] || "#{HexChat::Internal.get_info('configdir')}/mruby/archive"
+        HexChat::Internal.archive_enable(dir.to_s)
+      end
+
+      # Stop archiving, after writing out everything
+      def disable
+        HexChat::Internal.archive_disable
+      end
+
+      # Write out partially filled blocks now
+      def flush
+        HexChat::Internal.archive_flush
+      end
+
+      # Lines of a channel, newest first
+      # Options: since:, until: (Time or seconds since the epoch), nick:,
+      # limit: (default 100)
+      def search(network, channel, opts = {})
+        rows = HexChat::Internal.archive_search(network.to_s, channel.to_s, opts[:since].to_i, opts[:until].to_i,
+                                                opts[:nick] ? opts[:nick].to_s : nil, opts[:limit] || 100)
+        rows.map do |(t, nick, text)|
+          { time: Object.const_defined?('Time') ? Time.at(t) : t, nick: nick, text: text }
+        end
+      end
+
+      # Blocks and bytes written, blocks waiting to be written
+      def stats
+        (blocks, raw, comp, queued) = HexChat::Internal.archive_stats
+        { blocks: blocks, raw_bytes: raw, compressed_bytes: comp, queued: queued }
+      end
+    end
+  end
+
+  # Log file written by a background thread.  Writing only copies into a
+  # ring buffer, so a slow disk never stalls HexChat.
+  class Logger
+    # Options:
+    #   buffer: ring size in bytes (default 1 MiB), writes that don't fit
+    #           are dropped
+    #   fsync: :never (default), :always or seconds between fsyncs
+    #   max_size: rotate the file past this many bytes (default never)
+    #   keep: rotated files kept as path.1, path.2, ... (default 5)
+    def initialize(path, opts = {})
+      fsync = case opts[:fsync]
+              when nil, :never then -1
+              when :always then 0
+              else (opts[:fsync] * 1000).to_i
+              end
+      @logger = HexChat::Internal::Logger.new(path.to_s, opts[:buffer] || 1_048_576, fsync, opts[:max_size] || 0, opts[:keep] || 5)
+    end
+
+    # Queue a string, false if the buffer was full and it was dropped
+    def write(s)
+      @logger.write(s.to_s)
+    end
+
+    # Queue a string and return self, for chaining
+    def <<(s)
+      @logger.write(s.to_s)
+      self
+    end
+
+    # Queue each argument as a line, false if any was dropped
+    def puts(*lines)
+      queued = true
+      lines.each { |l| queued = false unless @logger.write(l.to_s.end_with?("\n") ? l.to_s : "#{l}\n") }
+      queued
+    end
+
+    # Ask the writer to write now, does not wait for it
+    def flush
+      @logger.flush
+      self
+    end
+
+    # Stop using the logger, what was queued is still written
+    def close
+      @logger.close
+    end
+
+    def stats
+      (written, dropped, pending, rotations, error) = @logger.stats
+      { written: written, dropped: dropped, pending: pending, rotations: rotations, errno: error }
+    end
+  end
+
+  # A non-blocking TCP or Unix domain stream socket, serviced by a HexChat
+  # fd hook so nothing waits on it.  Data is read and split into frames in
+  # C; handlers only see whole frames.
+  #
+  # Options:
+  #   framing: :line (default, LF terminated, CR dropped), :length (4 byte
+  #            big-endian length prefix) or :raw (whatever arrived)
+  #   max_frame: longest frame in bytes (default 1 MiB), a longer one
+  #              closes the socket
+  #   high_water: queued bytes past which write returns false (default
+  #               1 MiB), writing four times that raises
+  class Socket
+    FRAMING = { raw: 0, line: 1, length: 2 }
+
+    # Connect to host and port, host must be an IPv4 or IPv6 address:
+    # names are not resolved since that would block HexChat
+    def self.tcp(host, port, opts = {})
+      new('tcp', host, port, opts)
+    end
+
+    # Connect to a Unix domain socket
+    def self.unix(path, opts = {})
+      new('unix', path, 0, opts)
+    end
+
+    def initialize(kind, address, port, opts = {})
+      framing = FRAMING[opts[:framing] || :line]
+      fail ArgumentError, "unknown framing #{opts[:framing].inspect}" unless framing
+      @inst = opts[:plugin]
+      @handlers = {}
+      @sock = HexChat::Internal::Socket.new(kind, address.to_s, port.to_i, framing,
+                                            opts[:max_frame] || 1_048_576, opts[:high_water] || 1_048_576)
+      @hook = HexChat::Internal::Hook.new { |_fd, flags| service(flags) }
+      @hook.set_ref(self)
+      @flags = 0
+      update_hook
+    end
+
+    # Set the handler for :connect, :frame (gets the frame), :drain (the
+    # write queue emptied after write returned false) or :close (gets the
+    # error, nil if the peer closed)
+    def on(event, &block)
+      fail ArgumentError, "unknown socket event #{event.inspect}" unless [:connect, :frame, :drain, :close].include?(event)
+      @handlers[event] = block
+      self
+    end
+
+    # Queue a frame, false once the queue is past the high water mark
+    def write(data)
+      ok = @sock.write(data.to_s)
+      dispatch(@sock.service(0)) if @sock.state == :closed
+      update_hook
+      ok
+    end
+
+    # :connecting, :open or :closed
+    def state
+      @sock.state
+    end
+
+    def open?
+      @sock.state == :open
+    end
+
+    # Close now, anything still queued is dropped
+    def close
+      @hook.unhook
+      @sock.close
+      nil
+    end
+
+    # Plugins unhook everything they own when unloaded
+    alias unhook close
+
+    def stats
+      (received, sent, queued, buffered) = @sock.stats
+      { received: received, sent: sent, queued: queued, buffered: buffered }
+    end
+
+    private
+
+    # Called from the fd hook
+    def service(flags)
+      dispatch(@sock.service(flags))
+      1
+    ensure
+      update_hook
+    end
+
+    def dispatch(events)
+      events.each do |(event, arg)|
+        handler = @handlers[event]
+        next unless handler
+        begin
+          @inst ? @inst.instance_exec(arg, &handler) : handler.call(arg)
+        rescue => e
+          HexChat::Internal.print("MRuby: error in socket #{event} handler: #{e.inspect}")
+        end
+      end
+    end
+
+    # Hook for what the socket is waiting on, nothing once it is closed
+    def update_hook
+      flags = @sock.flags
+      return if flags == @flags
+      @flags = flags
+      if flags == 0
+        @hook.unhook
+      else
+        @hook.hook_fd(@sock.fd, flags)
+      end
+    end
+  end
+
+  # A child process whose output is read through HexChat fd hooks, so a
+  # long running command streams its results without stalling HexChat.
+  # Output is split into lines in C.  Only this child is ever waited for;
+  # no SIGCHLD handler is installed.
+  #
+  # Options:
+  #   stderr: :merge to read stderr as stdout lines (default: separate)
+  #   timeout: seconds after which the child gets SIGTERM
+  #   kill_after: seconds after SIGTERM before SIGKILL (default 2)
+  #   max_line: longest line in bytes (default 64 KiB), longer ones
+  #             are handed over in pieces
+  class Process
+    SIGTERM = 15
+    SIGKILL = 9
+
+    # Run argv (an Array, no shell is involved) and call the block with
+    # each line of its standard output
+    def self.spawn(argv, opts = {}, &block)
+      new(argv, opts, &block)
+    end
+
+    attr_reader :status, :signal
+
+    def initialize(argv, opts = {}, &block)
+      argv = [argv] unless argv.is_a?(Array)
+      @inst = opts[:plugin]
+      @handlers = { stdout: block }
+      @proc = HexChat::Internal::Process.new(argv.map(&:to_s), opts[:stderr] == :merge, opts[:max_line] || 65_536)
+      @pipes = {}
+      @proc.fds.each do |fd|
+        next if fd < 0
+        hook = HexChat::Internal::Hook.new { |f, _flags| service(f) }
+        hook.set_ref(self)
+        hook.hook_fd(fd, HexChat::FD_READ)
+        @pipes[fd] = hook
+      end
+      # Polled rather than told, HexChat owns SIGCHLD
+      @reaper = HexChat::Internal::Hook.new { reap }
+      @reaper.set_ref(self)
+      @reaper.hook_timer(100)
+      return unless opts[:timeout]
+      @kill_after = opts[:kill_after] || 2
+      @timer = HexChat::Internal::Hook.new { timeout }
+      @timer.set_ref(self)
+      @timer.hook_timer((opts[:timeout] * 1000).to_i)
+    end
+
+    # Set the handler for :stdout or :stderr (gets each line) or :exit
+    # (gets the exit status and the signal that killed it, one is nil)
+    def on(event, &block)
+      fail ArgumentError, "unknown process event #{event.inspect}" unless [:stdout, :stderr, :exit].include?(event)
+      @handlers[event] = block
+      self
+    end
+
+    def pid
+      @proc.pid
+    end
+
+    def running?
+      @done.nil?
+    end
+
+    # Send the child a signal, SIGTERM by default
+    def kill(signal = SIGTERM)
+      @proc.kill(signal)
+    end
+
+    # Kill the child and stop watching it, no handler runs after this.
+    # The child is reaped in the background.
+    def close
+      kill(SIGKILL) if running?
+      @handlers.clear
+      finish_pipes
+      finish_timers
+      nil
+    end
+
+    # Plugins unhook everything they own when unloaded
+    alias unhook close
+
+    private
+
+    # Called from the pipe hooks
+    def service(fd)
+      lines = @proc.service(fd)
+      dispatch_lines(lines)
+      unless @proc.fds.include?(fd)
+        release(@pipes.delete(fd))
+        reap if @pipes.empty?
+      end
+      1
+    end
+
+    def dispatch_lines(lines)
+      lines.each do |(stream, line)|
+        call_handler(stream == 0 ? :stdout : :stderr, line)
+      end
+    end
+
+    # Called from the reaper timer and once the pipes are closed
+    def reap
+      return 0 unless @done.nil?
+      result = @proc.reap
+      return 1 unless result
+      @done = true
+      (@status, @signal) = result
+      # Output still waiting, anything written later by grandchildren is lost
+      @pipes.each_key { |fd| dispatch_lines(@proc.service(fd)) }
+      finish_pipes
+      finish_timers
+      call_handler(:exit, @status, @signal)
+      0
+    end
+
+    # Called from the timeout timer: SIGTERM, then SIGKILL
+    def timeout
+      if @termed
+        kill(SIGKILL)
+        @timer.unhook
+        return 0
+      end
+      @termed = true
+      kill(SIGTERM)
+      @timer.hook_timer((@kill_after * 1000).to_i)
+      1
+    end
+
+    # The hooks root this object through their refs, so drop those too
+    def finish_pipes
+      @pipes.each_value { |hook| release(hook) }
+      @pipes.clear
+      @proc.close
+    end
+
+    def finish_timers
+      release(@reaper)
+      release(@timer) if @timer
+    end
+
+    def release(hook)
+      hook.unhook
+      hook.set_ref(nil)
+    end
+
+    def call_handler(event, *args)
+      handler = @handlers[event]
+      return unless handler
+      @inst ? @inst.instance_exec(*args, &handler) : handler.call(*args)
+    rescue => e
+      HexChat::Internal.print("MRuby: error in process #{event} handler: #{e.inspect}")
+    end
+  end
+
+  # Plugin health counters (hooks, callback latency, exceptions, heap) in
+  # the Prometheus text format, optionally served on a Unix domain socket
+  module Metrics
+    class << self
+      # Serve the metrics on a Unix domain socket, by default
+      # <configdir>/mruby/metrics.sock.  Only the owner can connect.
+      def listen(path = nil)
+        path ||= "#{HexChat::Internal.get_info('configdir')}/mruby/metrics.sock"
+        HexChat::Internal.metrics_listen(path.to_s)
+      end
+
+      # Stop serving, false if the socket was not open
+      def close
+        HexChat::Internal.metrics_close
+      end
+
+      # The metrics as a scrape would see them
+      def text
+        HexChat::Internal.metrics
+      end
     end
   end
 
   # Base class for HexChat lists plus dynamic generator functions
   class List
+    # String fields that repeat a lot and are returned as shared strings
+    INTERNED_FIELDS = [:nick, :host, :account, :prefix, :channel, :network, :server]
+
     class << self
       # Return fields for the current list
       def fields
@@ -246,6 +1103,15 @@ module HexChat
         @name = name
       end
 
+      # Create a list class the first time it is named, e.g. HexChat::List::Users
+      def const_missing(name)
+        return super unless self == HexChat::List
+        list = name.to_s.downcase
+        lists = HexChat::Internal::List.fields('lists')
+        return super unless lists && lists.include?(list) && list.capitalize == name.to_s
+        create_list_class(list)
+      end
+
       # Create all the list classes dynamically
       def create_list_classes
         return nil unless self == HexChat::List
@@ -275,8 +1141,10 @@ module HexChat
                    :context if n == :context
                  end
           field_hash[n] = { type: type, name: f }
+          field_hash[n][:interned] = true if type == :string && INTERNED_FIELDS.include?(n)
         end
         klass.set_values(field_hash, list)
+        klass
       end
 
       # Call block for each list item
@@ -291,13 +1159,13 @@ module HexChat
               # puts "#{n} #{i[:type]} #{i}"
               h[n] = case i[:type]
                      when :string
-                       list.str(n.to_s)
+                       i[:interned] ? list.istr(n.to_s) : list.str(n.to_s)
                      when :time
                        Object.const_defined?('Time') ? Time.at(list.time(n.to_s)) : list.time(n.to_s)
                      when :integer
                        list.int(n.to_s)
                      when :context
-                       HexChat::Context.new(list.cxt(n.to_s))
+                       HexChat::Context.wrap(list.cxt(n.to_s))
                      end
             end
             yield h
@@ -327,7 +1195,7 @@ module HexChat
   # use this and instead use the methods provided by the HexChat::Plugin
   # class
   class Hook
-    attr_reader :name, :fd, :timeout
+    attr_reader :type, :name, :fd, :timeout, :priority
 
     # Set up a new hook.  Inst will be the object that the hook
     # block will be instance_evaluated
@@ -339,9 +1207,16 @@ module HexChat
 
     # Set the hook for an action
     def on(type, name, opts = {}, &block)
+      # First, so bad options leave the hook as it was
+      coalesce(type, opts)
       unhook if hooked?
       @block = block
+      @type = type
+      @attrs = opts[:attrs] ? true : false
       priority = opts[:priority] || HexChat::PRI_NORM
+      @priority = type == :timer || type == :fd ? nil : priority
+      budget = opts[:budget] || (@inst.class.respond_to?(:budget) && @inst.class.budget)
+      self.budget = budget || 0
       case type
       when :command
         fail 'command name must be a String' unless name.is_a?(String)
@@ -350,14 +1225,23 @@ module HexChat
       when :fd
         fail 'fd must be an Integer' unless name.is_a?(Integer)
         @fd = name
+        @hook.hook_fd(name, opts[:flags] || HexChat::FD_READ)
       when :print
         fail 'print event name must be a String' unless name.is_a?(String)
         @name = name
-        @hook.hook_print(name, priority)
+        if opts[:attrs]
+          @hook.hook_print_attrs(name, priority)
+        else
+          @hook.hook_print(name, priority)
+        end
       when :server
         fail 'server event name must be a String' unless name.is_a?(String)
         @name = name
-        @hook.hook_server(name, priority)
+        if opts[:attrs]
+          @hook.hook_server_attrs(name, priority)
+        else
+          @hook.hook_server(name, priority)
+        end
       when :timer
         fail 'timeout must be an Fixnum' unless name.is_a?(Fixnum)
         @timeout = name
@@ -368,6 +1252,25 @@ module HexChat
       self
     end
 
+    # Set up the debounce:, throttle: or batch: option of a print or
+    # server hook, the block then gets an Array of events.  max: caps a
+    # debounce (1000 events by default).
+    def coalesce(type, opts)
+      modes = [:debounce, :throttle, :batch].select { |m| opts[m] }
+      fail 'only one of debounce, throttle and batch may be given' if modes.size > 1
+      mode = modes.first
+      fail "#{mode} only applies to print and server hooks" if mode && ![:print, :server].include?(type)
+      case mode
+      when nil
+        @hook.coalesce(nil)
+      when :batch
+        batch = opts[:batch].is_a?(Hash) ? opts[:batch] : { max: opts[:batch] }
+        @hook.coalesce(:batch, ((batch[:window] || 1) * 1000).to_i, batch[:max] || 0)
+      else
+        @hook.coalesce(mode, (opts[mode] * 1000).to_i, mode == :debounce ? opts[:max] || 0 : 0)
+      end
+    end
+
     # Call the hook's block
     def call(*args)
       fail 'block not set' unless @block.is_a?(Proc)
@@ -378,9 +1281,34 @@ module HexChat
       @hook.hooked?
     end
 
+    # True if the block is passed event attributes
+    def attrs?
+      @attrs
+    end
+
+    # Run the block as if HexChat had called the hook, returns the eat value
+    def fire(*args)
+      @hook.fire(*args)
+    end
+
     def unhook
       @hook.unhook
     end
+
+    # Seconds each call may run, 0 for the watchdog default
+    def budget=(seconds)
+      @hook.set_budget((seconds * 1000).to_i)
+    end
+
+    # Calls that ran over the budget
+    def overruns
+      @hook.overruns
+    end
+
+    # True if the watchdog unhooked this hook for running over its budget
+    def disabled?
+      @hook.disabled?
+    end
   end
 
   # The base class for all plugins.  Users should subclass this to create
@@ -408,15 +1336,45 @@ module HexChat
         nil
       end
 
+      # Define the block whose result is kept across /mrb reload.  It
+      # may return nil, true, false, numbers, Strings, Symbols, named
+      # Structs and Arrays and Hashes of those.
+      def snapshot(&block)
+        HexChat::Plugin::Registry.defer_hook(self, type: :snapshot, name: nil, opts: {}, block: block)
+        nil
+      end
+
+      # Define the block that gets the snapshot after /mrb reload, it runs
+      # after the setup blocks
+      def restore(&block)
+        HexChat::Plugin::Registry.defer_hook(self, type: :restore, name: nil, opts: {}, block: block)
+        nil
+      end
+
       # Define a hook
       def on(type, name, opts = {}, &block)
         HexChat::Plugin::Registry.defer_hook(self, type: type, name: name, opts: opts, block: block)
         nil
       end
 
-      # Register this plugin
-      def register
-        HexChat::Plugin::Registry.register(self)
+      # Soft heap limit in bytes.  Going over it runs a full GC and, if
+      # that does not help, prints a warning.  0 removes the limit.
+      def memory_limit(bytes)
+        HexChat::Internal.mem_limit(to_s, bytes.to_i)
+      end
+
+      # Seconds each hook callback of this plugin may run, nil for the
+      # watchdog default.  Call with no argument to read it.
+      def budget(seconds = nil)
+        @budget = seconds if seconds
+        @budget
+      end
+
+      # Register this plugin.  With lazy: true the plugin is not created
+      # until one of its hooks first fires, so its setup blocks only run
+      # if it is actually used.
+      def register(opts = {})
+        HexChat::Plugin::Registry.register(self, opts)
       end
 
       # I wish this worked, wonder if there's a way to delay response
@@ -438,10 +1396,26 @@ module HexChat
     def initialize
       @hooks = []
       @cleanup = []
-      setup_deferred
+      begin
+        setup_deferred
+      rescue
+        # Leave nothing hooked by a plugin that failed to start
+        @hooks.each(&:unhook)
+        raise
+      end
       self
     end
 
+    # State to carry over a reload, from the snapshot block
+    def snapshot_state
+      @snapshot ? instance_exec(&@snapshot) : nil
+    end
+
+    # Hand the state from before a reload to the restore block
+    def restore_state(state)
+      instance_exec(state, &@restore) if @restore
+    end
+
     def cleanup
       @hooks.each(&:unhook)
       @cleanup.each do |block|
@@ -459,6 +1433,10 @@ module HexChat
           instance_eval(&r[:block])
         when :cleanup
           @cleanup.push(r[:block])
+        when :snapshot
+          @snapshot = r[:block]
+        when :restore
+          @restore = r[:block]
         else
           on r[:type], r[:name], r[:opts] { |*args| instance_exec(*args, &r[:block]) }
         end
@@ -483,6 +1461,10 @@ module HexChat
       HexChat::Internal.emit_print(*args)
     end
 
+    def emit_print_batch(events)
+      HexChat.emit_print_batch(events)
+    end
+
     def nickcmp(n1, n2)
       HexChat::Internal.nickcmp(n1, n2)
     end
@@ -493,6 +1475,14 @@ module HexChat
       end
     end
 
+    def queue_command(cmd, priority = HexChat::QUEUE_NORM)
+      HexChat::Queue.command(cmd, priority)
+    end
+
+    def queue_mode(targets, change, priority = HexChat::QUEUE_NORM)
+      HexChat::Queue.mode(targets, change, priority)
+    end
+
     def get_info(item)
       HexChat::Internal.get_info(item)
     end
@@ -561,6 +1551,40 @@ module HexChat
       hook.on(type, name, opts, &block)
     end
 
+    # Run a command with HexChat::Process, killed when the plugin is
+    # unloaded.  Handlers run in the plugin instance.
+    def spawn(argv, opts = {}, &block)
+      process = HexChat::Process.spawn(argv, opts.merge(plugin: self), &block)
+      @hooks.push(process)
+      process
+    end
+
+    # Look up nick with HexChat::Whois, the block runs in the plugin
+    # instance and is dropped if the plugin is unloaded first
+    def whois(nick, opts = {}, &block)
+      fail ArgumentError, 'whois needs a block' unless block
+      unless @whois_waiters
+        @whois_waiters = HexChat::Whois::Waiters.new(self)
+        @hooks.push(@whois_waiters)
+      end
+      HexChat::Whois.lookup(nick, opts, &@whois_waiters.wrap(block))
+    end
+
+    # Open a HexChat::Socket to host and port, closed when the plugin is
+    # unloaded.  Handlers run in the plugin instance.
+    def tcp_connect(host, port, opts = {})
+      socket = HexChat::Socket.tcp(host, port, opts.merge(plugin: self))
+      @hooks.push(socket)
+      socket
+    end
+
+    # Open a HexChat::Socket to a Unix domain socket, as tcp_connect
+    def unix_connect(path, opts = {})
+      socket = HexChat::Socket.unix(path, opts.merge(plugin: self))
+      @hooks.push(socket)
+      socket
+    end
+
     def unhook
       fail 'not unhookable' unless $__HOOK_REF != self && $__HOOK_REF.respond_to?(:unhook)
       $__HOOK_REF.unhook
@@ -576,7 +1600,7 @@ module HexChat
       when :fd
         fail 'fd must be an Integer' unless name.is_a?(Integer)
         fail 'flags option (Integer) is required' unless opts[:flags].is_a?(Integer)
-        hook.hook_fd(fd, flags)
+        hook.hook_fd(name, opts[:flags])
       when :print
         fail 'print event name must be a String' unless name.is_a?(String)
         hook.hook_print(name)
@@ -607,6 +1631,7 @@ module HexChat
           if Dir.exist?(dir)
             files = Dir.new(dir).enum_for.select { |f| f.end_with?('.rb', '.mrb') }
             files.each { |f| load(f) }
+            watch(true)
           else
             HexChat::Internal.print("MRuby: #{dir} not found, autoloading disabled")
           end
@@ -625,7 +1650,14 @@ module HexChat
             "#{HexChat::Internal.get_info('libdirfs')}/mruby/#{file}"
           ].detect { |f| File.exist?(f) }
         end
-        success = HexChat::Internal.load(file) if file
+        if file
+          @loading_file = file
+          begin
+            success = HexChat::Internal.load(file)
+          ensure
+            @loading_file = nil
+          end
+        end
         if success
           HexChat::Internal.print("MRuby: Loaded #{plugin}")
         else
@@ -635,40 +1667,275 @@ module HexChat
       end
 
       def unload(klass_name)
-        klass = nil
-        if klass_name
-          ObjectSpace.each_object do |o|
-            klass = o if o.is_a?(Class) && o.ancestors.include?(HexChat::Plugin) && o.to_s == klass_name
-          end
-        end
-        if klass && klass != HexChat::Plugin
+        klass = find_class(klass_name)
+        if klass
           klass.unregister
         else
           print("Cannot unload: #{klass_name.inspect}")
         end
       end
 
+      # Reload scripts in the autoload directory when they are written
+      def watch(on)
+        return HexChat::Internal.scripts_unwatch unless on
+        dir = "#{HexChat::Internal.get_info('configdir')}/mruby"
+        HexChat::Internal.scripts_watch(dir, 300)
+      rescue => e
+        HexChat::Internal.print("MRuby: #{e.message}, scripts will not be reloaded when changed")
+        false
+      end
+
+      # Called by C when a script in the watched directory was written.
+      # Plugins from a file loaded before are reloaded, a new file is loaded.
+      def changed(file)
+        base = file.split('/').last
+        known = (@files ||= {}).values.detect { |f| f == file || f == base }
+        if known
+          HexChat::Internal.print("MRuby: #{base} changed, reloading")
+          reload_file(known)
+        else
+          load(file)
+        end
+      end
+
+      # Load the file a plugin class came from again.  Every plugin that
+      # file registers keeps its snapshot state, and keeps running as it
+      # was if the file fails to load.
+      def reload(klass_name)
+        klass = find_class(klass_name)
+        file = klass && (@files ||= {})[klass]
+        return HexChat::Internal.print("Cannot reload: #{klass_name.inspect}") unless file
+        reload_file(file)
+      end
+
+      # Reload a file, swapping in new instances of its plugins.  The
+      # plugins it registers are only staged while it loads, and swapped
+      # once the whole file has loaded, so a file that fails part way
+      # leaves every old instance running.  A lazy plugin's declarations
+      # are set aside while the file declares them again, and put back
+      # if it is not swapped.
+      def reload_file(file)
+        @reloading = {}
+        @staged = []
+        saved = {}
+        (@files ||= {}).each_pair do |klass, f|
+          next unless f == file
+          inst = (@registry ||= {})[klass]
+          @reloading[klass] = inst && HexChat::Internal.state_dump(inst.snapshot_state)
+          saved[klass] = (@deferred_hooks ||= {}).delete(klass) || []
+        end
+        success = load(file)
+        staged = @staged
+        @staged = nil
+        if success
+          staged.each do |(klass, opts)|
+            begin
+              swap(klass, opts)
+            rescue => e
+              HexChat::Internal.print("MRuby: Cannot reload #{klass}: #{e.message}")
+              restore_hooks(klass, saved[klass])
+              success = false
+            end
+          end
+        end
+        success
+      rescue => e
+        HexChat::Internal.print("MRuby: Cannot reload #{file}: #{e.message}")
+        false
+      ensure
+        # Anything left was not registered again or not swapped, it keeps
+        # its old declarations
+        @reloading.each_key { |klass| restore_hooks(klass, saved[klass]) } if @reloading
+        @reloading = nil
+        @staged = nil
+      end
+
+      # Put back the declarations of a plugin that was not reloaded.  A
+      # lazy one whose stubs went in a failed swap gets them back.
+      def restore_hooks(klass, hooks)
+        @deferred_hooks[klass] = hooks
+        stub_hooks(klass) unless hooks.empty? || registered?(klass)
+      rescue => e
+        HexChat::Internal.print("MRuby: Cannot restore #{klass}: #{e.message}")
+      end
+
       def list
-        if @registry
+        if @registry && !@registry.empty?
           puts "MRuby registered plugins: #{@registry.keys.map(&:to_s).join(', ')}"
+          @registry.each { |klass, inst| list_overruns(klass, inst) }
         else
           puts 'MRuby: no registered plugins'
         end
+        puts "MRuby lazy plugins not yet used: #{@lazy.keys.map(&:to_s).join(', ')}" if @lazy && !@lazy.empty?
+      end
+
+      # Report hooks of a plugin that ran over their budget
+      def list_overruns(klass, inst)
+        inst.hooks.each do |h|
+          next unless h.is_a?(HexChat::Hook) && h.overruns > 0
+          target = h.name || h.fd || h.timeout
+          state = h.disabled? ? 'disabled' : 'still hooked'
+          puts "  #{klass}: #{h.type} #{target} hook ran over its budget #{h.overruns} times, #{state}"
+        end
+      end
+
+      # Plugin class by name, nil if there is none
+      def find_class(klass_name)
+        klass = nil
+        if klass_name
+          ObjectSpace.each_object do |o|
+            klass = o if o.is_a?(Class) && o.ancestors.include?(HexChat::Plugin) && o.to_s == klass_name
+          end
+        end
+        klass == HexChat::Plugin ? nil : klass
       end
 
       def registered?(klass)
-        (@registry ||= {}).key?(klass)
+        (@registry ||= {}).key?(klass) || lazy?(klass)
+      end
+
+      # True if the plugin is registered lazily and has not fired yet
+      def lazy?(klass)
+        (@lazy ||= {}).key?(klass)
       end
 
-      def register(klass)
+      def register(klass, opts = {})
+        return stage(klass, opts) if @staged && @reloading.key?(klass)
         fail "#{klass} is already registered" if registered?(klass)
-        (@registry ||= {})[klass] = klass.new
+        (@files ||= {})[klass] = @loading_file if @loading_file
+        return register_lazy(klass) if opts[:lazy]
+        (@registry ||= {})[klass] = instantiate(klass)
         HexChat::Internal.print("Registered MRuby plugin #{klass}")
         klass
       end
 
+      # Create a plugin instance, charging its heap use to the class
+      def instantiate(klass)
+        owner = HexChat::Internal.mem_owner(klass.to_s)
+        begin
+          klass.new
+        ensure
+          HexChat::Internal.mem_owner(owner)
+        end
+      end
+
+      # Remember a plugin registered while its file is reloaded, it is
+      # swapped in once the file has loaded
+      def stage(klass, opts)
+        @staged.push([klass, opts])
+        klass
+      end
+
+      # Replace a plugin being reloaded.  The new instance sets up and
+      # restores the snapshot before the old one unhooks and cleans up,
+      # all within this call, so no event finds the plugin missing.  If
+      # the new instance fails to start, the old one keeps running.
+      def swap(klass, opts)
+        state = @reloading.delete(klass)
+        old = @registry[klass]
+        unless old
+          # Never created: a lazy plugin that has not fired yet
+          HexChat::Internal.unstub(klass)
+          @lazy.delete(klass)
+          return register(klass, opts)
+        end
+        inst = instantiate(klass)
+        begin
+          inst.restore_state(HexChat::Internal.state_load(state))
+        rescue
+          inst.cleanup
+          raise
+        end
+        @registry[klass] = inst
+        begin
+          old.cleanup
+        rescue => e
+          HexChat::Internal.print("MRuby: Cleaning up the old #{klass}: #{e.message}")
+        end
+        HexChat::Internal.print("Reloaded MRuby plugin #{klass}")
+        klass
+      end
+
+      # Hook stubs in place of the plugin's hooks.  A plugin without
+      # hooks could never be woken up, so it is registered right away.
+      def register_lazy(klass)
+        return register(klass) if lazy_hooks(klass).empty?
+        stub_hooks(klass)
+        HexChat::Internal.print("Registered MRuby plugin #{klass} (lazy)")
+        klass
+      end
+
+      # The deferred hooks of a lazy plugin that get stubs
+      def lazy_hooks(klass)
+        deferred_hooks(klass).reject { |r| [:setup, :cleanup, :snapshot, :restore].include?(r[:type]) }
+      end
+
+      # Hook a stub for each of a lazy plugin's hooks
+      def stub_hooks(klass)
+        (@lazy ||= {})[klass] = true
+        begin
+          lazy_hooks(klass).each do |r|
+            opts = r[:opts]
+            case r[:type]
+            when :command
+              HexChat::Internal.stub(klass, :command, r[:name], opts[:priority] || HexChat::PRI_NORM, opts[:help] || '')
+            when :timer
+              HexChat::Internal.stub(klass, :timer, (r[:name] * 1000).to_i)
+            when :fd
+              HexChat::Internal.stub(klass, :fd, r[:name], 0, opts[:flags])
+            else
+              HexChat::Internal.stub(klass, r[:type], r[:name], opts[:priority] || HexChat::PRI_NORM)
+            end
+          end
+        rescue
+          HexChat::Internal.unstub(klass)
+          @lazy.delete(klass)
+          raise
+        end
+      end
+
+      # Called by C when a stub of a lazy plugin fires.  Creates the
+      # plugin and passes the event to the matching hooks HexChat will not
+      # run itself.  HexChat keeps hooks sorted by priority, puts a new
+      # one ahead of those of equal priority and goes on from the stub,
+      # so it still reaches hooks below the stub's priority (nil for
+      # timers and fds, which it never reaches).  The rest are fired here
+      # in HexChat's order, stopping when one eats the event for plugins.
+      # If the plugin fails to start its stubs are put back.
+      def activate(klass, type, name, priority, args)
+        return HexChat::EAT_NONE unless lazy?(klass)
+        HexChat::Internal.unstub(klass)
+        @lazy.delete(klass)
+        begin
+          register(klass)
+        rescue
+          stub_hooks(klass)
+          raise
+        end
+        eat = HexChat::EAT_NONE
+        hooks = []
+        @registry[klass].hooks.each_with_index do |h, i|
+          next unless h.is_a?(HexChat::Hook) && h.type == type && h.hooked?
+          key = type == :timer ? h.timeout && (h.timeout * 1000).to_i : h.name || h.fd
+          hooks.push([h, i]) if key == name && (priority.nil? || h.priority >= priority)
+        end
+        hooks.sort_by { |(h, i)| [-(h.priority || 0), -i] }.each do |(h, _)|
+          a = (type == :print || type == :server) && !h.attrs? ? args[0..-2] : args
+          eat |= h.fire(*a)
+          break if eat & HexChat::EAT_PLUGIN != 0
+        end
+        eat
+      end
+
       def unregister(klass)
         fail "#{klass} is not registered" unless registered?(klass)
+        @files.delete(klass) if @files
+        if lazy?(klass)
+          HexChat::Internal.unstub(klass)
+          @lazy.delete(klass)
+          HexChat::Internal.print("Unregistered MRuby plugin #{klass}")
+          return
+        end
         @registry[klass].cleanup
         HexChat::Internal.print("Unregistered MRuby plugin #{klass}")
         (@registry ||= {}).delete(klass)
@@ -699,11 +1966,7 @@ def puts(*args)
   print(*args)
 end
 
-HexChat::List.create_list_classes
-
 # Little shorthand/compatibility
 XChat = HexChat
 
-HexChat::Plugin::Registry.autoload
-
 puts "MRuby interface initialized, version #{HexChat::VERSION}"
@@ -6,29 +6,70 @@
  * 
  **********************/
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* pipe2 */
+#endif
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
 #include <sys/types.h>
 
+#include <sys/stat.h>
+
 #ifdef WIN32
 #include <direct.h>
+#include <windows.h>
 #else
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
 #endif
 
 #include "hexchat-plugin.h"
 #undef _POSIX_C_SOURCE  /* Avoid warnings from /usr/include/features.h */
 #undef _XOPEN_SOURCE
+// MRB_ENABLE_DEBUG_HOOK adds fields to mrb_state, so the plugin has to be
+// built with MRuby's defines (the Rakefile reads them from its build)
 #include <mruby.h>
+#include <mruby/version.h>
+#include <mruby/opcode.h>
 #include <mruby/compile.h>
 #include <mruby/string.h>
 #include <mruby/class.h>
 #include <mruby/data.h>
 #include <mruby/array.h>
+#include <mruby/hash.h>
+#include <mruby/range.h>
+#include <mruby/proc.h>
 #include <mruby/variable.h>
 #include <mruby/error.h>
 #include <mruby/dump.h>
+#include <mruby/gc.h>
+
+// Strings shared between callers are frozen where MRuby has a flag for
+// it.  MRuby 1.2 has none, there they are read-only by convention.
+#if defined(MRB_SET_FROZEN_FLAG)
+#define HEX_MRB_STR_FREEZE(v) MRB_SET_FROZEN_FLAG(mrb_basic_ptr(v))
+#elif defined(RSTR_SET_FROZEN_FLAG)
+#define HEX_MRB_STR_FREEZE(v) RSTR_SET_FROZEN_FLAG(mrb_str_ptr(v))
+#else
+#define HEX_MRB_STR_FREEZE(v) ((void)0)
+#endif
 
 // This contains the Ruby code that provides the high-level interface
 #include "hexchat_mrb_lib.h"
@@ -36,11 +77,20 @@
 static hexchat_plugin *ph;                /* plugin handle */
 static mrb_state *hex_g_mrb;              /* mruby interpreter state */
 static mrbc_context *console_cxt = NULL;  /* console context */
+static hexchat_context *console_hc = NULL; /* console query window */
+static hexchat_hook *console_hook = NULL;  /* console input hook */
 static struct RClass *hexchat_module;     /* HexChat module */
 static struct RClass *internal_class;     /* HexChat::Internal class */
 static struct RClass *cxt_class;          /* HexChat::Internal::Context class */
 static struct RClass *list_class;         /* HexChat::Internal::List class */
 static struct RClass *hook_class;         /* HexChat::Internal::Hook class */
+static struct RClass *attrs_class;        /* HexChat::Internal::EventAttrs class */
+static struct RClass *maskset_class;      /* HexChat::Internal::MaskSet class */
+static struct RClass *rate_class;         /* HexChat::Internal::RateTracker class */
+static struct RClass *logger_class;       /* HexChat::Internal::Logger class */
+static struct RClass *socket_class;       /* HexChat::Internal::Socket class */
+static struct RClass *process_class;      /* HexChat::Internal::Process class */
+static struct RClass *budget_class;       /* HexChat::BudgetExceeded exception */
 
 // This structure holds a HexChat context pointer
 // We will wrap this as an instance of class HexChat::Internal::Context
@@ -54,6 +104,58 @@ struct mrb_hexchat_list {
   hexchat_list *l;      /* HexChat list */
 };
 
+// Hook types, indexes into hex_hook_types and hex_hook_stats
+#define HEX_MRB_HOOK_NONE    0
+#define HEX_MRB_HOOK_COMMAND 1
+#define HEX_MRB_HOOK_PRINT   2
+#define HEX_MRB_HOOK_SERVER  3
+#define HEX_MRB_HOOK_TIMER   4
+#define HEX_MRB_HOOK_FD      5
+#define HEX_MRB_HOOK_KINDS   6
+
+// How events reach a print or server hook's block
+#define HEX_MRB_COALESCE_NONE     0   /* one call per event */
+#define HEX_MRB_COALESCE_DEBOUNCE 1   /* one call once events stop for the window */
+#define HEX_MRB_COALESCE_THROTTLE 2   /* at most one call per window */
+#define HEX_MRB_COALESCE_BATCH    3   /* one call per max events or window */
+#define HEX_MRB_DEBOUNCE_MAX   1000   /* default events that end a debounce early */
+static const char *hex_hook_types[HEX_MRB_HOOK_KINDS] = {
+  "hook", "command", "print", "server", "timer", "fd"
+};
+
+// Dispatch latency histogram bounds in ns, the last bucket is +Inf
+#define HEX_MRB_METRIC_BUCKETS 6
+static const uint64_t hex_metric_bounds[HEX_MRB_METRIC_BUCKETS] = {
+  10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+// Counters for one hook type, these outlive the hooks
+struct hex_mrb_hook_stats {
+  uint64_t registered;  /* times hooked */
+  uint64_t active;      /* hooked right now */
+  uint64_t fired;
+  uint64_t exceptions;
+  uint64_t ns;          /* time spent in callbacks */
+  uint64_t overruns;    /* callbacks over their budget */
+  uint64_t buckets[HEX_MRB_METRIC_BUCKETS + 1];
+};
+
+// Watchdog
+#define HEX_MRB_WATCH_TICKS 1024              /* instructions between clock reads */
+#define HEX_MRB_WATCH_GRACE 10000000ULL       /* ns left for ensure blocks after a raise */
+#if MRUBY_RELEASE_MAJOR == 1 && defined(MRB_ENABLE_DEBUG_HOOK)
+#define HEX_MRB_WATCH_RAISE 1                 /* runaway callbacks are interrupted */
+#else
+#define HEX_MRB_WATCH_RAISE 0
+#endif
+
+// Events a coalescing hook collected in one context
+struct hex_mrb_co_bucket {
+  struct hex_mrb_co_bucket *next;  /* in order of each context's first event */
+  hexchat_context *context;
+  mrb_value events;     /* Array, registered with the GC */
+};
+
 // This structure holds a map of ruby code to HexChat hooks
 // We will wrap this as an instance of class HexChat::Internal::Hook
 struct mrb_hexchat_hook {
@@ -61,6 +163,24 @@ struct mrb_hexchat_hook {
   void *xhook;          /* HexChat hook handle */
   mrb_value block;      /* Ruby block reference */
   mrb_value ref;        /* Object reference */
+  int kind;             /* HEX_MRB_HOOK_* */
+  char name[64];        /* event name, command, timeout or fd */
+  char *plugin;         /* plugin class name, filled in when first needed */
+  uint64_t fired;       /* times called */
+  uint64_t exceptions;  /* times the block raised */
+  uint64_t ns;          /* time spent in the block */
+  uint32_t budget_ms;   /* time allowed per callback, 0 for the default */
+  uint32_t overruns;    /* callbacks over budget */
+  int disabled;         /* unhooked by the watchdog */
+  int mem_owner;        /* heap owner of the plugin, -1 until looked up */
+  int coalesce;         /* HEX_MRB_COALESCE_* */
+  uint32_t window_ms;   /* debounce, throttle or batch window */
+  uint32_t batch_max;   /* events that end a batch or debounce, 0 for no limit */
+  struct hex_mrb_co_bucket *buckets;  /* events collected for the next calls */
+  void *co_timer;       /* HexChat timer that makes the next call */
+  uint64_t last_ns;     /* clock of the last event collected */
+  struct mrb_hexchat_hook *prev;  /* all allocated hooks */
+  struct mrb_hexchat_hook *next;
   /* Object reference is used to provide access to the containing object
   * Normally, this is an instance of HexChat::Hook, which provides the
   * high-level interface to hooks.  This is then used to set $__HOOK_REF
@@ -73,6 +193,725 @@ struct mrb_hexchat_hook {
 static void
 hex_mrb_hook_free(mrb_state *mrb, struct mrb_hexchat_hook *hk);
 
+// prototype for dropping the history of a closed context
+static void
+hex_mrb_history_drop(hexchat_context *c);
+
+// Per-server state, keyed by the HexChat server id
+// Filled in from the ISUPPORT (005) numeric
+struct hex_mrb_server {
+  int id;               /* HexChat server id */
+  int modes_per_line;   /* ISUPPORT MODES */
+  int casemapping;      /* ISUPPORT CASEMAPPING, HEX_MRB_CASEMAP_* */
+  struct hex_mrb_server *next;
+};
+
+// IRC casemappings
+#define HEX_MRB_CASEMAP_ASCII   0
+#define HEX_MRB_CASEMAP_RFC1459 1
+#define HEX_MRB_CASEMAP_STRICT  2
+#define HEX_MRB_CASEMAPS        3
+static const char *hex_casemap_names[HEX_MRB_CASEMAPS] = {
+  "ascii", "rfc1459", "strict_rfc1459"
+};
+
+// Interned string table, open addressing
+#define HEX_MRB_INTERN_MIN  1024
+#define HEX_MRB_INTERN_MAX  65536  /* table is flushed past this many strings */
+struct hex_mrb_intern_slot {
+  uint32_t hash;        /* hash of the string bytes */
+  mrb_value str;        /* shared String, nil if the slot is free */
+};
+
+// Hostmask set, masks are filed by the shape of their host part
+#define HEX_MRB_MASK_HOST     0   /* literal host, in the host table */
+#define HEX_MRB_MASK_SUFFIX   1   /* '*' then a literal, in the suffix trie */
+#define HEX_MRB_MASK_WILDCARD 2   /* anything else, tried one by one */
+#define HEX_MRB_MASK_KINDS    3
+#define HEX_MRB_MASK_MIN      64  /* initial buckets */
+struct hex_mrb_mask {
+  char *mask;                   /* mask as given */
+  char *folded;                 /* mask under the set's casemapping */
+  mrb_int len;                  /* length of both */
+  uint32_t mhash;               /* hash of folded */
+  uint32_t hhash;               /* hash of the literal host (HOST only) */
+  int kind;                     /* HEX_MRB_MASK_* */
+  struct hex_mrb_mask *mnext;   /* next in the mask table bucket */
+  struct hex_mrb_mask *next;    /* next in the index list holding it */
+  struct hex_mrb_mask **list;   /* head of that list */
+};
+
+// Suffix trie node, children are keyed on host characters from the end
+struct hex_mrb_mask_node {
+  unsigned char ch;
+  struct hex_mrb_mask_node *child;
+  struct hex_mrb_mask_node *sibling;
+  struct hex_mrb_mask *masks;   /* masks whose suffix ends here */
+};
+
+// This structure holds an indexed set of hostmasks
+// We will wrap this as an instance of class HexChat::Internal::MaskSet
+struct mrb_hexchat_maskset {
+  int casemapping;              /* HEX_MRB_CASEMAP_* */
+  uint32_t cap;                 /* buckets in by_mask and by_host */
+  uint32_t count;               /* masks in the set */
+  uint32_t kinds[HEX_MRB_MASK_KINDS];
+  struct hex_mrb_mask **by_mask;  /* all masks, by folded mask */
+  struct hex_mrb_mask **by_host;  /* HOST masks, by literal host */
+  struct hex_mrb_mask_node suffix;  /* SUFFIX masks, trie root */
+  struct hex_mrb_mask *wild;      /* WILDCARD masks */
+};
+
+// Rate tracker limits
+#define HEX_MRB_RATE_MIN          64     /* initial key buckets */
+#define HEX_MRB_RATE_SWEEP        2      /* key buckets swept per hit */
+#define HEX_MRB_RATE_BUCKETS_MAX  1024
+#define HEX_MRB_RATE_WIDTH_MAX    65536
+#define HEX_MRB_RATE_DEPTH_MAX    8
+#define HEX_MRB_RATE_CELLS_MAX    (1 << 22)  /* sketch counters, buckets * width * depth */
+
+// A key tracked by a rate tracker, with its ring of counters
+struct hex_mrb_rate_key {
+  struct hex_mrb_rate_key *next;  /* next in the hash bucket */
+  uint32_t hash;        /* hash of key */
+  mrb_int len;          /* length of key */
+  char *key;            /* key bytes */
+  uint64_t epoch;       /* bucket number of the newest counter */
+  uint32_t total;       /* sum of counts */
+  uint32_t counts[];    /* one counter per bucket, a ring */
+};
+
+// This structure holds hit counters over a sliding window
+// We will wrap this as an instance of class HexChat::Internal::RateTracker
+// Keys are either tracked exactly, or in count-min sketch mode folded into
+// depth rows of width counter rings, which bounds memory.
+struct mrb_hexchat_rate {
+  uint64_t bucket_ns;   /* width of a bucket */
+  uint32_t buckets;     /* buckets per window */
+  uint32_t cap;         /* key buckets */
+  uint32_t count;       /* keys tracked */
+  uint32_t sweep;       /* next key bucket to sweep */
+  struct hex_mrb_rate_key **keys;
+  uint32_t width;       /* sketch cells per row */
+  uint32_t depth;       /* sketch rows, 0 when tracking exactly */
+  uint32_t *cells;      /* sketch counter rings */
+  uint32_t *totals;     /* sum of each sketch cell's ring */
+  uint64_t *epochs;     /* newest bucket of each sketch cell */
+};
+
+// Scrollback history limits
+#define HEX_MRB_HIST_BUCKETS    64    /* contexts hash buckets */
+#define HEX_MRB_HIST_TERMS_MIN  256   /* initial term buckets */
+#define HEX_MRB_HIST_TERM_MIN   2     /* shorter words are not indexed */
+#define HEX_MRB_HIST_TERM_MAX   32    /* longer words are cut */
+#define HEX_MRB_HIST_QUERY_MAX  8     /* words used from a query */
+#define HEX_MRB_HIST_ARENA_MIN  4096  /* first arena allocation, doubled as it fills */
+
+// A line in the history ring, its nick and text live in the arena
+struct hex_mrb_hist_line {
+  uint32_t seq;         /* sequence number in the context */
+  uint32_t off;         /* arena offset of nick then text */
+  uint16_t nick_len;
+  uint16_t text_len;
+  time_t time;          /* when it was printed */
+};
+
+// An index term with the sequence numbers of the lines it occurs in
+struct hex_mrb_hist_term {
+  struct hex_mrb_hist_term *next;  /* next in the hash bucket */
+  uint32_t hash;
+  uint32_t start;       /* first posting still in the ring */
+  uint32_t n;           /* postings used */
+  uint32_t cap;         /* postings allocated */
+  uint32_t *posts;      /* ascending sequence numbers */
+  unsigned char len;
+  char text[HEX_MRB_HIST_TERM_MAX];
+};
+
+// Scrollback of one context: a ring of lines, a byte arena handed out in
+// the same order, and an inverted index of the words in it
+struct hex_mrb_hist {
+  hexchat_context *c;
+  struct hex_mrb_hist *next;       /* next in the hash bucket */
+  uint32_t next_seq;    /* sequence number of the next line */
+  uint32_t count;       /* lines in the ring */
+  uint32_t lines;       /* ring size */
+  struct hex_mrb_hist_line *ring;
+  char *arena;          /* NULL until the first line */
+  uint32_t arena_size;  /* bytes allocated */
+  uint32_t arena_max;   /* bytes it may grow to, then it wraps */
+  uint32_t head;        /* next free arena byte */
+  struct hex_mrb_hist_term **terms;
+  uint32_t term_cap;
+  uint32_t term_count;
+};
+
+// Print events recorded in the history, and where nick and text are
+struct hex_mrb_hist_event {
+  const char *name;
+  int nick;
+  int text;
+};
+
+static const struct hex_mrb_hist_event hex_history_events[] = {
+  { "Channel Message",           1, 2 },
+  { "Channel Msg Hilight",       1, 2 },
+  { "Channel Action",            1, 2 },
+  { "Channel Action Hilight",    1, 2 },
+  { "Your Message",              1, 2 },
+  { "Your Action",               1, 2 },
+  { "Private Message to Dialog", 1, 2 },
+  { "Private Action to Dialog",  1, 2 },
+  { "Channel Notice",            1, 3 },
+  { "Notice",                    1, 2 },
+  { NULL,                        0, 0 }
+};
+
+// Chat archive, block files of compressed records
+#define HEX_MRB_ARCH_BLOCK    65536       /* raw bytes per block */
+#define HEX_MRB_ARCH_REC      11          /* record header bytes */
+#define HEX_MRB_ARCH_BUCKETS  64          /* open channel hash buckets */
+#define HEX_MRB_ARCH_FLUSH    60000       /* ms a partial block may stay open */
+#define HEX_MRB_ARCH_MAGIC    0x4252484du /* "MHRB" */
+#define HEX_MRB_LZ_BITS       12
+#define HEX_MRB_LZ_HASH       (1 << HEX_MRB_LZ_BITS)
+
+// Block header in the block file
+struct hex_mrb_arch_head {
+  uint32_t magic;
+  uint32_t raw_len;     /* bytes of records */
+  uint32_t comp_len;    /* compressed bytes following */
+  uint32_t lines;
+  int64_t first;        /* time of the first record */
+  int64_t last;         /* time of the last record */
+};
+
+// Sparse index entry, one per block, in the .idx file next to it
+struct hex_mrb_arch_index {
+  int64_t first;
+  int64_t last;
+  uint64_t offset;      /* of the block header */
+  uint32_t size;        /* header and compressed bytes */
+  uint32_t lines;
+};
+
+// Block being filled for a network and channel
+struct hex_mrb_arch_chan {
+  struct hex_mrb_arch_chan *next;  /* next in the hash bucket */
+  uint32_t hash;        /* hash of path */
+  char *path;           /* block file */
+  char *buf;            /* records */
+  uint32_t len;
+  uint32_t lines;
+  int64_t first;
+  int64_t last;
+  uint64_t opened;      /* clock when the first record went in */
+};
+
+// Block waiting for the writer thread
+struct hex_mrb_arch_job {
+  struct hex_mrb_arch_job *next;
+  char *path;
+  char *raw;
+  uint32_t len;
+  uint32_t lines;
+  int64_t first;
+  int64_t last;
+};
+
+// Log writer
+#define HEX_MRB_LOG_POLL        100           /* ms between writer passes */
+#define HEX_MRB_LOG_BUFFER_MAX  (64 << 20)    /* largest ring */
+#define HEX_MRB_LOG_NEVER       UINT64_MAX    /* fsync_ns to never fsync */
+
+// A log file with the ring buffer feeding it
+// The UI thread only moves tail, the writer thread only moves head.
+struct hex_mrb_logger {
+  struct hex_mrb_logger *next;  /* next logger, guarded by hex_log_lock */
+  char *path;
+  int fd;
+  int keep;             /* rotated files kept */
+  int closing;          /* free once drained, guarded by hex_log_lock */
+  int error;            /* errno of the last failed write or open, atomic */
+  int unsynced;         /* written since the last fsync */
+  uint64_t size;        /* current file size */
+  uint64_t max_size;    /* rotate past this, 0 to never rotate */
+  uint64_t fsync_ns;    /* fsync interval, 0 for every write */
+  uint64_t synced;      /* clock at the last fsync */
+  uint64_t written;     /* bytes written, atomic */
+  uint64_t dropped;     /* bytes that did not fit the ring */
+  uint32_t rotations;   /* atomic */
+  char *ring;
+  uint32_t cap;         /* ring size, a power of two */
+  uint32_t head;        /* next byte to write out */
+  uint32_t tail;        /* next byte to fill */
+};
+
+// Heap accounting
+#define HEX_MRB_MEM_OWNERS 256   /* plugins tracked, later ones count as core */
+
+// Header in front of every block mruby allocates, keeps 16 byte alignment
+struct hex_mrb_mem_head {
+  uint64_t size;        /* bytes asked for */
+  uint32_t owner;       /* index into hex_mem_owners */
+  uint32_t pool;        /* size class + 1, 0 if from malloc */
+};
+
+// Size of an MRuby object heap page, as gc.c's add_heap asks for it: a
+// header of five pointers and a flag, then MRB_HEAP_PAGE_SIZE slots the
+// size of the largest object structure (RVALUE)
+#ifndef MRB_HEAP_PAGE_SIZE
+#define MRB_HEAP_PAGE_SIZE 1024
+#endif
+union hex_mrb_rvalue {
+  struct RBasic basic;
+  struct RObject object;
+  struct RClass klass;
+  struct RString string;
+  struct RArray array;
+  struct RHash hash;
+  struct RRange range;
+  struct RData data;
+  struct RProc proc;
+  struct REnv env;
+  struct RException exc;
+#ifdef MRB_WORD_BOXING
+  struct RFloat floatv;
+  struct RCptr cptr;
+#endif
+};
+struct hex_mrb_heap_page {
+  void *freelist, *prev, *next, *free_next, *free_prev;
+  mrb_bool old:1;
+  void *objects[];
+};
+#define HEX_MRB_HEAP_PAGE_BYTES (sizeof(struct hex_mrb_heap_page) + MRB_HEAP_PAGE_SIZE * sizeof(union hex_mrb_rvalue))
+
+// Small block pool, blocks (header included) up to HEX_MRB_POOL_MAX bytes
+// are carved from aligned pages of one size class each
+#define HEX_MRB_POOL_PAGE    65536    /* page size and alignment */
+#define HEX_MRB_POOL_HEAD    64       /* page header, rounded up */
+#define HEX_MRB_POOL_MAX     512
+#define HEX_MRB_POOL_CLASSES 15
+static const uint32_t hex_pool_sizes[HEX_MRB_POOL_CLASSES] = {
+  32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+
+// A pool page, the header sits at the start of the page
+struct hex_mrb_pool_page {
+  struct hex_mrb_pool_page *next;  /* pages of the class with room */
+  struct hex_mrb_pool_page *prev;
+  void *free;           /* freed blocks, linked through their first word */
+  char *bump;           /* first block never handed out */
+  uint32_t used;        /* blocks handed out */
+  uint32_t cls;
+  int partial;          /* on the class's list of pages with room */
+};
+
+// A size class
+struct hex_mrb_pool_class {
+  struct hex_mrb_pool_page *partial;  /* pages with room, NULL if none */
+  uint64_t pages;
+  uint64_t used;        /* blocks handed out */
+  uint64_t requested;   /* bytes mruby asked for in them */
+};
+
+// Heap use of one plugin class, owner 0 is everything outside plugins
+struct hex_mrb_mem_owner {
+  char *name;
+  uint64_t live;        /* bytes in use */
+  uint64_t peak;        /* highest live */
+  uint64_t allocs;      /* blocks allocated */
+  uint64_t frees;       /* blocks freed */
+  uint64_t limit;       /* soft limit, 0 for none */
+  int warned;           /* over the limit and told so */
+};
+
+// Trace recorder
+#define HEX_MRB_TRACE_SPANS 65536  /* spans kept, oldest are overwritten */
+
+// A finished span, written out as a Chrome trace "X" event
+struct hex_mrb_trace_span {
+  uint64_t start;       /* clock at entry */
+  uint64_t dur;         /* ns spent */
+  const char *cat;      /* hook type, "load", "eval" or "gc" */
+  char name[48];        /* event name, file or code */
+  char plugin[32];      /* plugin class name */
+};
+
+// A hook standing in for a plugin registered with lazy: true
+// It holds no plugin instance; the first fire instantiates the plugin
+struct hex_mrb_stub {
+  struct hex_mrb_stub *next;
+  mrb_state *mrb;
+  mrb_value def;        /* [plugin class, type, name, priority], GC registered */
+  hexchat_hook *hook;
+};
+
+// Script directory watch
+#define HEX_MRB_SCRIPT_DELAY 300  /* ms without changes before reloading */
+
+// A script written since the last reload
+struct hex_mrb_changed {
+  struct hex_mrb_changed *next;
+  char *name;           /* file name within the watched directory */
+};
+
+// Sockets
+#define HEX_MRB_SOCK_RAW    0      /* a frame is whatever one read returned */
+#define HEX_MRB_SOCK_LINE   1      /* LF terminated, a CR before it is dropped */
+#define HEX_MRB_SOCK_LENGTH 2      /* 4 byte big-endian length, then the frame */
+#define HEX_MRB_SOCK_CONNECTING 0
+#define HEX_MRB_SOCK_OPEN       1
+#define HEX_MRB_SOCK_CLOSED     2
+#define HEX_MRB_SOCK_CHUNK 16384   /* least free buffer space for a read */
+#define HEX_MRB_SOCK_READS 16      /* reads per fd callback */
+
+// A non-blocking stream socket, serviced from a HexChat fd hook in Ruby
+struct hex_mrb_socket {
+  int fd;
+  int state;            /* HEX_MRB_SOCK_CONNECTING, OPEN or CLOSED */
+  int framing;          /* HEX_MRB_SOCK_RAW, LINE or LENGTH */
+  int blocked;          /* write returned false, a drain event is owed */
+  int reported;         /* the close event was returned */
+  size_t max_frame;     /* longer frames close the socket */
+  size_t high_water;    /* queued bytes past which write returns false */
+  char *rbuf;           /* received bytes not yet framed */
+  size_t rlen, rcap;
+  char *wbuf;           /* queued bytes, sent from woff */
+  size_t wlen, woff, wcap;
+  uint64_t bytes_in, bytes_out;
+  char error[128];      /* why it closed, empty if the peer closed */
+};
+
+// A child process with its output on pipes, serviced from fd hooks in Ruby
+struct hex_mrb_process {
+  pid_t pid;
+  int exited;           /* reaped */
+  int status;           /* wait status once reaped, -1 if it was lost */
+  int fd[2];            /* stdout and stderr pipes, -1 once closed */
+  char *buf[2];         /* bytes after the last full line */
+  size_t len[2], cap[2];
+  size_t max_line;      /* longer lines are split */
+};
+
+// A child whose Process object was freed before it was reaped
+struct hex_mrb_orphan {
+  struct hex_mrb_orphan *next;
+  pid_t pid;
+};
+
+// Startup profile
+#define HEX_MRB_STARTUP_PHASES 8  /* phases timed from plugin init to autoload */
+
+// Time spent in one startup phase
+struct hex_mrb_startup_phase {
+  const char *name;
+  uint64_t ns;
+};
+
+// A script loaded by autoload
+struct hex_mrb_startup_script {
+  char *file;
+  uint64_t ns;          /* load time, includes registering its plugins */
+  int ok;               /* loaded without an exception */
+};
+
+// Field names of a HexChat list, fetched once per list
+struct hex_mrb_list_fields {
+  struct hex_mrb_list_fields *next;
+  char *name;
+  mrb_value fields;     /* Array of String, GC registered */
+};
+
+// Metrics endpoint
+#define HEX_MRB_METRICS_CLIENTS 8    /* connections kept, the oldest is dropped */
+#define HEX_MRB_METRICS_REQUEST 2048 /* request bytes read before answering */
+
+// A connection to the metrics socket
+// The request is read, then the whole response is written and the socket closed
+struct hex_mrb_metrics_client {
+  struct hex_mrb_metrics_client *next;
+  mrb_state *mrb;
+  int fd;
+  hexchat_hook *hook;   /* read hook, then write hook */
+  size_t req_len;
+  char req[HEX_MRB_METRICS_REQUEST];
+  char *out;            /* response, NULL until the request is in */
+  size_t out_len;
+  size_t out_off;       /* bytes of out written */
+};
+
+// Growable text buffer
+struct hex_mrb_strbuf {
+  char *p;
+  size_t len;
+  size_t cap;
+};
+
+// Outbound queue lanes, highest priority first
+#define HEX_MRB_QUEUE_HIGH  0
+#define HEX_MRB_QUEUE_NORM  1
+#define HEX_MRB_QUEUE_LOW   2
+#define HEX_MRB_QUEUE_LANES 3
+
+// Default modes per line when the server did not send MODES (RFC1459)
+#define HEX_MRB_MODES_DEFAULT 3
+// Most targets coalesced into a single hexchat_send_modes call
+#define HEX_MRB_MODES_BATCH_MAX 64
+// Most arguments passed to a print event by emit_print_batch
+#define HEX_MRB_EMIT_ARGS_MAX 16
+// How often the queue timer ticks, in ms
+#define HEX_MRB_QUEUE_TICK 100
+
+// A queued outbound command or mode change
+struct hex_mrb_queue_item {
+  mrb_int id;           /* handle returned to Ruby for cancellation */
+  hexchat_context *c;   /* context the item was queued from */
+  char *text;           /* command, or mode target */
+  char sign;            /* '+' or '-' for mode changes, 0 for commands */
+  char mode;            /* mode character for mode changes */
+  struct hex_mrb_queue_item *next;
+};
+
+// Outbound queue for one server, paced by a token bucket
+struct hex_mrb_queue {
+  int server_id;        /* HexChat server id */
+  double tokens;        /* lines we may send right now */
+  uint64_t refilled;    /* clock of last refill, in ns */
+  struct hex_mrb_queue_item *head[HEX_MRB_QUEUE_LANES];
+  struct hex_mrb_queue_item *tail[HEX_MRB_QUEUE_LANES];
+  struct hex_mrb_queue *next;
+};
+
+// WHOIS cache
+#define HEX_MRB_WHOIS_BUCKETS 256     /* hash buckets */
+#define HEX_MRB_WHOIS_SIZE    512     /* default entries kept, least recently used go first */
+#define HEX_MRB_WHOIS_TTL     300000  /* default ms a reply stays fresh */
+#define HEX_MRB_WHOIS_TIMEOUT 30000   /* default ms to wait for a reply */
+#define HEX_MRB_WHOIS_PARTIAL  0      /* only seen in WHO replies */
+#define HEX_MRB_WHOIS_PENDING  1      /* WHOIS sent, no reply yet */
+#define HEX_MRB_WHOIS_COMPLETE 2      /* end of WHOIS seen */
+#define HEX_MRB_WHOIS_MISSING  3      /* no such nick, answered with nil at the end */
+#define HEX_MRB_WHOIS_NICK        0
+#define HEX_MRB_WHOIS_USER        1
+#define HEX_MRB_WHOIS_HOST        2
+#define HEX_MRB_WHOIS_REALNAME    3
+#define HEX_MRB_WHOIS_SERVER      4
+#define HEX_MRB_WHOIS_SERVER_INFO 5
+#define HEX_MRB_WHOIS_ACCOUNT     6
+#define HEX_MRB_WHOIS_CHANNELS    7
+#define HEX_MRB_WHOIS_AWAY        8
+#define HEX_MRB_WHOIS_FIELDS      9
+static const char *hex_whois_fields[HEX_MRB_WHOIS_FIELDS] = {
+  "nick", "user", "host", "realname", "server", "server_info", "account", "channels", "away"
+};
+
+// What is known about a nick on one server
+struct hex_mrb_whois {
+  int server_id;        /* HexChat server id */
+  char *key;            /* nick folded with the server's casemapping */
+  char *field[HEX_MRB_WHOIS_FIELDS];  /* NULL when not known */
+  long idle;            /* seconds idle, -1 if not known */
+  long signon;          /* signon time, -1 if not known */
+  int oper;             /* 313 seen, or '*' in WHO flags */
+  int secure;           /* 671 seen */
+  int state;            /* HEX_MRB_WHOIS_* */
+  int quiet;            /* our query, HexChat does not print the reply */
+  mrb_int query;        /* queue id of our WHOIS until it is sent, 0 after */
+  uint64_t expires;     /* clock when a complete entry goes stale, or a sent query times out */
+  mrb_value waiters;    /* Array of blocks waiting for the reply, or nil */
+  struct hex_mrb_whois *hnext;  /* hash chain */
+  struct hex_mrb_whois *prev;   /* LRU list, most recently used first */
+  struct hex_mrb_whois *next;
+};
+
+// Compiled console statements, keyed by source and known locals
+#define HEX_MRB_CONSOLE_CACHE 64
+struct hex_mrb_console_stmt {
+  char *src;            /* statement source */
+  int slen;             /* console locals when compiled */
+  mrb_value proc;       /* compiled statement, GC registered */
+};
+
+// Interned HexChat::Internal::Context objects, one per hexchat_context
+#define HEX_MRB_CXT_BUCKETS 256
+struct hex_mrb_cxt_entry {
+  hexchat_context *c;   /* HexChat context */
+  mrb_value obj;        /* its HexChat::Internal::Context, GC registered */
+  unsigned int info_valid;  /* cached get_info keys, HEX_MRB_INFO_* bits */
+  struct hex_mrb_cxt_entry *next;
+};
+
+// get_info keys cached per context, kept as instance variables of the
+// interned context so the GC sees them
+#define HEX_MRB_INFO_CHANNEL  (1 << 0)
+#define HEX_MRB_INFO_NETWORK  (1 << 1)
+#define HEX_MRB_INFO_SERVER   (1 << 2)
+#define HEX_MRB_INFO_HOST     (1 << 3)
+#define HEX_MRB_INFO_NICK     (1 << 4)
+#define HEX_MRB_INFO_TOPIC    (1 << 5)
+#define HEX_MRB_INFO_AWAY     (1 << 6)
+#define HEX_MRB_INFO_CONN     (HEX_MRB_INFO_NETWORK|HEX_MRB_INFO_SERVER|HEX_MRB_INFO_HOST|HEX_MRB_INFO_NICK|HEX_MRB_INFO_AWAY)
+#define HEX_MRB_INFO_ALL      0x7f
+#define HEX_MRB_INFO_PREFS    (1u << 31)  /* only used for deferred invalidation */
+
+static const char *hex_info_keys[] = {
+  "channel", "network", "server", "host", "nick", "topic", "away", NULL
+};
+
+// get_info keys that never change while HexChat runs
+static const char *hex_info_global_keys[] = {
+  "configdir", "libdirfs", "version", NULL
+};
+
+// Events that make cached get_info values stale
+struct hex_mrb_info_event {
+  const char *name;     /* print event, or server message if server is set */
+  int server;           /* hook as a server message */
+  unsigned int mask;    /* HEX_MRB_INFO_* bits to drop */
+  int all;              /* drop them in every context, not just the current one */
+};
+
+static const struct hex_mrb_info_event hex_info_events[] = {
+  { "You Join",           0, HEX_MRB_INFO_ALL,     0 },
+  { "Topic",              0, HEX_MRB_INFO_TOPIC,   0 },
+  { "Topic Change",       0, HEX_MRB_INFO_TOPIC,   0 },
+  { "Change Nick",        0, HEX_MRB_INFO_CHANNEL, 1 },
+  { "Your Nick Changing", 0, HEX_MRB_INFO_NICK,    1 },
+  { "Connected",          0, HEX_MRB_INFO_CONN,    1 },
+  { "Disconnected",       0, HEX_MRB_INFO_CONN,    1 },
+  { "001",                1, HEX_MRB_INFO_CONN,    1 },
+  { "005",                1, HEX_MRB_INFO_CONN,    1 },
+  { "305",                1, HEX_MRB_INFO_AWAY,    1 },
+  { "306",                1, HEX_MRB_INFO_AWAY,    1 },
+  { NULL,                 0, 0,                    0 }
+};
+
+// Cached Context.find results
+#define HEX_MRB_FIND_BUCKETS 64
+struct hex_mrb_find_entry {
+  char *serv;           /* server name, NULL for any */
+  char *chan;           /* channel name, NULL for the front tab */
+  hexchat_context *from;  /* current context if serv is NULL, its server is searched */
+  hexchat_context *c;   /* result */
+  struct hex_mrb_find_entry *next;
+};
+
+static struct hex_mrb_console_stmt console_cache[HEX_MRB_CONSOLE_CACHE];
+static mrb_sym hex_info_syms[8];                   /* ivars for cached info */
+static mrb_value hex_info_global[4];               /* never-changing info */
+static mrb_value hex_prefs_cache;                  /* get_prefs results by name */
+static unsigned int hex_info_deferred = 0;         /* to drop after HexChat catches up */
+static hexchat_hook *hex_info_timer = NULL;        /* runs the deferred drop */
+static struct hex_mrb_cxt_entry *hex_cxt_table[HEX_MRB_CXT_BUCKETS];
+static struct hex_mrb_find_entry *hex_find_cache[HEX_MRB_FIND_BUCKETS];
+static struct hex_mrb_server *hex_servers = NULL;  /* known servers */
+static unsigned char hex_casemap[HEX_MRB_CASEMAPS][256];  /* lowercasing tables */
+static struct hex_mrb_intern_slot *hex_intern = NULL;    /* interned strings */
+static uint32_t hex_intern_cap = 0;                /* slots in hex_intern */
+static uint32_t hex_intern_count = 0;              /* strings in hex_intern */
+static mrb_value hex_intern_keep;                  /* Array keeping them alive */
+static struct hex_mrb_hist *hex_history[HEX_MRB_HIST_BUCKETS];  /* scrollback by context */
+static hexchat_hook *hex_history_hooks[16];        /* print hooks feeding it */
+static uint32_t hex_history_lines = 5000;          /* ring size for new contexts */
+static uint32_t hex_history_bytes = 512 * 1024;    /* arena size for new contexts */
+static char *hex_arch_dir = NULL;                  /* archive directory, NULL when off */
+static struct hex_mrb_arch_chan *hex_arch_chans[HEX_MRB_ARCH_BUCKETS];  /* open blocks */
+static hexchat_hook *hex_arch_hooks[16];           /* print hooks feeding it */
+static hexchat_hook *hex_arch_timer = NULL;        /* writes out idle blocks */
+static struct hex_mrb_arch_job *hex_arch_jobs = NULL;   /* blocks for the writer */
+static struct hex_mrb_arch_job **hex_arch_tail = &hex_arch_jobs;
+static uint64_t hex_arch_blocks = 0;               /* blocks written */
+static uint64_t hex_arch_raw = 0;                  /* record bytes written */
+static uint64_t hex_arch_comp = 0;                 /* compressed bytes written */
+static uint32_t hex_arch_queued = 0;               /* blocks waiting */
+#ifndef WIN32
+static pthread_t hex_arch_thread;                  /* block writer */
+static pthread_mutex_t hex_arch_lock = PTHREAD_MUTEX_INITIALIZER;  /* guards jobs and counters */
+static pthread_cond_t hex_arch_cond = PTHREAD_COND_INITIALIZER;    /* jobs waiting or stop */
+static int hex_arch_stop = 0;                      /* writer should exit */
+#endif
+#ifndef WIN32
+static struct hex_mrb_logger *hex_loggers = NULL;  /* open loggers */
+static pthread_t hex_log_thread;                   /* log writer */
+static pthread_mutex_t hex_log_lock = PTHREAD_MUTEX_INITIALIZER;  /* guards the logger list */
+static pthread_cond_t hex_log_cond = PTHREAD_COND_INITIALIZER;    /* wakes the writer */
+static int hex_log_running = 0;                    /* writer started */
+static int hex_log_stop = 0;                       /* writer should exit */
+static int hex_log_wake = 0;                       /* writer should not sleep */
+#endif
+static struct mrb_hexchat_hook *hex_hooks = NULL; /* all allocated hooks */
+static struct hex_mrb_hook_stats hex_hook_stats[HEX_MRB_HOOK_KINDS];
+static uint64_t hex_metric_load_errors = 0;        /* scripts that raised while loading */
+static uint64_t hex_metric_eval_errors = 0;        /* /mrb eval that raised */
+static uint64_t hex_metric_gc_runs = 0;            /* GC.start calls */
+static uint64_t hex_metric_gc_ns = 0;              /* time spent in GC.start */
+#ifndef WIN32
+static int hex_metrics_fd = -1;                    /* listening socket, -1 when off */
+static char *hex_metrics_path = NULL;              /* socket path */
+static hexchat_hook *hex_metrics_hook = NULL;      /* accepts connections */
+static struct hex_mrb_metrics_client *hex_metrics_clients = NULL;  /* newest first */
+static uint64_t hex_metrics_scrapes = 0;           /* responses sent */
+#endif
+static uint32_t hex_watch_budget_ms = 0;           /* default callback budget, 0 for none */
+static uint32_t hex_watch_strikes = 3;             /* overruns before a hook is disabled, 0 never */
+static uint64_t hex_watch_deadline = 0;            /* when the running callback must stop, 0 if none */
+static int hex_watch_ticks = 0;                    /* instructions until the next clock read */
+static struct mrb_hexchat_hook *hex_watch_hook = NULL;  /* callback being watched */
+static int hex_watch_expired = 0;                  /* deadline passed, raise at the next safe point */
+static struct hex_mrb_mem_owner hex_mem_owners[HEX_MRB_MEM_OWNERS];  /* heap use per plugin */
+static uint32_t hex_mem_owner_count = 1;           /* owners in use, 0 is core */
+static uint32_t hex_mem_current = 0;               /* owner charged for new blocks */
+static int hex_mem_check = 0;                      /* an owner went over its limit */
+static struct hex_mrb_pool_class hex_pool[HEX_MRB_POOL_CLASSES];  /* small block pool */
+static uint8_t hex_pool_index[HEX_MRB_POOL_MAX / 16 + 1];  /* 16 byte units to size class */
+static int hex_pool_on = 1;                        /* new small blocks come from the pool */
+static uint64_t hex_pool_large = 0;                /* blocks from malloc */
+static uint64_t hex_pool_large_bytes = 0;          /* bytes asked for in them */
+static struct hex_mrb_trace_span *hex_trace = NULL;  /* span ring, NULL when not tracing */
+static uint64_t hex_trace_count = 0;               /* spans recorded since start */
+static uint64_t hex_trace_origin = 0;              /* clock at start */
+static struct hex_mrb_startup_phase hex_startup[HEX_MRB_STARTUP_PHASES];  /* init phases */
+static int hex_startup_count = 0;                  /* phases recorded */
+static uint64_t hex_startup_mark = 0;              /* clock at the end of the last phase */
+static struct hex_mrb_startup_script *hex_startup_scripts = NULL;  /* autoloaded scripts */
+static uint32_t hex_startup_script_count = 0;      /* scripts recorded */
+static uint32_t hex_startup_script_cap = 0;        /* slots in hex_startup_scripts */
+static int hex_startup_loading = 0;                /* autoload running, loads are recorded */
+static hexchat_hook *hex_autoload_timer = NULL;    /* runs autoload once HexChat is up */
+static struct hex_mrb_list_fields *hex_list_fields = NULL;  /* field names by list */
+static struct hex_mrb_stub *hex_stubs = NULL;      /* hooks of lazily registered plugins */
+static struct hex_mrb_orphan *hex_orphans = NULL;  /* killed children still to reap */
+static hexchat_hook *hex_orphan_timer = NULL;      /* reaps them */
+static int hex_scripts_fd = -1;                    /* inotify instance, -1 when not watching */
+static char *hex_scripts_dir = NULL;               /* watched directory */
+static hexchat_hook *hex_scripts_hook = NULL;      /* reads change events */
+static hexchat_hook *hex_scripts_timer = NULL;     /* reloads once changes settle */
+static int hex_scripts_delay = HEX_MRB_SCRIPT_DELAY;  /* settle time in ms */
+static struct hex_mrb_changed *hex_scripts_changed = NULL;  /* scripts to reload */
+static struct hex_mrb_queue *hex_queues = NULL;    /* outbound queues */
+static hexchat_hook *hex_queue_timer = NULL;       /* drains all queues */
+static mrb_int hex_queue_next_id = 1;              /* next queue item id */
+static int hex_queue_burst = 5;                    /* token bucket size */
+static int hex_queue_interval = 2000;              /* ms per token */
+static int hex_queue_draining = 0;                 /* drain in progress */
+static struct hex_mrb_whois *hex_whois[HEX_MRB_WHOIS_BUCKETS];  /* cache by server and nick */
+static struct hex_mrb_whois *hex_whois_mru = NULL;  /* LRU list ends */
+static struct hex_mrb_whois *hex_whois_lru = NULL;
+static uint32_t hex_whois_count = 0;               /* entries in the cache */
+static uint32_t hex_whois_pending = 0;             /* queries waiting on a reply */
+static uint32_t hex_whois_size = HEX_MRB_WHOIS_SIZE;
+static uint32_t hex_whois_ttl = HEX_MRB_WHOIS_TTL;
+static uint32_t hex_whois_timeout = HEX_MRB_WHOIS_TIMEOUT;
+static hexchat_hook *hex_whois_timer = NULL;       /* times out queries while any are pending */
+static uint32_t hex_whois_quiet = 0;               /* quiet queries without their end of WHOIS */
+static hexchat_hook *hex_whois_raw = NULL;         /* eats other numerics while any are */
+static uint64_t hex_whois_hits = 0;                /* lookups answered from the cache */
+static uint64_t hex_whois_joined = 0;              /* lookups that joined a pending query */
+static uint64_t hex_whois_queries = 0;             /* WHOIS commands sent */
+static uint64_t hex_whois_timeouts = 0;            /* queries that got no reply */
+
 // MRuby data type structures
 static const struct mrb_data_type mrb_hexchat_cxt_type = {
   "HexChat::Internal::Context", mrb_free
@@ -86,6 +925,45 @@ static const struct mrb_data_type mrb_hexchat_hook_type = {
   "HexChat::Internal::Hook", (void *)hex_mrb_hook_free
 };
 
+static const struct mrb_data_type mrb_hexchat_attrs_type = {
+  "HexChat::Internal::EventAttrs", mrb_free
+};
+
+static void
+hex_mrb_maskset_free(mrb_state *mrb, void *p);
+
+static const struct mrb_data_type mrb_hexchat_maskset_type = {
+  "HexChat::Internal::MaskSet", hex_mrb_maskset_free
+};
+
+static void
+hex_mrb_rate_free(mrb_state *mrb, void *p);
+
+static const struct mrb_data_type mrb_hexchat_rate_type = {
+  "HexChat::Internal::RateTracker", hex_mrb_rate_free
+};
+
+static void
+hex_mrb_socket_free(mrb_state *mrb, void *p);
+
+static const struct mrb_data_type mrb_hexchat_socket_type = {
+  "HexChat::Internal::Socket", hex_mrb_socket_free
+};
+
+static void
+hex_mrb_process_free(mrb_state *mrb, void *p);
+
+static const struct mrb_data_type mrb_hexchat_process_type = {
+  "HexChat::Internal::Process", hex_mrb_process_free
+};
+
+static void
+hex_mrb_logger_free(mrb_state *mrb, void *p);
+
+static const struct mrb_data_type mrb_hexchat_logger_type = {
+  "HexChat::Internal::Logger", hex_mrb_logger_free
+};
+
 // "File names" for varous execution contexts
 static const char *mrb_file_internal = "(internal)";
 static const char *mrb_file_eval     = "(eval)";
@@ -109,116 +987,452 @@ hex_mrb_context_wrap(mrb_state *mrb, struct RClass *cc, struct mrb_hexchat_conte
   return mrb_obj_value(Data_Wrap_Struct(mrb, cc, &mrb_hexchat_cxt_type, cxt));
 }
 
-// Allocate a MRuby HexChat list data type
-static struct mrb_hexchat_list*
-hex_mrb_list_alloc(mrb_state *mrb, hexchat_list *l)
+// Hash a pointer into a power of two sized table
+static unsigned int
+hex_mrb_ptr_hash(void *ptr, unsigned int buckets)
 {
-  struct mrb_hexchat_list *lst;
-  lst = (struct mrb_hexchat_list *)mrb_malloc(mrb, sizeof(struct mrb_hexchat_list));
-  lst->l = l;
-  return lst;
+  uintptr_t v = (uintptr_t)ptr;
+  v ^= v >> 16;
+  v *= 0x45d9f3b;
+  v ^= v >> 16;
+  return (unsigned int)v & (buckets - 1);
 }
 
-// Wrap the mrb_hexchat_list structure
-static mrb_value
-hex_mrb_list_wrap(mrb_state *mrb, struct RClass *lc, struct mrb_hexchat_list *lst)
+// Find (or create) the intern table entry for a HexChat context
+static struct hex_mrb_cxt_entry*
+hex_mrb_context_entry(mrb_state *mrb, hexchat_context *c)
 {
-  return mrb_obj_value(Data_Wrap_Struct(mrb, lc, &mrb_hexchat_list_type, lst));
+  unsigned int b = hex_mrb_ptr_hash(c, HEX_MRB_CXT_BUCKETS);
+  struct hex_mrb_cxt_entry *e;
+  for (e = hex_cxt_table[b]; e != NULL; e = e->next) {
+    if (e->c == c) {
+      return e;
+    }
+  }
+  e = (struct hex_mrb_cxt_entry *)malloc(sizeof(struct hex_mrb_cxt_entry));
+  e->c = c;
+  e->obj = hex_mrb_context_wrap(mrb, cxt_class, hex_mrb_context_alloc(mrb, c));
+  e->info_valid = 0;
+  mrb_gc_register(mrb, e->obj);
+  e->next = hex_cxt_table[b];
+  hex_cxt_table[b] = e;
+  return e;
 }
 
-// Wrap the mrb_hexchat_hook structure
-//static mrb_value
-//mrb_hexchat_hook_wrap(mrb_state *mrb, struct RClass *hc, struct mrb_hexchat_hook *hk)
-//{
-//  return mrb_obj_value(Data_Wrap_Struct(mrb, hc, &mrb_hexchat_hook_type, hk));
-//}
-
-// Allocate an mrb_hexchat_hook object and initialize
-static struct mrb_hexchat_hook*
-hex_mrb_hook_alloc(mrb_state *mrb, mrb_value block)
+// Return the one HexChat::Internal::Context object for a HexChat context
+static mrb_value
+hex_mrb_context_intern(mrb_state *mrb, hexchat_context *c)
 {
-  struct mrb_hexchat_hook *hk;
-  hk = (struct mrb_hexchat_hook *)mrb_malloc(mrb, sizeof(struct mrb_hexchat_hook));
-  hk->xhook = NULL;
-  hk->mrb = mrb;
-  hk->block = block;
-  hk->ref = mrb_nil_value();
-  mrb_gc_register(mrb, hk->block);	// Prevent MRuby from GC the block
-  return hk;
+  return hex_mrb_context_entry(mrb, c)->obj;
 }
 
-// Unhook a hook referenced in an mrb_hexchat_hook structure
+// Drop cached get_info values, in one context or all of them if c is NULL
 static void
-hex_mrb_hook_unhook(struct mrb_hexchat_hook *hk)
+hex_mrb_info_invalidate(hexchat_context *c, unsigned int mask)
 {
-  if (hk->xhook != NULL) {
-    hexchat_unhook(ph, hk->xhook);
-    // printf("MRB unhooked %p (xchat %p) from %llx\n", (void *)hk, (void *)hk->xhook, (unsigned long long int)mrb_obj_id(hk->block));
-    hk->xhook = NULL;
+  for (int b = 0; b < HEX_MRB_CXT_BUCKETS; b++) {
+    for (struct hex_mrb_cxt_entry *e = hex_cxt_table[b]; e != NULL; e = e->next) {
+      if (c == NULL || e->c == c) {
+        e->info_valid &= ~mask;
+      }
+    }
   }
 }
 
-// I need to see if MRuby has this check already
-// if so, next two functions are redundant.
-static void
-hex_mrb_gc_register_if_not_nil(mrb_state *mrb, mrb_value value)
+// Deferred invalidation timer
+// Server and command hooks run before HexChat acts on the message, so
+// whatever is cached in the meantime is dropped again once it has.
+static int
+hex_mrb_info_deferred_cb(mrb_state *mrb)
 {
-  if (!mrb_obj_equal(mrb, value, mrb_nil_value())) {
-    mrb_gc_register(mrb, value);
+  hex_mrb_info_invalidate(NULL, hex_info_deferred & HEX_MRB_INFO_ALL);
+  if (hex_info_deferred & HEX_MRB_INFO_PREFS) {
+    mrb_hash_clear(mrb, hex_prefs_cache);
   }
+  hex_info_deferred = 0;
+  hex_info_timer = NULL;
+  return 0;
 }
 
 static void
-hex_mrb_gc_unregister_if_not_nil(mrb_state *mrb, mrb_value value)
+hex_mrb_info_defer(mrb_state *mrb, unsigned int mask)
 {
-  if (!mrb_obj_equal(mrb, value, mrb_nil_value())) {
-    mrb_gc_unregister(mrb, value);
+  hex_info_deferred |= mask;
+  if (hex_info_timer == NULL) {
+    hex_info_timer = hexchat_hook_timer(ph, 0, (void *)hex_mrb_info_deferred_cb, (void *)mrb);
   }
 }
 
-// Free a mrb_hexchat_hook structure
-static void
-hex_mrb_hook_free(mrb_state *mrb, struct mrb_hexchat_hook *hk)
+// Print hook for events in hex_info_events
+static int
+hex_mrb_info_print_cb(char *word[], const struct hex_mrb_info_event *ev)
 {
-  hex_mrb_hook_unhook(hk);
-  mrb_gc_unregister(mrb, hk->block);
-  hex_mrb_gc_unregister_if_not_nil(mrb, hk->ref);
-  mrb_free(mrb, hk);
+  hex_mrb_info_invalidate(ev->all ? NULL : hexchat_get_context(ph), ev->mask);
+  return HEXCHAT_EAT_NONE;
 }
 
-// Set the object reference in an mrb_hexchat_hook
-static mrb_value
-hex_mrb_hook_set_ref(mrb_state *mrb, struct mrb_hexchat_hook *hk,  mrb_value ref)
+// Server hook for events in hex_info_events
+static int
+hex_mrb_info_server_cb(char *word[], char *word_eol[], const struct hex_mrb_info_event *ev)
 {
-  mrb_value old_ref = hk->ref;
-  hex_mrb_gc_unregister_if_not_nil(mrb, hk->ref);
-  hk->ref = ref;
-  hex_mrb_gc_register_if_not_nil(mrb, hk->ref);
-  return old_ref;
+  hex_mrb_info_invalidate(ev->all ? NULL : hexchat_get_context(ph), ev->mask);
+  hex_mrb_info_defer(hex_g_mrb, ev->mask);
+  return HEXCHAT_EAT_NONE;
 }
 
-// Put a HexChat hook into an mrb_hexchat_hook data structure
+// /SET command hook, prefs may be about to change
+static int
+hex_mrb_info_set_cb(char *word[], char *word_eol[], mrb_state *mrb)
+{
+  mrb_hash_clear(mrb, hex_prefs_cache);
+  hex_mrb_info_defer(mrb, HEX_MRB_INFO_PREFS);
+  return HEXCHAT_EAT_NONE;
+}
+
+// Hook everything that invalidates cached info
 static void
-hex_mrb_hook_hook(mrb_state *mrb, struct mrb_hexchat_hook *hk, void *xhook)
+hex_mrb_info_hook(mrb_state *mrb)
 {
-  hex_mrb_hook_unhook(hk);
-  hk->xhook = xhook;
-  hk->mrb = mrb;
-  // printf("MRB hooked %p (xchat %p) to %llx\n", (void *)hk, (void *)xhook, (unsigned long long  int)mrb_obj_id(hk->block));
+  for (const struct hex_mrb_info_event *ev = hex_info_events; ev->name != NULL; ev++) {
+    if (ev->server) {
+      hexchat_hook_server(ph, ev->name, HEXCHAT_PRI_HIGHEST, (void *)hex_mrb_info_server_cb, (void *)ev);
+    } else {
+      hexchat_hook_print(ph, ev->name, HEXCHAT_PRI_HIGHEST, (void *)hex_mrb_info_print_cb, (void *)ev);
+    }
+  }
+  hexchat_hook_command(ph, "set", HEXCHAT_PRI_HIGHEST, (void *)hex_mrb_info_set_cb, NULL, (void *)mrb);
 }
 
-// Convert HexChat "words" to an MRuby Array
-static mrb_value
-hex_mrb_words_to_array(mrb_state *mrb, char *word[], int start, int limit)
+// Forget an interned context; objects still held by scripts become null
+static void
+hex_mrb_context_unintern(mrb_state *mrb, hexchat_context *c)
 {
-  mrb_value array = mrb_ary_new(mrb);
-  if (word == NULL) {
-    return array;
+  struct hex_mrb_cxt_entry **p = &hex_cxt_table[hex_mrb_ptr_hash(c, HEX_MRB_CXT_BUCKETS)];
+  while (*p != NULL) {
+    struct hex_mrb_cxt_entry *e = *p;
+    if (e->c == c) {
+      ((struct mrb_hexchat_context *)DATA_PTR(e->obj))->c = NULL;
+      mrb_gc_unregister(mrb, e->obj);
+      *p = e->next;
+      free(e);
+      return;
+    }
+    p = &e->next;
   }
-  for (
-      int index = start;
-      index < limit && word[index] != NULL && word[index][0] != 0;
-      index++
+}
+
+// Hash the key of a Context.find call
+static unsigned int
+hex_mrb_find_hash(const char *serv, const char *chan)
+{
+  unsigned int h = 2166136261u;
+  for (const char *p = serv; p != NULL && *p; p++) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  h = (h ^ (serv == NULL ? 1 : 2)) * 16777619u;
+  for (const char *p = chan; p != NULL && *p; p++) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  h = (h ^ (chan == NULL ? 1 : 2)) * 16777619u;
+  return h & (HEX_MRB_FIND_BUCKETS - 1);
+}
+
+// Compare strings that may be NULL
+static int
+hex_mrb_streq_null(const char *a, const char *b)
+{
+  return (a == NULL || b == NULL) ? a == b : strcmp(a, b) == 0;
+}
+
+static char*
+hex_mrb_strdup_null(const char *s)
+{
+  return s == NULL ? NULL : strdup(s);
+}
+
+// hexchat_find_context, cached until the next context change
+// Without a server name HexChat looks on the current context's server,
+// so those results are also keyed by the current context.
+static hexchat_context*
+hex_mrb_find_context(const char *serv, const char *chan)
+{
+  unsigned int b = hex_mrb_find_hash(serv, chan);
+  hexchat_context *from = serv == NULL ? hexchat_get_context(ph) : NULL;
+  struct hex_mrb_find_entry *e;
+  hexchat_context *c;
+  for (e = hex_find_cache[b]; e != NULL; e = e->next) {
+    if (e->from == from && hex_mrb_streq_null(e->serv, serv) && hex_mrb_streq_null(e->chan, chan)) {
+      return e->c;
+    }
+  }
+  c = hexchat_find_context(ph, serv, chan);
+  // Misses are not cached, the channel may be joined later
+  if (c != NULL) {
+    e = (struct hex_mrb_find_entry *)malloc(sizeof(struct hex_mrb_find_entry));
+    e->serv = hex_mrb_strdup_null(serv);
+    e->chan = hex_mrb_strdup_null(chan);
+    e->from = from;
+    e->c = c;
+    e->next = hex_find_cache[b];
+    hex_find_cache[b] = e;
+  }
+  return c;
+}
+
+// Throw away all cached Context.find results
+static void
+hex_mrb_find_cache_clear(void)
+{
+  for (int b = 0; b < HEX_MRB_FIND_BUCKETS; b++) {
+    while (hex_find_cache[b] != NULL) {
+      struct hex_mrb_find_entry *e = hex_find_cache[b];
+      hex_find_cache[b] = e->next;
+      free(e->serv);
+      free(e->chan);
+      free(e);
+    }
+  }
+}
+
+// Free the intern table, used at shutdown
+static void
+hex_mrb_context_free_all(mrb_state *mrb)
+{
+  hex_mrb_find_cache_clear();
+  for (int b = 0; b < HEX_MRB_CXT_BUCKETS; b++) {
+    while (hex_cxt_table[b] != NULL) {
+      struct hex_mrb_cxt_entry *e = hex_cxt_table[b];
+      hex_cxt_table[b] = e->next;
+      mrb_gc_unregister(mrb, e->obj);
+      free(e);
+    }
+  }
+}
+
+// "Open Context"/"Focus Tab" print hook, find results may have changed
+static int
+hex_mrb_context_change_cb(char *word[], void *userdata)
+{
+  hex_mrb_find_cache_clear();
+  return HEXCHAT_EAT_NONE;
+}
+
+// "Close Context" print hook, runs last so scripts see the context first
+static int
+hex_mrb_context_close_cb(char *word[], mrb_state *mrb)
+{
+  hexchat_context *c = hexchat_get_context(ph);
+  hex_mrb_find_cache_clear();
+  hex_mrb_context_unintern(mrb, c);
+  hex_mrb_history_drop(c);
+  if (c == console_hc) {
+    // Console closed, stop intercepting input
+    hexchat_unhook(ph, console_hook);
+    console_hook = NULL;
+    console_hc = NULL;
+  }
+  return HEXCHAT_EAT_NONE;
+}
+
+// Allocate a MRuby HexChat list data type
+static struct mrb_hexchat_list*
+hex_mrb_list_alloc(mrb_state *mrb, hexchat_list *l)
+{
+  struct mrb_hexchat_list *lst;
+  lst = (struct mrb_hexchat_list *)mrb_malloc(mrb, sizeof(struct mrb_hexchat_list));
+  lst->l = l;
+  return lst;
+}
+
+// Wrap the mrb_hexchat_list structure
+static mrb_value
+hex_mrb_list_wrap(mrb_state *mrb, struct RClass *lc, struct mrb_hexchat_list *lst)
+{
+  return mrb_obj_value(Data_Wrap_Struct(mrb, lc, &mrb_hexchat_list_type, lst));
+}
+
+// Wrap a copy of HexChat event attributes
+// HexChat's own structure only lives as long as the callback
+static mrb_value
+hex_mrb_attrs_wrap(mrb_state *mrb, hexchat_event_attrs *attrs)
+{
+  hexchat_event_attrs *copy;
+  copy = (hexchat_event_attrs *)mrb_malloc(mrb, sizeof(hexchat_event_attrs));
+  *copy = *attrs;
+  return mrb_obj_value(Data_Wrap_Struct(mrb, attrs_class, &mrb_hexchat_attrs_type, copy));
+}
+
+// Wrap the mrb_hexchat_hook structure
+//static mrb_value
+//mrb_hexchat_hook_wrap(mrb_state *mrb, struct RClass *hc, struct mrb_hexchat_hook *hk)
+//{
+//  return mrb_obj_value(Data_Wrap_Struct(mrb, hc, &mrb_hexchat_hook_type, hk));
+//}
+
+// Allocate an mrb_hexchat_hook object and initialize
+static struct mrb_hexchat_hook*
+hex_mrb_hook_alloc(mrb_state *mrb, mrb_value block)
+{
+  struct mrb_hexchat_hook *hk;
+  hk = (struct mrb_hexchat_hook *)mrb_malloc(mrb, sizeof(struct mrb_hexchat_hook));
+  hk->xhook = NULL;
+  hk->mrb = mrb;
+  hk->block = block;
+  hk->ref = mrb_nil_value();
+  hk->kind = HEX_MRB_HOOK_NONE;
+  hk->name[0] = '\0';
+  hk->plugin = NULL;
+  hk->fired = 0;
+  hk->exceptions = 0;
+  hk->ns = 0;
+  hk->budget_ms = 0;
+  hk->overruns = 0;
+  hk->disabled = 0;
+  hk->mem_owner = -1;
+  hk->coalesce = HEX_MRB_COALESCE_NONE;
+  hk->window_ms = 0;
+  hk->batch_max = 0;
+  hk->buckets = NULL;
+  hk->co_timer = NULL;
+  hk->last_ns = 0;
+  hk->prev = NULL;
+  hk->next = hex_hooks;
+  if (hex_hooks != NULL) {
+    hex_hooks->prev = hk;
+  }
+  hex_hooks = hk;
+  mrb_gc_register(mrb, hk->block);	// Prevent MRuby from GC the block
+  return hk;
+}
+
+// Drop the events collected for a coalescing hook and its timer
+static void
+hex_mrb_hook_coalesce_reset(struct mrb_hexchat_hook *hk)
+{
+  if (hk->co_timer != NULL) {
+    hexchat_unhook(ph, hk->co_timer);
+    hk->co_timer = NULL;
+  }
+  while (hk->buckets != NULL) {
+    struct hex_mrb_co_bucket *b = hk->buckets;
+    hk->buckets = b->next;
+    mrb_gc_unregister(hk->mrb, b->events);
+    free(b);
+  }
+}
+
+// Unhook a hook referenced in an mrb_hexchat_hook structure
+static void
+hex_mrb_hook_unhook(struct mrb_hexchat_hook *hk)
+{
+  hex_mrb_hook_coalesce_reset(hk);
+  if (hk->xhook != NULL) {
+    hex_hook_stats[hk->kind].active--;
+    hexchat_unhook(ph, hk->xhook);
+    // printf("MRB unhooked %p (xchat %p) from %llx\n", (void *)hk, (void *)hk->xhook, (unsigned long long int)mrb_obj_id(hk->block));
+    hk->xhook = NULL;
+  }
+}
+
+// I need to see if MRuby has this check already
+// if so, next two functions are redundant.
+static void
+hex_mrb_gc_register_if_not_nil(mrb_state *mrb, mrb_value value)
+{
+  if (!mrb_obj_equal(mrb, value, mrb_nil_value())) {
+    mrb_gc_register(mrb, value);
+  }
+}
+
+static void
+hex_mrb_gc_unregister_if_not_nil(mrb_state *mrb, mrb_value value)
+{
+  if (!mrb_obj_equal(mrb, value, mrb_nil_value())) {
+    mrb_gc_unregister(mrb, value);
+  }
+}
+
+// Free a mrb_hexchat_hook structure
+static void
+hex_mrb_hook_free(mrb_state *mrb, struct mrb_hexchat_hook *hk)
+{
+  hex_mrb_hook_unhook(hk);
+  mrb_gc_unregister(mrb, hk->block);
+  hex_mrb_gc_unregister_if_not_nil(mrb, hk->ref);
+  if (hk->prev != NULL) {
+    hk->prev->next = hk->next;
+  } else {
+    hex_hooks = hk->next;
+  }
+  if (hk->next != NULL) {
+    hk->next->prev = hk->prev;
+  }
+  mrb_free(mrb, hk->plugin);
+  mrb_free(mrb, hk);
+}
+
+// Set the object reference in an mrb_hexchat_hook
+// The plugin class name is looked up here, where raising is safe, so
+// HexChat callbacks and the metrics socket only ever read it
+static mrb_value
+hex_mrb_hook_set_ref(mrb_state *mrb, struct mrb_hexchat_hook *hk,  mrb_value ref)
+{
+  mrb_value old_ref = hk->ref;
+  const char *name = "";
+  size_t len;
+  hex_mrb_gc_unregister_if_not_nil(mrb, hk->ref);
+  hk->ref = ref;
+  hex_mrb_gc_register_if_not_nil(mrb, hk->ref);
+  mrb_free(mrb, hk->plugin);
+  hk->plugin = NULL;
+  hk->mem_owner = -1;
+  if (!mrb_nil_p(ref)) {
+    mrb_value inst = mrb_iv_get(mrb, ref, mrb_intern_lit(mrb, "@inst"));
+    name = mrb_obj_classname(mrb, mrb_nil_p(inst) ? ref : inst);
+  }
+  len = strlen(name);
+  hk->plugin = (char *)mrb_malloc(mrb, len + 1);
+  memcpy(hk->plugin, name, len + 1);
+  return old_ref;
+}
+
+// Name of the plugin class a hook belongs to
+// This is the class of the HexChat::Hook's @inst, or "" if it has none
+static const char *
+hex_mrb_hook_plugin(struct mrb_hexchat_hook *hk)
+{
+  return hk->plugin != NULL ? hk->plugin : "";
+}
+
+// Put a HexChat hook into an mrb_hexchat_hook data structure
+static void
+hex_mrb_hook_hook(mrb_state *mrb, struct mrb_hexchat_hook *hk, int kind, const char *name, void *xhook)
+{
+  hex_mrb_hook_unhook(hk);
+  hk->xhook = xhook;
+  hk->mrb = mrb;
+  hk->kind = kind;
+  hk->disabled = 0;
+  if (xhook != NULL) {
+    hex_hook_stats[kind].registered++;
+    hex_hook_stats[kind].active++;
+  }
+  snprintf(hk->name, sizeof(hk->name), "%s", name);
+  // printf("MRB hooked %p (xchat %p) to %llx\n", (void *)hk, (void *)xhook, (unsigned long long  int)mrb_obj_id(hk->block));
+}
+
+// Convert HexChat "words" to an MRuby Array
+static mrb_value
+hex_mrb_words_to_array(mrb_state *mrb, char *word[], int start, int limit)
+{
+  mrb_value array = mrb_ary_new(mrb);
+  if (word == NULL) {
+    return array;
+  }
+  for (
+      int index = start;
+      index < limit && word[index] != NULL && word[index][0] != 0;
+      index++
   ) {
     mrb_value value = mrb_str_new_cstr(mrb, word[index]);
     mrb_ary_push(mrb, array, value);
@@ -282,102 +1496,595 @@ hex_mrb_print_exc(mrb_state *mrb)
   }
 }
 
-// Get data from hook C structure into an array
-static mrb_value
-hex_mrb_hook_info(mrb_state *mrb, struct mrb_hexchat_hook *hk)
+// Monotonic clock in nanoseconds
+static uint64_t
+hex_mrb_clock_ns(void)
 {
-  mrb_value array = mrb_ary_new(mrb);
-  mrb_ary_push(mrb, array, hex_mrb_ptr_to_s(mrb, hk));
-  mrb_ary_push(mrb, array, hex_mrb_ptr_to_s(mrb, hk->xhook));
-  mrb_ary_push(mrb, array, hex_mrb_obj_id_to_s(mrb, hk->block));
-  mrb_ary_push(mrb, array, mrb_fixnum_value(mrb_obj_id(hk->block)));
-  return array;
+#ifdef WIN32
+  return (uint64_t)GetTickCount64() * 1000000ULL;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
 }
 
-// HexChat::Internal.print(String)
-static mrb_value
-hex_mrb_xi_print(mrb_state *mrb, mrb_value self)
+// Close the current startup phase, timed from the end of the previous one
+static void
+hex_mrb_startup_phase(const char *name)
 {
-  char *out;
-  mrb_get_args(mrb, "z", &out);
-  hexchat_print(ph, out);
-  return mrb_nil_value();
+  uint64_t now = hex_mrb_clock_ns();
+  if (hex_startup_count < HEX_MRB_STARTUP_PHASES) {
+    hex_startup[hex_startup_count].name = name;
+    hex_startup[hex_startup_count].ns = now - hex_startup_mark;
+    hex_startup_count++;
+  }
+  hex_startup_mark = now;
 }
 
-// HexChat::Internal.command(String)
-static mrb_value
-hex_mrb_xi_command(mrb_state *mrb, mrb_value self)
+// Record a script loaded during autoload
+static void
+hex_mrb_startup_script(const char *file, uint64_t ns, int ok)
 {
-  char *cmd;
-  mrb_get_args(mrb, "z", &cmd);
-  hexchat_command(ph, cmd);
-  return mrb_nil_value();
+  struct hex_mrb_startup_script *sc;
+  if (hex_startup_script_count == hex_startup_script_cap) {
+    uint32_t cap = hex_startup_script_cap ? hex_startup_script_cap * 2 : 16;
+    sc = realloc(hex_startup_scripts, cap * sizeof(*sc));
+    if (sc == NULL) {
+      return;
+    }
+    hex_startup_scripts = sc;
+    hex_startup_script_cap = cap;
+  }
+  sc = &hex_startup_scripts[hex_startup_script_count];
+  sc->file = strdup(file);
+  if (sc->file == NULL) {
+    return;
+  }
+  sc->ns = ns;
+  sc->ok = ok;
+  hex_startup_script_count++;
 }
 
-// HexChat::Internal.get_info(String)
-static mrb_value
-hex_mrb_xi_get_info(mrb_state *mrb, mrb_value self)
+// Forget the startup profile
+static void
+hex_mrb_startup_free(void)
 {
-  char *id;
-  const char *info;
-  mrb_value result = mrb_nil_value();
-  mrb_get_args(mrb, "z", &id);
-  info = hexchat_get_info(ph, id);
-  if (info != NULL) {
-    result = mrb_str_new_cstr(mrb, info);
+  for (uint32_t i = 0; i < hex_startup_script_count; i++) {
+    free(hex_startup_scripts[i].file);
   }
-  return result;
+  free(hex_startup_scripts);
+  hex_startup_scripts = NULL;
+  hex_startup_script_count = 0;
+  hex_startup_script_cap = 0;
+  hex_startup_count = 0;
 }
 
-// HexChat::Internal.strip(String)
-static mrb_value
-hex_mrb_xi_strip(mrb_state *mrb, mrb_value self)
+// Start a trace span, returns 0 when not tracing
+static uint64_t
+hex_mrb_trace_begin(void)
 {
-  const char *text;
-  int flags = 1 | 2;
-  char *new_text;
-  mrb_value result = mrb_nil_value();
-  mrb_get_args(mrb, "z|i", &text, &flags);
-  new_text = hexchat_strip(ph, text, -1, flags);
-  if (new_text != NULL) {
-    result = mrb_str_new_cstr(mrb, new_text);
-    hexchat_free(ph, new_text);
-  }
-  return result;
+  return hex_trace != NULL ? hex_mrb_clock_ns() : 0;
 }
 
-// HexChat::Internal.get_prefs(String)
-static mrb_value
-hex_mrb_xi_get_prefs(mrb_state *mrb, mrb_value self)
+// Finish a trace span started at start into the ring
+// Spans that began before tracing was turned on are dropped
+static void
+hex_mrb_trace_end(uint64_t start, const char *cat, const char *name, const char *plugin)
 {
-  const char *name;
-  int r_type;
-  int r_int;
-  const char *r_str;
-  mrb_value result = mrb_nil_value();
-  mrb_get_args(mrb, "z", &name);
-  r_type = hexchat_get_prefs(ph, name, &r_str, &r_int);
-  switch(r_type) {
-  case 1: // string
-      result = mrb_str_new_cstr(mrb, r_str);
-      break;
-  case 2: // int
-      result = mrb_fixnum_value((mrb_int)r_int);
-      break;
-  case 3: // bool
-      if (r_int) {
-        result = mrb_true_value();
-      } else {
-        result = mrb_false_value();
-      }
-      break;
+  struct hex_mrb_trace_span *sp;
+  if (hex_trace == NULL || start < hex_trace_origin) {
+    return;
   }
-  return result;
+  sp = &hex_trace[hex_trace_count++ % HEX_MRB_TRACE_SPANS];
+  sp->start = start;
+  sp->dur = hex_mrb_clock_ns() - start;
+  sp->cat = cat;
+  snprintf(sp->name, sizeof(sp->name), "%s", name ? name : "");
+  snprintf(sp->plugin, sizeof(sp->plugin), "%s", plugin ? plugin : "");
 }
 
-// HexChat::Internal.pluginpref_set_str(String, String)
-static mrb_value
-hex_mrb_xi_pluginpref_set_str(mrb_state *mrb, mrb_value self)
+// Write a string as a JSON string literal
+static void
+hex_mrb_trace_json_str(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for (; *s; s++) {
+    unsigned char ch = (unsigned char)*s;
+    if (ch == '"' || ch == '\\') {
+      fputc('\\', f);
+      fputc(ch, f);
+    } else if (ch < 0x20) {
+      fprintf(f, "\\u%04x", ch);
+    } else {
+      fputc(ch, f);
+    }
+  }
+  fputc('"', f);
+}
+
+// Write the span ring as Chrome trace event JSON, oldest span first
+// Returns the number of spans written, or -1 if the file could not be written
+static long
+hex_mrb_trace_write(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  uint32_t n = hex_trace_count < HEX_MRB_TRACE_SPANS ? (uint32_t)hex_trace_count : HEX_MRB_TRACE_SPANS;
+  uint64_t first = hex_trace_count - n;
+  if (f == NULL) {
+    return -1;
+  }
+  fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+  for (uint32_t i = 0; i < n; i++) {
+    struct hex_mrb_trace_span *sp = &hex_trace[(first + i) % HEX_MRB_TRACE_SPANS];
+    uint64_t ts = sp->start - hex_trace_origin;
+    fputs(i ? ",\n" : "\n", f);
+    fputs("{\"name\":", f);
+    hex_mrb_trace_json_str(f, sp->name);
+    fputs(",\"cat\":", f);
+    hex_mrb_trace_json_str(f, sp->cat);
+    fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"plugin\":",
+            (unsigned long long)(ts / 1000), (unsigned)(ts % 1000),
+            (unsigned long long)(sp->dur / 1000), (unsigned)(sp->dur % 1000));
+    hex_mrb_trace_json_str(f, sp->plugin);
+    fputs("}}", f);
+  }
+  fprintf(f, "\n],\"otherData\":{\"dropped\":%llu}}\n", (unsigned long long)first);
+  if (fclose(f) != 0) {
+    return -1;
+  }
+  return (long)n;
+}
+
+// Get a page aligned to its size
+static struct hex_mrb_pool_page *
+hex_mrb_pool_page_alloc(void)
+{
+#ifdef WIN32
+  return (struct hex_mrb_pool_page *)_aligned_malloc(HEX_MRB_POOL_PAGE, HEX_MRB_POOL_PAGE);
+#else
+  void *p;
+  if (posix_memalign(&p, HEX_MRB_POOL_PAGE, HEX_MRB_POOL_PAGE) != 0) {
+    return NULL;
+  }
+  return (struct hex_mrb_pool_page *)p;
+#endif
+}
+
+static void
+hex_mrb_pool_page_free(struct hex_mrb_pool_page *pg)
+{
+#ifdef WIN32
+  _aligned_free(pg);
+#else
+  free(pg);
+#endif
+}
+
+// Take a page off its class's list of pages with room
+static void
+hex_mrb_pool_unlink(struct hex_mrb_pool_class *c, struct hex_mrb_pool_page *pg)
+{
+  if (pg->prev != NULL) {
+    pg->prev->next = pg->next;
+  } else {
+    c->partial = pg->next;
+  }
+  if (pg->next != NULL) {
+    pg->next->prev = pg->prev;
+  }
+  pg->next = pg->prev = NULL;
+  pg->partial = 0;
+}
+
+// Get a block of a size class, NULL if no page could be had
+static void *
+hex_mrb_pool_get(uint32_t cls)
+{
+  struct hex_mrb_pool_class *c = &hex_pool[cls];
+  struct hex_mrb_pool_page *pg = c->partial;
+  uint32_t size = hex_pool_sizes[cls];
+  void *b;
+  if (pg == NULL) {
+    pg = hex_mrb_pool_page_alloc();
+    if (pg == NULL) {
+      return NULL;
+    }
+    pg->next = pg->prev = NULL;
+    pg->free = NULL;
+    pg->bump = (char *)pg + HEX_MRB_POOL_HEAD;
+    pg->used = 0;
+    pg->cls = cls;
+    pg->partial = 1;
+    c->partial = pg;
+    c->pages++;
+  }
+  if (pg->free != NULL) {
+    b = pg->free;
+    pg->free = *(void **)b;
+  } else {
+    b = pg->bump;
+    pg->bump += size;
+  }
+  pg->used++;
+  c->used++;
+  if (pg->free == NULL && pg->bump + size > (char *)pg + HEX_MRB_POOL_PAGE) {
+    hex_mrb_pool_unlink(c, pg);
+  }
+  return b;
+}
+
+// Give a block back to its page
+// An empty page is released unless it is the class's only page with room
+static void
+hex_mrb_pool_put(void *b)
+{
+  struct hex_mrb_pool_page *pg = (struct hex_mrb_pool_page *)((uintptr_t)b & ~(uintptr_t)(HEX_MRB_POOL_PAGE - 1));
+  struct hex_mrb_pool_class *c = &hex_pool[pg->cls];
+  *(void **)b = pg->free;
+  pg->free = b;
+  pg->used--;
+  c->used--;
+  if (!pg->partial) {
+    pg->next = c->partial;
+    pg->prev = NULL;
+    if (c->partial != NULL) {
+      c->partial->prev = pg;
+    }
+    c->partial = pg;
+    pg->partial = 1;
+  }
+  if (pg->used == 0 && (pg->prev != NULL || pg->next != NULL)) {
+    hex_mrb_pool_unlink(c, pg);
+    hex_mrb_pool_page_free(pg);
+    c->pages--;
+  }
+}
+
+// Allocate a block with room for size bytes after the header
+// Small blocks come from the pool while it is on, the rest from malloc
+static struct hex_mrb_mem_head *
+hex_mrb_block_alloc(size_t size)
+{
+  size_t total = sizeof(struct hex_mrb_mem_head) + size;
+  struct hex_mrb_mem_head *h = NULL;
+  if (hex_pool_on && total <= HEX_MRB_POOL_MAX) {
+    uint32_t cls = hex_pool_index[(total + 15) / 16];
+    h = (struct hex_mrb_mem_head *)hex_mrb_pool_get(cls);
+    if (h != NULL) {
+      h->pool = cls + 1;
+      hex_pool[cls].requested += size;
+    }
+  }
+  if (h == NULL) {
+    h = (struct hex_mrb_mem_head *)malloc(total);
+    if (h == NULL) {
+      return NULL;
+    }
+    h->pool = 0;
+    hex_pool_large++;
+    hex_pool_large_bytes += size;
+  }
+  h->size = size;
+  return h;
+}
+
+// Free a block from hex_mrb_block_alloc
+static void
+hex_mrb_block_free(struct hex_mrb_mem_head *h)
+{
+  if (h->pool) {
+    hex_pool[h->pool - 1].requested -= h->size;
+    hex_mrb_pool_put(h);
+  } else {
+    hex_pool_large--;
+    hex_pool_large_bytes -= h->size;
+    free(h);
+  }
+}
+
+// Resize a block from hex_mrb_block_alloc, NULL (and h untouched) on failure
+// Pool blocks stay put while the new size fits their class
+static struct hex_mrb_mem_head *
+hex_mrb_block_realloc(struct hex_mrb_mem_head *h, size_t size)
+{
+  size_t total = sizeof(struct hex_mrb_mem_head) + size;
+  struct hex_mrb_mem_head *nh;
+  if (h->pool && total <= hex_pool_sizes[h->pool - 1]) {
+    hex_pool[h->pool - 1].requested += size - h->size;
+    h->size = size;
+    return h;
+  }
+  if (h->pool || (hex_pool_on && total <= HEX_MRB_POOL_MAX)) {
+    nh = hex_mrb_block_alloc(size);
+    if (nh == NULL) {
+      return NULL;
+    }
+    memcpy(nh + 1, h + 1, h->size < size ? h->size : size);
+    nh->owner = h->owner;
+    hex_mrb_block_free(h);
+    return nh;
+  }
+  nh = (struct hex_mrb_mem_head *)realloc(h, total);
+  if (nh == NULL) {
+    return NULL;
+  }
+  hex_pool_large_bytes += size - nh->size;
+  nh->size = size;
+  return nh;
+}
+
+// Release the pool's empty pages, used once mruby has freed everything
+static void
+hex_mrb_pool_free_all(void)
+{
+  for (int i = 0; i < HEX_MRB_POOL_CLASSES; i++) {
+    struct hex_mrb_pool_page *pg = hex_pool[i].partial;
+    while (pg != NULL) {
+      struct hex_mrb_pool_page *next = pg->next;
+      if (pg->used == 0) {
+        hex_mrb_pool_unlink(&hex_pool[i], pg);
+        hex_mrb_pool_page_free(pg);
+        hex_pool[i].pages--;
+      }
+      pg = next;
+    }
+  }
+}
+
+// Fill in the size to size class table
+static void
+hex_mrb_pool_init(void)
+{
+  uint32_t cls = 0;
+  for (uint32_t units = 0; units <= HEX_MRB_POOL_MAX / 16; units++) {
+    while (hex_pool_sizes[cls] < units * 16) {
+      cls++;
+    }
+    hex_pool_index[units] = (uint8_t)cls;
+  }
+}
+
+// Allocator handed to mrb_open_allocf, charges every block to a plugin
+// New blocks go to hex_mem_current, a block keeps its owner until freed.
+// Object heap pages are charged to core: a page holds objects of every
+// plugin, and would otherwise count against whichever one made it grow.
+static void *
+hex_mrb_allocf(mrb_state *mrb, void *p, size_t size, void *ud)
+{
+  struct hex_mrb_mem_head *h = p != NULL ? (struct hex_mrb_mem_head *)p - 1 : NULL;
+  struct hex_mrb_mem_owner *o;
+  if (size == 0) {
+    if (h != NULL) {
+      o = &hex_mem_owners[h->owner];
+      o->live -= h->size;
+      o->frees++;
+      if (o->warned && o->live <= o->limit) {
+        o->warned = 0;
+      }
+      hex_mrb_block_free(h);
+    }
+    return NULL;
+  }
+  if (size > SIZE_MAX - sizeof(struct hex_mrb_mem_head)) {
+    return NULL;
+  }
+  if (h != NULL) {
+    uint64_t old = h->size;
+    struct hex_mrb_mem_head *nh = hex_mrb_block_realloc(h, size);
+    if (nh == NULL) {
+      return NULL;
+    }
+    h = nh;
+    o = &hex_mem_owners[h->owner];
+    o->live = o->live - old + size;
+  } else {
+    h = hex_mrb_block_alloc(size);
+    if (h == NULL) {
+      return NULL;
+    }
+    h->owner = size == HEX_MRB_HEAP_PAGE_BYTES ? 0 : hex_mem_current;
+    o = &hex_mem_owners[h->owner];
+    o->live += size;
+    o->allocs++;
+  }
+  if (o->live > o->peak) {
+    o->peak = o->live;
+  }
+  if (o->limit > 0 && o->live > o->limit && !o->warned) {
+    hex_mem_check = 1;
+  }
+  return h + 1;
+}
+
+// Find the heap owner for a plugin class name, adding it if new
+// Returns 0 (core) for "" or when the table is full
+static uint32_t
+hex_mrb_mem_owner(const char *name)
+{
+  uint32_t i;
+  if (name == NULL || *name == '\0') {
+    return 0;
+  }
+  for (i = 1; i < hex_mem_owner_count; i++) {
+    if (strcmp(hex_mem_owners[i].name, name) == 0) {
+      return i;
+    }
+  }
+  if (hex_mem_owner_count == HEX_MRB_MEM_OWNERS) {
+    return 0;
+  }
+  hex_mem_owners[i].name = strdup(name);
+  if (hex_mem_owners[i].name == NULL) {
+    return 0;
+  }
+  return hex_mem_owner_count++;
+}
+
+// Warn about plugins over their soft limit, after a full GC to see whether
+// they really are.  Only called between callbacks, never from the allocator.
+static void
+hex_mrb_mem_enforce(mrb_state *mrb)
+{
+  hex_mem_check = 0;
+  mrb_full_gc(mrb);
+  for (uint32_t i = 0; i < hex_mem_owner_count; i++) {
+    struct hex_mrb_mem_owner *o = &hex_mem_owners[i];
+    if (o->limit > 0 && o->live > o->limit && !o->warned) {
+      o->warned = 1;
+      hexchat_printf(ph, "MRuby: %s uses %llu bytes, over its limit of %llu",
+                     i ? o->name : "(core)", (unsigned long long)o->live, (unsigned long long)o->limit);
+    }
+  }
+}
+
+// Get data from hook C structure into an array
+static mrb_value
+hex_mrb_hook_info(mrb_state *mrb, struct mrb_hexchat_hook *hk)
+{
+  mrb_value array = mrb_ary_new(mrb);
+  mrb_ary_push(mrb, array, hex_mrb_ptr_to_s(mrb, hk));
+  mrb_ary_push(mrb, array, hex_mrb_ptr_to_s(mrb, hk->xhook));
+  mrb_ary_push(mrb, array, hex_mrb_obj_id_to_s(mrb, hk->block));
+  mrb_ary_push(mrb, array, mrb_fixnum_value(mrb_obj_id(hk->block)));
+  return array;
+}
+
+// HexChat::Internal.print(String)
+static mrb_value
+hex_mrb_xi_print(mrb_state *mrb, mrb_value self)
+{
+  char *out;
+  mrb_get_args(mrb, "z", &out);
+  hexchat_print(ph, out);
+  return mrb_nil_value();
+}
+
+// HexChat::Internal.command(String)
+static mrb_value
+hex_mrb_xi_command(mrb_state *mrb, mrb_value self)
+{
+  char *cmd;
+  mrb_get_args(mrb, "z", &cmd);
+  hexchat_command(ph, cmd);
+  return mrb_nil_value();
+}
+
+// Uncached hexchat_get_info
+static mrb_value
+hex_mrb_get_info(mrb_state *mrb, const char *id)
+{
+  const char *info = hexchat_get_info(ph, id);
+  return info != NULL ? mrb_str_new_cstr(mrb, info) : mrb_nil_value();
+}
+
+// A value for the info and prefs caches, frozen like interned strings
+static mrb_value
+hex_mrb_cache_share(mrb_value v)
+{
+  if (mrb_string_p(v)) {
+    HEX_MRB_STR_FREEZE(v);
+  }
+  return v;
+}
+
+// HexChat::Internal.get_info(String)
+// Commonly used keys are cached until an event changes them, so the same
+// read-only String is returned each time.
+static mrb_value
+hex_mrb_xi_get_info(mrb_state *mrb, mrb_value self)
+{
+  char *id;
+  mrb_get_args(mrb, "z", &id);
+  for (int i = 0; hex_info_keys[i] != NULL; i++) {
+    if (strcmp(id, hex_info_keys[i]) == 0) {
+      hexchat_context *c = hexchat_get_context(ph);
+      struct hex_mrb_cxt_entry *e;
+      mrb_value result;
+      if (c == NULL) {
+        break;
+      }
+      e = hex_mrb_context_entry(mrb, c);
+      if (e->info_valid & (1 << i)) {
+        return mrb_iv_get(mrb, e->obj, hex_info_syms[i]);
+      }
+      result = hex_mrb_cache_share(hex_mrb_get_info(mrb, id));
+      mrb_iv_set(mrb, e->obj, hex_info_syms[i], result);
+      e->info_valid |= 1 << i;
+      return result;
+    }
+  }
+  for (int i = 0; hex_info_global_keys[i] != NULL; i++) {
+    if (strcmp(id, hex_info_global_keys[i]) == 0) {
+      if (mrb_nil_p(hex_info_global[i])) {
+        hex_info_global[i] = hex_mrb_cache_share(hex_mrb_get_info(mrb, id));
+        mrb_gc_register(mrb, hex_info_global[i]);
+      }
+      return hex_info_global[i];
+    }
+  }
+  return hex_mrb_get_info(mrb, id);
+}
+
+// HexChat::Internal.strip(String)
+static mrb_value
+hex_mrb_xi_strip(mrb_state *mrb, mrb_value self)
+{
+  const char *text;
+  int flags = 1 | 2;
+  char *new_text;
+  mrb_value result = mrb_nil_value();
+  mrb_get_args(mrb, "z|i", &text, &flags);
+  new_text = hexchat_strip(ph, text, -1, flags);
+  if (new_text != NULL) {
+    result = mrb_str_new_cstr(mrb, new_text);
+    hexchat_free(ph, new_text);
+  }
+  return result;
+}
+
+// HexChat::Internal.get_prefs(String)
+// Results are cached until the next /SET
+static mrb_value
+hex_mrb_xi_get_prefs(mrb_state *mrb, mrb_value self)
+{
+  const char *name;
+  int r_type;
+  int r_int;
+  const char *r_str;
+  mrb_value key;
+  mrb_value result = mrb_nil_value();
+  mrb_get_args(mrb, "z", &name);
+  key = mrb_symbol_value(mrb_intern_cstr(mrb, name));
+  result = mrb_hash_get(mrb, hex_prefs_cache, key);
+  if (!mrb_nil_p(result)) {
+    return result;
+  }
+  r_type = hexchat_get_prefs(ph, name, &r_str, &r_int);
+  switch(r_type) {
+  case 1: // string
+      result = hex_mrb_cache_share(mrb_str_new_cstr(mrb, r_str));
+      break;
+  case 2: // int
+      result = mrb_fixnum_value((mrb_int)r_int);
+      break;
+  case 3: // bool
+      if (r_int) {
+        result = mrb_true_value();
+      } else {
+        result = mrb_false_value();
+      }
+      break;
+  }
+  if (!mrb_nil_p(result)) {
+    mrb_hash_set(mrb, hex_prefs_cache, key, result);
+  }
+  return result;
+}
+
+// HexChat::Internal.pluginpref_set_str(String, String)
+static mrb_value
+hex_mrb_xi_pluginpref_set_str(mrb_state *mrb, mrb_value self)
 {
   const char *var;
   const char *value;
@@ -400,96 +2107,5700 @@ hex_mrb_xi_pluginpref_get_str(mrb_state *mrb, mrb_value self)
   if (success) {
     result = mrb_str_new_cstr(mrb, buf);
   }
-  return result;
+  return result;
+}
+
+// HexChat::Internal.pluginpref_set_int(String, Integer)
+static mrb_value
+hex_mrb_xi_pluginpref_set_int(mrb_state *mrb, mrb_value self)
+{
+  const char *var;
+  int value;
+  int success;
+  mrb_get_args(mrb, "zi", &var, &value);
+  success = hexchat_pluginpref_set_int(ph, var, value);
+  return success ? mrb_true_value() : mrb_false_value();
+}
+
+// HexChat::Internal.pluginpref_get_int(String)
+static mrb_value
+hex_mrb_xi_pluginpref_get_int(mrb_state *mrb, mrb_value self)
+{
+  char *var;
+  mrb_get_args(mrb, "z", &var);
+  return mrb_fixnum_value((mrb_int)hexchat_pluginpref_get_int(ph, var));
+}
+
+// HexChat::Internal.emit_print(String, [String]...)
+// (takes up to 6 strings after the required one)
+static mrb_value
+hex_mrb_xi_emit_print(mrb_state *mrb, mrb_value self)
+{
+  char *name;
+  char *argv[6];
+  int result;
+  memset(&argv, 0, sizeof(char*)*6);
+  mrb_get_args(mrb, "z|z!z!z!z!z!z!", &name,
+          &argv[0], &argv[1], &argv[2],
+          &argv[3], &argv[4], &argv[5]);
+  result = hexchat_emit_print(ph, name,
+          argv[0], argv[1], argv[2],
+          argv[3], argv[4], argv[5], NULL);
+  return result ? mrb_true_value() : mrb_false_value();
+}
+
+// Get the HexChat context out of a HexChat::Internal::Context or a
+// HexChat::Context wrapping one, NULL if there isn't one
+static hexchat_context*
+hex_mrb_value_to_context(mrb_state *mrb, mrb_value v)
+{
+  if (mrb_type(v) == MRB_TT_OBJECT) {
+    v = mrb_iv_get(mrb, v, mrb_intern_lit(mrb, "@context"));
+  }
+  if (mrb_type(v) == MRB_TT_DATA && DATA_TYPE(v) == &mrb_hexchat_cxt_type) {
+    return ((struct mrb_hexchat_context *)DATA_PTR(v))->c;
+  }
+  return NULL;
+}
+
+// Check one emit_print_batch entry
+// Returns what is wrong with it and sets *cls to the error class, or NULL
+// if it can be emitted.  Nothing in here raises.
+static const char*
+hex_mrb_emit_batch_check(mrb_state *mrb, mrb_value ev, struct RClass **cls)
+{
+  mrb_value name;
+  mrb_value args;
+  mrb_value stime;
+  *cls = E_TYPE_ERROR;
+  if (!mrb_array_p(ev) || RARRAY_LEN(ev) < 1 || !mrb_string_p(mrb_ary_ref(mrb, ev, 0))) {
+    return "event must be [String, Array, time, context]";
+  }
+  name = mrb_ary_ref(mrb, ev, 0);
+  args = mrb_ary_ref(mrb, ev, 1);
+  stime = mrb_ary_ref(mrb, ev, 2);
+  if (!mrb_nil_p(args) && !mrb_array_p(args)) {
+    return "event args must be an Array";
+  }
+  if (!mrb_nil_p(stime) && !mrb_fixnum_p(stime) && !mrb_float_p(stime)) {
+    return "server time must be Integer, Float or nil";
+  }
+  if (!mrb_nil_p(mrb_ary_ref(mrb, ev, 3)) && hex_mrb_value_to_context(mrb, mrb_ary_ref(mrb, ev, 3)) == NULL) {
+    return "event context must be a HexChat::Context or nil";
+  }
+  *cls = E_ARGUMENT_ERROR;
+  if (memchr(RSTRING_PTR(name), 0, RSTRING_LEN(name)) != NULL) {
+    return "event name contains null byte";
+  }
+  if (mrb_array_p(args) && RARRAY_LEN(args) > HEX_MRB_EMIT_ARGS_MAX) {
+    return "too many event args (at most 16)";
+  }
+  for (mrb_int i = 0; mrb_array_p(args) && i < RARRAY_LEN(args); i++) {
+    mrb_value a = mrb_ary_ref(mrb, args, i);
+    if (!mrb_nil_p(a) && !mrb_string_p(a)) {
+      *cls = E_TYPE_ERROR;
+      return "event args must be Strings";
+    }
+    if (!mrb_nil_p(a) && memchr(RSTRING_PTR(a), 0, RSTRING_LEN(a)) != NULL) {
+      return "string contains null byte";
+    }
+  }
+  return NULL;
+}
+
+// HexChat::Internal.emit_print_batch(Array)
+// Each element is [event, [args...], server_time, context], the last
+// three are optional.  Emits them all with one attrs structure and returns
+// the number of events HexChat accepted.
+// Print hooks run while we emit and may change the array, so each event
+// is checked again right before it is used; a bad one stops the batch and
+// raises once the context is restored.
+static mrb_value
+hex_mrb_xi_emit_print_batch(mrb_state *mrb, mrb_value self)
+{
+  mrb_value events;
+  mrb_int count = 0;
+  hexchat_event_attrs *attrs;
+  hexchat_context *orig;
+  struct RClass *cls = NULL;
+  const char *err = NULL;
+  int ai;
+  mrb_get_args(mrb, "A", &events);
+  // Check everything first so nothing is emitted from a bad batch
+  for (mrb_int i = 0; i < RARRAY_LEN(events); i++) {
+    err = hex_mrb_emit_batch_check(mrb, mrb_ary_ref(mrb, events, i), &cls);
+    if (err != NULL) {
+      mrb_raise(mrb, cls, err);
+    }
+  }
+  orig = hexchat_get_context(ph);
+  attrs = hexchat_event_attrs_create(ph);
+  ai = mrb_gc_arena_save(mrb);
+  for (mrb_int i = 0; err == NULL && i < RARRAY_LEN(events); i++) {
+    char *argv[HEX_MRB_EMIT_ARGS_MAX];
+    mrb_value ev = mrb_ary_ref(mrb, events, i);
+    mrb_value args;
+    mrb_value stime;
+    hexchat_context *c;
+    err = hex_mrb_emit_batch_check(mrb, ev, &cls);
+    if (err != NULL) {
+      break;
+    }
+    args = mrb_ary_ref(mrb, ev, 1);
+    stime = mrb_ary_ref(mrb, ev, 2);
+    c = hex_mrb_value_to_context(mrb, mrb_ary_ref(mrb, ev, 3));
+    memset(&argv, 0, sizeof(argv));
+    for (mrb_int a = 0; mrb_array_p(args) && a < RARRAY_LEN(args); a++) {
+      mrb_value v = mrb_ary_ref(mrb, args, a);
+      argv[a] = mrb_nil_p(v) ? "" : mrb_str_to_cstr(mrb, v);
+    }
+    if (mrb_fixnum_p(stime)) {
+      attrs->server_time_utc = (time_t)mrb_fixnum(stime);
+    } else if (mrb_float_p(stime)) {
+      attrs->server_time_utc = (time_t)mrb_float(stime);
+    } else {
+      attrs->server_time_utc = 0;
+    }
+    // Entries without a context go to the caller's, not the last one set
+    if (hexchat_set_context(ph, c != NULL ? c : orig)) {
+      // HexChat stops reading at the first NULL
+      count += hexchat_emit_print_attrs(ph, attrs, mrb_str_to_cstr(mrb, mrb_ary_ref(mrb, ev, 0)),
+              argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7],
+              argv[8], argv[9], argv[10], argv[11], argv[12], argv[13], argv[14], argv[15],
+              NULL) ? 1 : 0;
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  hexchat_event_attrs_free(ph, attrs);
+  hexchat_set_context(ph, orig);
+  if (err != NULL) {
+    mrb_raisef(mrb, cls, "%S (batch changed while emitting, %S events emitted)",
+               mrb_str_new_cstr(mrb, err), mrb_fixnum_value(count));
+  }
+  return mrb_fixnum_value(count);
+}
+
+// HexChat::Internal.load(String)
+// Loads an MRuby file
+static mrb_value
+hex_mrb_xi_load(mrb_state *mrb, mrb_value self) {
+  char *fname;
+  FILE *file;
+  mrb_value result = mrb_nil_value();
+  mrb_get_args(mrb, "z", &fname);
+  file = fopen(fname, "rb");  // b flag for OSes that care...
+  if (file != NULL) {
+    char buf[4];
+    size_t b_read;
+    uint64_t start = hex_mrb_trace_begin();
+    uint64_t t0 = hex_startup_loading ? hex_mrb_clock_ns() : 0;
+    mrbc_context *c = mrbc_context_new(mrb);
+    mrbc_filename(mrb, c, fname);
+    c->lineno = 1;
+    b_read = fread((void *)buf, 1, 4, file);
+    rewind(file);
+    if (b_read == 4 && strncmp("RITE", buf, 4) == 0) {
+      // RiteVM compiled - load it
+      mrb_load_irep_file_cxt(mrb, file, c);
+    } else {
+      // Reopen without binary flag and load it
+      fclose(file);
+      file = fopen(fname, "r");
+      mrb_load_file_cxt(mrb, file, c);
+    }
+    fclose(file);
+    mrbc_context_free(mrb, c);
+    if (start) {
+      const char *base = strrchr(fname, '/');
+      hex_mrb_trace_end(start, "load", base ? base + 1 : fname, "");
+    }
+    if (t0) {
+      const char *base = strrchr(fname, '/');
+      hex_mrb_startup_script(base ? base + 1 : fname, hex_mrb_clock_ns() - t0, !mrb->exc);
+    }
+    if (mrb->exc) {
+      hex_metric_load_errors++;
+      hexchat_printf(ph, "error loading %s", fname);
+      hex_mrb_print_exc(mrb);
+      mrb->exc = 0;
+      result = mrb_false_value();
+    } else {
+      result = mrb_true_value();
+    }
+  }
+  return result;
+}
+
+// HexChat::Internal.watchdog(Integer, Integer)
+// Sets the default callback budget in ms (0 for none) and the overruns
+// before a hook is disabled (0 for never).  Returns true if runaway
+// callbacks are interrupted, false if overruns are only counted afterwards.
+static mrb_value
+hex_mrb_xi_watchdog(mrb_state *mrb, mrb_value self)
+{
+  mrb_int ms, strikes;
+  mrb_get_args(mrb, "ii", &ms, &strikes);
+  if (ms < 0 || strikes < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "budget and strikes must not be negative");
+  }
+  hex_watch_budget_ms = (uint32_t)ms;
+  hex_watch_strikes = (uint32_t)strikes;
+  return mrb_bool_value(HEX_MRB_WATCH_RAISE);
+}
+
+// HexChat::Internal.mem_owner(String or nil)
+// Charges new heap blocks to the named plugin class (nil for core)
+// Returns the previous owner's name, so it can be put back
+static mrb_value
+hex_mrb_xi_mem_owner(mrb_state *mrb, mrb_value self)
+{
+  char *name = NULL;
+  uint32_t old = hex_mem_current;
+  mrb_get_args(mrb, "z!", &name);
+  hex_mem_current = hex_mrb_mem_owner(name);
+  if (hex_mem_check) {
+    hex_mrb_mem_enforce(mrb);
+  }
+  return old ? mrb_str_new_cstr(mrb, hex_mem_owners[old].name) : mrb_nil_value();
+}
+
+// HexChat::Internal.mem_limit(String, Integer)
+// Soft heap limit of a plugin class in bytes, 0 for none
+static mrb_value
+hex_mrb_xi_mem_limit(mrb_state *mrb, mrb_value self)
+{
+  char *name;
+  mrb_int limit;
+  uint32_t i;
+  mrb_get_args(mrb, "zi", &name, &limit);
+  if (limit < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "limit must not be negative");
+  }
+  i = hex_mrb_mem_owner(name);
+  if (i == 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "too many plugins to track");
+  }
+  hex_mem_owners[i].limit = (uint64_t)limit;
+  hex_mem_owners[i].warned = 0;
+  return mrb_nil_value();
+}
+
+// HexChat::Internal.mem_stats
+// [[name, live bytes, peak bytes, blocks allocated, blocks freed, limit], ...]
+// The first row is core, with a nil name
+static mrb_value
+hex_mrb_xi_mem_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_value rows = mrb_ary_new_capa(mrb, (mrb_int)hex_mem_owner_count);
+  for (uint32_t i = 0; i < hex_mem_owner_count; i++) {
+    struct hex_mrb_mem_owner *o = &hex_mem_owners[i];
+    mrb_value row[6];
+    row[0] = i ? mrb_str_new_cstr(mrb, o->name) : mrb_nil_value();
+    row[1] = mrb_fixnum_value((mrb_int)o->live);
+    row[2] = mrb_fixnum_value((mrb_int)o->peak);
+    row[3] = mrb_fixnum_value((mrb_int)o->allocs);
+    row[4] = mrb_fixnum_value((mrb_int)o->frees);
+    row[5] = mrb_fixnum_value((mrb_int)o->limit);
+    mrb_ary_push(mrb, rows, mrb_ary_new_from_values(mrb, 6, row));
+  }
+  return rows;
+}
+
+// HexChat::Internal.pool(true/false)
+// Turns the small block pool on or off for new blocks, returns the old setting
+// Blocks already in the pool stay there until freed
+static mrb_value
+hex_mrb_xi_pool(mrb_state *mrb, mrb_value self)
+{
+  mrb_bool on;
+  int old = hex_pool_on;
+  mrb_get_args(mrb, "b", &on);
+  hex_pool_on = on ? 1 : 0;
+  return mrb_bool_value(old);
+}
+
+// HexChat::Internal.pool_stats
+// [on, malloc blocks, malloc bytes asked for,
+//  [[block size, pages, blocks used, blocks free, bytes asked for], ...]]
+static mrb_value
+hex_mrb_xi_pool_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_value rows = mrb_ary_new_capa(mrb, HEX_MRB_POOL_CLASSES);
+  mrb_value result[4];
+  for (int i = 0; i < HEX_MRB_POOL_CLASSES; i++) {
+    struct hex_mrb_pool_class *c = &hex_pool[i];
+    uint64_t per_page = (HEX_MRB_POOL_PAGE - HEX_MRB_POOL_HEAD) / hex_pool_sizes[i];
+    mrb_value row[5];
+    row[0] = mrb_fixnum_value((mrb_int)hex_pool_sizes[i]);
+    row[1] = mrb_fixnum_value((mrb_int)c->pages);
+    row[2] = mrb_fixnum_value((mrb_int)c->used);
+    row[3] = mrb_fixnum_value((mrb_int)(c->pages * per_page - c->used));
+    row[4] = mrb_fixnum_value((mrb_int)c->requested);
+    mrb_ary_push(mrb, rows, mrb_ary_new_from_values(mrb, 5, row));
+  }
+  result[0] = mrb_bool_value(hex_pool_on);
+  result[1] = mrb_fixnum_value((mrb_int)hex_pool_large);
+  result[2] = mrb_fixnum_value((mrb_int)hex_pool_large_bytes);
+  result[3] = rows;
+  return mrb_ary_new_from_values(mrb, 4, result);
+}
+
+// HexChat::Internal.trace_start
+// Returns false if a trace is already running
+static mrb_value
+hex_mrb_xi_trace_start(mrb_state *mrb, mrb_value self)
+{
+  if (hex_trace != NULL) {
+    return mrb_false_value();
+  }
+  hex_trace = (struct hex_mrb_trace_span *)mrb_malloc(mrb, sizeof(struct hex_mrb_trace_span) * HEX_MRB_TRACE_SPANS);
+  hex_trace_count = 0;
+  hex_trace_origin = hex_mrb_clock_ns();
+  return mrb_true_value();
+}
+
+// HexChat::Internal.trace_stop(String)
+// Writes the trace to the file and stops, returns the spans written
+// or nil if no trace is running.  Keeps tracing if the file can't be written.
+static mrb_value
+hex_mrb_xi_trace_stop(mrb_state *mrb, mrb_value self)
+{
+  char *path;
+  long n;
+  mrb_get_args(mrb, "z", &path);
+  if (hex_trace == NULL) {
+    return mrb_nil_value();
+  }
+  n = hex_mrb_trace_write(path);
+  if (n < 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "unable to write %S: %S",
+               mrb_str_new_cstr(mrb, path), mrb_str_new_cstr(mrb, strerror(errno)));
+  }
+  mrb_free(mrb, hex_trace);
+  hex_trace = NULL;
+  return mrb_fixnum_value((mrb_int)n);
+}
+
+// GC.start, replaced so that full collections show up in traces and metrics
+static mrb_value
+hex_mrb_gc_start(mrb_state *mrb, mrb_value self)
+{
+  uint64_t start = hex_mrb_clock_ns();
+  mrb_full_gc(mrb);
+  hex_metric_gc_runs++;
+  hex_metric_gc_ns += hex_mrb_clock_ns() - start;
+  if (hex_trace != NULL) {
+    hex_mrb_trace_end(start, "gc", "GC.start", "");
+  }
+  return mrb_nil_value();
+}
+
+// Find (or create) the state for the server of the current context
+static struct hex_mrb_server*
+hex_mrb_server_current(void)
+{
+  struct hex_mrb_server *s;
+  int id = hexchat_list_int(ph, NULL, "id");
+  for (s = hex_servers; s != NULL; s = s->next) {
+    if (s->id == id) {
+      return s;
+    }
+  }
+  s = (struct hex_mrb_server *)malloc(sizeof(struct hex_mrb_server));
+  s->id = id;
+  s->modes_per_line = HEX_MRB_MODES_DEFAULT;
+  s->casemapping = HEX_MRB_CASEMAP_RFC1459;
+  s->next = hex_servers;
+  hex_servers = s;
+  return s;
+}
+
+// Free all server state
+static void
+hex_mrb_server_free_all(void)
+{
+  while (hex_servers != NULL) {
+    struct hex_mrb_server *s = hex_servers;
+    hex_servers = s->next;
+    free(s);
+  }
+}
+
+// ISUPPORT (005) server hook, records the server's limits
+static int
+hex_mrb_isupport_cb(char *word[], char *word_eol[], void *userdata)
+{
+  struct hex_mrb_server *s = hex_mrb_server_current();
+  for (int i = 4; i < 32 && word[i] != NULL && word[i][0] != 0 && word[i][0] != ':'; i++) {
+    if (strncmp(word[i], "MODES", 5) == 0 && (word[i][5] == '=' || word[i][5] == 0)) {
+      int modes = word[i][5] == '=' ? atoi(word[i] + 6) : 0;
+      s->modes_per_line = modes > 0 ? modes : HEX_MRB_MODES_BATCH_MAX;
+    } else if (strncmp(word[i], "CASEMAPPING=", 12) == 0) {
+      const char *cm = word[i] + 12;
+      if (strcmp(cm, "ascii") == 0) {
+        s->casemapping = HEX_MRB_CASEMAP_ASCII;
+      } else if (strcmp(cm, "strict-rfc1459") == 0) {
+        s->casemapping = HEX_MRB_CASEMAP_STRICT;
+      } else {
+        s->casemapping = HEX_MRB_CASEMAP_RFC1459;
+      }
+    }
+  }
+  return HEXCHAT_EAT_NONE;
+}
+
+// Fill in the casemapping lowercase tables
+static void
+hex_mrb_casemap_init(void)
+{
+  for (int cm = 0; cm < HEX_MRB_CASEMAPS; cm++) {
+    for (int ch = 0; ch < 256; ch++) {
+      hex_casemap[cm][ch] = (ch >= 'A' && ch <= 'Z') ? ch + 32 : ch;
+    }
+    if (cm != HEX_MRB_CASEMAP_ASCII) {
+      hex_casemap[cm]['['] = '{';
+      hex_casemap[cm][']'] = '}';
+      hex_casemap[cm]['\\'] = '|';
+    }
+    if (cm == HEX_MRB_CASEMAP_RFC1459) {
+      hex_casemap[cm]['~'] = '^';
+    }
+  }
+}
+
+// Compare two names under a casemapping, like strcasecmp
+static int
+hex_mrb_casecmp(const unsigned char *map, const char *a, mrb_int alen, const char *b, mrb_int blen)
+{
+  mrb_int n = alen < blen ? alen : blen;
+  for (mrb_int i = 0; i < n; i++) {
+    int d = (int)map[(unsigned char)a[i]] - (int)map[(unsigned char)b[i]];
+    if (d != 0) {
+      return d;
+    }
+  }
+  return alen == blen ? 0 : (alen < blen ? -1 : 1);
+}
+
+// Casemapping table for the current server
+static const unsigned char*
+hex_mrb_casemap_current(void)
+{
+  return hex_casemap[hex_mrb_server_current()->casemapping];
+}
+
+// FNV-1a over a byte string
+static uint32_t
+hex_mrb_hash_bytes(const char *p, mrb_int len)
+{
+  uint32_t h = 2166136261u;
+  for (mrb_int i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)p[i]) * 16777619u;
+  }
+  return h;
+}
+
+// (Re)create an empty intern table
+static void
+hex_mrb_intern_reset(mrb_state *mrb, uint32_t cap)
+{
+  free(hex_intern);
+  hex_intern = (struct hex_mrb_intern_slot *)malloc(sizeof(struct hex_mrb_intern_slot) * cap);
+  for (uint32_t i = 0; i < cap; i++) {
+    hex_intern[i].hash = 0;
+    hex_intern[i].str = mrb_nil_value();
+  }
+  hex_intern_cap = cap;
+  hex_intern_count = 0;
+  mrb_ary_clear(mrb, hex_intern_keep);
+}
+
+// Grow the intern table, rehashing what's in it
+static void
+hex_mrb_intern_grow(void)
+{
+  struct hex_mrb_intern_slot *old = hex_intern;
+  uint32_t old_cap = hex_intern_cap;
+  hex_intern_cap *= 2;
+  hex_intern = (struct hex_mrb_intern_slot *)malloc(sizeof(struct hex_mrb_intern_slot) * hex_intern_cap);
+  for (uint32_t i = 0; i < hex_intern_cap; i++) {
+    hex_intern[i].hash = 0;
+    hex_intern[i].str = mrb_nil_value();
+  }
+  for (uint32_t i = 0; i < old_cap; i++) {
+    if (!mrb_nil_p(old[i].str)) {
+      uint32_t j = old[i].hash & (hex_intern_cap - 1);
+      while (!mrb_nil_p(hex_intern[j].str)) {
+        j = (j + 1) & (hex_intern_cap - 1);
+      }
+      hex_intern[j] = old[i];
+    }
+  }
+  free(old);
+}
+
+// Return the shared String with the given contents
+static mrb_value
+hex_mrb_intern_str(mrb_state *mrb, const char *p, mrb_int len)
+{
+  uint32_t h = hex_mrb_hash_bytes(p, len);
+  uint32_t i = h & (hex_intern_cap - 1);
+  while (!mrb_nil_p(hex_intern[i].str)) {
+    mrb_value v = hex_intern[i].str;
+    if (hex_intern[i].hash == h && RSTRING_LEN(v) == len && memcmp(RSTRING_PTR(v), p, len) == 0) {
+      return v;
+    }
+    i = (i + 1) & (hex_intern_cap - 1);
+  }
+  if (hex_intern_count >= HEX_MRB_INTERN_MAX) {
+    hex_mrb_intern_reset(mrb, HEX_MRB_INTERN_MIN);
+    return hex_mrb_intern_str(mrb, p, len);
+  }
+  hex_intern[i].hash = h;
+  hex_intern[i].str = mrb_str_new(mrb, p, len);
+  HEX_MRB_STR_FREEZE(hex_intern[i].str);
+  mrb_ary_push(mrb, hex_intern_keep, hex_intern[i].str);
+  if (++hex_intern_count * 2 > hex_intern_cap) {
+    mrb_value v = hex_intern[i].str;
+    hex_mrb_intern_grow();
+    return v;
+  }
+  return hex_intern[i].str;
+}
+
+// Fold a name under a casemapping into out, which holds len bytes
+static void
+hex_mrb_casefold(const unsigned char *map, const char *p, mrb_int len, char *out)
+{
+  for (mrb_int i = 0; i < len; i++) {
+    out[i] = (char)map[(unsigned char)p[i]];
+  }
+}
+
+// Symbol for a name folded under a casemapping
+// The symbol table never shrinks, but it holds each folded name once
+static mrb_value
+hex_mrb_casefold_key(mrb_state *mrb, const unsigned char *map, const char *p, mrb_int len)
+{
+  char buf[256];
+  char *folded = len < (mrb_int)sizeof(buf) ? buf : (char *)mrb_malloc(mrb, len);
+  mrb_value key;
+  hex_mrb_casefold(map, p, len, folded);
+  key = mrb_symbol_value(mrb_intern(mrb, folded, (size_t)len));
+  if (folded != buf) {
+    mrb_free(mrb, folded);
+  }
+  return key;
+}
+
+// HexChat::Internal.intern(String)
+static mrb_value
+hex_mrb_xi_intern(mrb_state *mrb, mrb_value self)
+{
+  char *p;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &p, &len);
+  return hex_mrb_intern_str(mrb, p, len);
+}
+
+// HexChat::Internal.intern_key(String)
+// Symbol that is the same for all spellings of a nick or channel
+static mrb_value
+hex_mrb_xi_intern_key(mrb_state *mrb, mrb_value self)
+{
+  char *p;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &p, &len);
+  return hex_mrb_casefold_key(mrb, hex_mrb_casemap_current(), p, len);
+}
+
+// HexChat::Internal.intern_clear
+static mrb_value
+hex_mrb_xi_intern_clear(mrb_state *mrb, mrb_value self)
+{
+  mrb_int count = (mrb_int)hex_intern_count;
+  hex_mrb_intern_reset(mrb, HEX_MRB_INTERN_MIN);
+  return mrb_fixnum_value(count);
+}
+
+// HexChat::Internal.intern_size
+static mrb_value
+hex_mrb_xi_intern_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value((mrb_int)hex_intern_count);
+}
+
+// HexChat::Internal.casemapping
+static mrb_value
+hex_mrb_xi_casemapping(mrb_state *mrb, mrb_value self)
+{
+  return mrb_symbol_value(mrb_intern_cstr(mrb, hex_casemap_names[hex_mrb_server_current()->casemapping]));
+}
+
+// HexChat::Internal.nickcmp(String, String or Array)
+// Compares using the current server's casemapping.  Given an Array,
+// returns an Array of results, one per element.
+static mrb_value
+hex_mrb_xi_nickcmp(mrb_state *mrb, mrb_value self)
+{
+  char *nick1;
+  mrb_int len1;
+  mrb_value other;
+  const unsigned char *map = hex_mrb_casemap_current();
+  mrb_get_args(mrb, "so", &nick1, &len1, &other);
+  if (mrb_array_p(other)) {
+    mrb_int n = RARRAY_LEN(other);
+    mrb_value result = mrb_ary_new_capa(mrb, n);
+    for (mrb_int i = 0; i < n; i++) {
+      mrb_value v = mrb_ary_ref(mrb, other, i);
+      if (!mrb_string_p(v)) {
+        mrb_raise(mrb, E_TYPE_ERROR, "nickcmp array must contain Strings");
+      }
+      mrb_ary_push(mrb, result, mrb_fixnum_value(hex_mrb_casecmp(map, nick1, len1, RSTRING_PTR(v), RSTRING_LEN(v))));
+    }
+    return result;
+  }
+  if (!mrb_string_p(other)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "nickcmp expects a String or an Array");
+  }
+  return mrb_fixnum_value(hex_mrb_casecmp(map, nick1, len1, RSTRING_PTR(other), RSTRING_LEN(other)));
+}
+
+// Casemapping for a name given as a Symbol or String, nil for the
+// current server's
+static int
+hex_mrb_casemap_from_value(mrb_state *mrb, mrb_value v)
+{
+  const char *name;
+  if (mrb_nil_p(v)) {
+    return hex_mrb_server_current()->casemapping;
+  }
+  if (mrb_symbol_p(v)) {
+    name = mrb_sym2name(mrb, mrb_symbol(v));
+  } else if (mrb_string_p(v)) {
+    name = mrb_str_to_cstr(mrb, v);
+  } else {
+    mrb_raise(mrb, E_TYPE_ERROR, "casemapping must be a Symbol or nil");
+    return HEX_MRB_CASEMAP_RFC1459;
+  }
+  for (int cm = 0; cm < HEX_MRB_CASEMAPS; cm++) {
+    if (strcmp(name, hex_casemap_names[cm]) == 0) {
+      return cm;
+    }
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown casemapping %S", v);
+  return HEX_MRB_CASEMAP_RFC1459;
+}
+
+// Match a string against a mask with '*' and '?' wildcards
+// Both are expected to be folded already
+static int
+hex_mrb_mask_glob(const char *m, mrb_int mlen, const char *s, mrb_int slen)
+{
+  mrb_int mi = 0, si = 0, star = -1, mark = 0;
+  while (si < slen) {
+    if (mi < mlen && m[mi] == '*') {
+      star = mi++;
+      mark = si;
+    } else if (mi < mlen && (m[mi] == '?' || m[mi] == s[si])) {
+      mi++;
+      si++;
+    } else if (star >= 0) {
+      mi = star + 1;
+      si = ++mark;
+    } else {
+      return 0;
+    }
+  }
+  while (mi < mlen && m[mi] == '*') {
+    mi++;
+  }
+  return mi == mlen;
+}
+
+// Position of the last '@' in a string, -1 if none
+static mrb_int
+hex_mrb_mask_at(const char *p, mrb_int len)
+{
+  for (mrb_int i = len - 1; i >= 0; i--) {
+    if (p[i] == '@') {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Does the string contain wildcards
+static int
+hex_mrb_mask_wild(const char *p, mrb_int len)
+{
+  for (mrb_int i = 0; i < len; i++) {
+    if (p[i] == '*' || p[i] == '?') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Unlink a mask from the index list holding it
+static void
+hex_mrb_mask_unlink(struct hex_mrb_mask *m)
+{
+  struct hex_mrb_mask **pp = m->list;
+  while (*pp != m) {
+    pp = &(*pp)->next;
+  }
+  *pp = m->next;
+  m->next = NULL;
+  m->list = NULL;
+}
+
+// Push a mask onto an index list
+static void
+hex_mrb_mask_link(struct hex_mrb_mask **list, struct hex_mrb_mask *m)
+{
+  m->next = *list;
+  m->list = list;
+  *list = m;
+}
+
+// Find or create the trie node for a suffix, walked from its end
+static struct hex_mrb_mask_node*
+hex_mrb_mask_node(struct hex_mrb_mask_node *node, const char *suffix, mrb_int len)
+{
+  for (mrb_int i = len - 1; i >= 0; i--) {
+    unsigned char ch = (unsigned char)suffix[i];
+    struct hex_mrb_mask_node *n = node->child;
+    while (n != NULL && n->ch != ch) {
+      n = n->sibling;
+    }
+    if (n == NULL) {
+      n = (struct hex_mrb_mask_node *)calloc(1, sizeof(struct hex_mrb_mask_node));
+      n->ch = ch;
+      n->sibling = node->child;
+      node->child = n;
+    }
+    node = n;
+  }
+  return node;
+}
+
+// Free a trie below a node
+static void
+hex_mrb_mask_node_free(struct hex_mrb_mask_node *node)
+{
+  struct hex_mrb_mask_node *n = node->child;
+  while (n != NULL) {
+    struct hex_mrb_mask_node *next = n->sibling;
+    hex_mrb_mask_node_free(n);
+    free(n);
+    n = next;
+  }
+  node->child = NULL;
+}
+
+// Find a mask in the set by its folded form
+static struct hex_mrb_mask*
+hex_mrb_maskset_find(struct mrb_hexchat_maskset *ms, const char *folded, mrb_int len, uint32_t h)
+{
+  struct hex_mrb_mask *m;
+  for (m = ms->by_mask[h & (ms->cap - 1)]; m != NULL; m = m->mnext) {
+    if (m->mhash == h && m->len == len && memcmp(m->folded, folded, len) == 0) {
+      return m;
+    }
+  }
+  return NULL;
+}
+
+// Resize both hash tables of a set, refiling the masks
+static void
+hex_mrb_maskset_rehash(struct mrb_hexchat_maskset *ms, uint32_t cap)
+{
+  struct hex_mrb_mask **old_mask = ms->by_mask;
+  struct hex_mrb_mask **old_host = ms->by_host;
+  uint32_t old_cap = ms->cap;
+  ms->cap = cap;
+  ms->by_mask = (struct hex_mrb_mask **)calloc(cap, sizeof(struct hex_mrb_mask *));
+  ms->by_host = (struct hex_mrb_mask **)calloc(cap, sizeof(struct hex_mrb_mask *));
+  for (uint32_t i = 0; i < old_cap; i++) {
+    struct hex_mrb_mask *m = old_mask[i];
+    while (m != NULL) {
+      struct hex_mrb_mask *next = m->mnext;
+      m->mnext = ms->by_mask[m->mhash & (cap - 1)];
+      ms->by_mask[m->mhash & (cap - 1)] = m;
+      m = next;
+    }
+    m = old_host[i];
+    while (m != NULL) {
+      struct hex_mrb_mask *next = m->next;
+      hex_mrb_mask_link(&ms->by_host[m->hhash & (cap - 1)], m);
+      m = next;
+    }
+  }
+  free(old_mask);
+  free(old_host);
+}
+
+// Drop every mask from a set
+static void
+hex_mrb_maskset_clear(struct mrb_hexchat_maskset *ms)
+{
+  for (uint32_t i = 0; i < ms->cap; i++) {
+    struct hex_mrb_mask *m = ms->by_mask[i];
+    while (m != NULL) {
+      struct hex_mrb_mask *next = m->mnext;
+      free(m->mask);
+      free(m->folded);
+      free(m);
+      m = next;
+    }
+    ms->by_mask[i] = NULL;
+    ms->by_host[i] = NULL;
+  }
+  hex_mrb_mask_node_free(&ms->suffix);
+  ms->suffix.masks = NULL;
+  ms->wild = NULL;
+  ms->count = 0;
+  for (int k = 0; k < HEX_MRB_MASK_KINDS; k++) {
+    ms->kinds[k] = 0;
+  }
+}
+
+// Free a HexChat::Internal::MaskSet
+static void
+hex_mrb_maskset_free(mrb_state *mrb, void *p)
+{
+  struct mrb_hexchat_maskset *ms = (struct mrb_hexchat_maskset *)p;
+  if (ms != NULL) {
+    hex_mrb_maskset_clear(ms);
+    free(ms->by_mask);
+    free(ms->by_host);
+    free(ms);
+  }
+}
+
+// Fold a string into buf, or into a malloc'd copy if it doesn't fit
+static char*
+hex_mrb_mask_fold(int casemapping, const char *p, mrb_int len, char *buf, size_t size)
+{
+  const unsigned char *map = hex_casemap[casemapping];
+  char *folded = (size_t)len < size ? buf : (char *)malloc(len + 1);
+  for (mrb_int i = 0; i < len; i++) {
+    folded[i] = (char)map[(unsigned char)p[i]];
+  }
+  folded[len] = 0;
+  return folded;
+}
+
+// Add a mask to a set, 0 if it was already there
+static int
+hex_mrb_maskset_add(struct mrb_hexchat_maskset *ms, const char *p, mrb_int len)
+{
+  struct hex_mrb_mask *m;
+  char *folded = hex_mrb_mask_fold(ms->casemapping, p, len, NULL, 0);
+  uint32_t h = hex_mrb_hash_bytes(folded, len);
+  mrb_int at;
+  if (hex_mrb_maskset_find(ms, folded, len, h) != NULL) {
+    free(folded);
+    return 0;
+  }
+  if (ms->count >= ms->cap) {
+    hex_mrb_maskset_rehash(ms, ms->cap * 2);
+  }
+  m = (struct hex_mrb_mask *)calloc(1, sizeof(struct hex_mrb_mask));
+  m->mask = (char *)malloc(len + 1);
+  memcpy(m->mask, p, len);
+  m->mask[len] = 0;
+  m->folded = folded;
+  m->len = len;
+  m->mhash = h;
+  m->mnext = ms->by_mask[h & (ms->cap - 1)];
+  ms->by_mask[h & (ms->cap - 1)] = m;
+  at = hex_mrb_mask_at(folded, len);
+  m->kind = HEX_MRB_MASK_WILDCARD;
+  if (at >= 0) {
+    const char *host = folded + at + 1;
+    mrb_int hlen = len - at - 1;
+    if (!hex_mrb_mask_wild(host, hlen)) {
+      m->kind = HEX_MRB_MASK_HOST;
+      m->hhash = hex_mrb_hash_bytes(host, hlen);
+      hex_mrb_mask_link(&ms->by_host[m->hhash & (ms->cap - 1)], m);
+    } else if (host[0] == '*' && !hex_mrb_mask_wild(host + 1, hlen - 1)) {
+      struct hex_mrb_mask_node *node = hex_mrb_mask_node(&ms->suffix, host + 1, hlen - 1);
+      m->kind = HEX_MRB_MASK_SUFFIX;
+      hex_mrb_mask_link(&node->masks, m);
+    }
+  }
+  if (m->kind == HEX_MRB_MASK_WILDCARD) {
+    hex_mrb_mask_link(&ms->wild, m);
+  }
+  ms->kinds[m->kind]++;
+  ms->count++;
+  return 1;
+}
+
+// Remove a mask from a set, 0 if it wasn't there
+// Trie nodes are kept for reuse until the set is cleared
+static int
+hex_mrb_maskset_remove(struct mrb_hexchat_maskset *ms, const char *p, mrb_int len)
+{
+  char buf[256];
+  char *folded = hex_mrb_mask_fold(ms->casemapping, p, len, buf, sizeof(buf));
+  uint32_t h = hex_mrb_hash_bytes(folded, len);
+  struct hex_mrb_mask *m = hex_mrb_maskset_find(ms, folded, len, h);
+  struct hex_mrb_mask **pp;
+  if (folded != buf) {
+    free(folded);
+  }
+  if (m == NULL) {
+    return 0;
+  }
+  hex_mrb_mask_unlink(m);
+  pp = &ms->by_mask[h & (ms->cap - 1)];
+  while (*pp != m) {
+    pp = &(*pp)->mnext;
+  }
+  *pp = m->mnext;
+  ms->kinds[m->kind]--;
+  ms->count--;
+  free(m->mask);
+  free(m->folded);
+  free(m);
+  return 1;
+}
+
+// Try the masks on one index list against a folded hostmask
+// Matches are pushed onto result, or with a nil result the first match
+// stops the search.  Returns non-zero to stop.
+static int
+hex_mrb_maskset_try(mrb_state *mrb, struct hex_mrb_mask *m, uint32_t hhash, const char *s, mrb_int slen, mrb_value result)
+{
+  for (; m != NULL; m = m->next) {
+    if (m->kind == HEX_MRB_MASK_HOST && m->hhash != hhash) {
+      continue;
+    }
+    if (hex_mrb_mask_glob(m->folded, m->len, s, slen)) {
+      if (mrb_nil_p(result)) {
+        return 1;
+      }
+      mrb_ary_push(mrb, result, mrb_str_new(mrb, m->mask, m->len));
+    }
+  }
+  return 0;
+}
+
+// Find the masks matching a hostmask, see hex_mrb_maskset_try
+// Only the host table bucket and the trie path for the host are looked
+// at, plus the masks that could not be indexed.
+static int
+hex_mrb_maskset_match(mrb_state *mrb, struct mrb_hexchat_maskset *ms, const char *p, mrb_int len, mrb_value result)
+{
+  char buf[512];
+  char *s = hex_mrb_mask_fold(ms->casemapping, p, len, buf, sizeof(buf));
+  mrb_int at = hex_mrb_mask_at(s, len);
+  int found = 0;
+  if (at >= 0) {
+    const char *host = s + at + 1;
+    mrb_int hlen = len - at - 1;
+    uint32_t hh = hex_mrb_hash_bytes(host, hlen);
+    struct hex_mrb_mask_node *node = &ms->suffix;
+    found = hex_mrb_maskset_try(mrb, ms->by_host[hh & (ms->cap - 1)], hh, s, len, result);
+    for (mrb_int i = hlen; !found && node != NULL; i--) {
+      found = hex_mrb_maskset_try(mrb, node->masks, 0, s, len, result);
+      if (i == 0) {
+        break;
+      }
+      for (node = node->child; node != NULL && node->ch != (unsigned char)host[i - 1]; node = node->sibling);
+    }
+  }
+  if (!found) {
+    found = hex_mrb_maskset_try(mrb, ms->wild, 0, s, len, result);
+  }
+  if (s != buf) {
+    free(s);
+  }
+  return found;
+}
+
+// Get the set of a HexChat::Internal::MaskSet
+static struct mrb_hexchat_maskset*
+hex_mrb_maskset_get(mrb_state *mrb, mrb_value self)
+{
+  return (struct mrb_hexchat_maskset *)mrb_data_get_ptr(mrb, self, &mrb_hexchat_maskset_type);
+}
+
+// HexChat::Internal::MaskSet#initialize(casemapping = nil)
+static mrb_value
+hex_mrb_xm_initialize(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms;
+  mrb_value cm = mrb_nil_value();
+  int casemapping;
+  mrb_get_args(mrb, "|o", &cm);
+  casemapping = hex_mrb_casemap_from_value(mrb, cm);
+  ms = (struct mrb_hexchat_maskset *)DATA_PTR(self);
+  if (ms) {
+    hex_mrb_maskset_free(mrb, ms);
+  }
+  mrb_data_init(self, NULL, &mrb_hexchat_maskset_type);
+  ms = (struct mrb_hexchat_maskset *)calloc(1, sizeof(struct mrb_hexchat_maskset));
+  ms->casemapping = casemapping;
+  ms->cap = HEX_MRB_MASK_MIN;
+  ms->by_mask = (struct hex_mrb_mask **)calloc(ms->cap, sizeof(struct hex_mrb_mask *));
+  ms->by_host = (struct hex_mrb_mask **)calloc(ms->cap, sizeof(struct hex_mrb_mask *));
+  mrb_data_init(self, ms, &mrb_hexchat_maskset_type);
+  return self;
+}
+
+// HexChat::Internal::MaskSet#add(mask)
+static mrb_value
+hex_mrb_xm_add(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms = hex_mrb_maskset_get(mrb, self);
+  char *p;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &p, &len);
+  return mrb_bool_value(hex_mrb_maskset_add(ms, p, len));
+}
+
+// HexChat::Internal::MaskSet#remove(mask)
+static mrb_value
+hex_mrb_xm_remove(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms = hex_mrb_maskset_get(mrb, self);
+  char *p;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &p, &len);
+  return mrb_bool_value(hex_mrb_maskset_remove(ms, p, len));
+}
+
+// HexChat::Internal::MaskSet#include?(mask)
+static mrb_value
+hex_mrb_xm_include(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms = hex_mrb_maskset_get(mrb, self);
+  char buf[256];
+  char *p, *folded;
+  mrb_int len;
+  mrb_bool found;
+  mrb_get_args(mrb, "s", &p, &len);
+  folded = hex_mrb_mask_fold(ms->casemapping, p, len, buf, sizeof(buf));
+  found = hex_mrb_maskset_find(ms, folded, len, hex_mrb_hash_bytes(folded, len)) != NULL;
+  if (folded != buf) {
+    free(folded);
+  }
+  return mrb_bool_value(found);
+}
+
+// HexChat::Internal::MaskSet#match(hostmask)
+// Array of the masks matching nick!user@host
+static mrb_value
+hex_mrb_xm_match(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms = hex_mrb_maskset_get(mrb, self);
+  mrb_value result = mrb_ary_new(mrb);
+  char *p;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &p, &len);
+  hex_mrb_maskset_match(mrb, ms, p, len, result);
+  return result;
+}
+
+// HexChat::Internal::MaskSet#match?(hostmask)
+static mrb_value
+hex_mrb_xm_match_q(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms = hex_mrb_maskset_get(mrb, self);
+  char *p;
+  mrb_int len;
+  mrb_get_args(mrb, "s", &p, &len);
+  return mrb_bool_value(hex_mrb_maskset_match(mrb, ms, p, len, mrb_nil_value()));
+}
+
+// HexChat::Internal::MaskSet#masks
+static mrb_value
+hex_mrb_xm_masks(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms = hex_mrb_maskset_get(mrb, self);
+  mrb_value result = mrb_ary_new_capa(mrb, (mrb_int)ms->count);
+  for (uint32_t i = 0; i < ms->cap; i++) {
+    for (struct hex_mrb_mask *m = ms->by_mask[i]; m != NULL; m = m->mnext) {
+      mrb_ary_push(mrb, result, mrb_str_new(mrb, m->mask, m->len));
+    }
+  }
+  return result;
+}
+
+// HexChat::Internal::MaskSet#size
+static mrb_value
+hex_mrb_xm_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value((mrb_int)hex_mrb_maskset_get(mrb, self)->count);
+}
+
+// HexChat::Internal::MaskSet#clear
+static mrb_value
+hex_mrb_xm_clear(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms = hex_mrb_maskset_get(mrb, self);
+  hex_mrb_maskset_clear(ms);
+  hex_mrb_maskset_rehash(ms, HEX_MRB_MASK_MIN);
+  return self;
+}
+
+// HexChat::Internal::MaskSet#stats
+// How many masks landed in each index
+static mrb_value
+hex_mrb_xm_stats(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_maskset *ms = hex_mrb_maskset_get(mrb, self);
+  mrb_value h = mrb_hash_new(mrb);
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "host")), mrb_fixnum_value((mrb_int)ms->kinds[HEX_MRB_MASK_HOST]));
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "suffix")), mrb_fixnum_value((mrb_int)ms->kinds[HEX_MRB_MASK_SUFFIX]));
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "wildcard")), mrb_fixnum_value((mrb_int)ms->kinds[HEX_MRB_MASK_WILDCARD]));
+  mrb_hash_set(mrb, h, mrb_symbol_value(mrb_intern_lit(mrb, "casemapping")), mrb_symbol_value(mrb_intern_cstr(mrb, hex_casemap_names[ms->casemapping])));
+  return h;
+}
+
+// Move a ring of counters forward to bucket now, taking what expired off
+// its total.  Each bucket is cleared once per pass of the ring, so this
+// costs one step per bucket of elapsed time, at most n.
+static void
+hex_mrb_rate_advance(uint64_t *epoch, uint32_t *counts, uint32_t *total, uint32_t n, uint64_t now)
+{
+  if (now <= *epoch) {
+    return;
+  }
+  if (now - *epoch >= n) {
+    memset(counts, 0, sizeof(uint32_t) * n);
+    *total = 0;
+  } else {
+    for (uint64_t e = *epoch + 1; e <= now; e++) {
+      *total -= counts[e % n];
+      counts[e % n] = 0;
+    }
+  }
+  *epoch = now;
+}
+
+// Count over the last k buckets of an advanced ring
+// The whole window is the running total; a shorter one sums whichever is
+// fewer, its own buckets or the older ones to take off the total.
+static uint32_t
+hex_mrb_rate_sum(const uint32_t *counts, uint32_t total, uint32_t n, uint64_t now, uint32_t k)
+{
+  uint32_t sum = 0;
+  if (k >= n) {
+    return total;
+  }
+  if (k <= n / 2) {
+    for (uint32_t i = 0; i < k; i++) {
+      sum += counts[(now + n - i) % n];
+    }
+    return sum;
+  }
+  for (uint32_t i = k; i < n; i++) {
+    sum += counts[(now + n - i) % n];
+  }
+  return total - sum;
+}
+
+// Current bucket number of a tracker
+static uint64_t
+hex_mrb_rate_now(struct mrb_hexchat_rate *rt)
+{
+  return hex_mrb_clock_ns() / rt->bucket_ns;
+}
+
+// Buckets covering a window given in ms, at least one, at most all
+static uint32_t
+hex_mrb_rate_buckets(struct mrb_hexchat_rate *rt, mrb_int window_ms)
+{
+  uint64_t k;
+  if (window_ms <= 0) {
+    return rt->buckets;
+  }
+  k = ((uint64_t)window_ms * 1000000ULL + rt->bucket_ns - 1) / rt->bucket_ns;
+  return k < 1 ? 1 : (k > rt->buckets ? rt->buckets : (uint32_t)k);
+}
+
+// Free a tracked key
+static void
+hex_mrb_rate_key_free(struct hex_mrb_rate_key *k)
+{
+  free(k->key);
+  free(k);
+}
+
+// Find a tracked key, creating it if asked to
+static struct hex_mrb_rate_key*
+hex_mrb_rate_key(struct mrb_hexchat_rate *rt, const char *p, mrb_int len, uint64_t now, int create)
+{
+  uint32_t h = hex_mrb_hash_bytes(p, len);
+  struct hex_mrb_rate_key *k;
+  for (k = rt->keys[h & (rt->cap - 1)]; k != NULL; k = k->next) {
+    if (k->hash == h && k->len == len && memcmp(k->key, p, len) == 0) {
+      return k;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  if (rt->count >= rt->cap) {
+    // Grow the table
+    struct hex_mrb_rate_key **old = rt->keys;
+    uint32_t old_cap = rt->cap;
+    struct hex_mrb_rate_key **keys = (struct hex_mrb_rate_key **)calloc(old_cap * 2, sizeof(struct hex_mrb_rate_key *));
+    if (keys == NULL) {
+      return NULL;
+    }
+    rt->cap *= 2;
+    rt->keys = keys;
+    for (uint32_t i = 0; i < old_cap; i++) {
+      while (old[i] != NULL) {
+        struct hex_mrb_rate_key *next = old[i]->next;
+        old[i]->next = rt->keys[old[i]->hash & (rt->cap - 1)];
+        rt->keys[old[i]->hash & (rt->cap - 1)] = old[i];
+        old[i] = next;
+      }
+    }
+    free(old);
+  }
+  k = (struct hex_mrb_rate_key *)calloc(1, sizeof(struct hex_mrb_rate_key) + sizeof(uint32_t) * rt->buckets);
+  if (k == NULL) {
+    return NULL;
+  }
+  k->hash = h;
+  k->len = len;
+  k->key = (char *)malloc(len + 1);
+  if (k->key == NULL) {
+    free(k);
+    return NULL;
+  }
+  memcpy(k->key, p, len);
+  k->key[len] = 0;
+  k->epoch = now;
+  k->next = rt->keys[h & (rt->cap - 1)];
+  rt->keys[h & (rt->cap - 1)] = k;
+  rt->count++;
+  return k;
+}
+
+// Drop keys that have seen nothing for a whole window
+// Only a couple of buckets are looked at per call, so the cost is spread
+// over the hits.
+static void
+hex_mrb_rate_sweep(struct mrb_hexchat_rate *rt, uint64_t now)
+{
+  for (int i = 0; i < HEX_MRB_RATE_SWEEP; i++) {
+    struct hex_mrb_rate_key **pp = &rt->keys[rt->sweep];
+    while (*pp != NULL) {
+      struct hex_mrb_rate_key *k = *pp;
+      if (now - k->epoch >= rt->buckets) {
+        *pp = k->next;
+        hex_mrb_rate_key_free(k);
+        rt->count--;
+      } else {
+        pp = &k->next;
+      }
+    }
+    rt->sweep = (rt->sweep + 1) & (rt->cap - 1);
+  }
+}
+
+// Record hits for a key and return its count over the last k buckets
+// In sketch mode this is the smallest count among the key's cells.
+static uint32_t
+hex_mrb_rate_hit(struct mrb_hexchat_rate *rt, const char *p, mrb_int len, uint32_t hits, uint32_t k)
+{
+  uint64_t now = hex_mrb_rate_now(rt);
+  if (rt->depth > 0) {
+    uint32_t h1 = hex_mrb_hash_bytes(p, len);
+    uint32_t h2 = (h1 >> 16 | h1 << 16) * 0x9e3779b1u | 1;
+    uint32_t min = UINT32_MAX;
+    for (uint32_t d = 0; d < rt->depth; d++) {
+      uint32_t cell = d * rt->width + ((h1 + d * h2) & (rt->width - 1));
+      uint32_t *counts = rt->cells + (size_t)cell * rt->buckets;
+      uint32_t sum;
+      hex_mrb_rate_advance(&rt->epochs[cell], counts, &rt->totals[cell], rt->buckets, now);
+      counts[now % rt->buckets] += hits;
+      rt->totals[cell] += hits;
+      sum = hex_mrb_rate_sum(counts, rt->totals[cell], rt->buckets, now, k);
+      min = sum < min ? sum : min;
+    }
+    return min;
+  } else {
+    struct hex_mrb_rate_key *key;
+    if (hits > 0) {
+      hex_mrb_rate_sweep(rt, now);
+    }
+    key = hex_mrb_rate_key(rt, p, len, now, hits > 0);
+    if (key == NULL) {
+      return 0;
+    }
+    hex_mrb_rate_advance(&key->epoch, key->counts, &key->total, rt->buckets, now);
+    key->counts[now % rt->buckets] += hits;
+    key->total += hits;
+    return hex_mrb_rate_sum(key->counts, key->total, rt->buckets, now, k);
+  }
+}
+
+// Forget every key of a tracker
+static void
+hex_mrb_rate_clear(struct mrb_hexchat_rate *rt)
+{
+  if (rt->depth > 0) {
+    memset(rt->cells, 0, sizeof(uint32_t) * rt->buckets * rt->width * rt->depth);
+    memset(rt->totals, 0, sizeof(uint32_t) * rt->width * rt->depth);
+    memset(rt->epochs, 0, sizeof(uint64_t) * rt->width * rt->depth);
+    return;
+  }
+  for (uint32_t i = 0; i < rt->cap; i++) {
+    while (rt->keys[i] != NULL) {
+      struct hex_mrb_rate_key *k = rt->keys[i];
+      rt->keys[i] = k->next;
+      hex_mrb_rate_key_free(k);
+    }
+  }
+  rt->count = 0;
+}
+
+// Free a HexChat::Internal::RateTracker
+static void
+hex_mrb_rate_free(mrb_state *mrb, void *p)
+{
+  struct mrb_hexchat_rate *rt = (struct mrb_hexchat_rate *)p;
+  if (rt != NULL) {
+    hex_mrb_rate_clear(rt);
+    free(rt->keys);
+    free(rt->cells);
+    free(rt->totals);
+    free(rt->epochs);
+    free(rt);
+  }
+}
+
+// Get the tracker of a HexChat::Internal::RateTracker
+static struct mrb_hexchat_rate*
+hex_mrb_rate_get(mrb_state *mrb, mrb_value self)
+{
+  return (struct mrb_hexchat_rate *)mrb_data_get_ptr(mrb, self, &mrb_hexchat_rate_type);
+}
+
+// HexChat::Internal::RateTracker#initialize(window_ms, buckets, width = 0, depth = 0)
+// A non-zero depth selects count-min sketch mode with depth rows of
+// width cells each (width is rounded up to a power of two).
+static mrb_value
+hex_mrb_xr_initialize(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_rate *rt;
+  mrb_int window, buckets, width = 0, depth = 0;
+  uint32_t w = 1;
+  mrb_get_args(mrb, "ii|ii", &window, &buckets, &width, &depth);
+  if (window <= 0 || buckets <= 0 || buckets > HEX_MRB_RATE_BUCKETS_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "window must be positive and buckets between 1 and 1024");
+  }
+  if (depth < 0 || depth > HEX_MRB_RATE_DEPTH_MAX || width < 0 || width > HEX_MRB_RATE_WIDTH_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "sketch depth must be at most 8 and width at most 65536");
+  }
+  while (depth > 0 && w < (uint32_t)width) {
+    w <<= 1;
+  }
+  if (depth > 0 && (uint64_t)buckets * w * (uint64_t)depth > HEX_MRB_RATE_CELLS_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "sketch too large, buckets * width * depth must be at most 4194304");
+  }
+  rt = (struct mrb_hexchat_rate *)DATA_PTR(self);
+  if (rt) {
+    hex_mrb_rate_free(mrb, rt);
+  }
+  mrb_data_init(self, NULL, &mrb_hexchat_rate_type);
+  rt = (struct mrb_hexchat_rate *)calloc(1, sizeof(struct mrb_hexchat_rate));
+  if (rt == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory");
+  }
+  rt->buckets = (uint32_t)buckets;
+  rt->bucket_ns = (uint64_t)window * 1000000ULL / (uint64_t)buckets;
+  if (rt->bucket_ns == 0) {
+    rt->bucket_ns = 1;
+  }
+  if (depth > 0) {
+    rt->width = w;
+    rt->depth = (uint32_t)depth;
+    rt->cells = (uint32_t *)calloc((size_t)rt->buckets * w * rt->depth, sizeof(uint32_t));
+    rt->totals = (uint32_t *)calloc((size_t)w * rt->depth, sizeof(uint32_t));
+    rt->epochs = (uint64_t *)calloc((size_t)w * rt->depth, sizeof(uint64_t));
+    if (rt->cells == NULL || rt->totals == NULL || rt->epochs == NULL) {
+      free(rt->cells);
+      free(rt->totals);
+      free(rt->epochs);
+      free(rt);
+      mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory for the sketch");
+    }
+  } else {
+    rt->cap = HEX_MRB_RATE_MIN;
+    rt->keys = (struct hex_mrb_rate_key **)calloc(rt->cap, sizeof(struct hex_mrb_rate_key *));
+    if (rt->keys == NULL) {
+      free(rt);
+      mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory");
+    }
+  }
+  mrb_data_init(self, rt, &mrb_hexchat_rate_type);
+  return self;
+}
+
+// HexChat::Internal::RateTracker#hit(key, hits = 1, window_ms = 0)
+// Returns the count over window_ms (0 for the whole window) after the hit
+static mrb_value
+hex_mrb_xr_hit(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_rate *rt = hex_mrb_rate_get(mrb, self);
+  char *p;
+  mrb_int len, hits = 1, window = 0;
+  mrb_get_args(mrb, "s|ii", &p, &len, &hits, &window);
+  if (hits < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "hits must not be negative");
+  }
+  return mrb_fixnum_value((mrb_int)hex_mrb_rate_hit(rt, p, len, (uint32_t)hits, hex_mrb_rate_buckets(rt, window)));
+}
+
+// HexChat::Internal::RateTracker#count(key, window_ms = 0)
+static mrb_value
+hex_mrb_xr_count(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_rate *rt = hex_mrb_rate_get(mrb, self);
+  char *p;
+  mrb_int len, window = 0;
+  mrb_get_args(mrb, "s|i", &p, &len, &window);
+  return mrb_fixnum_value((mrb_int)hex_mrb_rate_hit(rt, p, len, 0, hex_mrb_rate_buckets(rt, window)));
+}
+
+// HexChat::Internal::RateTracker#delete(key)
+// Not possible in sketch mode, where keys share cells
+static mrb_value
+hex_mrb_xr_delete(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_rate *rt = hex_mrb_rate_get(mrb, self);
+  struct hex_mrb_rate_key **pp;
+  char *p;
+  mrb_int len;
+  uint32_t h;
+  mrb_get_args(mrb, "s", &p, &len);
+  if (rt->depth > 0) {
+    return mrb_false_value();
+  }
+  h = hex_mrb_hash_bytes(p, len);
+  for (pp = &rt->keys[h & (rt->cap - 1)]; *pp != NULL; pp = &(*pp)->next) {
+    struct hex_mrb_rate_key *k = *pp;
+    if (k->hash == h && k->len == len && memcmp(k->key, p, len) == 0) {
+      *pp = k->next;
+      hex_mrb_rate_key_free(k);
+      rt->count--;
+      return mrb_true_value();
+    }
+  }
+  return mrb_false_value();
+}
+
+// HexChat::Internal::RateTracker#size
+// Keys tracked, nil in sketch mode
+static mrb_value
+hex_mrb_xr_size(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_rate *rt = hex_mrb_rate_get(mrb, self);
+  return rt->depth > 0 ? mrb_nil_value() : mrb_fixnum_value((mrb_int)rt->count);
+}
+
+// HexChat::Internal::RateTracker#clear
+static mrb_value
+hex_mrb_xr_clear(mrb_state *mrb, mrb_value self)
+{
+  hex_mrb_rate_clear(hex_mrb_rate_get(mrb, self));
+  return self;
+}
+
+// Next search token in a line, lowercased into out
+// Tokens are runs of letters, digits, '_' and non-ASCII bytes; formatting
+// codes are skipped.  Returns the token length, 0 at the end of the line.
+static int
+hex_mrb_hist_token(const char *p, mrb_int len, mrb_int *pos, char *out)
+{
+  mrb_int i = *pos;
+  int n = 0;
+  for (;;) {
+    while (i < len) {
+      unsigned char ch = (unsigned char)p[i];
+      if (ch == 3) {
+        // Color code, up to two digits, optionally a comma and two more
+        int d;
+        i++;
+        for (d = 0; d < 2 && i < len && p[i] >= '0' && p[i] <= '9'; d++, i++);
+        if (d > 0 && i + 1 < len && p[i] == ',' && p[i + 1] >= '0' && p[i + 1] <= '9') {
+          i++;
+          for (d = 0; d < 2 && i < len && p[i] >= '0' && p[i] <= '9'; d++, i++);
+        }
+        continue;
+      }
+      if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_' || ch >= 0x80) {
+        break;
+      }
+      i++;
+    }
+    if (i >= len) {
+      *pos = i;
+      return 0;
+    }
+    n = 0;
+    while (i < len) {
+      unsigned char ch = (unsigned char)p[i];
+      if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_' || ch >= 0x80)) {
+        break;
+      }
+      if (n < HEX_MRB_HIST_TERM_MAX) {
+        out[n++] = (char)hex_casemap[HEX_MRB_CASEMAP_ASCII][ch];
+      }
+      i++;
+    }
+    if (n >= HEX_MRB_HIST_TERM_MIN) {
+      *pos = i;
+      return n;
+    }
+  }
+}
+
+// Nick key: the folded nick behind a byte no text token can contain
+static int
+hex_mrb_hist_nick_key(const char *nick, mrb_int len, char *out)
+{
+  int n = 1;
+  out[0] = 1;
+  for (mrb_int i = 0; i < len && n < HEX_MRB_HIST_TERM_MAX; i++) {
+    out[n++] = (char)hex_casemap[HEX_MRB_CASEMAP_RFC1459][(unsigned char)nick[i]];
+  }
+  return n;
+}
+
+// Find the history of a context, creating it if asked to
+static struct hex_mrb_hist*
+hex_mrb_hist_get(hexchat_context *c, int create)
+{
+  unsigned int b = hex_mrb_ptr_hash(c, HEX_MRB_HIST_BUCKETS);
+  struct hex_mrb_hist *h;
+  for (h = hex_history[b]; h != NULL; h = h->next) {
+    if (h->c == c) {
+      return h;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  h = (struct hex_mrb_hist *)calloc(1, sizeof(struct hex_mrb_hist));
+  h->c = c;
+  h->lines = hex_history_lines;
+  h->ring = (struct hex_mrb_hist_line *)calloc(h->lines, sizeof(struct hex_mrb_hist_line));
+  h->arena_max = hex_history_bytes;
+  h->term_cap = HEX_MRB_HIST_TERMS_MIN;
+  h->terms = (struct hex_mrb_hist_term **)calloc(h->term_cap, sizeof(struct hex_mrb_hist_term *));
+  h->next = hex_history[b];
+  hex_history[b] = h;
+  return h;
+}
+
+// Drop postings of lines that have left the ring
+static void
+hex_mrb_hist_trim(struct hex_mrb_hist_term *t, uint32_t oldest)
+{
+  while (t->start < t->n && t->posts[t->start] < oldest) {
+    t->start++;
+  }
+  if (t->start > 0 && t->start * 2 >= t->n) {
+    memmove(t->posts, t->posts + t->start, sizeof(uint32_t) * (t->n - t->start));
+    t->n -= t->start;
+    t->start = 0;
+  }
+}
+
+// Find a term in a context's index, creating it if asked to
+static struct hex_mrb_hist_term*
+hex_mrb_hist_term(struct hex_mrb_hist *h, const char *p, int len, int create)
+{
+  uint32_t hash = hex_mrb_hash_bytes(p, len);
+  struct hex_mrb_hist_term *t;
+  for (t = h->terms[hash & (h->term_cap - 1)]; t != NULL; t = t->next) {
+    if (t->hash == hash && t->len == len && memcmp(t->text, p, len) == 0) {
+      return t;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  if (h->term_count >= h->term_cap) {
+    struct hex_mrb_hist_term **old = h->terms;
+    uint32_t old_cap = h->term_cap;
+    h->term_cap *= 2;
+    h->terms = (struct hex_mrb_hist_term **)calloc(h->term_cap, sizeof(struct hex_mrb_hist_term *));
+    for (uint32_t i = 0; i < old_cap; i++) {
+      while (old[i] != NULL) {
+        struct hex_mrb_hist_term *next = old[i]->next;
+        old[i]->next = h->terms[old[i]->hash & (h->term_cap - 1)];
+        h->terms[old[i]->hash & (h->term_cap - 1)] = old[i];
+        old[i] = next;
+      }
+    }
+    free(old);
+  }
+  t = (struct hex_mrb_hist_term *)calloc(1, sizeof(struct hex_mrb_hist_term));
+  t->hash = hash;
+  t->len = (unsigned char)len;
+  memcpy(t->text, p, len);
+  t->next = h->terms[hash & (h->term_cap - 1)];
+  h->terms[hash & (h->term_cap - 1)] = t;
+  h->term_count++;
+  return t;
+}
+
+// Add a line to a term's postings
+static void
+hex_mrb_hist_post(struct hex_mrb_hist *h, const char *p, int len, uint32_t seq)
+{
+  struct hex_mrb_hist_term *t = hex_mrb_hist_term(h, p, len, 1);
+  if (t->n > t->start && t->posts[t->n - 1] == seq) {
+    return;   // same term twice in a line
+  }
+  hex_mrb_hist_trim(t, h->next_seq - h->count);
+  if (t->n == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 4;
+    t->posts = (uint32_t *)realloc(t->posts, sizeof(uint32_t) * t->cap);
+  }
+  t->posts[t->n++] = seq;
+}
+
+// Trim every term, freeing those with no lines left
+// Run once per trip around the ring so memory follows the live lines
+static void
+hex_mrb_hist_compact(struct hex_mrb_hist *h)
+{
+  uint32_t oldest = h->next_seq - h->count;
+  for (uint32_t i = 0; i < h->term_cap; i++) {
+    struct hex_mrb_hist_term **pp = &h->terms[i];
+    while (*pp != NULL) {
+      struct hex_mrb_hist_term *t = *pp;
+      hex_mrb_hist_trim(t, oldest);
+      if (t->start == t->n) {
+        *pp = t->next;
+        free(t->posts);
+        free(t);
+        h->term_count--;
+      } else {
+        if (t->cap > 8 && t->n * 4 < t->cap) {
+          t->cap /= 2;
+          t->posts = (uint32_t *)realloc(t->posts, sizeof(uint32_t) * t->cap);
+        }
+        pp = &t->next;
+      }
+    }
+  }
+}
+
+// The line with a given sequence number
+static struct hex_mrb_hist_line*
+hex_mrb_hist_line(struct hex_mrb_hist *h, uint32_t seq)
+{
+  return &h->ring[seq % h->lines];
+}
+
+// Append a line to a context's history and index it
+static void
+hex_mrb_hist_append(struct hex_mrb_hist *h, const char *nick, const char *text)
+{
+  size_t nick_len = strlen(nick);
+  size_t text_len = strlen(text);
+  uint32_t seq = h->next_seq;
+  struct hex_mrb_hist_line *line;
+  char term[HEX_MRB_HIST_TERM_MAX];
+  mrb_int pos = 0;
+  int n;
+  if (nick_len > HEX_MRB_HIST_TERM_MAX) {
+    nick_len = HEX_MRB_HIST_TERM_MAX;
+  }
+  if (nick_len + text_len > h->arena_max / 4) {
+    text_len = h->arena_max / 4 - nick_len;
+  }
+  if (text_len > UINT16_MAX) {
+    text_len = UINT16_MAX;
+  }
+  // The arena starts small and doubles until it reaches its limit, lines
+  // are contiguous from 0 until then so growing keeps their offsets
+  while (h->head + nick_len + text_len > h->arena_size && h->arena_size < h->arena_max) {
+    uint32_t size = h->arena_size ? h->arena_size * 2 : HEX_MRB_HIST_ARENA_MIN;
+    char *arena;
+    if (size > h->arena_max) {
+      size = h->arena_max;
+    }
+    arena = (char *)realloc(h->arena, size);
+    if (arena == NULL) {
+      return;   // drop the line, the next one tries again
+    }
+    h->arena = arena;
+    h->arena_size = size;
+  }
+  // Dropping the oldest line only takes it out of the ring, its postings
+  // are trimmed lazily
+  if (h->count == h->lines) {
+    h->count--;
+  }
+  // Arena space is handed out in order, wrapping at the end; lines in
+  // the way are the oldest ones
+  if (h->head + nick_len + text_len > h->arena_size) {
+    uint32_t old_head = h->head;
+    while (h->count > 0 && hex_mrb_hist_line(h, h->next_seq - h->count)->off >= old_head) {
+      h->count--;
+    }
+    h->head = 0;
+  }
+  while (h->count > 0) {
+    struct hex_mrb_hist_line *old = hex_mrb_hist_line(h, h->next_seq - h->count);
+    if (old->off >= h->head + nick_len + text_len || old->off + old->nick_len + old->text_len <= h->head) {
+      break;
+    }
+    h->count--;
+  }
+  line = hex_mrb_hist_line(h, seq);
+  line->seq = seq;
+  line->time = time(NULL);
+  line->off = h->head;
+  line->nick_len = (uint16_t)nick_len;
+  line->text_len = (uint16_t)text_len;
+  memcpy(h->arena + h->head, nick, nick_len);
+  memcpy(h->arena + h->head + nick_len, text, text_len);
+  h->head += (uint32_t)(nick_len + text_len);
+  h->next_seq++;
+  h->count++;
+  n = hex_mrb_hist_nick_key(nick, (mrb_int)nick_len, term);
+  hex_mrb_hist_post(h, term, n, seq);
+  while ((n = hex_mrb_hist_token(text, (mrb_int)text_len, &pos, term)) > 0) {
+    hex_mrb_hist_post(h, term, n, seq);
+  }
+  if (h->next_seq % h->lines == 0) {
+    hex_mrb_hist_compact(h);
+  }
+}
+
+// Free a context's history
+static void
+hex_mrb_hist_free(struct hex_mrb_hist *h)
+{
+  for (uint32_t i = 0; i < h->term_cap; i++) {
+    while (h->terms[i] != NULL) {
+      struct hex_mrb_hist_term *t = h->terms[i];
+      h->terms[i] = t->next;
+      free(t->posts);
+      free(t);
+    }
+  }
+  free(h->terms);
+  free(h->ring);
+  free(h->arena);
+  free(h);
+}
+
+// Forget the history of a closed context
+static void
+hex_mrb_history_drop(hexchat_context *c)
+{
+  struct hex_mrb_hist **pp = &hex_history[hex_mrb_ptr_hash(c, HEX_MRB_HIST_BUCKETS)];
+  while (*pp != NULL) {
+    if ((*pp)->c == c) {
+      struct hex_mrb_hist *h = *pp;
+      *pp = h->next;
+      hex_mrb_hist_free(h);
+      return;
+    }
+    pp = &(*pp)->next;
+  }
+}
+
+// Free all history
+static void
+hex_mrb_history_free_all(void)
+{
+  for (int i = 0; i < HEX_MRB_HIST_BUCKETS; i++) {
+    while (hex_history[i] != NULL) {
+      struct hex_mrb_hist *h = hex_history[i];
+      hex_history[i] = h->next;
+      hex_mrb_hist_free(h);
+    }
+  }
+}
+
+// Print hook feeding the history
+static int
+hex_mrb_history_cb(char *word[], const struct hex_mrb_hist_event *ev)
+{
+  if (word[ev->nick] != NULL && word[ev->text] != NULL && word[ev->text][0] != 0) {
+    hex_mrb_hist_append(hex_mrb_hist_get(hexchat_get_context(ph), 1), word[ev->nick], word[ev->text]);
+  }
+  return HEXCHAT_EAT_NONE;
+}
+
+// Position of a sequence number in a term's postings, or where it would go
+static uint32_t
+hex_mrb_hist_bsearch(struct hex_mrb_hist_term *t, uint32_t seq)
+{
+  uint32_t lo = t->start, hi = t->n;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (t->posts[mid] < seq) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Newest live line at or before a time, binary searching the ring
+// Returns one past the newest sequence number to look at
+static uint32_t
+hex_mrb_hist_seek(struct hex_mrb_hist *h, time_t until)
+{
+  uint32_t lo = h->next_seq - h->count, hi = h->next_seq;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (hex_mrb_hist_line(h, mid)->time <= until) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// HexChat::Internal.history_enable(lines, bytes)
+// Sizes apply to contexts seen from now on
+static mrb_value
+hex_mrb_xi_history_enable(mrb_state *mrb, mrb_value self)
+{
+  mrb_int lines, bytes;
+  mrb_get_args(mrb, "ii", &lines, &bytes);
+  if (lines < 16 || bytes < 1024 || lines > 0x1000000) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "history needs at least 16 lines and 1024 bytes");
+  }
+  hex_history_lines = (uint32_t)lines;
+  hex_history_bytes = (uint32_t)bytes;
+  if (hex_history_hooks[0] == NULL) {
+    for (int i = 0; hex_history_events[i].name != NULL; i++) {
+      hex_history_hooks[i] = hexchat_hook_print(ph, hex_history_events[i].name, HEXCHAT_PRI_LOWEST, (void *)hex_mrb_history_cb, (void *)&hex_history_events[i]);
+    }
+  }
+  return mrb_true_value();
+}
+
+// HexChat::Internal.history_disable
+// Stops recording and forgets everything
+static mrb_value
+hex_mrb_xi_history_disable(mrb_state *mrb, mrb_value self)
+{
+  for (int i = 0; hex_history_events[i].name != NULL; i++) {
+    if (hex_history_hooks[i] != NULL) {
+      hexchat_unhook(ph, hex_history_hooks[i]);
+      hex_history_hooks[i] = NULL;
+    }
+  }
+  hex_mrb_history_free_all();
+  return mrb_nil_value();
+}
+
+// HexChat::Internal.history_search(context, query, nick, since, until, limit)
+// Lines of one context matching every word of query (nil for any), said
+// by nick (nil for anyone) between the two times (0 for no bound), newest
+// first, as [time, nick, text] arrays.
+static mrb_value
+hex_mrb_xi_history_search(mrb_state *mrb, mrb_value self)
+{
+  mrb_value cxt, query, nick, result;
+  mrb_int since, until, limit;
+  struct hex_mrb_hist *h;
+  struct hex_mrb_hist_term *terms[HEX_MRB_HIST_QUERY_MAX];
+  char term[HEX_MRB_HIST_TERM_MAX];
+  int nterms = 0, rarest = -1, n;
+  uint32_t oldest, seq;
+  hexchat_context *c;
+  mrb_get_args(mrb, "oooiii", &cxt, &query, &nick, &since, &until, &limit);
+  c = mrb_nil_p(cxt) ? hexchat_get_context(ph) : hex_mrb_value_to_context(mrb, cxt);
+  result = mrb_ary_new(mrb);
+  h = c != NULL ? hex_mrb_hist_get(c, 0) : NULL;
+  if (h == NULL || h->count == 0 || limit <= 0) {
+    return result;
+  }
+  if (mrb_string_p(nick)) {
+    n = hex_mrb_hist_nick_key(RSTRING_PTR(nick), RSTRING_LEN(nick), term);
+    if ((terms[nterms++] = hex_mrb_hist_term(h, term, n, 0)) == NULL) {
+      return result;
+    }
+  }
+  if (mrb_string_p(query)) {
+    mrb_int pos = 0;
+    while (nterms < HEX_MRB_HIST_QUERY_MAX && (n = hex_mrb_hist_token(RSTRING_PTR(query), RSTRING_LEN(query), &pos, term)) > 0) {
+      if ((terms[nterms++] = hex_mrb_hist_term(h, term, n, 0)) == NULL) {
+        return result;
+      }
+    }
+  }
+  oldest = h->next_seq - h->count;
+  for (int i = 0; i < nterms; i++) {
+    hex_mrb_hist_trim(terms[i], oldest);
+    if (rarest < 0 || terms[i]->n - terms[i]->start < terms[rarest]->n - terms[rarest]->start) {
+      rarest = i;
+    }
+  }
+  seq = until > 0 ? hex_mrb_hist_seek(h, (time_t)until) : h->next_seq;
+  if (rarest >= 0) {
+    // Walk the rarest term's postings from the newest, probing the others
+    struct hex_mrb_hist_term *r = terms[rarest];
+    uint32_t i = hex_mrb_hist_bsearch(r, seq);
+    while (i > r->start && RARRAY_LEN(result) < limit) {
+      struct hex_mrb_hist_line *line;
+      int all = 1;
+      seq = r->posts[--i];
+      line = hex_mrb_hist_line(h, seq);
+      if (since > 0 && line->time < (time_t)since) {
+        break;
+      }
+      for (int j = 0; j < nterms && all; j++) {
+        uint32_t k;
+        if (j == rarest) {
+          continue;
+        }
+        k = hex_mrb_hist_bsearch(terms[j], seq);
+        all = k < terms[j]->n && terms[j]->posts[k] == seq;
+      }
+      if (all) {
+        mrb_value row[3];
+        row[0] = mrb_fixnum_value((mrb_int)line->time);
+        row[1] = mrb_str_new(mrb, h->arena + line->off, line->nick_len);
+        row[2] = mrb_str_new(mrb, h->arena + line->off + line->nick_len, line->text_len);
+        mrb_ary_push(mrb, result, mrb_ary_new_from_values(mrb, 3, row));
+      }
+    }
+  } else {
+    // Time range only
+    while (seq > oldest && RARRAY_LEN(result) < limit) {
+      struct hex_mrb_hist_line *line = hex_mrb_hist_line(h, --seq);
+      mrb_value row[3];
+      if (since > 0 && line->time < (time_t)since) {
+        break;
+      }
+      row[0] = mrb_fixnum_value((mrb_int)line->time);
+      row[1] = mrb_str_new(mrb, h->arena + line->off, line->nick_len);
+      row[2] = mrb_str_new(mrb, h->arena + line->off + line->nick_len, line->text_len);
+      mrb_ary_push(mrb, result, mrb_ary_new_from_values(mrb, 3, row));
+    }
+  }
+  return result;
+}
+
+// HexChat::Internal.history_contexts
+// Contexts with recorded history
+static mrb_value
+hex_mrb_xi_history_contexts(mrb_state *mrb, mrb_value self)
+{
+  mrb_value result = mrb_ary_new(mrb);
+  for (int i = 0; i < HEX_MRB_HIST_BUCKETS; i++) {
+    for (struct hex_mrb_hist *h = hex_history[i]; h != NULL; h = h->next) {
+      mrb_ary_push(mrb, result, hex_mrb_context_intern(mrb, h->c));
+    }
+  }
+  return result;
+}
+
+// HexChat::Internal.history_stats
+// [contexts, lines, terms, bytes allocated]
+static mrb_value
+hex_mrb_xi_history_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_int contexts = 0, lines = 0, terms = 0, bytes = 0;
+  mrb_value row[4];
+  for (int i = 0; i < HEX_MRB_HIST_BUCKETS; i++) {
+    for (struct hex_mrb_hist *h = hex_history[i]; h != NULL; h = h->next) {
+      contexts++;
+      lines += h->count;
+      terms += h->term_count;
+      bytes += sizeof(struct hex_mrb_hist) + h->arena_size + sizeof(struct hex_mrb_hist_line) * h->lines
+               + sizeof(struct hex_mrb_hist_term *) * h->term_cap;
+      for (uint32_t j = 0; j < h->term_cap; j++) {
+        for (struct hex_mrb_hist_term *t = h->terms[j]; t != NULL; t = t->next) {
+          bytes += sizeof(struct hex_mrb_hist_term) + sizeof(uint32_t) * t->cap;
+        }
+      }
+    }
+  }
+  row[0] = mrb_fixnum_value(contexts);
+  row[1] = mrb_fixnum_value(lines);
+  row[2] = mrb_fixnum_value(terms);
+  row[3] = mrb_fixnum_value(bytes);
+  return mrb_ary_new_from_values(mrb, 4, row);
+}
+
+// Compress a block with a small LZ77 coder
+// A byte below 0x80 is followed by that many plus one literal bytes, a
+// byte from 0x80 up copies (byte & 0x7f) + 4 bytes from the 16 bit
+// distance that follows.  dst needs n + n / 128 + 1 bytes.
+static uint32_t
+hex_mrb_lz_compress(const unsigned char *src, uint32_t n, unsigned char *dst)
+{
+  uint32_t table[HEX_MRB_LZ_HASH];
+  uint32_t i = 0, lit = 0, o = 0;
+  memset(table, 0, sizeof(table));
+  while (i + 4 <= n) {
+    uint32_t v = (uint32_t)src[i] | (uint32_t)src[i + 1] << 8 | (uint32_t)src[i + 2] << 16 | (uint32_t)src[i + 3] << 24;
+    uint32_t h = (v * 2654435761u) >> (32 - HEX_MRB_LZ_BITS);
+    uint32_t cand = table[h];
+    table[h] = i + 1;
+    if (cand > 0 && i + 1 - cand <= 0xffff && memcmp(src + cand - 1, src + i, 4) == 0) {
+      uint32_t from = cand - 1, len = 4, dist = i - from;
+      while (i + len < n && len < 131 && src[from + len] == src[i + len]) {
+        len++;
+      }
+      while (lit < i) {
+        uint32_t run = i - lit > 128 ? 128 : i - lit;
+        dst[o++] = (unsigned char)(run - 1);
+        memcpy(dst + o, src + lit, run);
+        o += run;
+        lit += run;
+      }
+      dst[o++] = (unsigned char)(0x80 | (len - 4));
+      dst[o++] = (unsigned char)(dist & 0xff);
+      dst[o++] = (unsigned char)(dist >> 8);
+      i += len;
+      lit = i;
+    } else {
+      i++;
+    }
+  }
+  while (lit < n) {
+    uint32_t run = n - lit > 128 ? 128 : n - lit;
+    dst[o++] = (unsigned char)(run - 1);
+    memcpy(dst + o, src + lit, run);
+    o += run;
+    lit += run;
+  }
+  return o;
+}
+
+// Decompress a block, returns its size or -1 if it is damaged
+static int64_t
+hex_mrb_lz_decompress(const unsigned char *src, uint32_t n, unsigned char *dst, uint32_t cap)
+{
+  uint32_t i = 0, o = 0;
+  while (i < n) {
+    unsigned char c = src[i++];
+    if (c < 0x80) {
+      uint32_t run = (uint32_t)c + 1;
+      if (i + run > n || o + run > cap) {
+        return -1;
+      }
+      memcpy(dst + o, src + i, run);
+      i += run;
+      o += run;
+    } else {
+      uint32_t len = (uint32_t)(c & 0x7f) + 4, dist;
+      if (i + 2 > n) {
+        return -1;
+      }
+      dist = (uint32_t)src[i] | (uint32_t)src[i + 1] << 8;
+      i += 2;
+      if (dist == 0 || dist > o || o + len > cap) {
+        return -1;
+      }
+      for (uint32_t k = 0; k < len; k++, o++) {
+        dst[o] = dst[o - dist];
+      }
+    }
+  }
+  return o;
+}
+
+// Create the directories leading to a file
+static void
+hex_mrb_mkdirs(char *path)
+{
+  for (char *p = path + 1; *p; p++) {
+    if (*p == '/') {
+      *p = 0;
+#ifdef WIN32
+      _mkdir(path);
+#else
+      mkdir(path, 0700);
+#endif
+      *p = '/';
+    }
+  }
+}
+
+// Compress a block and append it and its index entry to the files
+// Runs on the writer thread
+static void
+hex_mrb_arch_write(struct hex_mrb_arch_job *job)
+{
+  struct hex_mrb_arch_head head;
+  struct hex_mrb_arch_index entry;
+  unsigned char *comp = (unsigned char *)malloc(job->len + job->len / 128 + 1);
+  size_t plen = strlen(job->path);
+  char *idx = (char *)malloc(plen + 5);
+  FILE *f;
+  head.magic = HEX_MRB_ARCH_MAGIC;
+  head.raw_len = job->len;
+  head.comp_len = hex_mrb_lz_compress((unsigned char *)job->raw, job->len, comp);
+  head.lines = job->lines;
+  head.first = job->first;
+  head.last = job->last;
+  memcpy(idx, job->path, plen);
+  memcpy(idx + plen, ".idx", 5);
+  hex_mrb_mkdirs(job->path);
+  f = fopen(job->path, "ab");
+  if (f != NULL) {
+    fseek(f, 0, SEEK_END);
+    entry.offset = (uint64_t)ftell(f);
+    entry.size = (uint32_t)sizeof(head) + head.comp_len;
+    entry.lines = head.lines;
+    entry.first = head.first;
+    entry.last = head.last;
+    if (fwrite(&head, sizeof(head), 1, f) == 1 && fwrite(comp, head.comp_len, 1, f) == 1 && fclose(f) == 0) {
+      // The index only ever points at complete blocks
+      f = fopen(idx, "ab");
+      if (f != NULL) {
+        fwrite(&entry, sizeof(entry), 1, f);
+        fclose(f);
+      }
+    } else {
+      fclose(f);
+    }
+  }
+#ifndef WIN32
+  pthread_mutex_lock(&hex_arch_lock);
+#endif
+  hex_arch_blocks++;
+  hex_arch_raw += job->len;
+  hex_arch_comp += head.comp_len;
+#ifndef WIN32
+  pthread_mutex_unlock(&hex_arch_lock);
+#endif
+  free(idx);
+  free(comp);
+  free(job->path);
+  free(job->raw);
+  free(job);
+}
+
+#ifndef WIN32
+// Writer thread, writes queued blocks until told to stop
+static void*
+hex_mrb_arch_writer(void *arg)
+{
+  for (;;) {
+    struct hex_mrb_arch_job *jobs;
+    pthread_mutex_lock(&hex_arch_lock);
+    while (hex_arch_jobs == NULL && !hex_arch_stop) {
+      pthread_cond_wait(&hex_arch_cond, &hex_arch_lock);
+    }
+    jobs = hex_arch_jobs;
+    hex_arch_jobs = NULL;
+    hex_arch_tail = &hex_arch_jobs;
+    pthread_mutex_unlock(&hex_arch_lock);
+    if (jobs == NULL) {
+      break;
+    }
+    while (jobs != NULL) {
+      struct hex_mrb_arch_job *next = jobs->next;
+      hex_mrb_arch_write(jobs);
+      pthread_mutex_lock(&hex_arch_lock);
+      hex_arch_queued--;
+      pthread_mutex_unlock(&hex_arch_lock);
+      jobs = next;
+    }
+  }
+  return NULL;
+}
+#endif
+
+// Hand a channel's block to the writer and start a new one
+static void
+hex_mrb_arch_handoff(struct hex_mrb_arch_chan *ch)
+{
+  struct hex_mrb_arch_job *job;
+  if (ch->lines == 0) {
+    return;
+  }
+  job = (struct hex_mrb_arch_job *)malloc(sizeof(struct hex_mrb_arch_job));
+  job->next = NULL;
+  job->path = strdup(ch->path);
+  job->raw = ch->buf;
+  job->len = ch->len;
+  job->lines = ch->lines;
+  job->first = ch->first;
+  job->last = ch->last;
+  ch->buf = (char *)malloc(HEX_MRB_ARCH_BLOCK);
+  ch->len = 0;
+  ch->lines = 0;
+#ifdef WIN32
+  hex_mrb_arch_write(job);
+#else
+  pthread_mutex_lock(&hex_arch_lock);
+  *hex_arch_tail = job;
+  hex_arch_tail = &job->next;
+  hex_arch_queued++;
+  pthread_cond_signal(&hex_arch_cond);
+  pthread_mutex_unlock(&hex_arch_lock);
+#endif
+}
+
+// Block file for a network and channel, names are made safe for paths
+static char*
+hex_mrb_arch_path(const char *network, const char *channel)
+{
+  size_t dlen = strlen(hex_arch_dir);
+  size_t nlen = strlen(network);
+  size_t clen = strlen(channel);
+  char *path = (char *)malloc(dlen + nlen + clen + 8);
+  char *p = path + dlen;
+  memcpy(path, hex_arch_dir, dlen);
+  *p++ = '/';
+  for (int part = 0; part < 2; part++) {
+    const char *s = part == 0 ? network : channel;
+    size_t len = part == 0 ? nlen : clen;
+    for (size_t i = 0; i < len; i++) {
+      unsigned char ch = (unsigned char)s[i];
+      *p++ = (ch < 32 || strchr("/\\:*?\"<>|", ch) != NULL || (i == 0 && ch == '.'))
+             ? '_' : (char)hex_casemap[HEX_MRB_CASEMAP_RFC1459][ch];
+    }
+    if (len == 0) {
+      *p++ = '_';
+    }
+    *p++ = part == 0 ? '/' : '.';
+  }
+  memcpy(p, "blk", 4);
+  return path;
+}
+
+// Find or create the open block of a network and channel
+static struct hex_mrb_arch_chan*
+hex_mrb_arch_chan(const char *network, const char *channel)
+{
+  char *path = hex_mrb_arch_path(network, channel);
+  uint32_t h = hex_mrb_hash_bytes(path, (mrb_int)strlen(path));
+  struct hex_mrb_arch_chan *ch;
+  for (ch = hex_arch_chans[h & (HEX_MRB_ARCH_BUCKETS - 1)]; ch != NULL; ch = ch->next) {
+    if (ch->hash == h && strcmp(ch->path, path) == 0) {
+      free(path);
+      return ch;
+    }
+  }
+  ch = (struct hex_mrb_arch_chan *)calloc(1, sizeof(struct hex_mrb_arch_chan));
+  ch->hash = h;
+  ch->path = path;
+  ch->buf = (char *)malloc(HEX_MRB_ARCH_BLOCK);
+  ch->next = hex_arch_chans[h & (HEX_MRB_ARCH_BUCKETS - 1)];
+  hex_arch_chans[h & (HEX_MRB_ARCH_BUCKETS - 1)] = ch;
+  return ch;
+}
+
+// Append a record to a channel's open block
+// Records are a 64 bit time, 8 bit nick length, 16 bit text length, nick
+// and text, in host byte order.
+static void
+hex_mrb_arch_append(struct hex_mrb_arch_chan *ch, int64_t t, const char *nick, const char *text)
+{
+  size_t nick_len = strlen(nick);
+  size_t text_len = strlen(text);
+  uint32_t size;
+  char *p;
+  if (nick_len > 255) {
+    nick_len = 255;
+  }
+  if (text_len > 4096) {
+    text_len = 4096;
+  }
+  size = (uint32_t)(HEX_MRB_ARCH_REC + nick_len + text_len);
+  if (ch->len + size > HEX_MRB_ARCH_BLOCK) {
+    hex_mrb_arch_handoff(ch);
+  }
+  p = ch->buf + ch->len;
+  memcpy(p, &t, 8);
+  p[8] = (char)nick_len;
+  p[9] = (char)(text_len & 0xff);
+  p[10] = (char)(text_len >> 8);
+  memcpy(p + HEX_MRB_ARCH_REC, nick, nick_len);
+  memcpy(p + HEX_MRB_ARCH_REC + nick_len, text, text_len);
+  // Server times of played back lines may go backwards, the block
+  // range covers all of them
+  if (ch->lines == 0) {
+    ch->first = t;
+    ch->last = t;
+    ch->opened = hex_mrb_clock_ns();
+  } else if (t < ch->first) {
+    ch->first = t;
+  } else if (t > ch->last) {
+    ch->last = t;
+  }
+  ch->len += size;
+  ch->lines++;
+}
+
+// Print hook feeding the archive, lines are stamped with the IRCv3
+// server time when there is one
+static int
+hex_mrb_archive_cb(char *word[], hexchat_event_attrs *attrs, const struct hex_mrb_hist_event *ev)
+{
+  if (word[ev->nick] != NULL && word[ev->text] != NULL && word[ev->text][0] != 0) {
+    const char *network = hexchat_get_info(ph, "network");
+    const char *channel = hexchat_get_info(ph, "channel");
+    if (network == NULL) {
+      network = hexchat_get_info(ph, "server");
+    }
+    hex_mrb_arch_append(hex_mrb_arch_chan(network ? network : "", channel ? channel : ""),
+                        (int64_t)(attrs != NULL && attrs->server_time_utc > 0 ? attrs->server_time_utc : time(NULL)),
+                        word[ev->nick], word[ev->text]);
+  }
+  return HEXCHAT_EAT_NONE;
+}
+
+// Hand off open blocks, all of them or those open for a while
+static void
+hex_mrb_arch_flush(int all)
+{
+  uint64_t now = hex_mrb_clock_ns();
+  for (int i = 0; i < HEX_MRB_ARCH_BUCKETS; i++) {
+    for (struct hex_mrb_arch_chan *ch = hex_arch_chans[i]; ch != NULL; ch = ch->next) {
+      if (ch->lines > 0 && (all || now - ch->opened >= (uint64_t)HEX_MRB_ARCH_FLUSH * 1000000ULL)) {
+        hex_mrb_arch_handoff(ch);
+      }
+    }
+  }
+}
+
+// Timer writing out blocks that have been open for a while
+static int
+hex_mrb_arch_timer_cb(void *userdata)
+{
+  hex_mrb_arch_flush(0);
+  return 1;
+}
+
+// Stop archiving, writing out everything first
+static void
+hex_mrb_archive_stop(void)
+{
+  if (hex_arch_dir == NULL) {
+    return;
+  }
+  for (int i = 0; hex_history_events[i].name != NULL; i++) {
+    hexchat_unhook(ph, hex_arch_hooks[i]);
+    hex_arch_hooks[i] = NULL;
+  }
+  hexchat_unhook(ph, hex_arch_timer);
+  hex_arch_timer = NULL;
+  hex_mrb_arch_flush(1);
+#ifndef WIN32
+  pthread_mutex_lock(&hex_arch_lock);
+  hex_arch_stop = 1;
+  pthread_cond_signal(&hex_arch_cond);
+  pthread_mutex_unlock(&hex_arch_lock);
+  pthread_join(hex_arch_thread, NULL);
+#endif
+  for (int i = 0; i < HEX_MRB_ARCH_BUCKETS; i++) {
+    while (hex_arch_chans[i] != NULL) {
+      struct hex_mrb_arch_chan *ch = hex_arch_chans[i];
+      hex_arch_chans[i] = ch->next;
+      free(ch->path);
+      free(ch->buf);
+      free(ch);
+    }
+  }
+  free(hex_arch_dir);
+  hex_arch_dir = NULL;
+}
+
+// Push the records of a raw block matching a query onto rows, newest first
+// Returns non-zero once limit rows have been collected
+static int
+hex_mrb_arch_scan(mrb_state *mrb, const char *raw, uint32_t len, int64_t since, int64_t until,
+                  const char *nick, mrb_int nick_len, mrb_int limit, mrb_value rows)
+{
+  const unsigned char *map = hex_casemap[HEX_MRB_CASEMAP_RFC1459];
+  uint32_t offs[HEX_MRB_ARCH_BLOCK / HEX_MRB_ARCH_REC];
+  uint32_t n = 0;
+  for (uint32_t o = 0; o + HEX_MRB_ARCH_REC <= len; ) {
+    uint32_t size = HEX_MRB_ARCH_REC + (unsigned char)raw[o + 8]
+                    + ((uint32_t)(unsigned char)raw[o + 9] | (uint32_t)(unsigned char)raw[o + 10] << 8);
+    if (o + size > len) {
+      break;
+    }
+    offs[n++] = o;
+    o += size;
+  }
+  while (n > 0) {
+    const char *p = raw + offs[--n];
+    int64_t t;
+    uint32_t nl = (unsigned char)p[8];
+    uint32_t tl = (uint32_t)(unsigned char)p[9] | (uint32_t)(unsigned char)p[10] << 8;
+    memcpy(&t, p, 8);
+    if ((until > 0 && t > until) || (since > 0 && t < since)) {
+      continue;
+    }
+    if (nick != NULL && hex_mrb_casecmp(map, nick, nick_len, p + HEX_MRB_ARCH_REC, nl) != 0) {
+      continue;
+    }
+    {
+      mrb_value row[3];
+      row[0] = mrb_fixnum_value((mrb_int)t);
+      row[1] = mrb_str_new(mrb, p + HEX_MRB_ARCH_REC, nl);
+      row[2] = mrb_str_new(mrb, p + HEX_MRB_ARCH_REC + nl, tl);
+      mrb_ary_push(mrb, rows, mrb_ary_new_from_values(mrb, 3, row));
+    }
+    if (RARRAY_LEN(rows) >= limit) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// HexChat::Internal.archive_enable(dir)
+static mrb_value
+hex_mrb_xi_archive_enable(mrb_state *mrb, mrb_value self)
+{
+  char *dir;
+  mrb_get_args(mrb, "z", &dir);
+  if (hex_arch_dir != NULL) {
+    return mrb_false_value();
+  }
+#ifndef WIN32
+  hex_arch_stop = 0;
+  hex_arch_tail = &hex_arch_jobs;
+  if (pthread_create(&hex_arch_thread, NULL, hex_mrb_arch_writer, NULL) != 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "unable to start the archive writer");
+  }
+#endif
+  hex_arch_dir = strdup(dir);
+  for (int i = 0; hex_history_events[i].name != NULL; i++) {
+    hex_arch_hooks[i] = hexchat_hook_print_attrs(ph, hex_history_events[i].name, HEXCHAT_PRI_LOWEST, (void *)hex_mrb_archive_cb, (void *)&hex_history_events[i]);
+  }
+  hex_arch_timer = hexchat_hook_timer(ph, HEX_MRB_ARCH_FLUSH, hex_mrb_arch_timer_cb, NULL);
+  return mrb_true_value();
+}
+
+// HexChat::Internal.archive_disable
+static mrb_value
+hex_mrb_xi_archive_disable(mrb_state *mrb, mrb_value self)
+{
+  hex_mrb_archive_stop();
+  return mrb_nil_value();
+}
+
+// HexChat::Internal.archive_flush
+// Hands every open block to the writer
+static mrb_value
+hex_mrb_xi_archive_flush(mrb_state *mrb, mrb_value self)
+{
+  hex_mrb_arch_flush(1);
+  return mrb_nil_value();
+}
+
+// HexChat::Internal.archive_search(network, channel, since, until, nick, limit)
+// Records newest first as [time, nick, text].  Only blocks whose index
+// entry overlaps the time range are read and decompressed.
+static mrb_value
+hex_mrb_xi_archive_search(mrb_state *mrb, mrb_value self)
+{
+  char *network, *channel, *nick = NULL, *path, *idx;
+  mrb_int since, until, limit, nick_len = 0;
+  mrb_value rows;
+  struct hex_mrb_arch_chan *ch = NULL;
+  struct hex_mrb_arch_index *entries = NULL;
+  size_t count = 0, plen;
+  unsigned char *raw;
+  FILE *f;
+  int done = 0;
+  mrb_get_args(mrb, "zziis!i", &network, &channel, &since, &until, &nick, &nick_len, &limit);
+  rows = mrb_ary_new(mrb);
+  if (hex_arch_dir == NULL || limit <= 0) {
+    return rows;
+  }
+  path = hex_mrb_arch_path(network, channel);
+  // Records not written yet come first
+  {
+    uint32_t h = hex_mrb_hash_bytes(path, (mrb_int)strlen(path));
+    for (ch = hex_arch_chans[h & (HEX_MRB_ARCH_BUCKETS - 1)]; ch != NULL; ch = ch->next) {
+      if (ch->hash == h && strcmp(ch->path, path) == 0) {
+        break;
+      }
+    }
+  }
+  if (ch != NULL && ch->lines > 0) {
+    done = hex_mrb_arch_scan(mrb, ch->buf, ch->len, since, until, nick, nick_len, limit, rows);
+  }
+  raw = (unsigned char *)malloc(HEX_MRB_ARCH_BLOCK);
+  plen = strlen(path);
+  idx = (char *)malloc(plen + 5);
+  memcpy(idx, path, plen);
+  memcpy(idx + plen, ".idx", 5);
+  f = done ? NULL : fopen(idx, "rb");
+  if (f != NULL) {
+    long size;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    count = size > 0 ? (size_t)size / sizeof(struct hex_mrb_arch_index) : 0;
+    entries = (struct hex_mrb_arch_index *)malloc(sizeof(struct hex_mrb_arch_index) * (count + 1));
+    count = fread(entries, sizeof(struct hex_mrb_arch_index), count, f);
+    fclose(f);
+  }
+  if (count > 0) {
+#ifdef WIN32
+    FILE *blk = fopen(path, "rb");
+    unsigned char *comp = (unsigned char *)malloc(HEX_MRB_ARCH_BLOCK + HEX_MRB_ARCH_BLOCK / 128 + 1 + sizeof(struct hex_mrb_arch_head));
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    unsigned char *map = NULL;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+      map = (unsigned char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED) {
+        map = NULL;
+      }
+    }
+#endif
+    for (size_t i = count; i > 0 && !done; i--) {
+      struct hex_mrb_arch_index *e = &entries[i - 1];
+      struct hex_mrb_arch_head head;
+      const unsigned char *block;
+      int64_t len;
+      if ((since > 0 && e->last < since) || (until > 0 && e->first > until)) {
+        continue;
+      }
+      if (e->size < sizeof(head) || e->size > HEX_MRB_ARCH_BLOCK + HEX_MRB_ARCH_BLOCK / 128 + 1 + sizeof(head)) {
+        continue;
+      }
+#ifdef WIN32
+      if (blk == NULL || fseek(blk, (long)e->offset, SEEK_SET) != 0 || fread(comp, e->size, 1, blk) != 1) {
+        continue;
+      }
+      block = comp;
+#else
+      if (map == NULL || e->offset + e->size > (uint64_t)st.st_size) {
+        continue;
+      }
+      block = map + e->offset;
+#endif
+      memcpy(&head, block, sizeof(head));
+      if (head.magic != HEX_MRB_ARCH_MAGIC || sizeof(head) + head.comp_len != e->size) {
+        continue;
+      }
+      len = hex_mrb_lz_decompress(block + sizeof(head), head.comp_len, raw, HEX_MRB_ARCH_BLOCK);
+      if (len == (int64_t)head.raw_len) {
+        done = hex_mrb_arch_scan(mrb, (char *)raw, (uint32_t)len, since, until, nick, nick_len, limit, rows);
+      }
+    }
+#ifdef WIN32
+    if (blk != NULL) {
+      fclose(blk);
+    }
+    free(comp);
+#else
+    if (map != NULL) {
+      munmap(map, (size_t)st.st_size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+#endif
+  }
+  free(entries);
+  free(idx);
+  free(raw);
+  free(path);
+  return rows;
+}
+
+// HexChat::Internal.archive_stats
+// [blocks written, raw bytes, compressed bytes, blocks waiting]
+static mrb_value
+hex_mrb_xi_archive_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_value row[4];
+#ifndef WIN32
+  pthread_mutex_lock(&hex_arch_lock);
+#endif
+  row[0] = mrb_fixnum_value((mrb_int)hex_arch_blocks);
+  row[1] = mrb_fixnum_value((mrb_int)hex_arch_raw);
+  row[2] = mrb_fixnum_value((mrb_int)hex_arch_comp);
+  row[3] = mrb_fixnum_value((mrb_int)hex_arch_queued);
+#ifndef WIN32
+  pthread_mutex_unlock(&hex_arch_lock);
+#endif
+  return mrb_ary_new_from_values(mrb, 4, row);
+}
+
+#ifndef WIN32
+// Rename a log file out of the way, keeping up to keep old ones
+// Runs on the writer thread
+static void
+hex_mrb_log_rotate(struct hex_mrb_logger *lg)
+{
+  size_t plen = strlen(lg->path);
+  char *from = (char *)malloc(plen + 16);
+  char *to = (char *)malloc(plen + 16);
+  close(lg->fd);
+  if (lg->keep > 0) {
+    for (int i = lg->keep - 1; i >= 1; i--) {
+      snprintf(from, plen + 16, "%s.%d", lg->path, i);
+      snprintf(to, plen + 16, "%s.%d", lg->path, i + 1);
+      rename(from, to);
+    }
+    snprintf(to, plen + 16, "%s.1", lg->path);
+    rename(lg->path, to);
+  } else {
+    unlink(lg->path);
+  }
+  free(from);
+  free(to);
+  lg->size = 0;
+  __atomic_add_fetch(&lg->rotations, 1, __ATOMIC_RELAXED);
+  lg->fd = open(lg->path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (lg->fd < 0) {
+    __atomic_store_n(&lg->error, errno, __ATOMIC_RELAXED);
+  }
+}
+
+// Reopen a log file whose reopen after rotating failed
+// Runs on the writer thread
+static int
+hex_mrb_log_reopen(struct hex_mrb_logger *lg)
+{
+  struct stat st;
+  lg->fd = open(lg->path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (lg->fd < 0) {
+    __atomic_store_n(&lg->error, errno, __ATOMIC_RELAXED);
+    return 0;
+  }
+  lg->size = fstat(lg->fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+  return 1;
+}
+
+// Write out what is in a logger's ring
+// Runs on the writer thread, the producer only ever moves tail
+static void
+hex_mrb_log_drain(struct hex_mrb_logger *lg, uint64_t now)
+{
+  uint32_t tail = __atomic_load_n(&lg->tail, __ATOMIC_ACQUIRE);
+  uint32_t head = lg->head;
+  if (lg->fd < 0 && (tail == head || !hex_mrb_log_reopen(lg))) {
+    return;
+  }
+  while (tail != head && lg->fd >= 0) {
+    uint32_t n = tail - head;
+    uint32_t off = head & (lg->cap - 1);
+    struct iovec iov[2];
+    int cnt = 1;
+    ssize_t w;
+    if (lg->max_size > 0 && lg->size > 0 && lg->size + n > lg->max_size) {
+      hex_mrb_log_rotate(lg);
+      continue;
+    }
+    iov[0].iov_base = lg->ring + off;
+    iov[0].iov_len = n < lg->cap - off ? n : lg->cap - off;
+    if (iov[0].iov_len < n) {
+      iov[1].iov_base = lg->ring;
+      iov[1].iov_len = n - iov[0].iov_len;
+      cnt = 2;
+    }
+    w = writev(lg->fd, iov, cnt);
+    if (w <= 0) {
+      __atomic_store_n(&lg->error, errno, __ATOMIC_RELAXED);
+      break;
+    }
+    head += (uint32_t)w;
+    lg->size += (uint64_t)w;
+    __atomic_add_fetch(&lg->written, (uint64_t)w, __ATOMIC_RELAXED);
+    lg->unsynced = 1;
+    __atomic_store_n(&lg->head, head, __ATOMIC_RELEASE);
+  }
+  if (lg->unsynced && lg->fd >= 0 && lg->fsync_ns != HEX_MRB_LOG_NEVER && now - lg->synced >= lg->fsync_ns) {
+    fsync(lg->fd);
+    lg->synced = now;
+    lg->unsynced = 0;
+  }
+}
+
+// Free a logger once the writer is done with it
+static void
+hex_mrb_log_destroy(struct hex_mrb_logger *lg)
+{
+  if (lg->fd >= 0) {
+    close(lg->fd);
+  }
+  free(lg->path);
+  free(lg->ring);
+  free(lg);
+}
+
+// Writer thread, drains every logger until told to stop
+static void*
+hex_mrb_log_writer(void *arg)
+{
+  pthread_mutex_lock(&hex_log_lock);
+  for (;;) {
+    // New loggers are only ever pushed in front of the list and only this
+    // thread unlinks them, so the list can be walked unlocked
+    struct hex_mrb_logger *list = hex_loggers;
+    struct hex_mrb_logger *lg;
+    uint64_t now;
+    int stop = hex_log_stop;
+    struct timespec ts;
+    pthread_mutex_unlock(&hex_log_lock);
+    now = hex_mrb_clock_ns();
+    for (lg = list; lg != NULL; lg = lg->next) {
+      hex_mrb_log_drain(lg, now);
+    }
+    pthread_mutex_lock(&hex_log_lock);
+    for (struct hex_mrb_logger **pp = &hex_loggers; *pp != NULL; ) {
+      lg = *pp;
+      if (lg->closing && (lg->head == __atomic_load_n(&lg->tail, __ATOMIC_ACQUIRE) || lg->fd < 0 || lg->error)) {
+        *pp = lg->next;
+        hex_mrb_log_destroy(lg);
+      } else {
+        pp = &lg->next;
+      }
+    }
+    if (stop) {
+      break;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += HEX_MRB_LOG_POLL * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    if (!hex_log_wake) {
+      pthread_cond_timedwait(&hex_log_cond, &hex_log_lock, &ts);
+    }
+    hex_log_wake = 0;
+  }
+  pthread_mutex_unlock(&hex_log_lock);
+  return NULL;
+}
+
+// Wake the writer thread early
+static void
+hex_mrb_log_wake(void)
+{
+  pthread_mutex_lock(&hex_log_lock);
+  hex_log_wake = 1;
+  pthread_cond_signal(&hex_log_cond);
+  pthread_mutex_unlock(&hex_log_lock);
+}
+
+// Stop the writer thread after it has written everything
+static void
+hex_mrb_log_stop(void)
+{
+  if (!hex_log_running) {
+    return;
+  }
+  pthread_mutex_lock(&hex_log_lock);
+  for (struct hex_mrb_logger *lg = hex_loggers; lg != NULL; lg = lg->next) {
+    lg->closing = 1;
+  }
+  hex_log_stop = 1;
+  pthread_cond_signal(&hex_log_cond);
+  pthread_mutex_unlock(&hex_log_lock);
+  pthread_join(hex_log_thread, NULL);
+  // Anything the final pass could not write is dropped
+  while (hex_loggers != NULL) {
+    struct hex_mrb_logger *lg = hex_loggers;
+    hex_loggers = lg->next;
+    hex_mrb_log_destroy(lg);
+  }
+  hex_log_running = 0;
+}
+#endif
+
+// Detach a HexChat::Internal::Logger from its logger
+// The writer thread frees it once everything queued is written
+static void
+hex_mrb_logger_free(mrb_state *mrb, void *p)
+{
+#ifndef WIN32
+  struct hex_mrb_logger *lg = (struct hex_mrb_logger *)p;
+  if (lg != NULL) {
+    pthread_mutex_lock(&hex_log_lock);
+    lg->closing = 1;
+    hex_log_wake = 1;
+    pthread_cond_signal(&hex_log_cond);
+    pthread_mutex_unlock(&hex_log_lock);
+  }
+#endif
+}
+
+// Get the logger of a HexChat::Internal::Logger, raise if it was closed
+static struct hex_mrb_logger*
+hex_mrb_logger_get(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_logger *lg = (struct hex_mrb_logger *)mrb_data_get_ptr(mrb, self, &mrb_hexchat_logger_type);
+  if (lg == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "logger is closed");
+  }
+  return lg;
+}
+
+// HexChat::Internal::Logger#initialize(path, buffer, fsync_ms, max_size, keep)
+// fsync_ms is -1 to never fsync, 0 to fsync after every write
+static mrb_value
+hex_mrb_xg_initialize(mrb_state *mrb, mrb_value self)
+{
+#ifdef WIN32
+  mrb_raise(mrb, E_NOTIMP_ERROR, "HexChat::Logger needs threads, not available on Windows");
+  return self;
+#else
+  struct hex_mrb_logger *lg;
+  char *path;
+  mrb_int buffer, fsync_ms, max_size, keep;
+  uint32_t cap = 4096;
+  struct stat st;
+  int fd;
+  mrb_get_args(mrb, "ziiii", &path, &buffer, &fsync_ms, &max_size, &keep);
+  if (buffer <= 0 || buffer > HEX_MRB_LOG_BUFFER_MAX || keep < 0 || keep > 99 || max_size < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid logger buffer size, rotation size or count");
+  }
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (fd < 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "unable to open %S: %S",
+               mrb_str_new_cstr(mrb, path), mrb_str_new_cstr(mrb, strerror(errno)));
+  }
+  lg = (struct hex_mrb_logger *)DATA_PTR(self);
+  if (lg) {
+    hex_mrb_logger_free(mrb, lg);
+  }
+  mrb_data_init(self, NULL, &mrb_hexchat_logger_type);
+  while (cap < (uint32_t)buffer) {
+    cap <<= 1;
+  }
+  lg = (struct hex_mrb_logger *)calloc(1, sizeof(struct hex_mrb_logger));
+  lg->path = strdup(path);
+  lg->fd = fd;
+  lg->size = fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+  lg->max_size = (uint64_t)max_size;
+  lg->keep = (int)keep;
+  lg->fsync_ns = fsync_ms < 0 ? HEX_MRB_LOG_NEVER : (uint64_t)fsync_ms * 1000000ULL;
+  lg->ring = (char *)malloc(cap);
+  lg->cap = cap;
+  pthread_mutex_lock(&hex_log_lock);
+  if (!hex_log_running) {
+    int err;
+    hex_log_stop = 0;
+    err = pthread_create(&hex_log_thread, NULL, hex_mrb_log_writer, NULL);
+    if (err != 0) {
+      pthread_mutex_unlock(&hex_log_lock);
+      hex_mrb_log_destroy(lg);
+      mrb_raisef(mrb, E_RUNTIME_ERROR, "unable to start the logger thread: %S",
+                 mrb_str_new_cstr(mrb, strerror(err)));
+    }
+    hex_log_running = 1;
+  }
+  lg->next = hex_loggers;
+  hex_loggers = lg;
+  pthread_mutex_unlock(&hex_log_lock);
+  mrb_data_init(self, lg, &mrb_hexchat_logger_type);
+  return self;
+#endif
+}
+
+#ifndef WIN32
+// HexChat::Internal::Logger#write(String)
+// Copies into the ring, false if it did not fit and was dropped
+static mrb_value
+hex_mrb_xg_write(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_logger *lg = hex_mrb_logger_get(mrb, self);
+  char *p;
+  mrb_int len;
+  uint32_t head, tail, used, off, first;
+  mrb_get_args(mrb, "s", &p, &len);
+  head = __atomic_load_n(&lg->head, __ATOMIC_ACQUIRE);
+  tail = lg->tail;
+  used = tail - head;
+  if ((uint64_t)len > (uint64_t)(lg->cap - used)) {
+    lg->dropped += (uint64_t)len;
+    return mrb_false_value();
+  }
+  off = tail & (lg->cap - 1);
+  first = (uint32_t)len < lg->cap - off ? (uint32_t)len : lg->cap - off;
+  memcpy(lg->ring + off, p, first);
+  memcpy(lg->ring, p + first, (size_t)len - first);
+  __atomic_store_n(&lg->tail, tail + (uint32_t)len, __ATOMIC_RELEASE);
+  if (used + (uint32_t)len > lg->cap / 2) {
+    hex_mrb_log_wake();
+  }
+  return mrb_true_value();
+}
+
+// HexChat::Internal::Logger#flush
+// Asks the writer to write now, does not wait for it
+static mrb_value
+hex_mrb_xg_flush(mrb_state *mrb, mrb_value self)
+{
+  hex_mrb_logger_get(mrb, self);
+  hex_mrb_log_wake();
+  return self;
+}
+
+// HexChat::Internal::Logger#close
+static mrb_value
+hex_mrb_xg_close(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_logger *lg = (struct hex_mrb_logger *)mrb_data_get_ptr(mrb, self, &mrb_hexchat_logger_type);
+  hex_mrb_logger_free(mrb, lg);
+  DATA_PTR(self) = NULL;
+  return mrb_nil_value();
+}
+
+// HexChat::Internal::Logger#stats
+// [bytes written, bytes dropped, bytes waiting, rotations, last errno]
+// The writer thread updates its counters atomically, read them the same way
+static mrb_value
+hex_mrb_xg_stats(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_logger *lg = hex_mrb_logger_get(mrb, self);
+  mrb_value row[5];
+  row[0] = mrb_fixnum_value((mrb_int)__atomic_load_n(&lg->written, __ATOMIC_RELAXED));
+  row[1] = mrb_fixnum_value((mrb_int)lg->dropped);
+  row[2] = mrb_fixnum_value((mrb_int)(lg->tail - __atomic_load_n(&lg->head, __ATOMIC_ACQUIRE)));
+  row[3] = mrb_fixnum_value((mrb_int)__atomic_load_n(&lg->rotations, __ATOMIC_RELAXED));
+  row[4] = mrb_fixnum_value((mrb_int)__atomic_load_n(&lg->error, __ATOMIC_RELAXED));
+  return mrb_ary_new_from_values(mrb, 5, row);
+}
+#endif
+
+#ifndef WIN32
+// Find the next complete frame in a socket's read buffer, starting at *off
+// Returns 1 with the frame in *frame/*len and *off past it, 0 if more
+// bytes are needed, -1 if the frame is longer than max_frame
+static int
+hex_mrb_socket_frame(struct hex_mrb_socket *sk, size_t *off, const char **frame, size_t *len)
+{
+  const char *p = sk->rbuf + *off;
+  size_t avail = sk->rlen - *off;
+  if (avail == 0) {
+    return 0;
+  }
+  switch (sk->framing) {
+  case HEX_MRB_SOCK_LINE: {
+    const char *nl = memchr(p, '\n', avail);
+    if (nl == NULL) {
+      return avail > sk->max_frame ? -1 : 0;
+    }
+    *frame = p;
+    *len = (size_t)(nl - p);
+    if (*len > 0 && p[*len - 1] == '\r') {
+      (*len)--;
+    }
+    if (*len > sk->max_frame) {
+      return -1;
+    }
+    *off += (size_t)(nl - p) + 1;
+    return 1;
+  }
+  case HEX_MRB_SOCK_LENGTH: {
+    const unsigned char *u = (const unsigned char *)p;
+    uint32_t flen;
+    if (avail < 4) {
+      return 0;
+    }
+    flen = (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | (uint32_t)u[3];
+    if (flen > sk->max_frame) {
+      return -1;
+    }
+    if (avail - 4 < flen) {
+      return 0;
+    }
+    *frame = p + 4;
+    *len = flen;
+    *off += 4 + (size_t)flen;
+    return 1;
+  }
+  default:
+    *frame = p;
+    *len = avail;
+    *off += avail;
+    return 1;
+  }
+}
+
+// Close a socket's descriptor, keeping its buffers for a final read
+static void
+hex_mrb_socket_shut(struct hex_mrb_socket *sk, const char *error)
+{
+  if (sk->fd >= 0) {
+    close(sk->fd);
+    sk->fd = -1;
+  }
+  sk->state = HEX_MRB_SOCK_CLOSED;
+  sk->wlen = sk->woff = 0;
+  if (error != NULL && sk->error[0] == '\0') {
+    snprintf(sk->error, sizeof(sk->error), "%s", error);
+  }
+}
+
+// Free a HexChat::Internal::Socket
+static void
+hex_mrb_socket_free(mrb_state *mrb, void *p)
+{
+  struct hex_mrb_socket *sk = (struct hex_mrb_socket *)p;
+  if (sk != NULL) {
+    hex_mrb_socket_shut(sk, NULL);
+    free(sk->rbuf);
+    free(sk->wbuf);
+    free(sk);
+  }
+}
+
+// Get the socket of a HexChat::Internal::Socket
+static struct hex_mrb_socket*
+hex_mrb_socket_get(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_socket *sk = (struct hex_mrb_socket *)mrb_data_get_ptr(mrb, self, &mrb_hexchat_socket_type);
+  if (sk == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "socket not initialized");
+  }
+  return sk;
+}
+
+// Write out as much of the queue as the socket takes
+// Returns 0, or -1 after closing the socket on an error
+static int
+hex_mrb_socket_flush(struct hex_mrb_socket *sk)
+{
+  while (sk->woff < sk->wlen) {
+    ssize_t n = send(sk->fd, sk->wbuf + sk->woff, sk->wlen - sk->woff, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return 0;
+      }
+      hex_mrb_socket_shut(sk, strerror(errno));
+      return -1;
+    }
+    sk->woff += (size_t)n;
+    sk->bytes_out += (uint64_t)n;
+  }
+  sk->woff = sk->wlen = 0;
+  return 0;
+}
+
+// Push an [event, arg] pair onto an event Array
+static void
+hex_mrb_socket_event(mrb_state *mrb, mrb_value events, const char *event, mrb_value arg)
+{
+  mrb_value ev[2];
+  ev[0] = mrb_symbol_value(mrb_intern_cstr(mrb, event));
+  ev[1] = arg;
+  mrb_ary_push(mrb, events, mrb_ary_new_from_values(mrb, 2, ev));
+}
+
+// Start a non-blocking connect, kind is "tcp" or "unix"
+// TCP addresses must be numeric: resolving a name can block HexChat for
+// as long as DNS takes, so it is left to the caller.  Returns the fd, or
+// -1 with *err set to an errno or *gai to a getaddrinfo error.
+static int
+hex_mrb_socket_open(const char *kind, const char *addr, int port, int *err, int *gai)
+{
+  int fd = -1;
+  *err = 0;
+  *gai = 0;
+  if (strcmp(kind, "unix") == 0) {
+    struct sockaddr_un sa;
+    if (strlen(addr) >= sizeof(sa.sun_path)) {
+      *err = ENAMETOOLONG;
+      return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, addr);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 && errno != EINPROGRESS && errno != EAGAIN) {
+        *err = errno;
+      }
+    } else {
+      *err = errno;
+    }
+  } else {
+    struct addrinfo hints, *res, *ai;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+    *gai = getaddrinfo(addr, service, &hints, &res);
+    if (*gai != 0) {
+      return -1;
+    }
+    // Take the first address a connect can be started on
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0) {
+        *err = errno;
+        continue;
+      }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+        *err = 0;
+        break;
+      }
+      *err = errno;
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+  }
+  if (*err != 0 && fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd >= 0) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+}
+
+// HexChat::Internal::Socket#initialize(kind, address, port, framing, max_frame, high_water)
+// Starts a non-blocking connect, kind is "tcp" or "unix"
+static mrb_value
+hex_mrb_xs_initialize(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_socket *sk;
+  char *kind, *addr;
+  mrb_int port, framing, max_frame, high_water;
+  int fd;
+  int err, gai;
+  mrb_get_args(mrb, "zziiii", &kind, &addr, &port, &framing, &max_frame, &high_water);
+  if (framing < HEX_MRB_SOCK_RAW || framing > HEX_MRB_SOCK_LENGTH || max_frame <= 0 || high_water <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid socket framing, frame size or high water mark");
+  }
+  if (strcmp(kind, "unix") != 0 && strcmp(kind, "tcp") != 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown socket kind %S", mrb_str_new_cstr(mrb, kind));
+  }
+  if (strcmp(kind, "unix") == 0 && strlen(addr) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "socket path too long");
+  }
+  fd = hex_mrb_socket_open(kind, addr, (int)port, &err, &gai);
+  if (gai != 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%S is not an IP address and port (%S), names are not resolved",
+               mrb_str_new_cstr(mrb, addr), mrb_str_new_cstr(mrb, gai_strerror(gai)));
+  }
+  if (fd < 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "unable to connect to %S: %S",
+               mrb_str_new_cstr(mrb, addr), mrb_str_new_cstr(mrb, strerror(err)));
+  }
+  sk = (struct hex_mrb_socket *)DATA_PTR(self);
+  if (sk) {
+    hex_mrb_socket_free(mrb, sk);
+  }
+  mrb_data_init(self, NULL, &mrb_hexchat_socket_type);
+  sk = (struct hex_mrb_socket *)calloc(1, sizeof(struct hex_mrb_socket));
+  if (sk == NULL) {
+    close(fd);
+    mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory");
+  }
+  sk->fd = fd;
+  sk->state = HEX_MRB_SOCK_CONNECTING;
+  sk->framing = (int)framing;
+  sk->max_frame = (size_t)max_frame;
+  sk->high_water = (size_t)high_water;
+  mrb_data_init(self, sk, &mrb_hexchat_socket_type);
+  return self;
+}
+
+// HexChat::Internal::Socket#service(Integer)
+// Does what the fd flags HexChat reported allow: finish the connect,
+// read and split frames, write queued data.  Returns an Array of
+// [:connect, nil], [:frame, String], [:drain, nil] and [:close, reason]
+// events, reason being nil when the peer closed normally.
+static mrb_value
+hex_mrb_xs_service(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_socket *sk = hex_mrb_socket_get(mrb, self);
+  mrb_value events = mrb_ary_new(mrb);
+  mrb_int flags;
+  int eof = 0;
+  mrb_get_args(mrb, "i", &flags);
+  // The connect is done once the socket turns writable
+  if (sk->state == HEX_MRB_SOCK_CONNECTING && (flags & (HEXCHAT_FD_WRITE | HEXCHAT_FD_EXCEPTION))) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(sk->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+      err = errno;
+    }
+    if (err != 0) {
+      hex_mrb_socket_shut(sk, strerror(err));
+    } else {
+      sk->state = HEX_MRB_SOCK_OPEN;
+      hex_mrb_socket_event(mrb, events, "connect", mrb_nil_value());
+    }
+  }
+  if (sk->state == HEX_MRB_SOCK_OPEN && (flags & (HEXCHAT_FD_READ | HEXCHAT_FD_EXCEPTION))) {
+    size_t off = 0;
+    const char *frame;
+    size_t flen;
+    int r;
+    // Bounded, so a fast sender cannot hold up HexChat; the hook fires again
+    for (int reads = 0; reads < HEX_MRB_SOCK_READS && !eof; reads++) {
+      ssize_t n;
+      if (sk->rcap - sk->rlen < HEX_MRB_SOCK_CHUNK) {
+        size_t cap = sk->rcap ? sk->rcap * 2 : HEX_MRB_SOCK_CHUNK * 2;
+        char *nb = (char *)realloc(sk->rbuf, cap);
+        if (nb == NULL) {
+          hex_mrb_socket_shut(sk, "out of memory");
+          break;
+        }
+        sk->rbuf = nb;
+        sk->rcap = cap;
+      }
+      n = recv(sk->fd, sk->rbuf + sk->rlen, sk->rcap - sk->rlen, 0);
+      if (n > 0) {
+        sk->rlen += (size_t)n;
+        sk->bytes_in += (uint64_t)n;
+      } else if (n == 0) {
+        eof = 1;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      } else if (errno != EINTR) {
+        hex_mrb_socket_shut(sk, strerror(errno));
+        break;
+      }
+      // Frames that are complete now, a full buffer is not grown past need
+      while ((r = hex_mrb_socket_frame(sk, &off, &frame, &flen)) == 1) {
+        int ai = mrb_gc_arena_save(mrb);
+        hex_mrb_socket_event(mrb, events, "frame", mrb_str_new(mrb, frame, flen));
+        mrb_gc_arena_restore(mrb, ai);
+      }
+      if (off > 0) {
+        memmove(sk->rbuf, sk->rbuf + off, sk->rlen - off);
+        sk->rlen -= off;
+        off = 0;
+      }
+      if (r < 0) {
+        hex_mrb_socket_shut(sk, "frame too long");
+        break;
+      }
+    }
+    if (eof) {
+      hex_mrb_socket_shut(sk, NULL);
+    }
+  }
+  if (sk->state == HEX_MRB_SOCK_OPEN && (flags & HEXCHAT_FD_WRITE) && sk->wlen > 0) {
+    hex_mrb_socket_flush(sk);
+  }
+  if (sk->state == HEX_MRB_SOCK_OPEN && sk->blocked && sk->wlen - sk->woff <= sk->high_water / 2) {
+    sk->blocked = 0;
+    hex_mrb_socket_event(mrb, events, "drain", mrb_nil_value());
+  }
+  if (sk->state == HEX_MRB_SOCK_CLOSED && !sk->reported) {
+    sk->reported = 1;
+    hex_mrb_socket_event(mrb, events, "close", sk->error[0] ? mrb_str_new_cstr(mrb, sk->error) : mrb_nil_value());
+  }
+  return events;
+}
+
+// HexChat::Internal::Socket#write(String)
+// Frames and queues the data, sending what the socket takes right away.
+// Returns false once more than the high water mark is queued: wait for
+// the drain event.  Raises if four times that is queued.
+static mrb_value
+hex_mrb_xs_write(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_socket *sk = hex_mrb_socket_get(mrb, self);
+  char *p;
+  mrb_int len;
+  unsigned char head[4];
+  size_t hlen = 0, tlen = 0, need;
+  mrb_get_args(mrb, "s", &p, &len);
+  if (sk->state == HEX_MRB_SOCK_CLOSED) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "socket is closed");
+  }
+  if (sk->framing == HEX_MRB_SOCK_LENGTH) {
+    head[0] = (unsigned char)((uint32_t)len >> 24);
+    head[1] = (unsigned char)((uint32_t)len >> 16);
+    head[2] = (unsigned char)((uint32_t)len >> 8);
+    head[3] = (unsigned char)len;
+    hlen = 4;
+  } else if (sk->framing == HEX_MRB_SOCK_LINE) {
+    tlen = 1;
+  }
+  need = sk->wlen - sk->woff + hlen + (size_t)len + tlen;
+  if (need > sk->high_water * 4) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "socket write queue full");
+  }
+  // Reclaim what was already sent before growing
+  if (sk->woff > 0) {
+    memmove(sk->wbuf, sk->wbuf + sk->woff, sk->wlen - sk->woff);
+    sk->wlen -= sk->woff;
+    sk->woff = 0;
+  }
+  if (need > sk->wcap) {
+    size_t cap = sk->wcap ? sk->wcap : HEX_MRB_SOCK_CHUNK;
+    char *nb;
+    while (cap < need) {
+      cap *= 2;
+    }
+    nb = (char *)realloc(sk->wbuf, cap);
+    if (nb == NULL) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory");
+    }
+    sk->wbuf = nb;
+    sk->wcap = cap;
+  }
+  memcpy(sk->wbuf + sk->wlen, head, hlen);
+  memcpy(sk->wbuf + sk->wlen + hlen, p, (size_t)len);
+  if (tlen) {
+    sk->wbuf[sk->wlen + hlen + (size_t)len] = '\n';
+  }
+  sk->wlen += hlen + (size_t)len + tlen;
+  // An error here closes the socket, the next service call reports it
+  if (sk->state == HEX_MRB_SOCK_OPEN && hex_mrb_socket_flush(sk) < 0) {
+    return mrb_false_value();
+  }
+  if (sk->wlen - sk->woff > sk->high_water) {
+    sk->blocked = 1;
+    return mrb_false_value();
+  }
+  return mrb_true_value();
+}
+
+// HexChat::Internal::Socket#fd
+static mrb_value
+hex_mrb_xs_fd(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value((mrb_int)hex_mrb_socket_get(mrb, self)->fd);
+}
+
+// HexChat::Internal::Socket#state
+// :connecting, :open or :closed
+static mrb_value
+hex_mrb_xs_state(mrb_state *mrb, mrb_value self)
+{
+  static const char *names[] = { "connecting", "open", "closed" };
+  return mrb_symbol_value(mrb_intern_cstr(mrb, names[hex_mrb_socket_get(mrb, self)->state]));
+}
+
+// HexChat::Internal::Socket#flags
+// The fd flags to hook: writable while connecting or data is queued,
+// readable while open, none once closed
+static mrb_value
+hex_mrb_xs_flags(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_socket *sk = hex_mrb_socket_get(mrb, self);
+  int flags = 0;
+  if (sk->state == HEX_MRB_SOCK_CONNECTING) {
+    flags = HEXCHAT_FD_WRITE | HEXCHAT_FD_EXCEPTION;
+  } else if (sk->state == HEX_MRB_SOCK_OPEN) {
+    flags = HEXCHAT_FD_READ | HEXCHAT_FD_EXCEPTION | (sk->wlen > sk->woff ? HEXCHAT_FD_WRITE : 0);
+  }
+  return mrb_fixnum_value((mrb_int)flags);
+}
+
+// HexChat::Internal::Socket#close
+// Closes at once, queued data that was not sent yet is dropped
+static mrb_value
+hex_mrb_xs_close(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_socket *sk = hex_mrb_socket_get(mrb, self);
+  hex_mrb_socket_shut(sk, NULL);
+  sk->reported = 1;
+  return mrb_nil_value();
+}
+
+// HexChat::Internal::Socket#stats
+// [bytes received, bytes sent, bytes queued, bytes buffered]
+static mrb_value
+hex_mrb_xs_stats(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_socket *sk = hex_mrb_socket_get(mrb, self);
+  mrb_value row[4];
+  row[0] = mrb_fixnum_value((mrb_int)sk->bytes_in);
+  row[1] = mrb_fixnum_value((mrb_int)sk->bytes_out);
+  row[2] = mrb_fixnum_value((mrb_int)(sk->wlen - sk->woff));
+  row[3] = mrb_fixnum_value((mrb_int)sk->rlen);
+  return mrb_ary_new_from_values(mrb, 4, row);
+}
+#else
+static void
+hex_mrb_socket_free(mrb_state *mrb, void *p)
+{
+}
+
+// HexChat::Internal::Socket#initialize
+static mrb_value
+hex_mrb_xs_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_raise(mrb, E_NOTIMP_ERROR, "HexChat::Socket is not available on Windows");
+  return self;
+}
+#endif
+
+#ifndef WIN32
+extern char **environ;
+
+// Reap children whose Process objects are gone, called from a timer
+// Only our own pids are waited for, so children of HexChat or other
+// plugins are left to whoever is watching them
+static int
+hex_mrb_orphans_cb(void *userdata)
+{
+  struct hex_mrb_orphan **link = &hex_orphans;
+  while (*link != NULL) {
+    struct hex_mrb_orphan *o = *link;
+    if (waitpid(o->pid, NULL, WNOHANG) != 0) {
+      *link = o->next;
+      free(o);
+    } else {
+      link = &o->next;
+    }
+  }
+  if (hex_orphans == NULL) {
+    hex_orphan_timer = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+// Close the pipes of a child process
+static void
+hex_mrb_process_close(struct hex_mrb_process *pr)
+{
+  for (int i = 0; i < 2; i++) {
+    if (pr->fd[i] >= 0) {
+      close(pr->fd[i]);
+      pr->fd[i] = -1;
+    }
+  }
+}
+
+// Make a pipe with both ends close-on-exec, atomically where pipe2 exists
+// so a child spawned meanwhile by another thread cannot inherit them.
+// O_NONBLOCK is left to the caller: it is shared through dup2, and the
+// child's end has to block.
+static int
+hex_mrb_pipe(int fd[2])
+{
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+  return pipe2(fd, O_CLOEXEC);
+#else
+  if (pipe(fd) < 0) {
+    return -1;
+  }
+  fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+#endif
+}
+
+// Find the next line in a child's output buffer
+// Returns the bytes it takes up, newline included, or 0 if there is no
+// complete line yet; *llen is its length without the line end.  Longer
+// lines are cut into pieces of max_line bytes, newline or not.
+static size_t
+hex_mrb_process_split(const char *p, size_t len, size_t max_line, size_t *llen)
+{
+  const char *nl = memchr(p, '\n', len > max_line ? max_line + 1 : len);
+  if (nl == NULL) {
+    if (len >= max_line) {
+      *llen = max_line;
+      return max_line;
+    }
+    return 0;
+  }
+  *llen = (size_t)(nl - p);
+  if (*llen > 0 && nl[-1] == '\r') {
+    (*llen)--;
+  }
+  return (size_t)(nl - p) + 1;
+}
+
+// Free a HexChat::Internal::Process, killing the child if it still runs
+static void
+hex_mrb_process_free(mrb_state *mrb, void *p)
+{
+  struct hex_mrb_process *pr = (struct hex_mrb_process *)p;
+  if (pr == NULL) {
+    return;
+  }
+  hex_mrb_process_close(pr);
+  if (!pr->exited && pr->pid > 0) {
+    kill(pr->pid, SIGKILL);
+    if (waitpid(pr->pid, NULL, WNOHANG) == 0) {
+      struct hex_mrb_orphan *o = malloc(sizeof(*o));
+      if (o != NULL) {
+        o->pid = pr->pid;
+        o->next = hex_orphans;
+        hex_orphans = o;
+        if (hex_orphan_timer == NULL) {
+          hex_orphan_timer = hexchat_hook_timer(ph, 1000, hex_mrb_orphans_cb, NULL);
+        }
+      } else {
+        // Nowhere to remember it, so wait now; SIGKILL makes that short
+        while (waitpid(pr->pid, NULL, 0) < 0 && errno == EINTR);
+      }
+    }
+  }
+  free(pr->buf[0]);
+  free(pr->buf[1]);
+  free(pr);
+}
+
+// Get the child of a HexChat::Internal::Process
+static struct hex_mrb_process*
+hex_mrb_process_get(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_process *pr = (struct hex_mrb_process *)mrb_data_get_ptr(mrb, self, &mrb_hexchat_process_type);
+  if (pr == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "process not initialized");
+  }
+  return pr;
+}
+
+// HexChat::Internal::Process#initialize(argv, merge_stderr, max_line)
+// Starts argv[0], searched for in PATH, with stdin on /dev/null and
+// stdout and stderr on non-blocking pipes.  With merge_stderr both go
+// to the stdout pipe.
+static mrb_value
+hex_mrb_xp_initialize(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_process *pr;
+  mrb_value argv_v;
+  mrb_bool merge;
+  mrb_int max_line;
+  mrb_int argc;
+  char **argv;
+  int out[2] = { -1, -1 }, err[2] = { -1, -1 };
+  posix_spawn_file_actions_t fa;
+  pid_t pid;
+  int rc;
+  mrb_get_args(mrb, "Abi", &argv_v, &merge, &max_line);
+  argc = RARRAY_LEN(argv_v);
+  if (argc == 0 || max_line <= 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "empty command or invalid line length");
+  }
+  // Strings are checked before anything needs freeing
+  for (mrb_int i = 0; i < argc; i++) {
+    mrb_value a = mrb_ary_ref(mrb, argv_v, i);
+    if (!mrb_string_p(a)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "command arguments must be Strings");
+    }
+    mrb_str_to_cstr(mrb, a);
+  }
+  argv = (char **)mrb_malloc(mrb, sizeof(char *) * (argc + 1));
+  for (mrb_int i = 0; i < argc; i++) {
+    argv[i] = RSTRING_PTR(mrb_ary_ref(mrb, argv_v, i));
+  }
+  argv[argc] = NULL;
+  // Not for children spawned later; dup2 gives this child clean copies
+  if (hex_mrb_pipe(out) < 0 || (!merge && hex_mrb_pipe(err) < 0)) {
+    rc = errno;
+    pid = -1;
+  } else {
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+    posix_spawn_file_actions_adddup2(&fa, merge ? out[1] : err[1], 2);
+    rc = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+  }
+  mrb_free(mrb, argv);
+  // Our copies of the write ends, the child has its own
+  if (out[1] >= 0) {
+    close(out[1]);
+  }
+  if (err[1] >= 0) {
+    close(err[1]);
+  }
+  if (rc != 0) {
+    if (out[0] >= 0) {
+      close(out[0]);
+    }
+    if (err[0] >= 0) {
+      close(err[0]);
+    }
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "unable to run %S: %S",
+               mrb_ary_ref(mrb, argv_v, 0), mrb_str_new_cstr(mrb, strerror(rc)));
+  }
+  fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+  if (err[0] >= 0) {
+    fcntl(err[0], F_SETFL, fcntl(err[0], F_GETFL) | O_NONBLOCK);
+  }
+  pr = (struct hex_mrb_process *)DATA_PTR(self);
+  if (pr) {
+    hex_mrb_process_free(mrb, pr);
+  }
+  mrb_data_init(self, NULL, &mrb_hexchat_process_type);
+  pr = (struct hex_mrb_process *)calloc(1, sizeof(struct hex_mrb_process));
+  if (pr == NULL) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(out[0]);
+    if (err[0] >= 0) {
+      close(err[0]);
+    }
+    mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory");
+  }
+  pr->pid = pid;
+  pr->fd[0] = out[0];
+  pr->fd[1] = err[0];
+  pr->max_line = (size_t)max_line;
+  mrb_data_init(self, pr, &mrb_hexchat_process_type);
+  return self;
+}
+
+// Push [stream, line] onto an Array
+static void
+hex_mrb_process_line(mrb_state *mrb, mrb_value lines, int stream, const char *p, size_t len)
+{
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value row[2];
+  row[0] = mrb_fixnum_value(stream);
+  row[1] = mrb_str_new(mrb, p, len);
+  mrb_ary_push(mrb, lines, mrb_ary_new_from_values(mrb, 2, row));
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+// HexChat::Internal::Process#service(Integer)
+// Reads what is waiting on the pipe with the given fd and returns its
+// complete lines as [stream, line], stream 0 for stdout and 1 for stderr.
+// Lines longer than max_line come in pieces.  At end of file the pipe is
+// closed and an unterminated last line returned.
+static mrb_value
+hex_mrb_xp_service(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_process *pr = hex_mrb_process_get(mrb, self);
+  mrb_value lines = mrb_ary_new(mrb);
+  mrb_int fd;
+  int s;
+  mrb_get_args(mrb, "i", &fd);
+  for (s = 0; s < 2 && pr->fd[s] != fd; s++);
+  if (s == 2 || fd < 0) {
+    return lines;
+  }
+  for (int reads = 0; reads < HEX_MRB_SOCK_READS; reads++) {
+    size_t start = 0;
+    ssize_t n;
+    if (pr->cap[s] - pr->len[s] < HEX_MRB_SOCK_CHUNK) {
+      size_t cap = pr->cap[s] ? pr->cap[s] * 2 : HEX_MRB_SOCK_CHUNK * 2;
+      char *nb = (char *)realloc(pr->buf[s], cap);
+      if (nb == NULL) {
+        break;
+      }
+      pr->buf[s] = nb;
+      pr->cap[s] = cap;
+    }
+    n = read(pr->fd[s], pr->buf[s] + pr->len[s], pr->cap[s] - pr->len[s]);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      // End of file, or an error that means the same to us
+      if (pr->len[s] > 0) {
+        hex_mrb_process_line(mrb, lines, s, pr->buf[s], pr->len[s]);
+        pr->len[s] = 0;
+      }
+      close(pr->fd[s]);
+      pr->fd[s] = -1;
+      break;
+    }
+    pr->len[s] += (size_t)n;
+    for (;;) {
+      size_t llen;
+      size_t used = hex_mrb_process_split(pr->buf[s] + start, pr->len[s] - start, pr->max_line, &llen);
+      if (used == 0) {
+        break;
+      }
+      hex_mrb_process_line(mrb, lines, s, pr->buf[s] + start, llen);
+      start += used;
+    }
+    if (start > 0) {
+      memmove(pr->buf[s], pr->buf[s] + start, pr->len[s] - start);
+      pr->len[s] -= start;
+    }
+  }
+  return lines;
+}
+
+// HexChat::Internal::Process#reap
+// nil while the child runs, then [exit status or nil, signal or nil]
+static mrb_value
+hex_mrb_xp_reap(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_process *pr = hex_mrb_process_get(mrb, self);
+  mrb_value row[2];
+  if (!pr->exited) {
+    int status;
+    pid_t r = waitpid(pr->pid, &status, WNOHANG);
+    if (r == 0 || (r < 0 && errno == EINTR)) {
+      return mrb_nil_value();
+    }
+    pr->exited = 1;
+    pr->status = r < 0 ? -1 : status;
+  }
+  row[0] = pr->status >= 0 && WIFEXITED(pr->status) ? mrb_fixnum_value(WEXITSTATUS(pr->status)) : mrb_nil_value();
+  row[1] = pr->status >= 0 && WIFSIGNALED(pr->status) ? mrb_fixnum_value(WTERMSIG(pr->status)) : mrb_nil_value();
+  return mrb_ary_new_from_values(mrb, 2, row);
+}
+
+// HexChat::Internal::Process#kill(Integer)
+// Signals the child, false if it already exited
+static mrb_value
+hex_mrb_xp_kill(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_process *pr = hex_mrb_process_get(mrb, self);
+  mrb_int sig;
+  mrb_get_args(mrb, "i", &sig);
+  if (pr->exited) {
+    return mrb_false_value();
+  }
+  return mrb_bool_value(kill(pr->pid, (int)sig) == 0);
+}
+
+// HexChat::Internal::Process#close
+// Closes the pipes, the child gets SIGPIPE if it writes again
+static mrb_value
+hex_mrb_xp_close(mrb_state *mrb, mrb_value self)
+{
+  hex_mrb_process_close(hex_mrb_process_get(mrb, self));
+  return mrb_nil_value();
+}
+
+// HexChat::Internal::Process#fds
+// [stdout fd, stderr fd], -1 for a closed or merged pipe
+static mrb_value
+hex_mrb_xp_fds(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_process *pr = hex_mrb_process_get(mrb, self);
+  mrb_value row[2];
+  row[0] = mrb_fixnum_value(pr->fd[0]);
+  row[1] = mrb_fixnum_value(pr->fd[1]);
+  return mrb_ary_new_from_values(mrb, 2, row);
+}
+
+// HexChat::Internal::Process#pid
+static mrb_value
+hex_mrb_xp_pid(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value((mrb_int)hex_mrb_process_get(mrb, self)->pid);
+}
+
+// Forget orphaned children, those not dead yet stay zombies until HexChat exits
+static void
+hex_mrb_orphans_free(void)
+{
+  if (hex_orphan_timer != NULL) {
+    hexchat_unhook(ph, hex_orphan_timer);
+    hex_orphan_timer = NULL;
+  }
+  while (hex_orphans != NULL) {
+    struct hex_mrb_orphan *o = hex_orphans;
+    hex_orphans = o->next;
+    waitpid(o->pid, NULL, WNOHANG);
+    free(o);
+  }
+}
+#else
+static void
+hex_mrb_process_free(mrb_state *mrb, void *p)
+{
+}
+
+// HexChat::Internal::Process#initialize
+static mrb_value
+hex_mrb_xp_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_raise(mrb, E_NOTIMP_ERROR, "HexChat::Process is not available on Windows");
+  return self;
+}
+
+static void
+hex_mrb_orphans_free(void)
+{
+}
+#endif
+
+// Append bytes to a buffer, the buffer stays NUL terminated
+// On allocation failure the text is dropped
+static void
+hex_mrb_strbuf_append(struct hex_mrb_strbuf *b, const char *p, size_t len)
+{
+  if (b->len + len + 1 > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    char *np;
+    while (b->len + len + 1 > cap) {
+      cap *= 2;
+    }
+    np = (char *)realloc(b->p, cap);
+    if (np == NULL) {
+      return;
+    }
+    b->p = np;
+    b->cap = cap;
+  }
+  memcpy(b->p + b->len, p, len);
+  b->len += len;
+  b->p[b->len] = '\0';
+}
+
+// Append formatted text to a buffer
+static void
+hex_mrb_strbuf_printf(struct hex_mrb_strbuf *b, const char *fmt, ...)
+{
+  char tmp[512];
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  if (n > 0) {
+    hex_mrb_strbuf_append(b, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+  }
+}
+
+// Append a Prometheus label value, escaping \, " and newlines
+static void
+hex_mrb_strbuf_label(struct hex_mrb_strbuf *b, const char *s)
+{
+  for (; *s; s++) {
+    if (*s == '\\' || *s == '"') {
+      hex_mrb_strbuf_append(b, "\\", 1);
+      hex_mrb_strbuf_append(b, s, 1);
+    } else if (*s == '\n') {
+      hex_mrb_strbuf_append(b, "\\n", 2);
+    } else {
+      hex_mrb_strbuf_append(b, s, 1);
+    }
+  }
+}
+
+// Heap slot counts, filled in by walking the object space
+struct hex_mrb_heap_count {
+  uint64_t slots;
+  uint64_t free;
+};
+
+static void
+hex_mrb_heap_count_cb(mrb_state *mrb, struct RBasic *obj, void *data)
+{
+  struct hex_mrb_heap_count *hc = (struct hex_mrb_heap_count *)data;
+  hc->slots++;
+  if (obj->tt == MRB_TT_FREE) {
+    hc->free++;
+  }
+}
+
+// Counters of the hooks belonging to one plugin class
+struct hex_mrb_plugin_count {
+  const char *plugin;
+  uint64_t hooks;
+  uint64_t fired;
+  uint64_t exceptions;
+  uint64_t ns;
+};
+
+// Write all metrics in the Prometheus text format
+static void
+hex_mrb_metrics_render(mrb_state *mrb, struct hex_mrb_strbuf *b)
+{
+  struct hex_mrb_heap_count hc = { 0, 0 };
+  struct hex_mrb_plugin_count *pc;
+  size_t hooks = 0, plugins = 0;
+  uint64_t hook_exceptions = 0;
+  int k, i;
+
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_hooks Hooks currently hooked.\n# TYPE hexchat_mrb_hooks gauge\n");
+  for (k = 1; k < HEX_MRB_HOOK_KINDS; k++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_hooks{type=\"%s\"} %llu\n", hex_hook_types[k],
+                          (unsigned long long)hex_hook_stats[k].active);
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_hooks_registered_total Hooks hooked since the plugin loaded.\n"
+                        "# TYPE hexchat_mrb_hooks_registered_total counter\n");
+  for (k = 1; k < HEX_MRB_HOOK_KINDS; k++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_hooks_registered_total{type=\"%s\"} %llu\n", hex_hook_types[k],
+                          (unsigned long long)hex_hook_stats[k].registered);
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_hook_calls_total Hook callbacks run.\n"
+                        "# TYPE hexchat_mrb_hook_calls_total counter\n");
+  for (k = 1; k < HEX_MRB_HOOK_KINDS; k++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_hook_calls_total{type=\"%s\"} %llu\n", hex_hook_types[k],
+                          (unsigned long long)hex_hook_stats[k].fired);
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_hook_overruns_total Hook callbacks that ran over their budget.\n"
+                        "# TYPE hexchat_mrb_hook_overruns_total counter\n");
+  for (k = 1; k < HEX_MRB_HOOK_KINDS; k++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_hook_overruns_total{type=\"%s\"} %llu\n", hex_hook_types[k],
+                          (unsigned long long)hex_hook_stats[k].overruns);
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_hook_duration_seconds Time spent in hook callbacks.\n"
+                        "# TYPE hexchat_mrb_hook_duration_seconds histogram\n");
+  for (k = 1; k < HEX_MRB_HOOK_KINDS; k++) {
+    struct hex_mrb_hook_stats *st = &hex_hook_stats[k];
+    uint64_t cum = 0;
+    for (i = 0; i < HEX_MRB_METRIC_BUCKETS; i++) {
+      cum += st->buckets[i];
+      hex_mrb_strbuf_printf(b, "hexchat_mrb_hook_duration_seconds_bucket{type=\"%s\",le=\"%g\"} %llu\n",
+                            hex_hook_types[k], (double)hex_metric_bounds[i] / 1e9, (unsigned long long)cum);
+    }
+    cum += st->buckets[HEX_MRB_METRIC_BUCKETS];
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_hook_duration_seconds_bucket{type=\"%s\",le=\"+Inf\"} %llu\n"
+                          "hexchat_mrb_hook_duration_seconds_sum{type=\"%s\"} %.9f\n"
+                          "hexchat_mrb_hook_duration_seconds_count{type=\"%s\"} %llu\n",
+                          hex_hook_types[k], (unsigned long long)cum, hex_hook_types[k], (double)st->ns / 1e9,
+                          hex_hook_types[k], (unsigned long long)st->fired);
+    hook_exceptions += st->exceptions;
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_exceptions_total Exceptions raised by hooks, script loads and /mrb eval.\n"
+                        "# TYPE hexchat_mrb_exceptions_total counter\n"
+                        "hexchat_mrb_exceptions_total{source=\"hook\"} %llu\n"
+                        "hexchat_mrb_exceptions_total{source=\"load\"} %llu\n"
+                        "hexchat_mrb_exceptions_total{source=\"eval\"} %llu\n",
+                        (unsigned long long)hook_exceptions, (unsigned long long)hex_metric_load_errors,
+                        (unsigned long long)hex_metric_eval_errors);
+
+  mrb_objspace_each_objects(mrb, hex_mrb_heap_count_cb, &hc);
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_gc_runs_total Full collections started with GC.start.\n"
+                        "# TYPE hexchat_mrb_gc_runs_total counter\n"
+                        "hexchat_mrb_gc_runs_total %llu\n"
+                        "# HELP hexchat_mrb_gc_seconds_total Time spent in GC.start.\n"
+                        "# TYPE hexchat_mrb_gc_seconds_total counter\n"
+                        "hexchat_mrb_gc_seconds_total %.9f\n"
+                        "# HELP hexchat_mrb_heap_slots Object slots in the mruby heap.\n"
+                        "# TYPE hexchat_mrb_heap_slots gauge\n"
+                        "hexchat_mrb_heap_slots %llu\n"
+                        "# HELP hexchat_mrb_objects Heap slots in use, including garbage not yet swept.\n"
+                        "# TYPE hexchat_mrb_objects gauge\n"
+                        "hexchat_mrb_objects %llu\n",
+                        (unsigned long long)hex_metric_gc_runs, (double)hex_metric_gc_ns / 1e9,
+                        (unsigned long long)hc.slots, (unsigned long long)(hc.slots - hc.free));
+
+  // Group live hooks by plugin class
+  for (struct mrb_hexchat_hook *hk = hex_hooks; hk != NULL; hk = hk->next) {
+    hooks++;
+  }
+  pc = (struct hex_mrb_plugin_count *)calloc(hooks ? hooks : 1, sizeof(struct hex_mrb_plugin_count));
+  if (pc == NULL) {
+    return;
+  }
+  for (struct mrb_hexchat_hook *hk = hex_hooks; hk != NULL; hk = hk->next) {
+    const char *plugin = hex_mrb_hook_plugin(hk);
+    size_t j = 0;
+    while (j < plugins && strcmp(pc[j].plugin, plugin) != 0) {
+      j++;
+    }
+    if (j == plugins) {
+      pc[plugins++].plugin = plugin;
+    }
+    if (hk->xhook != NULL) {
+      pc[j].hooks++;
+    }
+    pc[j].fired += hk->fired;
+    pc[j].exceptions += hk->exceptions;
+    pc[j].ns += hk->ns;
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_plugin_heap_bytes Heap bytes allocated for each plugin class, \"\" is outside plugins.\n"
+                        "# TYPE hexchat_mrb_plugin_heap_bytes gauge\n");
+  for (uint32_t j = 0; j < hex_mem_owner_count; j++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_plugin_heap_bytes{plugin=\"");
+    hex_mrb_strbuf_label(b, j ? hex_mem_owners[j].name : "");
+    hex_mrb_strbuf_printf(b, "\"} %llu\n", (unsigned long long)hex_mem_owners[j].live);
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_plugin_hooks Hooks currently hooked by each plugin class.\n"
+                        "# TYPE hexchat_mrb_plugin_hooks gauge\n");
+  for (size_t j = 0; j < plugins; j++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_plugin_hooks{plugin=\"");
+    hex_mrb_strbuf_label(b, pc[j].plugin);
+    hex_mrb_strbuf_printf(b, "\"} %llu\n", (unsigned long long)pc[j].hooks);
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_plugin_hook_calls_total Callbacks run by the plugin's current hooks.\n"
+                        "# TYPE hexchat_mrb_plugin_hook_calls_total counter\n");
+  for (size_t j = 0; j < plugins; j++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_plugin_hook_calls_total{plugin=\"");
+    hex_mrb_strbuf_label(b, pc[j].plugin);
+    hex_mrb_strbuf_printf(b, "\"} %llu\n", (unsigned long long)pc[j].fired);
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_plugin_hook_exceptions_total Exceptions raised by the plugin's current hooks.\n"
+                        "# TYPE hexchat_mrb_plugin_hook_exceptions_total counter\n");
+  for (size_t j = 0; j < plugins; j++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_plugin_hook_exceptions_total{plugin=\"");
+    hex_mrb_strbuf_label(b, pc[j].plugin);
+    hex_mrb_strbuf_printf(b, "\"} %llu\n", (unsigned long long)pc[j].exceptions);
+  }
+  hex_mrb_strbuf_printf(b, "# HELP hexchat_mrb_plugin_hook_seconds_total Time spent in the plugin's current hooks.\n"
+                        "# TYPE hexchat_mrb_plugin_hook_seconds_total counter\n");
+  for (size_t j = 0; j < plugins; j++) {
+    hex_mrb_strbuf_printf(b, "hexchat_mrb_plugin_hook_seconds_total{plugin=\"");
+    hex_mrb_strbuf_label(b, pc[j].plugin);
+    hex_mrb_strbuf_printf(b, "\"} %.9f\n", (double)pc[j].ns / 1e9);
+  }
+  free(pc);
+}
+
+#ifndef WIN32
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Close a metrics connection and forget it
+// The hook is left alone when HexChat is about to remove it
+static void
+hex_mrb_metrics_drop(struct hex_mrb_metrics_client *cl, int unhook)
+{
+  struct hex_mrb_metrics_client **pp = &hex_metrics_clients;
+  while (*pp != NULL && *pp != cl) {
+    pp = &(*pp)->next;
+  }
+  if (*pp != NULL) {
+    *pp = cl->next;
+  }
+  if (unhook && cl->hook != NULL) {
+    hexchat_unhook(ph, cl->hook);
+  }
+  close(cl->fd);
+  free(cl->out);
+  free(cl);
+}
+
+// Write what the socket takes of the response
+// Returns 1 while there is more to write, 0 once done or failed
+static int
+hex_mrb_metrics_send(struct hex_mrb_metrics_client *cl)
+{
+  while (cl->out_off < cl->out_len) {
+    ssize_t n = send(cl->fd, cl->out + cl->out_off, cl->out_len - cl->out_off, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    cl->out_off += (size_t)n;
+  }
+  return 0;
+}
+
+// Metrics connection writable
+static int
+hex_mrb_metrics_write_cb(int fd, int flags, struct hex_mrb_metrics_client *cl)
+{
+  if (hex_mrb_metrics_send(cl)) {
+    return 1;
+  }
+  hex_mrb_metrics_drop(cl, 0);
+  return 0;
+}
+
+// An HTTP request ends with an empty line, anything else with a newline
+static int
+hex_mrb_metrics_request_done(struct hex_mrb_metrics_client *cl)
+{
+  if (cl->req_len >= 4 && strncmp(cl->req, "GET ", 4) == 0) {
+    return strstr(cl->req, "\r\n\r\n") != NULL || strstr(cl->req, "\n\n") != NULL;
+  }
+  return memchr(cl->req, '\n', cl->req_len) != NULL;
+}
+
+// Metrics connection readable, answer once the request is in
+// HTTP requests get an HTTP response, anything else just the metrics
+static int
+hex_mrb_metrics_read_cb(int fd, int flags, struct hex_mrb_metrics_client *cl)
+{
+  struct hex_mrb_strbuf body = { NULL, 0, 0 };
+  struct hex_mrb_strbuf out = { NULL, 0, 0 };
+  ssize_t n = recv(fd, cl->req + cl->req_len, sizeof(cl->req) - 1 - cl->req_len, 0);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 1;
+    }
+    hex_mrb_metrics_drop(cl, 0);
+    return 0;
+  }
+  cl->req_len += (size_t)n;
+  cl->req[cl->req_len] = '\0';
+  if (n > 0 && cl->req_len < sizeof(cl->req) - 1 && !hex_mrb_metrics_request_done(cl)) {
+    return 1;
+  }
+  hex_mrb_metrics_render(cl->mrb, &body);
+  if (strncmp(cl->req, "GET ", 4) == 0) {
+    hex_mrb_strbuf_printf(&out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)body.len);
+    hex_mrb_strbuf_append(&out, body.p ? body.p : "", body.len);
+    free(body.p);
+  } else {
+    out = body;
+  }
+  hex_metrics_scrapes++;
+  cl->out = out.p;
+  cl->out_len = out.len;
+  // The read hook goes away when we return 0
+  if (hex_mrb_metrics_send(cl)) {
+    cl->hook = hexchat_hook_fd(ph, fd, HEXCHAT_FD_WRITE, (void *)hex_mrb_metrics_write_cb, (void *)cl);
+  } else {
+    hex_mrb_metrics_drop(cl, 0);
+  }
+  return 0;
+}
+
+// Metrics socket readable, accept whatever connections are waiting
+static int
+hex_mrb_metrics_accept_cb(int fd, int flags, mrb_state *mrb)
+{
+  for (;;) {
+    struct hex_mrb_metrics_client *cl;
+    struct hex_mrb_metrics_client *last = NULL;
+    int count = 0;
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+    fcntl(cfd, F_SETFD, FD_CLOEXEC);
+    for (cl = hex_metrics_clients; cl != NULL; cl = cl->next) {
+      last = cl;
+      count++;
+    }
+    if (count >= HEX_MRB_METRICS_CLIENTS) {
+      hex_mrb_metrics_drop(last, 1);
+    }
+    cl = (struct hex_mrb_metrics_client *)calloc(1, sizeof(struct hex_mrb_metrics_client));
+    if (cl == NULL) {
+      close(cfd);
+      continue;
+    }
+    cl->mrb = mrb;
+    cl->fd = cfd;
+    cl->next = hex_metrics_clients;
+    hex_metrics_clients = cl;
+    cl->hook = hexchat_hook_fd(ph, cfd, HEXCHAT_FD_READ, (void *)hex_mrb_metrics_read_cb, (void *)cl);
+  }
+  return 1;
+}
+#endif
+
+// Stop listening for metrics and close all connections
+// Returns 1 if the socket was open
+static int
+hex_mrb_metrics_close(void)
+{
+#ifndef WIN32
+  if (hex_metrics_fd < 0) {
+    return 0;
+  }
+  while (hex_metrics_clients != NULL) {
+    hex_mrb_metrics_drop(hex_metrics_clients, 1);
+  }
+  hexchat_unhook(ph, hex_metrics_hook);
+  hex_metrics_hook = NULL;
+  close(hex_metrics_fd);
+  hex_metrics_fd = -1;
+  unlink(hex_metrics_path);
+  free(hex_metrics_path);
+  hex_metrics_path = NULL;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+// HexChat::Internal.metrics_listen(String)
+// Serves the metrics on a Unix domain socket at the path, only readable by us.
+// Missing directories are created, and the socket is bound under a umask
+// that keeps anyone else from connecting before it is chmod'ed.
+static mrb_value
+hex_mrb_xi_metrics_listen(mrb_state *mrb, mrb_value self)
+{
+#ifdef WIN32
+  mrb_raise(mrb, E_NOTIMP_ERROR, "the metrics socket needs Unix domain sockets, not available on Windows");
+  return mrb_nil_value();
+#else
+  char *path;
+  struct sockaddr_un sa;
+  struct stat st;
+  mode_t old_mask;
+  int fd;
+  int err = 0;
+  mrb_get_args(mrb, "z", &path);
+  if (strlen(path) >= sizeof(sa.sun_path)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "socket path too long");
+  }
+  hex_mrb_metrics_close();
+  // A socket left behind by an earlier run
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+  hex_mrb_mkdirs(sa.sun_path);
+  old_mask = umask(0077);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    err = errno;
+  }
+  umask(old_mask);
+  if (err == 0 && (chmod(path, 0600) < 0 || listen(fd, HEX_MRB_METRICS_CLIENTS) < 0)) {
+    err = errno;
+    unlink(path);
+  }
+  if (err != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "unable to listen on %S: %S",
+               mrb_str_new_cstr(mrb, path), mrb_str_new_cstr(mrb, strerror(err)));
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  hex_metrics_fd = fd;
+  hex_metrics_path = strdup(path);
+  hex_metrics_hook = hexchat_hook_fd(ph, fd, HEXCHAT_FD_READ, (void *)hex_mrb_metrics_accept_cb, (void *)mrb);
+  return mrb_true_value();
+#endif
+}
+
+// HexChat::Internal.metrics_close
+static mrb_value
+hex_mrb_xi_metrics_close(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(hex_mrb_metrics_close());
+}
+
+// HexChat::Internal.startup_stats
+// [[[phase, ms], ...], [[file, ms, ok], ...], autoload_pending]
+static mrb_value
+hex_mrb_xi_startup_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_value phases = mrb_ary_new_capa(mrb, hex_startup_count);
+  mrb_value scripts = mrb_ary_new_capa(mrb, hex_startup_script_count);
+  mrb_value result = mrb_ary_new_capa(mrb, 3);
+  for (int i = 0; i < hex_startup_count; i++) {
+    mrb_value row[2];
+    row[0] = mrb_str_new_cstr(mrb, hex_startup[i].name);
+    row[1] = mrb_float_value(mrb, hex_startup[i].ns / 1e6);
+    mrb_ary_push(mrb, phases, mrb_ary_new_from_values(mrb, 2, row));
+  }
+  for (uint32_t i = 0; i < hex_startup_script_count; i++) {
+    mrb_value row[3];
+    row[0] = mrb_str_new_cstr(mrb, hex_startup_scripts[i].file);
+    row[1] = mrb_float_value(mrb, hex_startup_scripts[i].ns / 1e6);
+    row[2] = mrb_bool_value(hex_startup_scripts[i].ok);
+    mrb_ary_push(mrb, scripts, mrb_ary_new_from_values(mrb, 3, row));
+  }
+  mrb_ary_push(mrb, result, phases);
+  mrb_ary_push(mrb, result, scripts);
+  mrb_ary_push(mrb, result, mrb_bool_value(hex_autoload_timer != NULL));
+  return result;
+}
+
+// Forget pending script changes
+static void
+hex_mrb_scripts_changed_free(void)
+{
+  while (hex_scripts_changed != NULL) {
+    struct hex_mrb_changed *ch = hex_scripts_changed;
+    hex_scripts_changed = ch->next;
+    free(ch->name);
+    free(ch);
+  }
+}
+
+// Stop watching the script directory
+// Returns 1 if it was watched
+static int
+hex_mrb_scripts_unwatch(void)
+{
+  if (hex_scripts_timer != NULL) {
+    hexchat_unhook(ph, hex_scripts_timer);
+    hex_scripts_timer = NULL;
+  }
+  hex_mrb_scripts_changed_free();
+#ifdef __linux__
+  if (hex_scripts_fd < 0) {
+    return 0;
+  }
+  hexchat_unhook(ph, hex_scripts_hook);
+  hex_scripts_hook = NULL;
+  close(hex_scripts_fd);
+  hex_scripts_fd = -1;
+  free(hex_scripts_dir);
+  hex_scripts_dir = NULL;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+#ifdef __linux__
+// Timer callback - changes have settled, hand each script to Ruby
+static int
+hex_mrb_scripts_timer_cb(void *userdata)
+{
+  mrb_state *mrb = (mrb_state *)userdata;
+  struct RClass *plugin = mrb_class_get_under(mrb, hexchat_module, "Plugin");
+  struct RClass *registry = mrb_class_get_under(mrb, plugin, "Registry");
+  struct hex_mrb_changed *list = hex_scripts_changed;
+  hex_scripts_changed = NULL;
+  hex_scripts_timer = NULL;
+  while (list != NULL) {
+    struct hex_mrb_changed *ch = list;
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_value path = mrb_str_new_cstr(mrb, hex_scripts_dir);
+    list = ch->next;
+    mrb_str_cat_lit(mrb, path, "/");
+    mrb_str_cat_cstr(mrb, path, ch->name);
+    mrb_funcall(mrb, mrb_obj_value(registry), "changed", 1, path);
+    if (mrb->exc) {
+      hexchat_printf(ph, "error reloading %s", ch->name);
+      hex_mrb_print_exc(mrb);
+      mrb->exc = 0;
+    }
+    mrb_gc_arena_restore(mrb, ai);
+    free(ch->name);
+    free(ch);
+    // A reload may have stopped the watch
+    if (hex_scripts_fd < 0) {
+      hex_scripts_changed = list;
+      hex_mrb_scripts_changed_free();
+      break;
+    }
+  }
+  return 0;
+}
+
+// Note a changed script, ignoring editor backups and swap files
+static void
+hex_mrb_scripts_note(const char *name)
+{
+  size_t len = strlen(name);
+  struct hex_mrb_changed *ch;
+  if (!((len > 3 && strcmp(name + len - 3, ".rb") == 0) || (len > 4 && strcmp(name + len - 4, ".mrb") == 0))) {
+    return;
+  }
+  for (ch = hex_scripts_changed; ch != NULL; ch = ch->next) {
+    if (strcmp(ch->name, name) == 0) {
+      return;
+    }
+  }
+  ch = malloc(sizeof(*ch));
+  if (ch == NULL || (ch->name = strdup(name)) == NULL) {
+    free(ch);
+    return;
+  }
+  ch->next = hex_scripts_changed;
+  hex_scripts_changed = ch;
+}
+
+// FD callback - drain change events and restart the settle timer
+static int
+hex_mrb_scripts_read_cb(int fd, int flags, void *userdata)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int noted = 0;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n; ) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->len > 0) {
+        hex_mrb_scripts_note(ev->name);
+        noted = 1;
+      }
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  if (noted && hex_scripts_changed != NULL) {
+    // Editors write in several steps, wait until they stop
+    if (hex_scripts_timer != NULL) {
+      hexchat_unhook(ph, hex_scripts_timer);
+    }
+    hex_scripts_timer = hexchat_hook_timer(ph, hex_scripts_delay, hex_mrb_scripts_timer_cb, userdata);
+  }
+  return 1;
+}
+#endif
+
+// HexChat::Internal.scripts_watch(String, Integer)
+// Reports scripts written in the directory to Registry.changed, once no
+// change was seen for the given ms.  Returns false if inotify is missing.
+static mrb_value
+hex_mrb_xi_scripts_watch(mrb_state *mrb, mrb_value self)
+{
+  char *dir;
+  mrb_int delay;
+  mrb_get_args(mrb, "zi", &dir, &delay);
+  hex_mrb_scripts_unwatch();
+#ifdef __linux__
+  hex_scripts_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (hex_scripts_fd < 0) {
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "inotify: %S", mrb_str_new_cstr(mrb, strerror(errno)));
+  }
+  // Written in place, or written elsewhere and renamed in
+  if (inotify_add_watch(hex_scripts_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    int err = errno;
+    close(hex_scripts_fd);
+    hex_scripts_fd = -1;
+    mrb_raisef(mrb, E_RUNTIME_ERROR, "unable to watch %S: %S",
+               mrb_str_new_cstr(mrb, dir), mrb_str_new_cstr(mrb, strerror(err)));
+  }
+  hex_scripts_dir = strdup(dir);
+  hex_scripts_delay = delay > 0 ? (int)delay : HEX_MRB_SCRIPT_DELAY;
+  hex_scripts_hook = hexchat_hook_fd(ph, hex_scripts_fd, HEXCHAT_FD_READ, (void *)hex_mrb_scripts_read_cb, (void *)mrb);
+  return mrb_true_value();
+#else
+  return mrb_false_value();
+#endif
+}
+
+// HexChat::Internal.scripts_unwatch
+static mrb_value
+hex_mrb_xi_scripts_unwatch(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(hex_mrb_scripts_unwatch());
+}
+
+// HexChat::Internal.scripts_watched
+// The watched directory, or nil
+static mrb_value
+hex_mrb_xi_scripts_watched(mrb_state *mrb, mrb_value self)
+{
+  return hex_scripts_dir ? mrb_str_new_cstr(mrb, hex_scripts_dir) : mrb_nil_value();
+}
+
+// Plugin state encoding, see hex_mrb_state_put
+#define HEX_MRB_STATE_MAGIC "HXS1"
+#define HEX_MRB_STATE_DEPTH 64   /* deepest nesting, also stops cycles */
+
+// Append an unsigned LEB128 number
+static void
+hex_mrb_state_uint(mrb_state *mrb, mrb_value buf, uint64_t v)
+{
+  char b[10];
+  int n = 0;
+  do {
+    b[n] = (char)(v & 0x7f);
+    v >>= 7;
+    if (v) {
+      b[n] |= (char)0x80;
+    }
+    n++;
+  } while (v);
+  mrb_str_cat(mrb, buf, b, n);
+}
+
+// Append a length prefixed byte string
+static void
+hex_mrb_state_bytes(mrb_state *mrb, mrb_value buf, const char *p, size_t len)
+{
+  hex_mrb_state_uint(mrb, buf, len);
+  mrb_str_cat(mrb, buf, p, len);
+}
+
+// Append one value: a tag byte, then its payload
+// nil 0, true T, false F, Integer i (zigzag), Float f (8 bytes, host
+// order), String s, Symbol :, Array [, Hash {, Struct S (class path and
+// member values).  Anything else raises TypeError.
+static void
+hex_mrb_state_put(mrb_state *mrb, mrb_value buf, mrb_value v, int depth)
+{
+  if (depth > HEX_MRB_STATE_DEPTH) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "state nested too deep or recursive");
+  }
+  switch (mrb_type(v)) {
+  case MRB_TT_FALSE:
+    mrb_str_cat(mrb, buf, mrb_nil_p(v) ? "0" : "F", 1);
+    break;
+  case MRB_TT_TRUE:
+    mrb_str_cat(mrb, buf, "T", 1);
+    break;
+  case MRB_TT_FIXNUM: {
+    int64_t i = (int64_t)mrb_fixnum(v);
+    mrb_str_cat(mrb, buf, "i", 1);
+    hex_mrb_state_uint(mrb, buf, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+    break;
+  }
+  case MRB_TT_FLOAT: {
+    double f = (double)mrb_float(v);
+    mrb_str_cat(mrb, buf, "f", 1);
+    mrb_str_cat(mrb, buf, (const char *)&f, sizeof(f));
+    break;
+  }
+  case MRB_TT_STRING:
+    mrb_str_cat(mrb, buf, "s", 1);
+    hex_mrb_state_bytes(mrb, buf, RSTRING_PTR(v), RSTRING_LEN(v));
+    break;
+  case MRB_TT_SYMBOL: {
+    mrb_int len;
+    const char *name = mrb_sym2name_len(mrb, mrb_symbol(v), &len);
+    mrb_str_cat(mrb, buf, ":", 1);
+    hex_mrb_state_bytes(mrb, buf, name, len);
+    break;
+  }
+  case MRB_TT_ARRAY:
+    mrb_str_cat(mrb, buf, "[", 1);
+    hex_mrb_state_uint(mrb, buf, RARRAY_LEN(v));
+    for (mrb_int i = 0; i < RARRAY_LEN(v); i++) {
+      hex_mrb_state_put(mrb, buf, mrb_ary_ref(mrb, v, i), depth + 1);
+    }
+    break;
+  case MRB_TT_HASH: {
+    mrb_value keys = mrb_hash_keys(mrb, v);
+    mrb_str_cat(mrb, buf, "{", 1);
+    hex_mrb_state_uint(mrb, buf, RARRAY_LEN(keys));
+    for (mrb_int i = 0; i < RARRAY_LEN(keys); i++) {
+      mrb_value k = mrb_ary_ref(mrb, keys, i);
+      hex_mrb_state_put(mrb, buf, k, depth + 1);
+      hex_mrb_state_put(mrb, buf, mrb_hash_get(mrb, v, k), depth + 1);
+    }
+    break;
+  }
+  default:
+    if (mrb_class_defined(mrb, "Struct") && mrb_obj_is_kind_of(mrb, v, mrb_class_get(mrb, "Struct"))) {
+      const char *path = mrb_class_name(mrb, mrb_obj_class(mrb, v));
+      mrb_value members = mrb_funcall(mrb, v, "to_a", 0);
+      // Anonymous Struct classes cannot be found again when loading
+      if (path == NULL || path[0] < 'A' || path[0] > 'Z') {
+        mrb_raise(mrb, E_TYPE_ERROR, "cannot save a Struct without a class name");
+      }
+      mrb_str_cat(mrb, buf, "S", 1);
+      hex_mrb_state_bytes(mrb, buf, path, strlen(path));
+      hex_mrb_state_uint(mrb, buf, RARRAY_LEN(members));
+      for (mrb_int i = 0; i < RARRAY_LEN(members); i++) {
+        hex_mrb_state_put(mrb, buf, mrb_ary_ref(mrb, members, i), depth + 1);
+      }
+      break;
+    }
+    mrb_raisef(mrb, E_TYPE_ERROR, "cannot save %S in plugin state", mrb_obj_value(mrb_obj_class(mrb, v)));
+  }
+}
+
+// Reader over an encoded state
+struct hex_mrb_state_in {
+  const unsigned char *p;
+  const unsigned char *end;
+};
+
+// Read an unsigned LEB128 number
+static uint64_t
+hex_mrb_state_get_uint(mrb_state *mrb, struct hex_mrb_state_in *in)
+{
+  uint64_t v = 0;
+  int shift = 0;
+  while (in->p < in->end && shift < 64) {
+    unsigned char b = *in->p++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return v;
+    }
+    shift += 7;
+  }
+  mrb_raise(mrb, E_ARGUMENT_ERROR, "truncated plugin state");
+  return 0;
+}
+
+// Read a length prefix and check that many bytes follow
+static size_t
+hex_mrb_state_get_len(mrb_state *mrb, struct hex_mrb_state_in *in)
+{
+  uint64_t len = hex_mrb_state_get_uint(mrb, in);
+  if (len > (uint64_t)(in->end - in->p)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "truncated plugin state");
+  }
+  return (size_t)len;
+}
+
+// Look up a class by its path, e.g. "Foo::Point"
+static mrb_value
+hex_mrb_state_class(mrb_state *mrb, const char *path, size_t len)
+{
+  mrb_value mod = mrb_obj_value(mrb->object_class);
+  size_t start = 0;
+  for (size_t i = 0; i <= len; i++) {
+    if (i == len || (path[i] == ':' && i + 1 < len && path[i + 1] == ':')) {
+      mod = mrb_const_get(mrb, mod, mrb_intern(mrb, path + start, i - start));
+      start = i + 2;
+      i++;
+    }
+  }
+  return mod;
+}
+
+// Read one value written by hex_mrb_state_put
+static mrb_value
+hex_mrb_state_get(mrb_state *mrb, struct hex_mrb_state_in *in, int depth)
+{
+  char tag;
+  size_t len;
+  mrb_value v;
+  if (depth > HEX_MRB_STATE_DEPTH || in->p >= in->end) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "truncated plugin state");
+  }
+  tag = (char)*in->p++;
+  switch (tag) {
+  case '0':
+    return mrb_nil_value();
+  case 'T':
+    return mrb_true_value();
+  case 'F':
+    return mrb_false_value();
+  case 'i': {
+    uint64_t z = hex_mrb_state_get_uint(mrb, in);
+    return mrb_fixnum_value((mrb_int)(int64_t)((z >> 1) ^ (~(z & 1) + 1)));
+  }
+  case 'f': {
+    double f;
+    if ((size_t)(in->end - in->p) < sizeof(f)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "truncated plugin state");
+    }
+    memcpy(&f, in->p, sizeof(f));
+    in->p += sizeof(f);
+    return mrb_float_value(mrb, (mrb_float)f);
+  }
+  case 's':
+    len = hex_mrb_state_get_len(mrb, in);
+    v = mrb_str_new(mrb, (const char *)in->p, len);
+    in->p += len;
+    return v;
+  case ':':
+    len = hex_mrb_state_get_len(mrb, in);
+    v = mrb_symbol_value(mrb_intern(mrb, (const char *)in->p, len));
+    in->p += len;
+    return v;
+  case '[':
+    len = hex_mrb_state_get_len(mrb, in);
+    v = mrb_ary_new_capa(mrb, (mrb_int)len);
+    for (size_t i = 0; i < len; i++) {
+      int ai = mrb_gc_arena_save(mrb);
+      mrb_ary_push(mrb, v, hex_mrb_state_get(mrb, in, depth + 1));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+    return v;
+  case '{':
+    len = hex_mrb_state_get_len(mrb, in);
+    v = mrb_hash_new(mrb);
+    for (size_t i = 0; i < len; i++) {
+      int ai = mrb_gc_arena_save(mrb);
+      mrb_value k = hex_mrb_state_get(mrb, in, depth + 1);
+      mrb_hash_set(mrb, v, k, hex_mrb_state_get(mrb, in, depth + 1));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+    return v;
+  case 'S': {
+    mrb_value klass, members;
+    len = hex_mrb_state_get_len(mrb, in);
+    klass = hex_mrb_state_class(mrb, (const char *)in->p, len);
+    in->p += len;
+    len = hex_mrb_state_get_len(mrb, in);
+    members = mrb_ary_new_capa(mrb, (mrb_int)len);
+    for (size_t i = 0; i < len; i++) {
+      mrb_ary_push(mrb, members, hex_mrb_state_get(mrb, in, depth + 1));
+    }
+    return mrb_funcall_argv(mrb, klass, mrb_intern_lit(mrb, "new"), RARRAY_LEN(members), RARRAY_PTR(members));
+  }
+  default:
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "bad plugin state tag %S", mrb_fixnum_value((unsigned char)tag));
+  }
+  return mrb_nil_value();
+}
+
+// HexChat::Internal.state_dump(Object)
+// Encodes plugin state as a binary String
+static mrb_value
+hex_mrb_xi_state_dump(mrb_state *mrb, mrb_value self)
+{
+  mrb_value v;
+  mrb_value buf;
+  mrb_get_args(mrb, "o", &v);
+  buf = mrb_str_new_lit(mrb, HEX_MRB_STATE_MAGIC);
+  hex_mrb_state_put(mrb, buf, v, 0);
+  return buf;
+}
+
+// HexChat::Internal.state_load(String)
+// Decodes a String from state_dump
+static mrb_value
+hex_mrb_xi_state_load(mrb_state *mrb, mrb_value self)
+{
+  char *p;
+  mrb_int len;
+  struct hex_mrb_state_in in;
+  mrb_value v;
+  mrb_get_args(mrb, "s", &p, &len);
+  if (len < 4 || memcmp(p, HEX_MRB_STATE_MAGIC, 4) != 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "not a plugin state");
+  }
+  in.p = (const unsigned char *)p + 4;
+  in.end = (const unsigned char *)p + len;
+  v = hex_mrb_state_get(mrb, &in, 0);
+  if (in.p != in.end) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "trailing bytes after plugin state");
+  }
+  return v;
+}
+
+// HexChat::Internal.metrics
+// The metrics text a scrape would get
+static mrb_value
+hex_mrb_xi_metrics(mrb_state *mrb, mrb_value self)
+{
+  struct hex_mrb_strbuf b = { NULL, 0, 0 };
+  mrb_value str;
+  hex_mrb_metrics_render(mrb, &b);
+  str = mrb_str_new(mrb, b.p ? b.p : "", b.len);
+  free(b.p);
+  return str;
+}
+
+// Find (or create) the outbound queue for a server id
+static struct hex_mrb_queue*
+hex_mrb_queue_get(int server_id)
+{
+  struct hex_mrb_queue *q;
+  for (q = hex_queues; q != NULL; q = q->next) {
+    if (q->server_id == server_id) {
+      return q;
+    }
+  }
+  q = (struct hex_mrb_queue *)calloc(1, sizeof(struct hex_mrb_queue));
+  q->server_id = server_id;
+  q->tokens = (double)hex_queue_burst;
+  q->refilled = hex_mrb_clock_ns();
+  q->next = hex_queues;
+  hex_queues = q;
+  return q;
+}
+
+static void
+hex_mrb_queue_item_free(struct hex_mrb_queue_item *item)
+{
+  free(item->text);
+  free(item);
+}
+
+// Unlink the head of a lane
+static struct hex_mrb_queue_item*
+hex_mrb_queue_shift(struct hex_mrb_queue *q, int lane)
+{
+  struct hex_mrb_queue_item *item = q->head[lane];
+  if (item != NULL) {
+    q->head[lane] = item->next;
+    if (q->head[lane] == NULL) {
+      q->tail[lane] = NULL;
+    }
+    item->next = NULL;
+  }
+  return item;
+}
+
+// Top up the token bucket from the time elapsed since the last refill
+static void
+hex_mrb_queue_refill(struct hex_mrb_queue *q, uint64_t now)
+{
+  q->tokens += (double)(now - q->refilled) / ((double)hex_queue_interval * 1000000.0);
+  if (q->tokens > (double)hex_queue_burst) {
+    q->tokens = (double)hex_queue_burst;
+  }
+  q->refilled = now;
+}
+
+// Send a run of adjacent, identical mode changes with hexchat_send_modes
+static void
+hex_mrb_queue_send_modes(struct hex_mrb_queue *q, int lane, struct hex_mrb_server *s)
+{
+  const char *targets[HEX_MRB_MODES_BATCH_MAX];
+  struct hex_mrb_queue_item *items[HEX_MRB_MODES_BATCH_MAX];
+  struct hex_mrb_queue_item *first = q->head[lane];
+  int mpl = s->modes_per_line;
+  int max = (int)q->tokens * mpl;
+  int n = 0;
+  if (max > HEX_MRB_MODES_BATCH_MAX) {
+    max = HEX_MRB_MODES_BATCH_MAX;
+  }
+  while (n < max && q->head[lane] != NULL
+         && q->head[lane]->c == first->c
+         && q->head[lane]->sign == first->sign
+         && q->head[lane]->mode == first->mode) {
+    items[n] = hex_mrb_queue_shift(q, lane);
+    targets[n] = items[n]->text;
+    n++;
+  }
+  hexchat_send_modes(ph, targets, n, mpl, first->sign, first->mode);
+  q->tokens -= (double)((n + mpl - 1) / mpl);
+  for (int i = 0; i < n; i++) {
+    hex_mrb_queue_item_free(items[i]);
+  }
+}
+
+// Send whatever the token bucket allows from one queue
+static void
+hex_mrb_queue_drain_one(struct hex_mrb_queue *q, uint64_t now)
+{
+  hex_mrb_queue_refill(q, now);
+  for (int lane = 0; lane < HEX_MRB_QUEUE_LANES; lane++) {
+    while (q->head[lane] != NULL && q->tokens >= 1.0) {
+      if (!hexchat_set_context(ph, q->head[lane]->c)) {
+        // Context went away, drop the item
+        hex_mrb_queue_item_free(hex_mrb_queue_shift(q, lane));
+      } else if (q->head[lane]->sign != 0) {
+        hex_mrb_queue_send_modes(q, lane, hex_mrb_server_current());
+      } else {
+        struct hex_mrb_queue_item *item = hex_mrb_queue_shift(q, lane);
+        hexchat_command(ph, item->text);
+        hex_mrb_queue_item_free(item);
+        q->tokens -= 1.0;
+      }
+    }
+  }
+}
+
+// See if anything is still waiting in any queue
+static int
+hex_mrb_queue_pending_any(void)
+{
+  for (struct hex_mrb_queue *q = hex_queues; q != NULL; q = q->next) {
+    for (int lane = 0; lane < HEX_MRB_QUEUE_LANES; lane++) {
+      if (q->head[lane] != NULL) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Queue timer callback, drains all queues
+// Removes itself once everything has been sent
+static int
+hex_mrb_queue_drain(void *userdata)
+{
+  hexchat_context *c = hexchat_get_context(ph);
+  uint64_t now = hex_mrb_clock_ns();
+  int pending;
+  hex_queue_draining = 1;
+  for (struct hex_mrb_queue *q = hex_queues; q != NULL; q = q->next) {
+    hex_mrb_queue_drain_one(q, now);
+  }
+  hex_queue_draining = 0;
+  hexchat_set_context(ph, c);
+  pending = hex_mrb_queue_pending_any();
+  if (!pending && userdata != NULL) {
+    hex_queue_timer = NULL;
+  }
+  return pending;
+}
+
+// Add an item to the current server's queue and make sure it gets drained
+static mrb_int
+hex_mrb_queue_push(const char *text, char sign, char mode, int lane)
+{
+  struct hex_mrb_queue_item *item;
+  struct hex_mrb_queue *q = hex_mrb_queue_get(hexchat_list_int(ph, NULL, "id"));
+  if (lane < 0 || lane >= HEX_MRB_QUEUE_LANES) {
+    lane = HEX_MRB_QUEUE_NORM;
+  }
+  item = (struct hex_mrb_queue_item *)malloc(sizeof(struct hex_mrb_queue_item));
+  item->id = hex_queue_next_id++;
+  item->c = hexchat_get_context(ph);
+  item->text = strdup(text);
+  item->sign = sign;
+  item->mode = mode;
+  item->next = NULL;
+  if (q->tail[lane] != NULL) {
+    q->tail[lane]->next = item;
+  } else {
+    q->head[lane] = item;
+  }
+  q->tail[lane] = item;
+  // Send right away if the bucket allows, otherwise leave it to the timer
+  if (hex_queue_timer == NULL && !hex_queue_draining && hex_mrb_queue_drain(NULL)) {
+    hex_queue_timer = hexchat_hook_timer(ph, HEX_MRB_QUEUE_TICK, hex_mrb_queue_drain, (void *)&hex_queue_timer);
+  }
+  return item->id;
+}
+
+// Drop queued items, all of them if id is 0
+// Returns the number of items dropped
+static mrb_int
+hex_mrb_queue_remove(mrb_int id)
+{
+  mrb_int count = 0;
+  for (struct hex_mrb_queue *q = hex_queues; q != NULL; q = q->next) {
+    for (int lane = 0; lane < HEX_MRB_QUEUE_LANES; lane++) {
+      struct hex_mrb_queue_item **p = &q->head[lane];
+      q->tail[lane] = NULL;
+      while (*p != NULL) {
+        struct hex_mrb_queue_item *item = *p;
+        if (id == 0 || item->id == id) {
+          *p = item->next;
+          hex_mrb_queue_item_free(item);
+          count++;
+        } else {
+          q->tail[lane] = item;
+          p = &item->next;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+// See if an item is still waiting to be sent
+static int
+hex_mrb_queue_has(mrb_int id)
+{
+  for (struct hex_mrb_queue *q = hex_queues; q != NULL; q = q->next) {
+    for (int lane = 0; lane < HEX_MRB_QUEUE_LANES; lane++) {
+      for (struct hex_mrb_queue_item *item = q->head[lane]; item != NULL; item = item->next) {
+        if (item->id == id) {
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// Free all queues, used at shutdown
+static void
+hex_mrb_queue_free_all(void)
+{
+  hex_mrb_queue_remove(0);
+  if (hex_queue_timer != NULL) {
+    hexchat_unhook(ph, hex_queue_timer);
+    hex_queue_timer = NULL;
+  }
+  while (hex_queues != NULL) {
+    struct hex_mrb_queue *q = hex_queues;
+    hex_queues = q->next;
+    free(q);
+  }
+}
+
+// HexChat::Internal.queue_command(String, Integer)
+static mrb_value
+hex_mrb_xi_queue_command(mrb_state *mrb, mrb_value self)
+{
+  char *cmd;
+  mrb_int lane = HEX_MRB_QUEUE_NORM;
+  mrb_get_args(mrb, "z|i", &cmd, &lane);
+  return mrb_fixnum_value(hex_mrb_queue_push(cmd, 0, 0, (int)lane));
+}
+
+// HexChat::Internal.queue_mode(String, String, Integer)
+// Target, then sign and mode character, e.g. "+o"
+static mrb_value
+hex_mrb_xi_queue_mode(mrb_state *mrb, mrb_value self)
+{
+  char *target;
+  char *mode;
+  mrb_int lane = HEX_MRB_QUEUE_NORM;
+  mrb_get_args(mrb, "zz|i", &target, &mode, &lane);
+  if ((mode[0] != '+' && mode[0] != '-') || mode[1] == 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid mode change: %S", mrb_str_new_cstr(mrb, mode));
+  }
+  return mrb_fixnum_value(hex_mrb_queue_push(target, mode[0], mode[1], (int)lane));
+}
+
+// HexChat::Internal.queue_cancel(Integer)
+static mrb_value
+hex_mrb_xi_queue_cancel(mrb_state *mrb, mrb_value self)
+{
+  mrb_int id;
+  mrb_get_args(mrb, "i", &id);
+  return (id != 0 && hex_mrb_queue_remove(id)) ? mrb_true_value() : mrb_false_value();
+}
+
+// HexChat::Internal.queue_clear
+static mrb_value
+hex_mrb_xi_queue_clear(mrb_state *mrb, mrb_value self)
+{
+  return mrb_fixnum_value(hex_mrb_queue_remove(0));
+}
+
+// HexChat::Internal.queue_pending
+static mrb_value
+hex_mrb_xi_queue_pending(mrb_state *mrb, mrb_value self)
+{
+  mrb_int count = 0;
+  for (struct hex_mrb_queue *q = hex_queues; q != NULL; q = q->next) {
+    for (int lane = 0; lane < HEX_MRB_QUEUE_LANES; lane++) {
+      for (struct hex_mrb_queue_item *item = q->head[lane]; item != NULL; item = item->next) {
+        count++;
+      }
+    }
+  }
+  return mrb_fixnum_value(count);
+}
+
+// HexChat::Internal.queue_configure(Integer, Integer)
+// Burst size in lines, then ms per line
+static mrb_value
+hex_mrb_xi_queue_configure(mrb_state *mrb, mrb_value self)
+{
+  mrb_int burst;
+  mrb_int interval;
+  mrb_get_args(mrb, "ii", &burst, &interval);
+  if (burst < 1 || interval < 1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "burst and interval must be positive");
+  }
+  hex_queue_burst = (int)burst;
+  hex_queue_interval = (int)interval;
+  return mrb_nil_value();
+}
+
+// Hash bucket of a WHOIS cache key
+static unsigned int
+hex_mrb_whois_bucket(int server_id, const char *key)
+{
+  uint32_t h = hex_mrb_hash_bytes(key, (mrb_int)strlen(key)) ^ ((uint32_t)server_id * 2654435761u);
+  return h & (HEX_MRB_WHOIS_BUCKETS - 1);
+}
+
+// Find the cache entry for a folded nick
+static struct hex_mrb_whois*
+hex_mrb_whois_find(int server_id, const char *key)
+{
+  struct hex_mrb_whois *e = hex_whois[hex_mrb_whois_bucket(server_id, key)];
+  while (e != NULL && (e->server_id != server_id || strcmp(e->key, key) != 0)) {
+    e = e->hnext;
+  }
+  return e;
+}
+
+// Find the entry for a nick on the server of the current context
+static struct hex_mrb_whois*
+hex_mrb_whois_lookup(const char *nick, int *server_id, char *buf, size_t size)
+{
+  struct hex_mrb_server *s = hex_mrb_server_current();
+  mrb_int len = (mrb_int)strlen(nick);
+  struct hex_mrb_whois *e;
+  char *key;
+  if ((size_t)len >= size) {
+    len = (mrb_int)size - 1;
+  }
+  key = hex_mrb_mask_fold(s->casemapping, nick, len, buf, size);
+  *server_id = s->id;
+  e = hex_mrb_whois_find(s->id, key);
+  return e;
+}
+
+// Replies the cache is filled from, hooked by hex_mrb_whois_hook
+static const char *hex_whois_events[] = {
+  "301", "311", "312", "313", "317", "318", "319", "330", "401", "671",
+  "352", "354", "NICK", "QUIT", NULL
+};
+
+// RAW LINE hook while quiet queries are out
+// Eats the numerics of their replies that are not hooked for the cache,
+// 307, 320, 338, 378 and so on, from the 311 until the 318.  Those that
+// are hooked pass, so the server hook below still sees them.
+static int
+hex_mrb_whois_raw_cb(char *word[], char *word_eol[], void *userdata)
+{
+  const char *cmd = word[2];
+  char buf[128];
+  int sid;
+  struct hex_mrb_whois *e;
+  for (int i = 0; i < 3; i++) {
+    if (cmd[i] < '0' || cmd[i] > '9') {
+      return HEXCHAT_EAT_NONE;
+    }
+  }
+  if (cmd[3] != 0) {
+    return HEXCHAT_EAT_NONE;
+  }
+  for (int i = 0; hex_whois_events[i] != NULL; i++) {
+    if (strcmp(cmd, hex_whois_events[i]) == 0) {
+      return HEXCHAT_EAT_NONE;
+    }
+  }
+  e = hex_mrb_whois_lookup(word[4], &sid, buf, sizeof(buf));
+  if (e != NULL && e->quiet && e->state == HEX_MRB_WHOIS_PENDING && e->field[HEX_MRB_WHOIS_NICK] != NULL) {
+    return HEXCHAT_EAT_HEXCHAT;
+  }
+  return HEXCHAT_EAT_NONE;
+}
+
+// Mark an entry's query quiet or not, RAW LINE is hooked while any is
+static void
+hex_mrb_whois_quiet(struct hex_mrb_whois *e, int quiet)
+{
+  quiet = quiet != 0;
+  if (e->quiet == quiet) {
+    return;
+  }
+  e->quiet = quiet;
+  if (quiet && hex_whois_quiet++ == 0) {
+    hex_whois_raw = hexchat_hook_server(ph, "RAW LINE", HEXCHAT_PRI_NORM, hex_mrb_whois_raw_cb, NULL);
+  } else if (!quiet && --hex_whois_quiet == 0 && hex_whois_raw != NULL) {
+    hexchat_unhook(ph, hex_whois_raw);
+    hex_whois_raw = NULL;
+  }
+}
+
+// Make an entry the most recently used
+static void
+hex_mrb_whois_touch(struct hex_mrb_whois *e)
+{
+  if (hex_whois_mru == e) {
+    return;
+  }
+  e->prev->next = e->next;
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    hex_whois_lru = e->prev;
+  }
+  e->prev = NULL;
+  e->next = hex_whois_mru;
+  hex_whois_mru->prev = e;
+  hex_whois_mru = e;
+}
+
+// Take an entry out of the table and the LRU list
+static void
+hex_mrb_whois_unlink(struct hex_mrb_whois *e)
+{
+  struct hex_mrb_whois **link = &hex_whois[hex_mrb_whois_bucket(e->server_id, e->key)];
+  while (*link != e) {
+    link = &(*link)->hnext;
+  }
+  *link = e->hnext;
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    hex_whois_mru = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    hex_whois_lru = e->prev;
+  }
+  hex_whois_count--;
+  if (!mrb_nil_p(e->waiters)) {
+    hex_whois_pending--;
+  }
+  hex_mrb_whois_quiet(e, 0);
+}
+
+// Forget the known fields of an entry
+static void
+hex_mrb_whois_clear(struct hex_mrb_whois *e)
+{
+  for (int i = 0; i < HEX_MRB_WHOIS_FIELDS; i++) {
+    free(e->field[i]);
+    e->field[i] = NULL;
+  }
+  e->idle = -1;
+  e->signon = -1;
+  e->oper = 0;
+  e->secure = 0;
+}
+
+// Free an unlinked entry, its waiters must have been answered
+static void
+hex_mrb_whois_free(mrb_state *mrb, struct hex_mrb_whois *e)
+{
+  hex_mrb_whois_clear(e);
+  hex_mrb_gc_unregister_if_not_nil(mrb, e->waiters);
+  free(e->key);
+  free(e);
+}
+
+// Add an entry for a folded nick, making room by dropping the least
+// recently used entries no one is waiting on
+static struct hex_mrb_whois*
+hex_mrb_whois_add(mrb_state *mrb, int server_id, const char *key)
+{
+  struct hex_mrb_whois *e = hex_whois_lru;
+  unsigned int b = hex_mrb_whois_bucket(server_id, key);
+  while (e != NULL && hex_whois_count >= hex_whois_size) {
+    struct hex_mrb_whois *prev = e->prev;
+    if (mrb_nil_p(e->waiters)) {
+      hex_mrb_whois_unlink(e);
+      hex_mrb_whois_free(mrb, e);
+    }
+    e = prev;
+  }
+  e = (struct hex_mrb_whois *)calloc(1, sizeof(struct hex_mrb_whois));
+  e->server_id = server_id;
+  e->key = strdup(key);
+  e->idle = -1;
+  e->signon = -1;
+  e->waiters = mrb_nil_value();
+  e->hnext = hex_whois[b];
+  hex_whois[b] = e;
+  e->next = hex_whois_mru;
+  if (hex_whois_mru != NULL) {
+    hex_whois_mru->prev = e;
+  } else {
+    hex_whois_lru = e;
+  }
+  hex_whois_mru = e;
+  hex_whois_count++;
+  return e;
+}
+
+// Set a field of an entry
+static void
+hex_mrb_whois_set(struct hex_mrb_whois *e, int field, const char *value)
+{
+  free(e->field[field]);
+  e->field[field] = strdup(value);
+}
+
+// Drop the entry for a nick unless a query for it is outstanding
+static void
+hex_mrb_whois_drop(mrb_state *mrb, const char *nick)
+{
+  char buf[128];
+  int sid;
+  struct hex_mrb_whois *e = hex_mrb_whois_lookup(nick, &sid, buf, sizeof(buf));
+  if (e != NULL && mrb_nil_p(e->waiters)) {
+    hex_mrb_whois_unlink(e);
+    hex_mrb_whois_free(mrb, e);
+  }
+}
+
+// The entry as a Hash with Symbol keys
+static mrb_value
+hex_mrb_whois_info(mrb_state *mrb, struct hex_mrb_whois *e)
+{
+  mrb_value info = mrb_hash_new(mrb);
+  for (int i = 0; i < HEX_MRB_WHOIS_FIELDS; i++) {
+    mrb_value v = mrb_nil_value();
+    if (e->field[i] != NULL && i == HEX_MRB_WHOIS_CHANNELS) {
+      v = mrb_funcall(mrb, mrb_str_new_cstr(mrb, e->field[i]), "split", 0);
+    } else if (e->field[i] != NULL) {
+      v = mrb_str_new_cstr(mrb, e->field[i]);
+    }
+    mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_cstr(mrb, hex_whois_fields[i])), v);
+  }
+  mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "idle")),
+               e->idle < 0 ? mrb_nil_value() : mrb_fixnum_value((mrb_int)e->idle));
+  mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "signon")),
+               e->signon < 0 ? mrb_nil_value() : mrb_fixnum_value((mrb_int)e->signon));
+  mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "operator")), mrb_bool_value(e->oper));
+  mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "secure")), mrb_bool_value(e->secure));
+  mrb_hash_set(mrb, info, mrb_symbol_value(mrb_intern_lit(mrb, "complete")),
+               mrb_bool_value(e->state == HEX_MRB_WHOIS_COMPLETE));
+  return info;
+}
+
+// Hand a reply (or nil) to everything waiting on it, in one call to Ruby
+// The waiters array has been taken off its entry, which may be gone
+static void
+hex_mrb_whois_answer(mrb_state *mrb, mrb_value waiters, mrb_value info)
+{
+  struct RClass *whois = mrb_module_get_under(mrb, hexchat_module, "Whois");
+  mrb_funcall(mrb, mrb_obj_value(whois), "deliver", 2, waiters, info);
+  if (mrb->exc) {
+    hexchat_print(ph, "error answering WHOIS lookups");
+    hex_mrb_print_exc(mrb);
+    mrb->exc = 0;
+  }
+  mrb_gc_unregister(mrb, waiters);
+}
+
+// Take the waiters off an entry
+static mrb_value
+hex_mrb_whois_waiters(struct hex_mrb_whois *e)
+{
+  mrb_value waiters = e->waiters;
+  if (!mrb_nil_p(waiters)) {
+    e->waiters = mrb_nil_value();
+    hex_whois_pending--;
+  }
+  return waiters;
+}
+
+// Timer, answers queries that got no reply with nil
+static int
+hex_mrb_whois_timer_cb(mrb_state *mrb)
+{
+  uint64_t now = hex_mrb_clock_ns();
+  struct hex_mrb_whois *e = hex_whois_mru;
+  struct hex_mrb_whois *late = NULL;
+  while (e != NULL) {
+    struct hex_mrb_whois *next = e->next;
+    // The wait starts once the WHOIS leaves the queue, a reply that
+    // comes later than that would otherwise be printed
+    if (e->query != 0 && !hex_mrb_queue_has(e->query)) {
+      e->query = 0;
+      e->expires = now + (uint64_t)hex_whois_timeout * 1000000;
+    }
+    if (!mrb_nil_p(e->waiters) && e->query == 0 && now >= e->expires) {
+      hex_mrb_whois_unlink(e);
+      e->next = late;
+      late = e;
+      hex_whois_timeouts++;
+    }
+    e = next;
+  }
+  // Answered after the walk, the blocks may look up more nicks
+  while (late != NULL) {
+    int ai = mrb_gc_arena_save(mrb);
+    e = late;
+    late = e->next;
+    hex_mrb_whois_answer(mrb, e->waiters, mrb_nil_value());
+    e->waiters = mrb_nil_value();
+    hex_mrb_whois_free(mrb, e);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  if (hex_whois_pending == 0) {
+    hex_whois_timer = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+// Nick from a ":nick!user@host" prefix, into buf
+static const char*
+hex_mrb_whois_prefix_nick(const char *prefix, char *buf, size_t size)
+{
+  size_t i = 0;
+  if (*prefix == ':') {
+    prefix++;
+  }
+  while (prefix[i] != 0 && prefix[i] != '!' && prefix[i] != '@' && i + 1 < size) {
+    buf[i] = prefix[i];
+    i++;
+  }
+  buf[i] = 0;
+  return buf;
+}
+
+// Fill an entry from a WHO reply, word[] indexes of the parts
+// Only adds entries while the cache has room, a big WHO does not push
+// complete replies out
+static void
+hex_mrb_whois_who(mrb_state *mrb, char *word[], const char *realname, int user, int nick, int flags)
+{
+  char buf[128];
+  int sid;
+  struct hex_mrb_whois *e = hex_mrb_whois_lookup(word[nick], &sid, buf, sizeof(buf));
+  if (e == NULL) {
+    if (hex_whois_count >= hex_whois_size) {
+      return;
+    }
+    e = hex_mrb_whois_add(mrb, sid, buf);
+    e->expires = hex_mrb_clock_ns() + (uint64_t)hex_whois_ttl * 1000000;
+  } else if (!mrb_nil_p(e->waiters)) {
+    return;
+  } else if (e->state == HEX_MRB_WHOIS_PARTIAL) {
+    e->expires = hex_mrb_clock_ns() + (uint64_t)hex_whois_ttl * 1000000;
+  }
+  hex_mrb_whois_set(e, HEX_MRB_WHOIS_NICK, word[nick]);
+  hex_mrb_whois_set(e, HEX_MRB_WHOIS_USER, word[user]);
+  hex_mrb_whois_set(e, HEX_MRB_WHOIS_HOST, word[user + 1]);
+  hex_mrb_whois_set(e, HEX_MRB_WHOIS_SERVER, word[user + 2]);
+  if (realname != NULL) {
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_REALNAME, realname);
+  }
+  // The away message is not in WHO replies, "" when gone
+  if (word[flags][0] == 'G' && e->field[HEX_MRB_WHOIS_AWAY] == NULL) {
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_AWAY, "");
+  } else if (word[flags][0] == 'H') {
+    free(e->field[HEX_MRB_WHOIS_AWAY]);
+    e->field[HEX_MRB_WHOIS_AWAY] = NULL;
+  }
+  e->oper = strchr(word[flags], '*') != NULL;
+}
+
+// Take the fields of a WHOIS numeric into an entry, word[2] is the
+// numeric and word[4] the nick
+static void
+hex_mrb_whois_parse(struct hex_mrb_whois *e, char *word[], char *word_eol[])
+{
+  const char *cmd = word[2];
+  const char *arg = word_eol[5][0] == ':' ? word_eol[5] + 1 : word_eol[5];
+  if (strcmp(cmd, "311") == 0) {
+    // <nick> <user> <host> * :<realname>
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_NICK, word[4]);
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_USER, word[5]);
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_HOST, word[6]);
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_REALNAME, word_eol[8][0] == ':' ? word_eol[8] + 1 : word_eol[8]);
+  } else if (strcmp(cmd, "312") == 0) {
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_SERVER, word[5]);
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_SERVER_INFO, word_eol[6][0] == ':' ? word_eol[6] + 1 : word_eol[6]);
+  } else if (strcmp(cmd, "313") == 0) {
+    e->oper = 1;
+  } else if (strcmp(cmd, "317") == 0) {
+    e->idle = atol(word[5]);
+    e->signon = word[6][0] >= '0' && word[6][0] <= '9' ? atol(word[6]) : -1;
+  } else if (strcmp(cmd, "319") == 0) {
+    // Long channel lists come in several lines
+    const char *old = e->field[HEX_MRB_WHOIS_CHANNELS];
+    if (old == NULL) {
+      hex_mrb_whois_set(e, HEX_MRB_WHOIS_CHANNELS, arg);
+    } else {
+      size_t olen = strlen(old);
+      char *chans = (char *)malloc(olen + strlen(arg) + 2);
+      memcpy(chans, old, olen);
+      chans[olen] = ' ';
+      strcpy(chans + olen + 1, arg);
+      free(e->field[HEX_MRB_WHOIS_CHANNELS]);
+      e->field[HEX_MRB_WHOIS_CHANNELS] = chans;
+    }
+  } else if (strcmp(cmd, "330") == 0) {
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_ACCOUNT, word[5]);
+  } else if (strcmp(cmd, "301") == 0) {
+    hex_mrb_whois_set(e, HEX_MRB_WHOIS_AWAY, arg);
+  } else if (strcmp(cmd, "671") == 0) {
+    e->secure = 1;
+  }
+}
+
+// Server hook for WHOIS and WHO replies, NICK and QUIT
+// Replies to our own queries are not printed by HexChat
+static int
+hex_mrb_whois_cb(char *word[], char *word_eol[], mrb_state *mrb)
+{
+  char buf[128];
+  int sid;
+  struct hex_mrb_whois *e;
+  const char *cmd = word[2];
+  int eat;
+  if (strcmp(cmd, "NICK") == 0 || strcmp(cmd, "QUIT") == 0) {
+    hex_mrb_whois_drop(mrb, hex_mrb_whois_prefix_nick(word[1], buf, sizeof(buf)));
+    if (cmd[0] == 'N') {
+      hex_mrb_whois_drop(mrb, word[3][0] == ':' ? word[3] + 1 : word[3]);
+    }
+    return HEXCHAT_EAT_NONE;
+  }
+  if (strcmp(cmd, "352") == 0) {
+    // <me> <channel> <user> <host> <server> <nick> <flags> :<hops> <realname>
+    const char *real = strchr(word_eol[10], ' ');
+    if (word[9][0] != 0) {
+      hex_mrb_whois_who(mrb, word, real != NULL ? real + 1 : NULL, 5, 8, 9);
+    }
+    return HEXCHAT_EAT_NONE;
+  }
+  if (strcmp(cmd, "354") == 0) {
+    // Only HexChat's own WHOX query (%chtsunfra,152) has a known layout
+    // <me> 152 <channel> <user> <host> <server> <nick> <flags> <account> :<realname>
+    if (strcmp(word[4], "152") == 0 && word[11][0] != 0) {
+      hex_mrb_whois_who(mrb, word, word_eol[12][0] == ':' ? word_eol[12] + 1 : word_eol[12], 6, 9, 10);
+      e = hex_mrb_whois_lookup(word[9], &sid, buf, sizeof(buf));
+      if (e != NULL && mrb_nil_p(e->waiters) && strcmp(word[11], "0") != 0) {
+        hex_mrb_whois_set(e, HEX_MRB_WHOIS_ACCOUNT, word[11]);
+      }
+    }
+    return HEXCHAT_EAT_NONE;
+  }
+  // WHOIS numerics: <me> <nick> ...
+  e = hex_mrb_whois_lookup(word[4], &sid, buf, sizeof(buf));
+  if (strcmp(cmd, "311") == 0) {
+    // <nick> <user> <host> * :<realname>, starts a reply
+    if (e == NULL) {
+      e = hex_mrb_whois_add(mrb, sid, buf);
+    }
+    hex_mrb_whois_clear(e);
+    e->state = HEX_MRB_WHOIS_PENDING;
+    hex_mrb_whois_parse(e, word, word_eol);
+    return e->quiet ? HEXCHAT_EAT_HEXCHAT : HEXCHAT_EAT_NONE;
+  }
+  // Anything else belongs to a reply in progress, or to a query of ours
+  if (e == NULL || (e->state != HEX_MRB_WHOIS_PENDING && e->state != HEX_MRB_WHOIS_MISSING)) {
+    return HEXCHAT_EAT_NONE;
+  }
+  eat = e->quiet ? HEXCHAT_EAT_HEXCHAT : HEXCHAT_EAT_NONE;
+  if (strcmp(cmd, "318") == 0) {
+    // End of WHOIS
+    mrb_value waiters = hex_mrb_whois_waiters(e);
+    mrb_value info = mrb_nil_value();
+    hex_mrb_whois_quiet(e, 0);
+    e->query = 0;
+    if (e->state == HEX_MRB_WHOIS_MISSING || e->field[HEX_MRB_WHOIS_NICK] == NULL) {
+      hex_mrb_whois_unlink(e);
+      hex_mrb_whois_free(mrb, e);
+    } else {
+      e->state = HEX_MRB_WHOIS_COMPLETE;
+      e->expires = hex_mrb_clock_ns() + (uint64_t)hex_whois_ttl * 1000000;
+      if (!mrb_nil_p(waiters)) {
+        info = hex_mrb_whois_info(mrb, e);
+      }
+    }
+    if (!mrb_nil_p(waiters)) {
+      hex_mrb_whois_answer(mrb, waiters, info);
+    }
+  } else if (strcmp(cmd, "401") == 0) {
+    e->state = HEX_MRB_WHOIS_MISSING;
+  } else if (e->field[HEX_MRB_WHOIS_NICK] == NULL) {
+    // No 311 yet, this is not the reply we are waiting for
+    return HEXCHAT_EAT_NONE;
+  } else {
+    hex_mrb_whois_parse(e, word, word_eol);
+  }
+  return eat;
+}
+
+// Hook the replies the WHOIS cache is filled from
+static void
+hex_mrb_whois_hook(mrb_state *mrb)
+{
+  for (int i = 0; hex_whois_events[i] != NULL; i++) {
+    hexchat_hook_server(ph, hex_whois_events[i], HEXCHAT_PRI_NORM, (void *)hex_mrb_whois_cb, (void *)mrb);
+  }
+}
+
+// Empty the WHOIS cache, pending lookups are dropped unanswered
+static void
+hex_mrb_whois_free_all(mrb_state *mrb)
+{
+  while (hex_whois_mru != NULL) {
+    struct hex_mrb_whois *e = hex_whois_mru;
+    hex_mrb_whois_unlink(e);
+    hex_mrb_whois_free(mrb, e);
+  }
+  if (hex_whois_timer != NULL) {
+    hexchat_unhook(ph, hex_whois_timer);
+    hex_whois_timer = NULL;
+  }
 }
 
-// HexChat::Internal.pluginpref_set_int(String, Integer)
+// HexChat::Internal.whois_lookup(String, Proc, Boolean)
+// Returns the cached reply, or nil once the block is waiting on a query.
+// A query already outstanding for the nick is joined, not repeated.
 static mrb_value
-hex_mrb_xi_pluginpref_set_int(mrb_state *mrb, mrb_value self)
+hex_mrb_xi_whois_lookup(mrb_state *mrb, mrb_value self)
 {
-  const char *var;
-  int value;
-  int success;
-  mrb_get_args(mrb, "zi", &var, &value);
-  success = hexchat_pluginpref_set_int(ph, var, value);
-  return success ? mrb_true_value() : mrb_false_value();
+  char buf[128];
+  char *nick;
+  mrb_value block;
+  mrb_bool quiet = TRUE;
+  int sid;
+  uint64_t now = hex_mrb_clock_ns();
+  struct hex_mrb_whois *e;
+  mrb_get_args(mrb, "zo|b", &nick, &block, &quiet);
+  if (nick[0] == 0 || strpbrk(nick, " ,\r\n") != NULL) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "invalid nick %S", mrb_str_new_cstr(mrb, nick));
+  }
+  e = hex_mrb_whois_lookup(nick, &sid, buf, sizeof(buf));
+  if (e != NULL && e->state == HEX_MRB_WHOIS_COMPLETE && now < e->expires) {
+    hex_mrb_whois_touch(e);
+    hex_whois_hits++;
+    return hex_mrb_whois_info(mrb, e);
+  }
+  if (e == NULL) {
+    e = hex_mrb_whois_add(mrb, sid, buf);
+  } else {
+    hex_mrb_whois_touch(e);
+  }
+  if (!mrb_nil_p(e->waiters)) {
+    hex_whois_joined++;
+  } else {
+    e->waiters = mrb_ary_new(mrb);
+    mrb_gc_register(mrb, e->waiters);
+    hex_whois_pending++;
+    e->expires = now + (uint64_t)hex_whois_timeout * 1000000;
+    if (e->state == HEX_MRB_WHOIS_PENDING) {
+      // Someone else's WHOIS is being answered, take that reply
+      hex_whois_joined++;
+    } else {
+      char *cmd = (char *)malloc(strlen(nick) + 13);
+      sprintf(cmd, "QUOTE WHOIS %s", nick);
+      // What WHO replies said goes, a nick set again marks the 311
+      hex_mrb_whois_clear(e);
+      e->state = HEX_MRB_WHOIS_PENDING;
+      hex_mrb_whois_quiet(e, quiet);
+      e->query = hex_mrb_queue_push(cmd, 0, 0, HEX_MRB_QUEUE_LOW);
+      free(cmd);
+      hex_whois_queries++;
+    }
+  }
+  mrb_ary_push(mrb, e->waiters, block);
+  if (hex_whois_timer == NULL) {
+    hex_whois_timer = hexchat_hook_timer(ph, 1000, (void *)hex_mrb_whois_timer_cb, (void *)mrb);
+  }
+  return mrb_nil_value();
 }
 
-// HexChat::Internal.pluginpref_get_int(String)
+// HexChat::Internal.whois_cached(String)
+// What is known about a nick without asking, nil if nothing fresh is
 static mrb_value
-hex_mrb_xi_pluginpref_get_int(mrb_state *mrb, mrb_value self)
+hex_mrb_xi_whois_cached(mrb_state *mrb, mrb_value self)
 {
-  char *var;
-  mrb_get_args(mrb, "z", &var);
-  return mrb_fixnum_value((mrb_int)hexchat_pluginpref_get_int(ph, var));
+  char buf[128];
+  char *nick;
+  int sid;
+  struct hex_mrb_whois *e;
+  mrb_get_args(mrb, "z", &nick);
+  e = hex_mrb_whois_lookup(nick, &sid, buf, sizeof(buf));
+  if (e == NULL || e->field[HEX_MRB_WHOIS_NICK] == NULL || !mrb_nil_p(e->waiters) ||
+      e->state == HEX_MRB_WHOIS_PENDING || hex_mrb_clock_ns() >= e->expires) {
+    return mrb_nil_value();
+  }
+  return hex_mrb_whois_info(mrb, e);
 }
 
-// HexChat::Internal.nickcmp(String, String)
+// HexChat::Internal.whois_forget(String or nil)
+// Drops a nick, or everything no query is outstanding for
 static mrb_value
-hex_mrb_xi_nickcmp(mrb_state *mrb, mrb_value self)
+hex_mrb_xi_whois_forget(mrb_state *mrb, mrb_value self)
 {
-  const char *nick1;
-  const char *nick2;
-  mrb_get_args(mrb, "zz", &nick1, &nick2);
-  return mrb_fixnum_value((mrb_int)hexchat_nickcmp(ph, nick1, nick2));
+  char *nick = NULL;
+  mrb_get_args(mrb, "|z!", &nick);
+  if (nick != NULL) {
+    hex_mrb_whois_drop(mrb, nick);
+  } else {
+    struct hex_mrb_whois *e = hex_whois_mru;
+    while (e != NULL) {
+      struct hex_mrb_whois *next = e->next;
+      if (mrb_nil_p(e->waiters)) {
+        hex_mrb_whois_unlink(e);
+        hex_mrb_whois_free(mrb, e);
+      }
+      e = next;
+    }
+  }
+  return mrb_nil_value();
 }
 
-// HexChat::Internal.emit_print(String, [String]...)
-// (takes up to 6 strings after the required one)
+// HexChat::Internal.whois_configure(Integer, Integer, Integer)
+// Entries kept, then ms a reply stays fresh and ms to wait for one
 static mrb_value
-hex_mrb_xi_emit_print(mrb_state *mrb, mrb_value self)
+hex_mrb_xi_whois_configure(mrb_state *mrb, mrb_value self)
 {
-  char *name;
-  char *argv[6];
-  int result;
-  memset(&argv, 0, sizeof(char*)*6);
-  mrb_get_args(mrb, "z|z!z!z!z!z!z!", &name,
-          &argv[0], &argv[1], &argv[2],
-          &argv[3], &argv[4], &argv[5]);
-  result = hexchat_emit_print(ph, name,
-          argv[0], argv[1], argv[2],
-          argv[3], argv[4], argv[5], NULL);
-  return result ? mrb_true_value() : mrb_false_value();
+  mrb_int size, ttl, timeout;
+  mrb_get_args(mrb, "iii", &size, &ttl, &timeout);
+  if (size < 1 || ttl < 0 || timeout < 1) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "size and timeout must be positive");
+  }
+  hex_whois_size = (uint32_t)size;
+  hex_whois_ttl = (uint32_t)ttl;
+  hex_whois_timeout = (uint32_t)timeout;
+  return mrb_nil_value();
 }
 
-// HexChat::Internal.load(String)
-// Loads an MRuby file
+// HexChat::Internal.whois_stats
+// [entries, pending, hits, joined, queries, timeouts]
 static mrb_value
-hex_mrb_xi_load(mrb_state *mrb, mrb_value self) {
-  char *fname;
-  FILE *file;
-  mrb_value result = mrb_nil_value();
-  mrb_get_args(mrb, "z", &fname);
-  file = fopen(fname, "rb");  // b flag for OSes that care...
-  if (file != NULL) {
-    char buf[4];
-    size_t b_read;
-    mrbc_context *c = mrbc_context_new(mrb);
-    mrbc_filename(mrb, c, fname);
-    c->lineno = 1;
-    b_read = fread((void *)buf, 1, 4, file);
-    rewind(file);
-    if (b_read == 4 && strncmp("RITE", buf, 4) == 0) {
-      // RiteVM compiled - load it
-      mrb_load_irep_file_cxt(mrb, file, c);
-    } else {
-      // Reopen without binary flag and load it
-      fclose(file);
-      file = fopen(fname, "r");
-      mrb_load_file_cxt(mrb, file, c);
-    }
-    fclose(file);
-    mrbc_context_free(mrb, c);
-    if (mrb->exc) {
-      hexchat_printf(ph, "error loading %s", fname);
-      hex_mrb_print_exc(mrb);
-      mrb->exc = 0;
-      result = mrb_false_value();
-    } else {
-      result = mrb_true_value();
-    }
-  }
-  return result;
+hex_mrb_xi_whois_stats(mrb_state *mrb, mrb_value self)
+{
+  mrb_value row[6];
+  row[0] = mrb_fixnum_value((mrb_int)hex_whois_count);
+  row[1] = mrb_fixnum_value((mrb_int)hex_whois_pending);
+  row[2] = mrb_fixnum_value((mrb_int)hex_whois_hits);
+  row[3] = mrb_fixnum_value((mrb_int)hex_whois_joined);
+  row[4] = mrb_fixnum_value((mrb_int)hex_whois_queries);
+  row[5] = mrb_fixnum_value((mrb_int)hex_whois_timeouts);
+  return mrb_ary_new_from_values(mrb, 6, row);
 }
 
 // HexChat::Internal::List.initialize(String)
@@ -544,12 +7855,46 @@ hex_mrb_xl_fields(mrb_state *mrb, mrb_value self)
 {
   const char *name;
   const char *const *fields;
+  struct hex_mrb_list_fields *lf;
+  mrb_value array;
   mrb_get_args(mrb, "z", &name);
+  for (lf = hex_list_fields; lf != NULL; lf = lf->next) {
+    if (strcmp(lf->name, name) == 0) {
+      return lf->fields;
+    }
+  }
   fields = hexchat_list_fields(ph, name);
-  //if (fields == NULL) {
-  //  return mrb_nil_value();
-  //}
-  return hex_mrb_words_to_array(mrb, (char **)fields, 0, 32);
+  if (fields == NULL) {
+    return hex_mrb_words_to_array(mrb, NULL, 0, 32);
+  }
+  // Field names never change while HexChat runs, so ask once per list
+  lf = malloc(sizeof(*lf));
+  array = hex_mrb_words_to_array(mrb, (char **)fields, 0, 32);
+  if (lf != NULL) {
+    lf->name = strdup(name);
+    if (lf->name == NULL) {
+      free(lf);
+      return array;
+    }
+    lf->fields = array;
+    mrb_gc_register(mrb, array);
+    lf->next = hex_list_fields;
+    hex_list_fields = lf;
+  }
+  return array;
+}
+
+// Drop the cached list field names
+static void
+hex_mrb_list_fields_free(mrb_state *mrb)
+{
+  while (hex_list_fields != NULL) {
+    struct hex_mrb_list_fields *lf = hex_list_fields;
+    hex_list_fields = lf->next;
+    mrb_gc_unregister(mrb, lf->fields);
+    free(lf->name);
+    free(lf);
+  }
 }
 
 // HexChat::Internal::List#next
@@ -608,6 +7953,25 @@ hex_mrb_xl_str(mrb_state *mrb, mrb_value self)
   return result;
 }
 
+// HexChat::Internal::List#istr(String)
+// Like #str, but returns a shared interned String
+static mrb_value
+hex_mrb_xl_istr(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_list *lst = (struct mrb_hexchat_list *)DATA_PTR(self);
+  mrb_value result = mrb_nil_value();
+  char *name;
+  mrb_get_args(mrb, "z", &name);
+  if (lst->l != NULL) {
+    const char *str;
+    str = hexchat_list_str(ph, lst->l, name);
+    if (str != NULL) {
+      result = hex_mrb_intern_str(mrb, str, (mrb_int)strlen(str));
+    }
+  }
+  return result;
+}
+
 // HexChat::Internal::List#int(String)
 static mrb_value
 hex_mrb_xl_int(mrb_state *mrb, mrb_value self)
@@ -636,9 +8000,7 @@ hex_mrb_xl_cxt(mrb_state *mrb, mrb_value self)
     const char *c;
     c = hexchat_list_str(ph, lst->l, name);
     if (c != NULL) {
-      struct mrb_hexchat_context *cxt;
-      cxt = hex_mrb_context_alloc(mrb, (hexchat_context *)c);
-      result = hex_mrb_context_wrap(mrb, cxt_class, cxt);
+      result = hex_mrb_context_intern(mrb, (hexchat_context *)c);
     }
   }
   return result;
@@ -664,27 +8026,26 @@ hex_mrb_xl_time(mrb_state *mrb, mrb_value self)
 static mrb_value
 hex_mrb_xc_current(mrb_state *mrb, mrb_value self)
 {
-  struct mrb_hexchat_context *cxt;
   hexchat_context *c = hexchat_get_context(ph);
-  cxt = hex_mrb_context_alloc(mrb, c);
-  return hex_mrb_context_wrap(mrb, mrb_class_ptr(self), cxt);
+  if (c == NULL) {
+    return mrb_nil_value();
+  }
+  return hex_mrb_context_intern(mrb, c);
 }
 
 // HexChat::Internal::Context#find(String, String)
 static mrb_value
 hex_mrb_xc_find(mrb_state *mrb, mrb_value self)
 {
-  struct mrb_hexchat_context *cxt;
   hexchat_context *c;
   char *serv = NULL;
   char *chan = NULL;
   mrb_get_args(mrb, "|z!z!", &serv, &chan);
-  c = hexchat_find_context(ph, serv, chan);
+  c = hex_mrb_find_context(serv, chan);
   if (c == NULL) {
     return mrb_nil_value();
   }
-  cxt = hex_mrb_context_alloc(mrb, c);
-  return hex_mrb_context_wrap(mrb, mrb_class_ptr(self), cxt);
+  return hex_mrb_context_intern(mrb, c);
 }
 
 // HexChat::Internal::Context.initialize(String, String)
@@ -732,6 +8093,32 @@ hex_mrb_xc_null(mrb_state *mrb, mrb_value self)
   return result;
 }
 
+// HexChat::Internal::Context#==(Object)
+// Same HexChat context, compared by pointer
+static mrb_value
+hex_mrb_xc_eq(mrb_state *mrb, mrb_value self)
+{
+  mrb_value other;
+  mrb_get_args(mrb, "o", &other);
+  if (mrb_type(other) != MRB_TT_DATA || DATA_TYPE(other) != &mrb_hexchat_cxt_type) {
+    return mrb_false_value();
+  }
+  // Closed contexts are not equal to anything
+  return mrb_bool_value(((struct mrb_hexchat_context *)DATA_PTR(self))->c != NULL
+                        && ((struct mrb_hexchat_context *)DATA_PTR(self))->c
+                        == ((struct mrb_hexchat_context *)DATA_PTR(other))->c);
+}
+
+// HexChat::Internal::Context#current?
+// See if this is the current context without creating any objects
+static mrb_value
+hex_mrb_xc_current_q(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_context *cxt;
+  cxt = (struct mrb_hexchat_context *)DATA_PTR(self);
+  return mrb_bool_value(cxt->c != NULL && cxt->c == hexchat_get_context(ph));
+}
+
 // HexChat::Internal::Context#ptr
 static mrb_value
 hex_mrb_xc_ptr(mrb_state *mrb, mrb_value self)
@@ -760,53 +8147,400 @@ hex_mrb_xh_hooked(mrb_state *mrb, mrb_value self)
   if (hk->xhook != NULL) {
     result = mrb_true_value();
   }
-  return result;
+  return result;
+}
+
+// HexChat::Internal::Hook#set_budget(Integer)
+// Milliseconds each callback may run, 0 for the watchdog default
+static mrb_value
+hex_mrb_xh_set_budget(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  mrb_int ms;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  mrb_get_args(mrb, "i", &ms);
+  if (ms < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "budget must not be negative");
+  }
+  hk->budget_ms = (uint32_t)ms;
+  return mrb_nil_value();
+}
+
+// HexChat::Internal::Hook#coalesce(Symbol or nil, Integer, Integer)
+// :debounce, :throttle or :batch with the window in ms and the events
+// that end a batch or debounce early (0 for the debounce default), nil for
+// a call per event.  Events already collected are dropped.
+static mrb_value
+hex_mrb_xh_coalesce(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  mrb_value mode;
+  mrb_int window = 0;
+  mrb_int max = 0;
+  int coalesce = HEX_MRB_COALESCE_NONE;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  mrb_get_args(mrb, "o|ii", &mode, &window, &max);
+  if (mrb_symbol_p(mode)) {
+    const char *name = mrb_sym2name(mrb, mrb_symbol(mode));
+    if (strcmp(name, "debounce") == 0) {
+      coalesce = HEX_MRB_COALESCE_DEBOUNCE;
+    } else if (strcmp(name, "throttle") == 0) {
+      coalesce = HEX_MRB_COALESCE_THROTTLE;
+    } else if (strcmp(name, "batch") == 0) {
+      coalesce = HEX_MRB_COALESCE_BATCH;
+    }
+  }
+  if (coalesce == HEX_MRB_COALESCE_NONE && !mrb_nil_p(mode)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown coalescing %S", mode);
+  }
+  if (window < 0 || max < 0 || (coalesce != HEX_MRB_COALESCE_NONE && coalesce != HEX_MRB_COALESCE_BATCH && window == 0)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "window must be positive");
+  }
+  if (coalesce == HEX_MRB_COALESCE_BATCH && window == 0 && max == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "batch needs a window or a size");
+  }
+  hex_mrb_hook_coalesce_reset(hk);
+  hk->coalesce = coalesce;
+  hk->window_ms = (uint32_t)window;
+  hk->batch_max = (uint32_t)max;
+  if (coalesce == HEX_MRB_COALESCE_DEBOUNCE && max == 0) {
+    hk->batch_max = HEX_MRB_DEBOUNCE_MAX;
+  }
+  return mrb_nil_value();
+}
+
+// HexChat::Internal::Hook#overruns
+static mrb_value
+hex_mrb_xh_overruns(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  return mrb_fixnum_value((mrb_int)hk->overruns);
+}
+
+// HexChat::Internal::Hook#disabled?
+// True if the watchdog unhooked this hook
+static mrb_value
+hex_mrb_xh_disabled(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  return mrb_bool_value(hk->disabled);
+}
+
+// HexChat::Internal::Hook#unhook
+static mrb_value
+hex_mrb_xh_unhook(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  hex_mrb_hook_unhook(hk);
+  return mrb_nil_value();
+}
+
+// HexChat::Internal::Hook#set_ref
+static mrb_value
+hex_mrb_xh_set_ref(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  mrb_value ref;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  mrb_get_args(mrb, "o", &ref);
+  return hex_mrb_hook_set_ref(mrb, hk, ref);
+}
+
+// HexChat::Internal::Hook#get_ref
+static mrb_value
+hex_mrb_xh_get_ref(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  return hk->ref;
+}
+
+// Set $__HOOK_REF global, used to provide unhook call from within
+// hook block.  Returns existing value.  Removes it completely if
+// it is set to nil.
+static mrb_value
+mrb_set_gv_hook(mrb_state *mrb, mrb_value v)
+{
+  mrb_sym mid = mrb_intern_str(mrb, mrb_str_new_cstr(mrb, "$__HOOK_REF"));
+  mrb_value gv_hook = mrb_gv_get(mrb, mid);
+  if (mrb_obj_equal(mrb, v, mrb_nil_value())) {
+    mrb_gv_remove(mrb, mid);
+  } else {
+    mrb_gv_set(mrb, mid, v);
+  }
+  return gv_hook;
+}
+
+// Instruction fetch hook, installed while a callback with a budget runs
+// Once the deadline passes the callback is flagged, and
+// HexChat::BudgetExceeded is raised at its next jump or method call (and
+// again after a short grace period if the block rescues it and carries
+// on).  The hook runs between instructions, and the MRB_TRY around the
+// 1.x VM loop unwinds a raise from it like one from a C method called by
+// that instruction; err is set first, as the VM does before calling C
+// methods, so rescue clauses and backtraces see the right instruction.
+// On other MRuby versions overruns are only counted, as they are when
+// MRuby is built without MRB_ENABLE_DEBUG_HOOK and there is no hook.
+#ifdef MRB_ENABLE_DEBUG_HOOK
+static void
+hex_mrb_watchdog_fetch(mrb_state *mrb, struct mrb_irep *irep, mrb_code *pc, mrb_value *regs)
+{
+  if (!hex_watch_expired) {
+    if (--hex_watch_ticks > 0 || hex_watch_deadline == 0) {
+      return;
+    }
+    hex_watch_ticks = HEX_MRB_WATCH_TICKS;
+    if (hex_mrb_clock_ns() < hex_watch_deadline) {
+      return;
+    }
+    hex_watch_expired = 1;
+  }
+#if HEX_MRB_WATCH_RAISE
+  switch (GET_OPCODE(*pc)) {
+  case OP_JMP:
+  case OP_JMPIF:
+  case OP_JMPNOT:
+  case OP_SEND:
+  case OP_SENDB:
+  case OP_CALL:
+  case OP_SUPER:
+    break;
+  default:
+    return;
+  }
+  hex_watch_expired = 0;
+  hex_watch_deadline = hex_mrb_clock_ns() + HEX_MRB_WATCH_GRACE;
+  mrb->c->ci->err = pc;
+  mrb_raisef(mrb, budget_class, "%S %S hook ran over its budget",
+             mrb_str_new_cstr(mrb, hex_hook_types[hex_watch_hook->kind]),
+             mrb_str_new_cstr(mrb, hex_watch_hook->name));
+#endif
+}
+#endif
+
+// Count a callback that ran over its budget, unhook repeat offenders
+static void
+hex_mrb_hook_overrun(struct mrb_hexchat_hook *hk)
+{
+  hex_hook_stats[hk->kind].overruns++;
+  hk->overruns++;
+  if (hex_watch_strikes > 0 && hk->overruns >= hex_watch_strikes && hk->xhook != NULL) {
+    hex_mrb_hook_unhook(hk);
+    hk->disabled = 1;
+    hexchat_printf(ph, "MRuby: %s %s hook of %s disabled after running over its budget %u times",
+                   hex_hook_types[hk->kind], hk->name, hex_mrb_hook_plugin(hk), (unsigned)hk->overruns);
+  }
+}
+
+// Call a hook's block with the callback arguments
+// Returns the block's eat value, or HEXCHAT_EAT_NONE if it raised
+static int
+hex_mrb_hook_invoke(struct mrb_hexchat_hook *hk, mrb_int argc, const mrb_value *argv)
+{
+  mrb_state *mrb = hk->mrb;
+  struct hex_mrb_hook_stats *st = &hex_hook_stats[hk->kind];
+  uint64_t start = hex_mrb_clock_ns();
+  uint64_t budget_ns = (uint64_t)(hk->budget_ms ? hk->budget_ms : hex_watch_budget_ms) * 1000000ULL;
+  uint64_t old_deadline = hex_watch_deadline;
+  struct mrb_hexchat_hook *old_watch = hex_watch_hook;
+  int old_expired = hex_watch_expired;
+  uint32_t old_owner = hex_mem_current;
+  uint64_t ns;
+  int b = 0;
+  int ret;
+  mrb_value old_gv_hook;
+  mrb_value result;
+#ifdef MRB_ENABLE_DEBUG_HOOK
+  void (*old_fetch)(struct mrb_state *, struct mrb_irep *, mrb_code *, mrb_value *) = mrb->code_fetch_hook;
+#endif
+  // A callback nested in another one gets no more than the outer one has left
+  if (budget_ns > 0 && (old_deadline == 0 || start + budget_ns < old_deadline)) {
+    hex_watch_deadline = start + budget_ns;
+    hex_watch_hook = hk;
+    hex_watch_ticks = HEX_MRB_WATCH_TICKS;
+    hex_watch_expired = 0;
+#ifdef MRB_ENABLE_DEBUG_HOOK
+    mrb->code_fetch_hook = hex_mrb_watchdog_fetch;
+#endif
+  }
+  if (hk->mem_owner < 0) {
+    hk->mem_owner = (int)hex_mrb_mem_owner(hex_mrb_hook_plugin(hk));
+  }
+  hex_mem_current = (uint32_t)hk->mem_owner;
+  old_gv_hook = mrb_set_gv_hook(mrb, hk->ref);
+  result = mrb_funcall_argv(mrb, hk->block, mrb_intern_lit(mrb, "call"), argc, argv);
+  mrb_set_gv_hook(mrb, old_gv_hook);
+  hex_mem_current = old_owner;
+#ifdef MRB_ENABLE_DEBUG_HOOK
+  mrb->code_fetch_hook = old_fetch;
+#endif
+  hex_watch_deadline = old_deadline;
+  hex_watch_hook = old_watch;
+  hex_watch_expired = old_expired;
+  ns = hex_mrb_clock_ns() - start;
+  if (hex_trace != NULL) {
+    hex_mrb_trace_end(start, hex_hook_types[hk->kind], hk->name, hex_mrb_hook_plugin(hk));
+  }
+  while (b < HEX_MRB_METRIC_BUCKETS && ns > hex_metric_bounds[b]) {
+    b++;
+  }
+  st->buckets[b]++;
+  st->fired++;
+  st->ns += ns;
+  hk->fired++;
+  hk->ns += ns;
+  if (budget_ns > 0 && ns > budget_ns) {
+    hex_mrb_hook_overrun(hk);
+  }
+  if (mrb->exc) {
+    st->exceptions++;
+    hk->exceptions++;
+    hexchat_printf(ph, "error in %s callback", hex_hook_types[hk->kind]);
+    hex_mrb_print_exc(mrb);
+    mrb->exc = 0;
+    ret = HEXCHAT_EAT_NONE;
+  } else {
+    ret = (int)mrb_fixnum(result);
+  }
+  if (hex_mem_check) {
+    hex_mrb_mem_enforce(mrb);
+  }
+  return ret;
+}
+
+// Call a coalescing hook's block with the events of one context, taken
+// off the hook.  The block runs in that context, if it is still open.
+static void
+hex_mrb_hook_flush_bucket(struct mrb_hexchat_hook *hk, struct hex_mrb_co_bucket *b)
+{
+  hexchat_context *c = hexchat_get_context(ph);
+  int moved = b->context != c && hexchat_set_context(ph, b->context);
+  hex_mrb_hook_invoke(hk, 1, &b->events);
+  if (moved) {
+    hexchat_set_context(ph, c);
+  }
+  mrb_gc_unregister(hk->mrb, b->events);
+  free(b);
 }
 
-// HexChat::Internal::Hook#unhook
-static mrb_value
-hex_mrb_xh_unhook(mrb_state *mrb, mrb_value self)
+// Call a coalescing hook's block once per context with what it collected
+// Stops if the block unhooks, events collected while it runs wait for the
+// next call.
+static void
+hex_mrb_hook_flush(struct mrb_hexchat_hook *hk)
 {
-  struct mrb_hexchat_hook *hk;
-  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
-  hex_mrb_hook_unhook(hk);
-  return mrb_nil_value();
+  struct hex_mrb_co_bucket *b = hk->buckets;
+  hk->buckets = NULL;
+  while (b != NULL) {
+    struct hex_mrb_co_bucket *next = b->next;
+    if (hk->xhook != NULL) {
+      hex_mrb_hook_flush_bucket(hk, b);
+    } else {
+      mrb_gc_unregister(hk->mrb, b->events);
+      free(b);
+    }
+    b = next;
+  }
 }
 
-// HexChat::Internal::Hook#set_ref
-static mrb_value
-hex_mrb_xh_set_ref(mrb_state *mrb, mrb_value self)
+// Timer of a coalescing hook
+static int
+hex_mrb_hook_coalesce_cb(struct mrb_hexchat_hook *hk)
 {
-  struct mrb_hexchat_hook *hk;
-  mrb_value ref;
-  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
-  mrb_get_args(mrb, "o", &ref);
-  return hex_mrb_hook_set_ref(mrb, hk, ref);
+  void *timer = hk->co_timer;
+  if (hk->coalesce == HEX_MRB_COALESCE_DEBOUNCE) {
+    uint64_t quiet = (uint64_t)hk->window_ms * 1000000ULL;
+    uint64_t since = hex_mrb_clock_ns() - hk->last_ns;
+    // Events came in since the timer was set, wait out the rest
+    if (since < quiet) {
+      hk->co_timer = hexchat_hook_timer(ph, (int)((quiet - since) / 1000000ULL) + 1, (void *)hex_mrb_hook_coalesce_cb, (void *)hk);
+      return 0;
+    }
+  }
+  hk->co_timer = NULL;
+  if (hk->buckets == NULL) {
+    return 0;
+  }
+  hex_mrb_hook_flush(hk);
+  // A throttle window restarts with the call, unless the block unhooked
+  if (hk->coalesce == HEX_MRB_COALESCE_THROTTLE && hk->co_timer == NULL && hk->xhook != NULL) {
+    hk->co_timer = timer;
+    return 1;
+  }
+  return 0;
 }
 
-// HexChat::Internal::Hook#get_ref
-static mrb_value
-hex_mrb_xh_get_ref(mrb_state *mrb, mrb_value self)
+// Collect an event for a coalescing hook
+// One argument is collected as is, several as an Array of them.  Each
+// context collects on its own, so one call never mixes contexts.
+static void
+hex_mrb_hook_collect(struct mrb_hexchat_hook *hk, mrb_int argc, const mrb_value *argv)
 {
-  struct mrb_hexchat_hook *hk;
-  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
-  return hk->ref;
+  mrb_state *mrb = hk->mrb;
+  hexchat_context *c = hexchat_get_context(ph);
+  struct hex_mrb_co_bucket **pp = &hk->buckets;
+  struct hex_mrb_co_bucket *b;
+  int start = 0;
+  while (*pp != NULL && (*pp)->context != c) {
+    pp = &(*pp)->next;
+  }
+  b = *pp;
+  if (b == NULL) {
+    b = (struct hex_mrb_co_bucket *)malloc(sizeof(struct hex_mrb_co_bucket));
+    if (b == NULL) {
+      return;
+    }
+    b->next = NULL;
+    b->context = c;
+    b->events = mrb_ary_new(mrb);
+    mrb_gc_register(mrb, b->events);
+    *pp = b;
+  }
+  mrb_ary_push(mrb, b->events, argc == 1 ? argv[0] : mrb_ary_new_from_values(mrb, argc, argv));
+  hk->last_ns = hex_mrb_clock_ns();
+  switch (hk->coalesce) {
+  case HEX_MRB_COALESCE_THROTTLE:
+    // The first event of a window goes through right away
+    if (hk->co_timer == NULL) {
+      hex_mrb_hook_flush(hk);
+      start = hk->co_timer == NULL && hk->xhook != NULL;
+    }
+    break;
+  case HEX_MRB_COALESCE_DEBOUNCE:
+  case HEX_MRB_COALESCE_BATCH:
+    // A steady stream would hold a debounce back forever, so it has a cap
+    // A full context goes on its own, the others wait for the timer
+    if (hk->batch_max > 0 && RARRAY_LEN(b->events) >= (mrb_int)hk->batch_max) {
+      *pp = b->next;
+      if (hk->buckets == NULL && hk->co_timer != NULL) {
+        hexchat_unhook(ph, hk->co_timer);
+        hk->co_timer = NULL;
+      }
+      hex_mrb_hook_flush_bucket(hk, b);
+    } else {
+      start = hk->co_timer == NULL && hk->window_ms > 0;
+    }
+    break;
+  }
+  if (start) {
+    hk->co_timer = hexchat_hook_timer(ph, (int)hk->window_ms, (void *)hex_mrb_hook_coalesce_cb, (void *)hk);
+  }
 }
 
-// Set $__HOOK_REF global, used to provide unhook call from within
-// hook block.  Returns existing value.  Removes it completely if
-// it is set to nil.
-static mrb_value
-mrb_set_gv_hook(mrb_state *mrb, mrb_value v)
+// Pass a callback to a hook's block, or collect it if the hook coalesces
+// Collected events are not eaten, the block runs after HexChat has moved on
+static int
+hex_mrb_hook_call(struct mrb_hexchat_hook *hk, mrb_int argc, const mrb_value *argv)
 {
-  mrb_sym mid = mrb_intern_str(mrb, mrb_str_new_cstr(mrb, "$__HOOK_REF"));
-  mrb_value gv_hook = mrb_gv_get(mrb, mid);
-  if (mrb_obj_equal(mrb, v, mrb_nil_value())) {
-    mrb_gv_remove(mrb, mid);
-  } else {
-    mrb_gv_set(mrb, mid, v);
+  if (hk->coalesce != HEX_MRB_COALESCE_NONE &&
+      (hk->kind == HEX_MRB_HOOK_PRINT || hk->kind == HEX_MRB_HOOK_SERVER)) {
+    hex_mrb_hook_collect(hk, argc, argv);
+    return HEXCHAT_EAT_NONE;
   }
-  return gv_hook;
+  return hex_mrb_hook_invoke(hk, argc, argv);
 }
 
 // Command hook callback function
@@ -814,19 +8548,10 @@ static int
 hex_mrb_hook_command_cb(char *word[], char *word_eol[], struct mrb_hexchat_hook *hk)
 {
   mrb_state *mrb = (mrb_state *)hk->mrb;
-  mrb_value block = hk->block;
   mrb_value rb_word = hex_mrb_words_to_array(mrb, word, 1, 32);
   mrb_value rb_word_eol = hex_mrb_words_to_array(mrb, word_eol, 1, 32);
-  mrb_value old_gv_hook = mrb_set_gv_hook(mrb, hk->ref);
-  mrb_value result = mrb_funcall(mrb, block, "call", (mrb_int)2, rb_word, rb_word_eol);
-  mrb_set_gv_hook(mrb, old_gv_hook);
-  if (mrb->exc) {
-    hexchat_print(ph, "error in command callback");
-    hex_mrb_print_exc(mrb);
-    mrb->exc = 0;
-    return HEXCHAT_EAT_NONE;
-  }
-  return (int)mrb_fixnum(result);
+  mrb_value argv[2] = { rb_word, rb_word_eol };
+  return hex_mrb_hook_call(hk, 2, argv);
 }
 
 // HexChat::Internal::Hook#hook_command(String, String, Integer)
@@ -839,7 +8564,7 @@ hex_mrb_xh_hook_command(mrb_state *mrb, mrb_value self)
   int pri = HEXCHAT_PRI_NORM;
   hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
   mrb_get_args(mrb, "zz!|i", &cmd, &help, &pri);
-  hex_mrb_hook_hook(mrb, hk, hexchat_hook_command(ph, cmd, pri, (void *)hex_mrb_hook_command_cb, help, (void *)hk));
+  hex_mrb_hook_hook(mrb, hk, HEX_MRB_HOOK_COMMAND, cmd, hexchat_hook_command(ph, cmd, pri, (void *)hex_mrb_hook_command_cb, help, (void *)hk));
   // printf("MRB command hooked %s\n", cmd);
   return mrb_nil_value();
 }
@@ -849,18 +8574,9 @@ static int
 hex_mrb_hook_print_cb(char *word[], struct mrb_hexchat_hook *hk)
 {
   mrb_state *mrb = (mrb_state *)hk->mrb;
-  mrb_value block = hk->block;
   mrb_value rb_word = hex_mrb_words_to_array(mrb, word, 1, 32);
-  mrb_value old_gv_hook = mrb_set_gv_hook(mrb, hk->ref);
-  mrb_value result = mrb_funcall(mrb, block, "call", (mrb_int)1, rb_word);
-  mrb_set_gv_hook(mrb, old_gv_hook);
-  if (mrb->exc) {
-    hexchat_print(ph, "error in print callback");
-    hex_mrb_print_exc(mrb);
-    mrb->exc = 0;
-    return HEXCHAT_EAT_NONE;
-  }
-  return (int)mrb_fixnum(result);
+  mrb_value argv[1] = { rb_word };
+  return hex_mrb_hook_call(hk, 1, argv);
 }
 
 // HexChat::Internal::Hook#hook_print(String, Integer)
@@ -872,7 +8588,7 @@ hex_mrb_xh_hook_print(mrb_state *mrb, mrb_value self)
   int pri = HEXCHAT_PRI_NORM;
   hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
   mrb_get_args(mrb, "z|i", &name, &pri);
-  hex_mrb_hook_hook(mrb, hk, hexchat_hook_print(ph, name, pri, (void *)hex_mrb_hook_print_cb, (void *)hk));
+  hex_mrb_hook_hook(mrb, hk, HEX_MRB_HOOK_PRINT, name, hexchat_hook_print(ph, name, pri, (void *)hex_mrb_hook_print_cb, (void *)hk));
   // printf("MRB print hooked %s\n", name);
   return mrb_nil_value();
 }
@@ -882,19 +8598,10 @@ static int
 hex_mrb_hook_server_cb(char *word[], char *word_eol[], struct mrb_hexchat_hook *hk)
 {
   mrb_state *mrb = (mrb_state *)hk->mrb;
-  mrb_value block = hk->block;
   mrb_value rb_word = hex_mrb_words_to_array(mrb, word, 1, 32);
   mrb_value rb_word_eol = hex_mrb_words_to_array(mrb, word_eol, 1, 32);
-  mrb_value old_gv_hook = mrb_set_gv_hook(mrb, hk->ref);
-  mrb_value result = mrb_funcall(mrb, block, "call", (mrb_int)2, rb_word, rb_word_eol);
-  mrb_set_gv_hook(mrb, old_gv_hook);
-  if (mrb->exc) {
-    hexchat_print(ph, "error in server callback");
-    hex_mrb_print_exc(mrb);
-    mrb->exc = 0;
-    return HEXCHAT_EAT_NONE;
-  }
-  return (int)mrb_fixnum(result);
+  mrb_value argv[2] = { rb_word, rb_word_eol };
+  return hex_mrb_hook_call(hk, 2, argv);
 }
 
 // HexChat::Internal::Hook#hook_server(String, Integer)
@@ -906,27 +8613,76 @@ hex_mrb_xh_hook_server(mrb_state *mrb, mrb_value self)
   int pri = HEXCHAT_PRI_NORM;
   hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
   mrb_get_args(mrb, "z|i", &name, &pri);
-  hex_mrb_hook_hook(mrb, hk, hexchat_hook_server(ph, name, pri, (void *)hex_mrb_hook_server_cb, (void *)hk));
+  hex_mrb_hook_hook(mrb, hk, HEX_MRB_HOOK_SERVER, name, hexchat_hook_server(ph, name, pri, (void *)hex_mrb_hook_server_cb, (void *)hk));
   // printf("MRB server hooked %s\n", name);
   return mrb_nil_value();
 }
 
-// Timer hook callback function
+// Print hook with attributes callback function
 static int
-hex_mrb_hook_timer_cb(struct mrb_hexchat_hook *hk)
+hex_mrb_hook_print_attrs_cb(char *word[], hexchat_event_attrs *attrs, struct mrb_hexchat_hook *hk)
 {
   mrb_state *mrb = (mrb_state *)hk->mrb;
-  mrb_value block = hk->block;
-  mrb_value old_gv_hook = mrb_set_gv_hook(mrb, hk->ref);
-  mrb_value result = mrb_funcall(mrb, block, "call", (mrb_int)0);
-  mrb_set_gv_hook(mrb, old_gv_hook);
-  if (mrb->exc) {
-    hexchat_print(ph, "error in timer callback");
-    hex_mrb_print_exc(mrb);
-    mrb->exc = 0;
-    return HEXCHAT_EAT_NONE;
+  mrb_value rb_word = hex_mrb_words_to_array(mrb, word, 1, 32);
+  mrb_value rb_attrs = hex_mrb_attrs_wrap(mrb, attrs);
+  mrb_value argv[2] = { rb_word, rb_attrs };
+  return hex_mrb_hook_call(hk, 2, argv);
+}
+
+// HexChat::Internal::Hook#hook_print_attrs(String, Integer)
+static mrb_value
+hex_mrb_xh_hook_print_attrs(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  char *name;
+  int pri = HEXCHAT_PRI_NORM;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  mrb_get_args(mrb, "z|i", &name, &pri);
+  hex_mrb_hook_hook(mrb, hk, HEX_MRB_HOOK_PRINT, name, hexchat_hook_print_attrs(ph, name, pri, (void *)hex_mrb_hook_print_attrs_cb, (void *)hk));
+  return mrb_nil_value();
+}
+
+// Server hook with attributes callback function
+static int
+hex_mrb_hook_server_attrs_cb(char *word[], char *word_eol[], hexchat_event_attrs *attrs, struct mrb_hexchat_hook *hk)
+{
+  mrb_state *mrb = (mrb_state *)hk->mrb;
+  mrb_value rb_word = hex_mrb_words_to_array(mrb, word, 1, 32);
+  mrb_value rb_word_eol = hex_mrb_words_to_array(mrb, word_eol, 1, 32);
+  mrb_value rb_attrs = hex_mrb_attrs_wrap(mrb, attrs);
+  mrb_value argv[3] = { rb_word, rb_word_eol, rb_attrs };
+  return hex_mrb_hook_call(hk, 3, argv);
+}
+
+// HexChat::Internal::Hook#hook_server_attrs(String, Integer)
+static mrb_value
+hex_mrb_xh_hook_server_attrs(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  char *name;
+  int pri = HEXCHAT_PRI_NORM;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  mrb_get_args(mrb, "z|i", &name, &pri);
+  hex_mrb_hook_hook(mrb, hk, HEX_MRB_HOOK_SERVER, name, hexchat_hook_server_attrs(ph, name, pri, (void *)hex_mrb_hook_server_attrs_cb, (void *)hk));
+  return mrb_nil_value();
+}
+
+// HexChat::Internal::EventAttrs#server_time_utc
+static mrb_value
+hex_mrb_xa_server_time_utc(mrb_state *mrb, mrb_value self)
+{
+  hexchat_event_attrs *attrs = (hexchat_event_attrs *)DATA_PTR(self);
+  if (attrs == NULL) {
+    return mrb_nil_value();
   }
-  return (int)mrb_fixnum(result);
+  return mrb_fixnum_value((mrb_int)attrs->server_time_utc);
+}
+
+// Timer hook callback function
+static int
+hex_mrb_hook_timer_cb(struct mrb_hexchat_hook *hk)
+{
+  return hex_mrb_hook_call(hk, 0, NULL);
 }
 
 // HexChat::Internal::Hook#hook_timer(Integer)
@@ -935,9 +8691,11 @@ hex_mrb_xh_hook_timer(mrb_state *mrb, mrb_value self)
 {
   struct mrb_hexchat_hook *hk;
   int timeout = 0;
+  char name[16];
   hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
   mrb_get_args(mrb, "i", &timeout);
-  hex_mrb_hook_hook(mrb, hk, hexchat_hook_timer(ph, timeout, (void *)hex_mrb_hook_timer_cb, (void *)hk));
+  snprintf(name, sizeof(name), "%dms", timeout);
+  hex_mrb_hook_hook(mrb, hk, HEX_MRB_HOOK_TIMER, name, hexchat_hook_timer(ph, timeout, (void *)hex_mrb_hook_timer_cb, (void *)hk));
   // printf("MRB hooked timer %d\n", timeout);
   return mrb_nil_value();
 }
@@ -946,19 +8704,8 @@ hex_mrb_xh_hook_timer(mrb_state *mrb, mrb_value self)
 static int
 hex_hex_mrb_hook_fd_cb(int fd, int flags, struct mrb_hexchat_hook *hk)
 {
-  mrb_state *mrb = (mrb_state *)hk->mrb;
-  mrb_value block = hk->block;
-  mrb_value old_gv_hook = mrb_set_gv_hook(mrb, hk->ref);
-  mrb_value result = mrb_funcall(mrb, block, "call", (mrb_int)2,
-  mrb_fixnum_value((mrb_int)fd), mrb_fixnum_value((mrb_int)flags));
-  mrb_set_gv_hook(mrb, old_gv_hook);
-  if (mrb->exc) {
-    hexchat_print(ph, "error in fd callback");
-    hex_mrb_print_exc(mrb);
-    mrb->exc = 0;
-    return HEXCHAT_EAT_NONE;
-  }
-  return (int)mrb_fixnum(result);
+  mrb_value argv[2] = { mrb_fixnum_value((mrb_int)fd), mrb_fixnum_value((mrb_int)flags) };
+  return hex_mrb_hook_call(hk, 2, argv);
 }
 
 // HexChat::Internal::Hook#hook_fd(Integer, Integer)
@@ -968,13 +8715,178 @@ hex_mrb_xh_hook_fd(mrb_state *mrb, mrb_value self)
   struct mrb_hexchat_hook *hk;
   int fd = 0;
   int flags = 0;
+  char name[16];
   hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
   mrb_get_args(mrb, "ii", &fd, &flags);
-  hex_mrb_hook_hook(mrb, hk, hexchat_hook_fd(ph, fd, flags, (void *)hex_hex_mrb_hook_fd_cb, (void *)hk));
+  snprintf(name, sizeof(name), "%d", fd);
+  hex_mrb_hook_hook(mrb, hk, HEX_MRB_HOOK_FD, name, hexchat_hook_fd(ph, fd, flags, (void *)hex_hex_mrb_hook_fd_cb, (void *)hk));
   // printf("MRB hooked fd %d\n", fd);
   return mrb_nil_value();
 }
 
+// HexChat::Internal::Hook#fire(*args)
+// Calls the block as the hook's callback would, returns the eat value
+static mrb_value
+hex_mrb_xh_fire(mrb_state *mrb, mrb_value self)
+{
+  struct mrb_hexchat_hook *hk;
+  mrb_value *argv;
+  mrb_int argc;
+  hk = (struct mrb_hexchat_hook *)DATA_PTR(self);
+  mrb_get_args(mrb, "*", &argv, &argc);
+  return mrb_fixnum_value(hex_mrb_hook_call(hk, argc, argv));
+}
+
+// Fire a stub: instantiate its plugin, which replaces every stub of the
+// class with real hooks, and let it handle this event
+// The stub is freed by the time Registry.activate returns
+static int
+hex_mrb_stub_fire(struct hex_mrb_stub *st, mrb_value args)
+{
+  mrb_state *mrb = st->mrb;
+  mrb_value def = st->def;
+  struct RClass *plugin = mrb_class_get_under(mrb, hexchat_module, "Plugin");
+  struct RClass *registry = mrb_class_get_under(mrb, plugin, "Registry");
+  mrb_value argv[5];
+  mrb_value result;
+  argv[0] = mrb_ary_ref(mrb, def, 0);
+  argv[1] = mrb_ary_ref(mrb, def, 1);
+  argv[2] = mrb_ary_ref(mrb, def, 2);
+  argv[3] = mrb_ary_ref(mrb, def, 3);
+  argv[4] = args;
+  // def stays reachable from this frame after the stub unregisters it
+  result = mrb_funcall_argv(mrb, mrb_obj_value(registry), mrb_intern_lit(mrb, "activate"), 5, argv);
+  if (mrb->exc) {
+    hexchat_printf(ph, "error activating %s", mrb_str_to_cstr(mrb, mrb_inspect(mrb, argv[0])));
+    hex_mrb_print_exc(mrb);
+    mrb->exc = 0;
+    return HEXCHAT_EAT_NONE;
+  }
+  return mrb_fixnum_p(result) ? (int)mrb_fixnum(result) : HEXCHAT_EAT_NONE;
+}
+
+// Command stub callback function
+static int
+hex_mrb_stub_command_cb(char *word[], char *word_eol[], struct hex_mrb_stub *st)
+{
+  mrb_value argv[2];
+  argv[0] = hex_mrb_words_to_array(st->mrb, word, 1, 32);
+  argv[1] = hex_mrb_words_to_array(st->mrb, word_eol, 1, 32);
+  return hex_mrb_stub_fire(st, mrb_ary_new_from_values(st->mrb, 2, argv));
+}
+
+// Print stub callback function, attributes are dropped by Ruby if unwanted
+static int
+hex_mrb_stub_print_cb(char *word[], hexchat_event_attrs *attrs, struct hex_mrb_stub *st)
+{
+  mrb_value argv[2];
+  argv[0] = hex_mrb_words_to_array(st->mrb, word, 1, 32);
+  argv[1] = hex_mrb_attrs_wrap(st->mrb, attrs);
+  return hex_mrb_stub_fire(st, mrb_ary_new_from_values(st->mrb, 2, argv));
+}
+
+// Server stub callback function, attributes are dropped by Ruby if unwanted
+static int
+hex_mrb_stub_server_cb(char *word[], char *word_eol[], hexchat_event_attrs *attrs, struct hex_mrb_stub *st)
+{
+  mrb_value argv[3];
+  argv[0] = hex_mrb_words_to_array(st->mrb, word, 1, 32);
+  argv[1] = hex_mrb_words_to_array(st->mrb, word_eol, 1, 32);
+  argv[2] = hex_mrb_attrs_wrap(st->mrb, attrs);
+  return hex_mrb_stub_fire(st, mrb_ary_new_from_values(st->mrb, 3, argv));
+}
+
+// Timer stub callback function, the stub is gone afterwards
+static int
+hex_mrb_stub_timer_cb(struct hex_mrb_stub *st)
+{
+  hex_mrb_stub_fire(st, mrb_ary_new(st->mrb));
+  return 0;
+}
+
+// FD stub callback function, the stub is gone afterwards
+static int
+hex_mrb_stub_fd_cb(int fd, int flags, struct hex_mrb_stub *st)
+{
+  mrb_value argv[2] = { mrb_fixnum_value((mrb_int)fd), mrb_fixnum_value((mrb_int)flags) };
+  hex_mrb_stub_fire(st, mrb_ary_new_from_values(st->mrb, 2, argv));
+  return 0;
+}
+
+// HexChat::Internal.stub(Class, Symbol, name, Integer, extra)
+// Hooks a stub for one hook of a lazy plugin.  name is the command or
+// event, timer ms or fd; extra is the command help or the fd flags.
+// Give it the real hook's priority, Registry.activate uses it to tell
+// which of the plugin's new hooks HexChat will still run for the event.
+static mrb_value
+hex_mrb_xi_stub(mrb_state *mrb, mrb_value self)
+{
+  mrb_value klass, name, extra = mrb_nil_value();
+  mrb_sym type;
+  mrb_int pri = HEXCHAT_PRI_NORM;
+  const char *tname;
+  struct hex_mrb_stub *st;
+  mrb_value def[4];
+  mrb_get_args(mrb, "Cno|io", &klass, &type, &name, &pri, &extra);
+  tname = mrb_sym2name(mrb, type);
+  st = malloc(sizeof(*st));
+  if (st == NULL) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory");
+  }
+  st->mrb = mrb;
+  st->hook = NULL;
+  if (strcmp(tname, "command") == 0) {
+    char *help = mrb_string_p(extra) ? mrb_str_to_cstr(mrb, extra) : NULL;
+    st->hook = hexchat_hook_command(ph, mrb_str_to_cstr(mrb, name), pri, (void *)hex_mrb_stub_command_cb, help, (void *)st);
+  } else if (strcmp(tname, "print") == 0) {
+    st->hook = hexchat_hook_print_attrs(ph, mrb_str_to_cstr(mrb, name), pri, (void *)hex_mrb_stub_print_cb, (void *)st);
+  } else if (strcmp(tname, "server") == 0) {
+    st->hook = hexchat_hook_server_attrs(ph, mrb_str_to_cstr(mrb, name), pri, (void *)hex_mrb_stub_server_cb, (void *)st);
+  } else if (strcmp(tname, "timer") == 0) {
+    st->hook = hexchat_hook_timer(ph, (int)mrb_fixnum(mrb_to_int(mrb, name)), (void *)hex_mrb_stub_timer_cb, (void *)st);
+  } else if (strcmp(tname, "fd") == 0) {
+    int flags = mrb_fixnum_p(extra) ? (int)mrb_fixnum(extra) : HEXCHAT_FD_READ;
+    st->hook = hexchat_hook_fd(ph, (int)mrb_fixnum(mrb_to_int(mrb, name)), flags, (void *)hex_mrb_stub_fd_cb, (void *)st);
+  }
+  if (st->hook == NULL) {
+    free(st);
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "cannot stub %S hook", mrb_symbol_value(type));
+  }
+  def[0] = klass;
+  def[1] = mrb_symbol_value(type);
+  def[2] = name;
+  def[3] = (strcmp(tname, "timer") == 0 || strcmp(tname, "fd") == 0) ? mrb_nil_value() : mrb_fixnum_value(pri);
+  st->def = mrb_ary_new_from_values(mrb, 4, def);
+  mrb_gc_register(mrb, st->def);
+  st->next = hex_stubs;
+  hex_stubs = st;
+  return mrb_nil_value();
+}
+
+// HexChat::Internal.unstub(Class or nil)
+// Unhooks the stubs of a plugin class, or all of them, returns how many
+static mrb_value
+hex_mrb_xi_unstub(mrb_state *mrb, mrb_value self)
+{
+  mrb_value klass;
+  struct hex_mrb_stub **link = &hex_stubs;
+  mrb_int count = 0;
+  mrb_get_args(mrb, "o", &klass);
+  while (*link != NULL) {
+    struct hex_mrb_stub *st = *link;
+    if (mrb_nil_p(klass) || mrb_obj_equal(mrb, mrb_ary_ref(mrb, st->def, 0), klass)) {
+      *link = st->next;
+      hexchat_unhook(ph, st->hook);
+      mrb_gc_unregister(mrb, st->def);
+      free(st);
+      count++;
+    } else {
+      link = &st->next;
+    }
+  }
+  return mrb_fixnum_value(count);
+}
+
 // HexChat::Internal::Hook.initialize(Block)
 static mrb_value
 hex_mrb_xh_initialize(mrb_state *mrb, mrb_value self)
@@ -1002,6 +8914,32 @@ hex_mrb_internal_begin(mrb_state *mrb)
   cxt_class = mrb_define_class_under(mrb, internal_class, "Context", mrb->object_class);
   list_class = mrb_define_class_under(mrb, internal_class, "List", mrb->object_class);
   hook_class = mrb_define_class_under(mrb, internal_class, "Hook", mrb->object_class);
+  attrs_class = mrb_define_class_under(mrb, internal_class, "EventAttrs", mrb->object_class);
+  maskset_class = mrb_define_class_under(mrb, internal_class, "MaskSet", mrb->object_class);
+  MRB_SET_INSTANCE_TT(maskset_class, MRB_TT_DATA);
+  rate_class = mrb_define_class_under(mrb, internal_class, "RateTracker", mrb->object_class);
+  MRB_SET_INSTANCE_TT(rate_class, MRB_TT_DATA);
+  logger_class = mrb_define_class_under(mrb, internal_class, "Logger", mrb->object_class);
+  MRB_SET_INSTANCE_TT(logger_class, MRB_TT_DATA);
+  socket_class = mrb_define_class_under(mrb, internal_class, "Socket", mrb->object_class);
+  MRB_SET_INSTANCE_TT(socket_class, MRB_TT_DATA);
+  process_class = mrb_define_class_under(mrb, internal_class, "Process", mrb->object_class);
+  MRB_SET_INSTANCE_TT(process_class, MRB_TT_DATA);
+  budget_class = mrb_define_class_under(mrb, hexchat_module, "BudgetExceeded", E_RUNTIME_ERROR);
+  for (int i = 0; hex_info_keys[i] != NULL; i++) {
+    char ivar[32];
+    snprintf(ivar, sizeof(ivar), "@__info_%s", hex_info_keys[i]);
+    hex_info_syms[i] = mrb_intern_cstr(mrb, ivar);
+  }
+  for (int i = 0; hex_info_global_keys[i] != NULL; i++) {
+    hex_info_global[i] = mrb_nil_value();
+  }
+  hex_prefs_cache = mrb_hash_new(mrb);
+  mrb_gc_register(mrb, hex_prefs_cache);
+  hex_mrb_casemap_init();
+  hex_intern_keep = mrb_ary_new(mrb);
+  mrb_gc_register(mrb, hex_intern_keep);
+  hex_mrb_intern_reset(mrb, HEX_MRB_INTERN_MIN);
   // HexChat constants
   mrb_define_const(mrb, hexchat_module, "STRIP_COLOR", mrb_fixnum_value((mrb_int)1));
   mrb_define_const(mrb, hexchat_module, "STRIP_ATTR",  mrb_fixnum_value((mrb_int)2));
@@ -1019,6 +8957,9 @@ hex_mrb_internal_begin(mrb_state *mrb)
   mrb_define_const(mrb, hexchat_module, "EAT_HEXCHAT", mrb_fixnum_value((mrb_int)HEXCHAT_EAT_HEXCHAT));
   mrb_define_const(mrb, hexchat_module, "EAT_PLUGIN",  mrb_fixnum_value((mrb_int)HEXCHAT_EAT_PLUGIN));
   mrb_define_const(mrb, hexchat_module, "EAT_ALL",     mrb_fixnum_value((mrb_int)HEXCHAT_EAT_ALL));
+  mrb_define_const(mrb, hexchat_module, "QUEUE_HIGH",  mrb_fixnum_value((mrb_int)HEX_MRB_QUEUE_HIGH));
+  mrb_define_const(mrb, hexchat_module, "QUEUE_NORM",  mrb_fixnum_value((mrb_int)HEX_MRB_QUEUE_NORM));
+  mrb_define_const(mrb, hexchat_module, "QUEUE_LOW",   mrb_fixnum_value((mrb_int)HEX_MRB_QUEUE_LOW));
   // HexChat::Internal methods
   mrb_define_class_method(mrb, internal_class, "print",     hex_mrb_xi_print, MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, internal_class, "command",   hex_mrb_xi_command, MRB_ARGS_REQ(1));
@@ -1030,8 +8971,55 @@ hex_mrb_internal_begin(mrb_state *mrb)
   mrb_define_class_method(mrb, internal_class, "pluginpref_set_int", hex_mrb_xi_pluginpref_set_int, MRB_ARGS_REQ(2));
   mrb_define_class_method(mrb, internal_class, "pluginpref_get_int", hex_mrb_xi_pluginpref_get_int, MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, internal_class, "nickcmp",   hex_mrb_xi_nickcmp, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, internal_class, "intern",       hex_mrb_xi_intern, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "intern_key",   hex_mrb_xi_intern_key, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "intern_clear", hex_mrb_xi_intern_clear, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "intern_size",  hex_mrb_xi_intern_size, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "casemapping",  hex_mrb_xi_casemapping, MRB_ARGS_NONE());
   mrb_define_class_method(mrb, internal_class, "emit_print", hex_mrb_xi_emit_print, MRB_ARGS_ARG(1,6));
+  mrb_define_class_method(mrb, internal_class, "emit_print_batch", hex_mrb_xi_emit_print_batch, MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, internal_class, "load",      hex_mrb_xi_load, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "watchdog",    hex_mrb_xi_watchdog, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, internal_class, "mem_owner",   hex_mrb_xi_mem_owner, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "mem_limit",   hex_mrb_xi_mem_limit, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, internal_class, "mem_stats",   hex_mrb_xi_mem_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "pool",        hex_mrb_xi_pool, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "pool_stats",  hex_mrb_xi_pool_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "trace_start", hex_mrb_xi_trace_start, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "trace_stop",  hex_mrb_xi_trace_stop, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "scripts_watch",   hex_mrb_xi_scripts_watch, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, internal_class, "scripts_unwatch", hex_mrb_xi_scripts_unwatch, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "scripts_watched", hex_mrb_xi_scripts_watched, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "state_dump",  hex_mrb_xi_state_dump, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "state_load",  hex_mrb_xi_state_load, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "stub",        hex_mrb_xi_stub, MRB_ARGS_ARG(3,2));
+  mrb_define_class_method(mrb, internal_class, "unstub",      hex_mrb_xi_unstub, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "startup_stats", hex_mrb_xi_startup_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "metrics",        hex_mrb_xi_metrics, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "metrics_listen", hex_mrb_xi_metrics_listen, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "metrics_close",  hex_mrb_xi_metrics_close, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, mrb_module_get(mrb, "GC"), "start", hex_mrb_gc_start, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "history_enable",   hex_mrb_xi_history_enable, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, internal_class, "history_disable",  hex_mrb_xi_history_disable, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "history_search",   hex_mrb_xi_history_search, MRB_ARGS_REQ(6));
+  mrb_define_class_method(mrb, internal_class, "history_contexts", hex_mrb_xi_history_contexts, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "history_stats",    hex_mrb_xi_history_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "archive_enable",   hex_mrb_xi_archive_enable, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "archive_disable",  hex_mrb_xi_archive_disable, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "archive_flush",    hex_mrb_xi_archive_flush, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "archive_search",   hex_mrb_xi_archive_search, MRB_ARGS_REQ(6));
+  mrb_define_class_method(mrb, internal_class, "archive_stats",    hex_mrb_xi_archive_stats, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "queue_command",   hex_mrb_xi_queue_command, MRB_ARGS_ARG(1,1));
+  mrb_define_class_method(mrb, internal_class, "queue_mode",      hex_mrb_xi_queue_mode, MRB_ARGS_ARG(2,1));
+  mrb_define_class_method(mrb, internal_class, "queue_cancel",    hex_mrb_xi_queue_cancel, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "queue_clear",     hex_mrb_xi_queue_clear, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "queue_pending",   hex_mrb_xi_queue_pending, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, internal_class, "queue_configure", hex_mrb_xi_queue_configure, MRB_ARGS_REQ(2));
+  mrb_define_class_method(mrb, internal_class, "whois_lookup", hex_mrb_xi_whois_lookup, MRB_ARGS_ARG(2,1));
+  mrb_define_class_method(mrb, internal_class, "whois_cached", hex_mrb_xi_whois_cached, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, internal_class, "whois_forget", hex_mrb_xi_whois_forget, MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, internal_class, "whois_configure", hex_mrb_xi_whois_configure, MRB_ARGS_REQ(3));
+  mrb_define_class_method(mrb, internal_class, "whois_stats", hex_mrb_xi_whois_stats, MRB_ARGS_NONE());
   // HexChat::Internal::Context methods
   mrb_define_class_method(mrb, cxt_class, "current",  hex_mrb_xc_current, MRB_ARGS_NONE());
   mrb_define_class_method(mrb, cxt_class, "find",     hex_mrb_xc_find, MRB_ARGS_OPT(2));
@@ -1039,11 +9027,14 @@ hex_mrb_internal_begin(mrb_state *mrb)
   mrb_define_method(mrb, cxt_class, "set",        hex_mrb_xc_set, MRB_ARGS_NONE());
   mrb_define_method(mrb, cxt_class, "null?",      hex_mrb_xc_null, MRB_ARGS_NONE());
   mrb_define_method(mrb, cxt_class, "ptr",        hex_mrb_xc_ptr, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cxt_class, "==",         hex_mrb_xc_eq, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cxt_class, "current?",   hex_mrb_xc_current_q, MRB_ARGS_NONE());
   // HexChat::Internal::List methods
   mrb_define_class_method(mrb, list_class, "get",     hex_mrb_xl_get, MRB_ARGS_REQ(1));
   mrb_define_class_method(mrb, list_class, "fields",  hex_mrb_xl_fields, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, list_class, "next",    hex_mrb_xl_next, MRB_ARGS_NONE());
   mrb_define_method(mrb, list_class, "str",     hex_mrb_xl_str, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, list_class, "istr",    hex_mrb_xl_istr, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, list_class, "int",     hex_mrb_xl_int, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, list_class, "time",    hex_mrb_xl_time, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, list_class, "cxt",     hex_mrb_xl_cxt, MRB_ARGS_REQ(1));
@@ -1053,16 +9044,72 @@ hex_mrb_internal_begin(mrb_state *mrb)
   mrb_define_method(mrb, list_class, "ptr", 	hex_mrb_xl_ptr, MRB_ARGS_NONE());
   // HexChat::Internal::Hook methods
   mrb_define_method(mrb, hook_class, "hooked?",       hex_mrb_xh_hooked, MRB_ARGS_NONE());
+  mrb_define_method(mrb, hook_class, "fire",          hex_mrb_xh_fire, MRB_ARGS_ANY());
   mrb_define_method(mrb, hook_class, "info",          hex_mrb_xh_info, MRB_ARGS_NONE());
   mrb_define_method(mrb, hook_class, "set_ref",       hex_mrb_xh_set_ref, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, hook_class, "get_ref",       hex_mrb_xh_get_ref, MRB_ARGS_NONE());
   mrb_define_method(mrb, hook_class, "unhook",        hex_mrb_xh_unhook, MRB_ARGS_NONE());
+  mrb_define_method(mrb, hook_class, "set_budget",    hex_mrb_xh_set_budget, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, hook_class, "coalesce",      hex_mrb_xh_coalesce, MRB_ARGS_ARG(1,2));
+  mrb_define_method(mrb, hook_class, "overruns",      hex_mrb_xh_overruns, MRB_ARGS_NONE());
+  mrb_define_method(mrb, hook_class, "disabled?",     hex_mrb_xh_disabled, MRB_ARGS_NONE());
   mrb_define_method(mrb, hook_class, "hook_command",  hex_mrb_xh_hook_command, MRB_ARGS_ARG(2,1));
   mrb_define_method(mrb, hook_class, "hook_fd",       hex_mrb_xh_hook_fd, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, hook_class, "hook_print",    hex_mrb_xh_hook_print, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, hook_class, "hook_server",   hex_mrb_xh_hook_server, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, hook_class, "hook_print_attrs",  hex_mrb_xh_hook_print_attrs, MRB_ARGS_ARG(1,1));
+  mrb_define_method(mrb, hook_class, "hook_server_attrs", hex_mrb_xh_hook_server_attrs, MRB_ARGS_ARG(1,1));
   mrb_define_method(mrb, hook_class, "hook_timer",    hex_mrb_xh_hook_timer, MRB_ARGS_REQ(1));
   mrb_define_method(mrb, hook_class, "initialize",    hex_mrb_xh_initialize, MRB_ARGS_REQ(1));
+  // HexChat::Internal::EventAttrs methods
+  mrb_define_method(mrb, attrs_class, "server_time_utc", hex_mrb_xa_server_time_utc, MRB_ARGS_NONE());
+  // HexChat::Internal::MaskSet methods
+  mrb_define_method(mrb, maskset_class, "initialize", hex_mrb_xm_initialize, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, maskset_class, "add",        hex_mrb_xm_add, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, maskset_class, "remove",     hex_mrb_xm_remove, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, maskset_class, "include?",   hex_mrb_xm_include, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, maskset_class, "match",      hex_mrb_xm_match, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, maskset_class, "match?",     hex_mrb_xm_match_q, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, maskset_class, "masks",      hex_mrb_xm_masks, MRB_ARGS_NONE());
+  mrb_define_method(mrb, maskset_class, "size",       hex_mrb_xm_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, maskset_class, "clear",      hex_mrb_xm_clear, MRB_ARGS_NONE());
+  mrb_define_method(mrb, maskset_class, "stats",      hex_mrb_xm_stats, MRB_ARGS_NONE());
+  // HexChat::Internal::RateTracker methods
+  mrb_define_method(mrb, rate_class, "initialize", hex_mrb_xr_initialize, MRB_ARGS_ARG(2,2));
+  mrb_define_method(mrb, rate_class, "hit",        hex_mrb_xr_hit, MRB_ARGS_ARG(1,2));
+  mrb_define_method(mrb, rate_class, "count",      hex_mrb_xr_count, MRB_ARGS_ARG(1,1));
+  mrb_define_method(mrb, rate_class, "delete",     hex_mrb_xr_delete, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, rate_class, "size",       hex_mrb_xr_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, rate_class, "clear",      hex_mrb_xr_clear, MRB_ARGS_NONE());
+  // HexChat::Internal::Logger methods
+  mrb_define_method(mrb, logger_class, "initialize", hex_mrb_xg_initialize, MRB_ARGS_REQ(5));
+#ifndef WIN32
+  mrb_define_method(mrb, logger_class, "write",      hex_mrb_xg_write, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, logger_class, "flush",      hex_mrb_xg_flush, MRB_ARGS_NONE());
+  mrb_define_method(mrb, logger_class, "close",      hex_mrb_xg_close, MRB_ARGS_NONE());
+  mrb_define_method(mrb, logger_class, "stats",      hex_mrb_xg_stats, MRB_ARGS_NONE());
+#endif
+  // HexChat::Internal::Socket methods
+  mrb_define_method(mrb, socket_class, "initialize", hex_mrb_xs_initialize, MRB_ARGS_REQ(6));
+#ifndef WIN32
+  mrb_define_method(mrb, socket_class, "service",    hex_mrb_xs_service, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, socket_class, "write",      hex_mrb_xs_write, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, socket_class, "fd",         hex_mrb_xs_fd, MRB_ARGS_NONE());
+  mrb_define_method(mrb, socket_class, "state",      hex_mrb_xs_state, MRB_ARGS_NONE());
+  mrb_define_method(mrb, socket_class, "flags",      hex_mrb_xs_flags, MRB_ARGS_NONE());
+  mrb_define_method(mrb, socket_class, "close",      hex_mrb_xs_close, MRB_ARGS_NONE());
+  mrb_define_method(mrb, socket_class, "stats",      hex_mrb_xs_stats, MRB_ARGS_NONE());
+#endif
+  // HexChat::Internal::Process methods
+  mrb_define_method(mrb, process_class, "initialize", hex_mrb_xp_initialize, MRB_ARGS_REQ(3));
+#ifndef WIN32
+  mrb_define_method(mrb, process_class, "service",    hex_mrb_xp_service, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, process_class, "reap",       hex_mrb_xp_reap, MRB_ARGS_NONE());
+  mrb_define_method(mrb, process_class, "kill",       hex_mrb_xp_kill, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, process_class, "close",      hex_mrb_xp_close, MRB_ARGS_NONE());
+  mrb_define_method(mrb, process_class, "fds",        hex_mrb_xp_fds, MRB_ARGS_NONE());
+  mrb_define_method(mrb, process_class, "pid",        hex_mrb_xp_pid, MRB_ARGS_NONE());
+#endif
   mrbc_filename(mrb, c, mrb_file_internal);
   c->lineno = 1;
   //mrb_load_string_cxt(mrb, xchat_rb, c);
@@ -1076,6 +9123,104 @@ hex_mrb_internal_begin(mrb_state *mrb)
   mrbc_filename(mrb, c, mrb_file_none);
 }
 
+// Compile a console statement, or fetch it from the cache
+// Statements are only reused while no new locals have been defined,
+// since the register layout of a compiled statement depends on them.
+static mrb_value
+hex_mrb_console_compile(mrb_state *mrb, const char *src)
+{
+  unsigned int h = 2166136261u;
+  struct hex_mrb_console_stmt *stmt;
+  mrb_value proc;
+  int slen = console_cxt->slen;
+  for (const char *p = src; *p; p++) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  stmt = &console_cache[h % HEX_MRB_CONSOLE_CACHE];
+  if (stmt->src != NULL && stmt->slen == slen && strcmp(stmt->src, src) == 0) {
+    return stmt->proc;
+  }
+  console_cxt->no_exec = TRUE;
+  proc = mrb_load_string_cxt(mrb, src, console_cxt);
+  console_cxt->no_exec = FALSE;
+  if (mrb->exc || !mrb_proc_p(proc)) {
+    return mrb_nil_value();
+  }
+  // Only cache statements that didn't define new locals
+  if (console_cxt->slen == slen) {
+    if (stmt->src != NULL) {
+      free(stmt->src);
+      mrb_gc_unregister(mrb, stmt->proc);
+    }
+    stmt->src = strdup(src);
+    stmt->slen = console_cxt->slen;
+    stmt->proc = proc;
+    mrb_gc_register(mrb, stmt->proc);
+  }
+  return proc;
+}
+
+// Free compiled console statements
+static void
+hex_mrb_console_cache_free(mrb_state *mrb)
+{
+  for (int i = 0; i < HEX_MRB_CONSOLE_CACHE; i++) {
+    if (console_cache[i].src != NULL) {
+      free(console_cache[i].src);
+      mrb_gc_unregister(mrb, console_cache[i].proc);
+      console_cache[i].src = NULL;
+    }
+  }
+}
+
+// Handle stuff directed at the MRuby "console"
+// Only hooked while the console window is open
+static int
+mruby_console (char *word[], char *word_eol[], mrb_state *mrb)
+{
+  if (hexchat_get_context(ph) == console_hc) {
+    mrb_value v;
+    mrb_value inspect;
+    hexchat_printf(ph, "[%d]> %s", console_cxt->lineno, word_eol[1]);
+    mrbc_filename(mrb, console_cxt, mrb_file_console);
+    v = hex_mrb_console_compile(mrb, word_eol[1]);
+    if (!mrb->exc && mrb_proc_p(v)) {
+      unsigned int keep = console_cxt->keep_lv ? console_cxt->slen + 1 : 0;
+      console_cxt->keep_lv = TRUE;
+      v = mrb_toplevel_run_keep(mrb, mrb_proc_ptr(v), keep);
+    }
+    if (mrb->exc) {
+      hex_mrb_print_exc(mrb);
+      mrb->exc = 0;
+      v = mrb_nil_value();
+    }
+    inspect = mrb_inspect(mrb, v);
+    hexchat_printf(ph, "=> %s", mrb_str_to_cstr(mrb, inspect));
+    console_cxt->lineno++;
+    return HEXCHAT_EAT_ALL;
+  }
+  return HEXCHAT_EAT_NONE;
+}
+
+// Open the console window, or focus it if it's already open
+static void
+hex_mrb_console_open(mrb_state *mrb)
+{
+  if (console_cxt == NULL) {
+    console_cxt = mrbc_context_new(mrb);
+    console_cxt->lineno = 1;
+  }
+  if (console_hc != NULL && hexchat_set_context(ph, console_hc)) {
+    hexchat_command(ph, "gui focus");
+    return;
+  }
+  hexchat_command(ph, "query >>MRuby<<");
+  console_hc = hexchat_find_context(ph, NULL, ">>MRuby<<");
+  if (console_hc != NULL && console_hook == NULL) {
+    console_hook = hexchat_hook_command(ph, "", HEXCHAT_PRI_NORM, (void *)mruby_console, NULL, (void *)mrb);
+  }
+}
+
 // Clean up in preparation for shutdown
 static void
 hex_mrb_internal_end(mrb_state *mrb)
@@ -1096,9 +9241,43 @@ hex_mrb_internal_end(mrb_state *mrb)
   } else {
     hexchat_print(ph, "Warning: HexChat::Internal#cleanup not defined, possible leaks!");
   }
+  if (console_hook != NULL) {
+    hexchat_unhook(ph, console_hook);
+    console_hook = NULL;
+  }
+  hex_mrb_console_cache_free(mrb);
   if (console_cxt != NULL) {
     mrbc_context_free(mrb, console_cxt);
   }
+  hex_mrb_queue_free_all();
+  hex_mrb_whois_free_all(mrb);
+  hex_mrb_metrics_close();
+  hex_mrb_scripts_unwatch();
+  hex_mrb_history_free_all();
+  hex_mrb_archive_stop();
+  hex_mrb_server_free_all();
+  hex_mrb_context_free_all(mrb);
+  if (hex_info_timer != NULL) {
+    hexchat_unhook(ph, hex_info_timer);
+    hex_info_timer = NULL;
+  }
+  while (hex_stubs != NULL) {
+    struct hex_mrb_stub *st = hex_stubs;
+    hex_stubs = st->next;
+    hexchat_unhook(ph, st->hook);
+    mrb_gc_unregister(mrb, st->def);
+    free(st);
+  }
+  if (hex_autoload_timer != NULL) {
+    hexchat_unhook(ph, hex_autoload_timer);
+    hex_autoload_timer = NULL;
+  }
+  hex_mrb_startup_free();
+  hex_mrb_list_fields_free(mrb);
+  free(hex_intern);
+  hex_intern = NULL;
+  mrb_free(mrb, hex_trace);
+  hex_trace = NULL;
 }
 
 // Handle the /MRB command
@@ -1109,22 +9288,23 @@ static int
 hex_mrb_command_eval (char *word[], char *word_eol[], mrb_state *mrb)
 {
   if (strlen(word_eol[2]) == 0) {
-    if (console_cxt == NULL) {
-            console_cxt = mrbc_context_new(mrb);
-            console_cxt->lineno = 1;
-    }
-    hexchat_command(ph, "query >>MRuby<<");
+    hex_mrb_console_open(mrb);
   } else {
     char *cmd = word[2];
     if (strcasecmp(cmd, "EVAL") == 0) {
       mrb_value v;
       mrb_value inspect;
+      uint64_t start = hex_mrb_trace_begin();
       mrbc_context *c = mrbc_context_new(mrb);
       c->lineno = 1;
       mrbc_filename(mrb, c, mrb_file_eval);
       v = mrb_load_string_cxt(mrb, word_eol[3], c);
       mrbc_context_free(mrb, c);
+      if (start) {
+        hex_mrb_trace_end(start, "eval", word_eol[3], "");
+      }
       if (mrb->exc) {
+                      hex_metric_eval_errors++;
                       hexchat_print(ph, "MRuby: Error evaluating code:");
               hex_mrb_print_exc(mrb);
               mrb->exc = 0;
@@ -1158,28 +9338,25 @@ hex_mrb_command_eval (char *word[], char *word_eol[], mrb_state *mrb)
   return HEXCHAT_EAT_ALL;
 }
 
-// Handle stuff directed at the MRuby "console"
+// Timer callback - autoload scripts once HexChat has finished starting up
 static int
-mruby_console (char *word[], char *word_eol[], mrb_state *mrb)
+hex_mrb_autoload_cb(void *userdata)
 {
-  char *channel = (char *)hexchat_get_info(ph, "channel");
-  if (channel && channel[0] == '>' && strcmp(channel, ">>MRuby<<") == 0) {
-    mrb_value v;
-    mrb_value inspect;
-    hexchat_printf(ph, "[%d]> %s", console_cxt->lineno, word_eol[1]);
-    mrbc_filename(mrb, console_cxt, mrb_file_console);
-    v = mrb_load_string_cxt(mrb, word_eol[1], console_cxt);
-    if (mrb->exc) {
-      hex_mrb_print_exc(mrb);
-      mrb->exc = 0;
-      v = mrb_nil_value();
-    }
-    inspect = mrb_inspect(mrb, v);
-    hexchat_printf(ph, "=> %s", mrb_str_to_cstr(mrb, inspect));
-    console_cxt->lineno++;
-    return HEXCHAT_EAT_ALL;
+  mrb_state *mrb = (mrb_state *)userdata;
+  struct RClass *plugin = mrb_class_get_under(mrb, hexchat_module, "Plugin");
+  struct RClass *registry = mrb_class_get_under(mrb, plugin, "Registry");
+  hex_autoload_timer = NULL;
+  hex_mrb_startup_phase("waiting");
+  hex_startup_loading = 1;
+  mrb_funcall(mrb, mrb_obj_value(registry), "autoload", 0);
+  hex_startup_loading = 0;
+  if (mrb->exc) {
+    hexchat_print(ph, "error autoloading scripts");
+    hex_mrb_print_exc(mrb);
+    mrb->exc = 0;
   }
-  return HEXCHAT_EAT_NONE;
+  hex_mrb_startup_phase("autoload");
+  return 0;
 }
 
 // HexChat interfacing - plugin info
@@ -1217,18 +9394,33 @@ hexchat_plugin_init (hexchat_plugin * plugin_handle, char **plugin_name,
   *plugin_version = MRUBY_VERSION;
 
   hexchat_printf (ph, "MRuby %s plugin initializing", MRUBY_VERSION);
+  hex_startup_mark = hex_mrb_clock_ns();
   // Initialize MRuby interpreter
-  mrb = mrb_open();
+  hex_mrb_pool_init();
+  if (getenv("HEXCHAT_MRB_POOL") != NULL && strcmp(getenv("HEXCHAT_MRB_POOL"), "0") == 0) {
+    hex_pool_on = 0;
+  }
+  mrb = mrb_open_allocf(hex_mrb_allocf, NULL);
   if (mrb == NULL) {
     hexchat_print (ph, "Invalid mrb_state");
     return HEXCHAT_EAT_HEXCHAT;
   }
   hex_g_mrb = mrb;
+  hex_mrb_startup_phase("interpreter");
   mrb_gv_set(mrb, mrb_intern_lit(mrb, "$0"), mrb_str_new_cstr(mrb, "(HexChat)"));
   hex_mrb_internal_begin(mrb);
+  hex_mrb_startup_phase("library");
 
   hexchat_hook_command (ph, "mrb", HEXCHAT_PRI_NORM, (void *)hex_mrb_command_eval, "MRB [<command>] opens MRuby console or, if given, runs command (see MRB HELP)", (void *)mrb);
-  hexchat_hook_command (ph, "", HEXCHAT_PRI_NORM, (void *)mruby_console, NULL, (void *)mrb);
+  hexchat_hook_server (ph, "005", HEXCHAT_PRI_NORM, hex_mrb_isupport_cb, NULL);
+  hexchat_hook_print (ph, "Open Context", HEXCHAT_PRI_HIGHEST, hex_mrb_context_change_cb, NULL);
+  hexchat_hook_print (ph, "Focus Tab", HEXCHAT_PRI_HIGHEST, hex_mrb_context_change_cb, NULL);
+  hexchat_hook_print (ph, "Close Context", HEXCHAT_PRI_LOWEST, (void *)hex_mrb_context_close_cb, (void *)mrb);
+  hex_mrb_info_hook(mrb);
+  hex_mrb_whois_hook(mrb);
+  hex_mrb_startup_phase("hooks");
+  // Scripts load after HexChat finishes starting, not while it waits on us
+  hex_autoload_timer = hexchat_hook_timer(ph, 0, hex_mrb_autoload_cb, (void *)mrb);
 
   hexchat_printf (ph, "MRuby %s plugin loaded", MRUBY_VERSION);
 
@@ -1241,6 +9433,20 @@ hexchat_plugin_deinit(hexchat_plugin *plugin_handle)
 {
   hex_mrb_internal_end(hex_g_mrb);
   mrb_close(hex_g_mrb);
+  // After mrb_close, which kills the children of unreferenced Process objects
+  hex_mrb_orphans_free();
+#ifndef WIN32
+  // After mrb_close, so every Logger object has let go of its logger
+  hex_mrb_log_stop();
+#endif
+  // Every block mruby had is freed by now
+  hex_mrb_pool_free_all();
+  for (uint32_t i = 1; i < hex_mem_owner_count; i++) {
+    free(hex_mem_owners[i].name);
+  }
+  memset(hex_mem_owners, 0, sizeof(hex_mem_owners));
+  hex_mem_owner_count = 1;
+  hex_mem_current = 0;
 
   initialized = 0;
   hexchat_printf(plugin_handle, "MRuby %s interface unloaded", MRUBY_VERSION);
@@ -0,0 +1,866 @@
+/**********************
+ *
+ * Unit tests for the C helpers of the MRuby plugin that run without
+ * HexChat or an interpreter.  mruby.c is included so its static
+ * functions can be reached.  The HexChat API is stubbed out below.
+ * Run with rake test.
+ *
+ **********************/
+
+// mruby.c defines this too, but only after these headers are in
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "../mruby.c"
+
+// HexChat provides these when it loads the plugin.  The helpers under
+// test reach only a few of them, the rest are here so the test links
+// without leaving any symbol unresolved.
+static char test_hook;
+
+hexchat_hook *
+hexchat_hook_command(hexchat_plugin *ph, const char *name, int pri,
+                     int (*callback)(char *word[], char *word_eol[], void *user_data),
+                     const char *help_text, void *userdata)
+{
+  return (hexchat_hook *)&test_hook;
+}
+
+hexchat_hook *
+hexchat_hook_server(hexchat_plugin *ph, const char *name, int pri,
+                    int (*callback)(char *word[], char *word_eol[], void *user_data), void *userdata)
+{
+  return (hexchat_hook *)&test_hook;
+}
+
+hexchat_hook *
+hexchat_hook_server_attrs(hexchat_plugin *ph, const char *name, int pri,
+                          int (*callback)(char *word[], char *word_eol[], hexchat_event_attrs *attrs, void *user_data),
+                          void *userdata)
+{
+  return (hexchat_hook *)&test_hook;
+}
+
+hexchat_hook *
+hexchat_hook_print(hexchat_plugin *ph, const char *name, int pri,
+                   int (*callback)(char *word[], void *user_data), void *userdata)
+{
+  return (hexchat_hook *)&test_hook;
+}
+
+hexchat_hook *
+hexchat_hook_print_attrs(hexchat_plugin *ph, const char *name, int pri,
+                         int (*callback)(char *word[], hexchat_event_attrs *attrs, void *user_data),
+                         void *userdata)
+{
+  return (hexchat_hook *)&test_hook;
+}
+
+hexchat_hook *
+hexchat_hook_timer(hexchat_plugin *ph, int timeout, int (*callback)(void *user_data), void *userdata)
+{
+  return (hexchat_hook *)&test_hook;
+}
+
+hexchat_hook *
+hexchat_hook_fd(hexchat_plugin *ph, int fd, int flags,
+                int (*callback)(int fd, int flags, void *user_data), void *userdata)
+{
+  return (hexchat_hook *)&test_hook;
+}
+
+void *
+hexchat_unhook(hexchat_plugin *ph, hexchat_hook *hook)
+{
+  return NULL;
+}
+
+void
+hexchat_print(hexchat_plugin *ph, const char *text)
+{
+}
+
+void
+hexchat_printf(hexchat_plugin *ph, const char *format, ...)
+{
+}
+
+void
+hexchat_command(hexchat_plugin *ph, const char *command)
+{
+}
+
+int
+hexchat_emit_print(hexchat_plugin *ph, const char *event_name, ...)
+{
+  return 1;
+}
+
+int
+hexchat_emit_print_attrs(hexchat_plugin *ph, hexchat_event_attrs *attrs, const char *event_name, ...)
+{
+  return 1;
+}
+
+hexchat_event_attrs *
+hexchat_event_attrs_create(hexchat_plugin *ph)
+{
+  return NULL;
+}
+
+void
+hexchat_event_attrs_free(hexchat_plugin *ph, hexchat_event_attrs *attrs)
+{
+}
+
+int
+hexchat_set_context(hexchat_plugin *ph, hexchat_context *ctx)
+{
+  return 1;
+}
+
+hexchat_context *
+hexchat_find_context(hexchat_plugin *ph, const char *servname, const char *channel)
+{
+  return NULL;
+}
+
+hexchat_context *
+hexchat_get_context(hexchat_plugin *ph)
+{
+  return NULL;
+}
+
+const char *
+hexchat_get_info(hexchat_plugin *ph, const char *id)
+{
+  return NULL;
+}
+
+int
+hexchat_get_prefs(hexchat_plugin *ph, const char *name, const char **string, int *integer)
+{
+  return 0;
+}
+
+hexchat_list *
+hexchat_list_get(hexchat_plugin *ph, const char *name)
+{
+  return NULL;
+}
+
+void
+hexchat_list_free(hexchat_plugin *ph, hexchat_list *xlist)
+{
+}
+
+const char * const *
+hexchat_list_fields(hexchat_plugin *ph, const char *name)
+{
+  return NULL;
+}
+
+int
+hexchat_list_next(hexchat_plugin *ph, hexchat_list *xlist)
+{
+  return 0;
+}
+
+const char *
+hexchat_list_str(hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+  return NULL;
+}
+
+int
+hexchat_list_int(hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+  return 0;
+}
+
+time_t
+hexchat_list_time(hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+  return 0;
+}
+
+void
+hexchat_send_modes(hexchat_plugin *ph, const char **targets, int ntargets, int modes_per_line, char sign, char mode)
+{
+}
+
+char *
+hexchat_strip(hexchat_plugin *ph, const char *str, int len, int flags)
+{
+  return NULL;
+}
+
+void
+hexchat_free(hexchat_plugin *ph, void *ptr)
+{
+}
+
+int
+hexchat_pluginpref_set_str(hexchat_plugin *ph, const char *var, const char *value)
+{
+  return 0;
+}
+
+int
+hexchat_pluginpref_get_str(hexchat_plugin *ph, const char *var, char *dest)
+{
+  return 0;
+}
+
+int
+hexchat_pluginpref_set_int(hexchat_plugin *ph, const char *var, int value)
+{
+  return 0;
+}
+
+int
+hexchat_pluginpref_get_int(hexchat_plugin *ph, const char *var)
+{
+  return -1;
+}
+
+static int test_checks = 0;
+static int test_failures = 0;
+
+// Record a check, print where it failed
+#define CHECK(cond) do { \
+  test_checks++; \
+  if (!(cond)) { \
+    test_failures++; \
+    fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+  } \
+} while (0)
+
+// A queue item with just text, for the queue tests
+static struct hex_mrb_queue_item*
+test_queue_item(mrb_int id, const char *text)
+{
+  struct hex_mrb_queue_item *item = calloc(1, sizeof(struct hex_mrb_queue_item));
+  item->id = id;
+  item->text = strdup(text);
+  return item;
+}
+
+// Append to a lane as hex_mrb_queue_push does
+static void
+test_queue_append(struct hex_mrb_queue *q, int lane, struct hex_mrb_queue_item *item)
+{
+  if (q->tail[lane] != NULL) {
+    q->tail[lane]->next = item;
+  } else {
+    q->head[lane] = item;
+  }
+  q->tail[lane] = item;
+}
+
+// Lanes are first in, first out, and emptying one clears its tail
+static void
+test_queue_shift(void)
+{
+  struct hex_mrb_queue q;
+  struct hex_mrb_queue_item *item;
+  memset(&q, 0, sizeof(q));
+  test_queue_append(&q, HEX_MRB_QUEUE_NORM, test_queue_item(1, "a"));
+  test_queue_append(&q, HEX_MRB_QUEUE_NORM, test_queue_item(2, "b"));
+  item = hex_mrb_queue_shift(&q, HEX_MRB_QUEUE_NORM);
+  CHECK(item != NULL && item->id == 1 && item->next == NULL);
+  hex_mrb_queue_item_free(item);
+  item = hex_mrb_queue_shift(&q, HEX_MRB_QUEUE_NORM);
+  CHECK(item != NULL && item->id == 2);
+  hex_mrb_queue_item_free(item);
+  CHECK(q.head[HEX_MRB_QUEUE_NORM] == NULL && q.tail[HEX_MRB_QUEUE_NORM] == NULL);
+  CHECK(hex_mrb_queue_shift(&q, HEX_MRB_QUEUE_HIGH) == NULL);
+}
+
+// The bucket fills at one token per interval and stops at the burst size
+static void
+test_queue_refill(void)
+{
+  struct hex_mrb_queue q;
+  memset(&q, 0, sizeof(q));
+  hex_queue_burst = 5;
+  hex_queue_interval = 2000;
+  q.refilled = 1000000000ULL;
+  hex_mrb_queue_refill(&q, q.refilled + 3000000000ULL);
+  CHECK(q.tokens > 1.49 && q.tokens < 1.51);
+  hex_mrb_queue_refill(&q, q.refilled + 60000000000ULL);
+  CHECK(q.tokens == 5.0);
+}
+
+// Items are dropped by id from any lane, tails stay right
+static void
+test_queue_remove(void)
+{
+  struct hex_mrb_queue *q = hex_mrb_queue_get(42);
+  CHECK(hex_mrb_queue_get(42) == q);
+  test_queue_append(q, HEX_MRB_QUEUE_LOW, test_queue_item(7, "x"));
+  test_queue_append(q, HEX_MRB_QUEUE_LOW, test_queue_item(8, "y"));
+  test_queue_append(q, HEX_MRB_QUEUE_HIGH, test_queue_item(9, "z"));
+  CHECK(hex_mrb_queue_pending_any());
+  CHECK(hex_mrb_queue_remove(8) == 1);
+  CHECK(q->tail[HEX_MRB_QUEUE_LOW] == q->head[HEX_MRB_QUEUE_LOW] && q->head[HEX_MRB_QUEUE_LOW]->id == 7);
+  CHECK(hex_mrb_queue_remove(8) == 0);
+  CHECK(hex_mrb_queue_remove(0) == 2);
+  CHECK(!hex_mrb_queue_pending_any());
+  hex_mrb_queue_free_all();
+}
+
+// Casemapping folds and comparisons
+static void
+test_casefold(void)
+{
+  const unsigned char *rfc = hex_casemap[HEX_MRB_CASEMAP_RFC1459];
+  const unsigned char *strict = hex_casemap[HEX_MRB_CASEMAP_STRICT];
+  const unsigned char *ascii = hex_casemap[HEX_MRB_CASEMAP_ASCII];
+  char out[16];
+  hex_mrb_casemap_init();
+  hex_mrb_casefold(rfc, "Foo[1]~\\", 8, out);
+  CHECK(memcmp(out, "foo{1}^|", 8) == 0);
+  hex_mrb_casefold(strict, "Foo[1]~", 7, out);
+  CHECK(memcmp(out, "foo{1}~", 7) == 0);
+  hex_mrb_casefold(ascii, "Foo[1]", 6, out);
+  CHECK(memcmp(out, "foo[1]", 6) == 0);
+  CHECK(hex_mrb_casecmp(rfc, "Nick[a]", 7, "nick{A}", 7) == 0);
+  CHECK(hex_mrb_casecmp(ascii, "Nick[a]", 7, "nick{A}", 7) != 0);
+  CHECK(hex_mrb_casecmp(rfc, "nick", 4, "nick2", 5) < 0);
+  CHECK(hex_mrb_casecmp(rfc, "\xc9", 1, "\xe9", 1) != 0);
+}
+
+// Folding masks and matching them with wildcards
+static void
+test_mask_fold(void)
+{
+  char buf[32];
+  char *folded;
+  hex_mrb_casemap_init();
+  folded = hex_mrb_mask_fold(HEX_MRB_CASEMAP_RFC1459, "*!*@Host[1].Example", 19, buf, sizeof(buf));
+  CHECK(folded == buf);
+  CHECK(strcmp(folded, "*!*@host{1}.example") == 0);
+  folded = hex_mrb_mask_fold(HEX_MRB_CASEMAP_ASCII, "ABCDEFGH", 8, buf, 8);
+  CHECK(folded != buf && strcmp(folded, "abcdefgh") == 0);
+  free(folded);
+  CHECK(hex_mrb_mask_glob("*!*@*.example", 13, "nick!user@a.example", 19));
+  CHECK(!hex_mrb_mask_glob("*!*@*.example", 13, "nick!user@example", 17));
+  CHECK(hex_mrb_mask_glob("n?ck!*", 6, "nick!u@h", 8));
+  CHECK(hex_mrb_mask_glob("**", 2, "", 0));
+  CHECK(!hex_mrb_mask_glob("?", 1, "", 0));
+  CHECK(hex_mrb_mask_at("a!b@c@d", 7) == 5);
+  CHECK(hex_mrb_mask_at("a!b", 3) == -1);
+  CHECK(hex_mrb_mask_wild("a?b", 3) && !hex_mrb_mask_wild("abc", 3));
+}
+
+// The history arena is allocated on the first line and grows to its limit
+static void
+test_history_arena(void)
+{
+  hexchat_context *c = (hexchat_context *)&test_checks;
+  struct hex_mrb_hist *h;
+  char text[1100];
+  hex_history_lines = 64;
+  hex_history_bytes = 16384;
+  h = hex_mrb_hist_get(c, 1);
+  CHECK(h->arena == NULL && h->arena_size == 0 && h->arena_max == 16384);
+  hex_mrb_hist_append(h, "nick", "hello world");
+  CHECK(h->arena != NULL && h->arena_size == HEX_MRB_HIST_ARENA_MIN);
+  CHECK(h->count == 1 && memcmp(h->arena, "nickhello world", 15) == 0);
+  memset(text, 'x', sizeof(text) - 1);
+  text[sizeof(text) - 1] = 0;
+  for (int i = 0; i < 8; i++) {
+    hex_mrb_hist_append(h, "nick", text);
+  }
+  CHECK(h->arena_size == 16384 && h->count == 9);
+  for (int i = 0; i < 32; i++) {
+    hex_mrb_hist_append(h, "nick", text);
+  }
+  CHECK(h->arena_size == 16384 && h->count < 16);
+  CHECK(hex_mrb_hist_get(c, 0) == h);
+  hex_mrb_history_drop(c);
+  CHECK(hex_mrb_hist_get(c, 0) == NULL);
+}
+
+// Archive block ranges cover server times that go backwards
+static void
+test_archive_range(void)
+{
+  struct hex_mrb_arch_chan ch;
+  memset(&ch, 0, sizeof(ch));
+  ch.buf = malloc(HEX_MRB_ARCH_BLOCK);
+  hex_mrb_arch_append(&ch, 1000, "nick", "live");
+  hex_mrb_arch_append(&ch, 400, "nick", "played back");
+  hex_mrb_arch_append(&ch, 1200, "nick", "live again");
+  CHECK(ch.lines == 3 && ch.first == 400 && ch.last == 1200);
+  CHECK(ch.len == 3 * HEX_MRB_ARCH_REC + 12 + 4 + 11 + 10);
+  free(ch.buf);
+}
+
+// Queue bytes into a logger's ring as HexChat::Internal::Logger#write does
+static void
+test_log_put(struct hex_mrb_logger *lg, const char *text)
+{
+  uint32_t len = (uint32_t)strlen(text);
+  for (uint32_t i = 0; i < len; i++) {
+    lg->ring[(lg->tail + i) & (lg->cap - 1)] = text[i];
+  }
+  lg->tail += len;
+}
+
+// Draining writes the ring out, rotates by size and survives a failed reopen
+static void
+test_log_rotate(void)
+{
+  char dir[] = "/tmp/test_mruby_XXXXXX";
+  char path[64];
+  char rotated[72];
+  struct hex_mrb_logger lg;
+  struct stat st;
+  CHECK(mkdtemp(dir) != NULL);
+  snprintf(path, sizeof(path), "%s/log", dir);
+  snprintf(rotated, sizeof(rotated), "%s/log.1", dir);
+  memset(&lg, 0, sizeof(lg));
+  lg.path = path;
+  lg.keep = 1;
+  lg.max_size = 16;
+  lg.fsync_ns = HEX_MRB_LOG_NEVER;
+  lg.cap = 64;
+  lg.ring = malloc(lg.cap);
+  lg.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  test_log_put(&lg, "0123456789\n");
+  hex_mrb_log_drain(&lg, 0);
+  CHECK(lg.head == lg.tail && lg.written == 11 && lg.rotations == 0);
+  test_log_put(&lg, "abcdefghij\n");
+  hex_mrb_log_drain(&lg, 0);
+  CHECK(lg.head == lg.tail && lg.written == 22 && lg.rotations == 1);
+  CHECK(stat(rotated, &st) == 0 && st.st_size == 11);
+  CHECK(stat(path, &st) == 0 && st.st_size == 11);
+  // The directory is gone, so the reopen after rotating fails
+  unlink(rotated);
+  unlink(path);
+  rmdir(dir);
+  test_log_put(&lg, "klmnopqrst\n");
+  hex_mrb_log_drain(&lg, 0);
+  CHECK(lg.fd < 0 && lg.error == ENOENT && lg.rotations == 2);
+  CHECK(lg.head != lg.tail);
+  hex_mrb_log_drain(&lg, 0);
+  CHECK(lg.fd < 0 && lg.error == ENOENT);
+  free(lg.ring);
+}
+
+// Metrics text helpers and the directories made for the socket
+static void
+test_metrics_helpers(void)
+{
+  struct hex_mrb_strbuf b = { NULL, 0, 0 };
+  char dir[] = "/tmp/test_mruby_XXXXXX";
+  char path[64];
+  struct stat st;
+  hex_mrb_strbuf_printf(&b, "x{plugin=\"");
+  hex_mrb_strbuf_label(&b, "A\"b\\c\nd");
+  hex_mrb_strbuf_printf(&b, "\"} %d\n", 3);
+  CHECK(b.p != NULL && strcmp(b.p, "x{plugin=\"A\\\"b\\\\c\\nd\"} 3\n") == 0);
+  free(b.p);
+  CHECK(mkdtemp(dir) != NULL);
+  snprintf(path, sizeof(path), "%s/a/b/metrics.sock", dir);
+  hex_mrb_mkdirs(path);
+  CHECK(strstr(path, "/a/b/metrics.sock") != NULL);
+  snprintf(path, sizeof(path), "%s/a/b", dir);
+  CHECK(stat(path, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 0777) == 0700);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/a", dir);
+  rmdir(path);
+  rmdir(dir);
+}
+
+// Socket framing: lines drop CR, lengths are big-endian, raw takes all
+static void
+test_socket_frame(void)
+{
+  struct hex_mrb_socket sk;
+  const char *frame = NULL;
+  size_t off = 0, len = 0;
+  char lenbuf[] = "\0\0\0\3abc\0\0";
+  memset(&sk, 0, sizeof(sk));
+  sk.framing = HEX_MRB_SOCK_LINE;
+  sk.max_frame = 4;
+  sk.rbuf = "ab\r\ncd\nef";
+  sk.rlen = strlen(sk.rbuf);
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == 1 && len == 2 && memcmp(frame, "ab", 2) == 0);
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == 1 && len == 2 && memcmp(frame, "cd", 2) == 0);
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == 0 && off == 7);
+  sk.rbuf = "abcdef";
+  sk.rlen = 6;
+  off = 0;
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == -1);
+  sk.framing = HEX_MRB_SOCK_LENGTH;
+  sk.rbuf = lenbuf;
+  sk.rlen = sizeof(lenbuf) - 1;
+  off = 0;
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == 1 && len == 3 && memcmp(frame, "abc", 3) == 0);
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == 0 && off == 7);
+  lenbuf[3] = 5;
+  off = 0;
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == -1);
+  sk.framing = HEX_MRB_SOCK_RAW;
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == 1 && len == sk.rlen && off == sk.rlen);
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == 0);
+}
+
+// A line round trip through a local echo server, as examples/echo.rb
+// does, and names are refused rather than resolved
+static void
+test_socket_echo(void)
+{
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(sa);
+  struct hex_mrb_socket sk;
+  struct pollfd pfd;
+  char buf[64], addr[32];
+  const char *frame = NULL;
+  size_t off = 0, len = 0;
+  ssize_t n;
+  int lfd, cfd, fd, err, gai;
+  CHECK(hex_mrb_socket_open("tcp", "localhost", 7000, &err, &gai) < 0 && gai != 0);
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) == 0 && listen(lfd, 1) == 0);
+  CHECK(getsockname(lfd, (struct sockaddr *)&sa, &salen) == 0);
+  inet_ntop(AF_INET, &sa.sin_addr, addr, sizeof(addr));
+  fd = hex_mrb_socket_open("tcp", addr, ntohs(sa.sin_port), &err, &gai);
+  CHECK(fd >= 0 && err == 0 && gai == 0);
+  CHECK((fcntl(fd, F_GETFL) & O_NONBLOCK) && (fcntl(fd, F_GETFD) & FD_CLOEXEC));
+  cfd = accept(lfd, NULL, NULL);
+  CHECK(cfd >= 0);
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  CHECK(poll(&pfd, 1, 1000) == 1 && write(fd, "hello\r\n", 7) == 7);
+  // The echo server
+  n = read(cfd, buf, sizeof(buf));
+  CHECK(n == 7 && write(cfd, buf, (size_t)n) == n);
+  pfd.events = POLLIN;
+  CHECK(poll(&pfd, 1, 1000) == 1);
+  memset(&sk, 0, sizeof(sk));
+  sk.framing = HEX_MRB_SOCK_LINE;
+  sk.max_frame = 64;
+  sk.rbuf = buf;
+  n = read(fd, buf, sizeof(buf));
+  sk.rlen = n > 0 ? (size_t)n : 0;
+  CHECK(hex_mrb_socket_frame(&sk, &off, &frame, &len) == 1 && len == 5 && memcmp(frame, "hello", 5) == 0);
+  close(cfd);
+  close(fd);
+  close(lfd);
+}
+
+// Child output lines: CR LF and LF ends, long runs cut at max_line
+static void
+test_process_split(void)
+{
+  const char *out = "ab\r\n\ncdefgh";
+  static char big[70001];
+  size_t llen = 99, pos = 0, pieces = 0, longest = 0, used;
+  int fd[2];
+  CHECK(hex_mrb_process_split(out, strlen(out), 4, &llen) == 4 && llen == 2);
+  CHECK(hex_mrb_process_split(out + 4, strlen(out) - 4, 4, &llen) == 1 && llen == 0);
+  CHECK(hex_mrb_process_split(out + 5, 6, 4, &llen) == 4 && llen == 4);
+  CHECK(hex_mrb_process_split(out + 9, 2, 4, &llen) == 0);
+  // A long line is cut even once its newline has arrived
+  CHECK(hex_mrb_process_split("abcdefghij\n", 11, 4, &llen) == 4 && llen == 4);
+  CHECK(hex_mrb_process_split("ghij\n", 5, 4, &llen) == 5 && llen == 4);
+  memset(big, 'x', 70000);
+  big[70000] = '\n';
+  while ((used = hex_mrb_process_split(big + pos, sizeof(big) - pos, 65536, &llen)) > 0) {
+    longest = llen > longest ? llen : longest;
+    pos += used;
+    pieces++;
+  }
+  CHECK(pos == sizeof(big) && pieces == 2 && longest == 65536);
+  CHECK(hex_mrb_pipe(fd) == 0);
+  CHECK((fcntl(fd[0], F_GETFD) & FD_CLOEXEC) && (fcntl(fd[1], F_GETFD) & FD_CLOEXEC));
+  CHECK(!(fcntl(fd[1], F_GETFL) & O_NONBLOCK));
+  close(fd[0]);
+  close(fd[1]);
+}
+
+// Split a server line into word[] and word_eol[] as HexChat does, the
+// slots past the end hold ""
+static void
+test_words(char *line, char *word[32], char *word_eol[32])
+{
+  static char copy[32][512];
+  int n = 1;
+  char *p = line;
+  word[0] = word_eol[0] = "";
+  while (n < 32 && *p != 0) {
+    size_t len = strcspn(p, " ");
+    word_eol[n] = p;
+    memcpy(copy[n], p, len);
+    copy[n][len] = 0;
+    word[n] = copy[n];
+    n++;
+    p += len;
+    while (*p == ' ') {
+      p++;
+    }
+  }
+  for (; n < 32; n++) {
+    word[n] = word_eol[n] = "";
+  }
+}
+
+// Feed one WHOIS numeric to an entry
+static void
+test_whois_line(struct hex_mrb_whois *e, const char *line)
+{
+  char buf[512], *word[32], *word_eol[32];
+  snprintf(buf, sizeof(buf), "%s", line);
+  test_words(buf, word, word_eol);
+  hex_mrb_whois_parse(e, word, word_eol);
+}
+
+// WHOIS numerics fill the fields, channel lists are joined
+static void
+test_whois_parse(void)
+{
+  struct hex_mrb_whois e;
+  char buf[32];
+  memset(&e, 0, sizeof(e));
+  hex_mrb_whois_clear(&e);
+  test_whois_line(&e, ":irc.example 311 me Nick ~u host.example * :Real Name");
+  test_whois_line(&e, ":irc.example 312 me Nick irc.example :Example server");
+  test_whois_line(&e, ":irc.example 319 me Nick :@#a #b");
+  test_whois_line(&e, ":irc.example 319 me Nick :+#c");
+  test_whois_line(&e, ":irc.example 317 me Nick 42 1700000000 :seconds idle, signon time");
+  test_whois_line(&e, ":irc.example 330 me Nick acct :is logged in as");
+  test_whois_line(&e, ":irc.example 301 me Nick :gone fishing");
+  test_whois_line(&e, ":irc.example 671 me Nick :is using a secure connection");
+  test_whois_line(&e, ":irc.example 320 me Nick :is identified");
+  CHECK(strcmp(e.field[HEX_MRB_WHOIS_NICK], "Nick") == 0);
+  CHECK(strcmp(e.field[HEX_MRB_WHOIS_USER], "~u") == 0 && strcmp(e.field[HEX_MRB_WHOIS_HOST], "host.example") == 0);
+  CHECK(strcmp(e.field[HEX_MRB_WHOIS_REALNAME], "Real Name") == 0);
+  CHECK(strcmp(e.field[HEX_MRB_WHOIS_SERVER], "irc.example") == 0);
+  CHECK(strcmp(e.field[HEX_MRB_WHOIS_SERVER_INFO], "Example server") == 0);
+  CHECK(strcmp(e.field[HEX_MRB_WHOIS_CHANNELS], "@#a #b +#c") == 0);
+  CHECK(e.idle == 42 && e.signon == 1700000000);
+  CHECK(strcmp(e.field[HEX_MRB_WHOIS_ACCOUNT], "acct") == 0);
+  CHECK(strcmp(e.field[HEX_MRB_WHOIS_AWAY], "gone fishing") == 0);
+  CHECK(e.secure && !e.oper);
+  // Servers that leave the signon time out
+  test_whois_line(&e, ":irc.example 317 me Nick 7 :seconds idle");
+  CHECK(e.idle == 7 && e.signon == -1);
+  hex_mrb_whois_clear(&e);
+  CHECK(strcmp(hex_mrb_whois_prefix_nick(":Nick!u@h", buf, sizeof(buf)), "Nick") == 0);
+  CHECK(strcmp(hex_mrb_whois_prefix_nick("irc.example", buf, sizeof(buf)), "irc.example") == 0);
+}
+
+// Queued items are found until they are sent or removed
+static void
+test_queue_has(void)
+{
+  struct hex_mrb_queue q;
+  memset(&q, 0, sizeof(q));
+  test_queue_append(&q, HEX_MRB_QUEUE_LOW, test_queue_item(7, "WHOIS a"));
+  hex_queues = &q;
+  CHECK(hex_mrb_queue_has(7) && !hex_mrb_queue_has(8));
+  hex_mrb_queue_item_free(hex_mrb_queue_shift(&q, HEX_MRB_QUEUE_LOW));
+  CHECK(!hex_mrb_queue_has(7));
+  hex_queues = NULL;
+}
+
+// Running totals of a counter ring match summing its buckets
+static void
+test_rate_window(void)
+{
+  uint32_t counts[8], total = 0;
+  uint64_t epoch = 0, now = 0;
+  int ok = 1;
+  memset(counts, 0, sizeof(counts));
+  for (int step = 0; step < 500; step++) {
+    now += (uint64_t)(step * 7 % 5 == 0 ? step % 11 : 1);
+    hex_mrb_rate_advance(&epoch, counts, &total, 8, now);
+    counts[now % 8] += (uint32_t)(step % 3 + 1);
+    total += (uint32_t)(step % 3 + 1);
+    for (uint32_t k = 1; k <= 9; k++) {
+      uint32_t want = 0;
+      for (uint32_t i = 0; i < k && i < 8; i++) {
+        want += counts[(now + 8 - i) % 8];
+      }
+      ok &= hex_mrb_rate_sum(counts, total, 8, now, k) == want;
+    }
+  }
+  CHECK(ok);
+  // A gap longer than the ring expires everything
+  hex_mrb_rate_advance(&epoch, counts, &total, 8, now + 8);
+  CHECK(total == 0 && hex_mrb_rate_sum(counts, total, 8, now + 8, 8) == 0);
+}
+
+// Compress and decompress a buffer, true if it comes back unchanged
+static int
+test_lz_round(const unsigned char *src, uint32_t n, uint32_t *clen)
+{
+  unsigned char *comp = (unsigned char *)malloc(n + n / 128 + 1);
+  unsigned char *back = (unsigned char *)malloc(n + 1);
+  int64_t len;
+  int ok;
+  *clen = hex_mrb_lz_compress(src, n, comp);
+  len = hex_mrb_lz_decompress(comp, *clen, back, n);
+  ok = *clen <= n + n / 128 + 1 && len == (int64_t)n && memcmp(back, src, n) == 0;
+  free(comp);
+  free(back);
+  return ok;
+}
+
+// Archive blocks survive the LZ coder, and damaged ones are refused
+static void
+test_lz_codec(void)
+{
+  uint32_t n = 140000, clen, seed = 12345;
+  unsigned char *buf = (unsigned char *)malloc(n);
+  unsigned char out[64];
+  for (uint32_t i = 0; i < n; i++) {
+    seed = seed * 1103515245u + 12345u;
+    buf[i] = (unsigned char)(seed >> 16);
+  }
+  CHECK(test_lz_round(buf, 0, &clen) && clen == 0);
+  CHECK(test_lz_round(buf, 3, &clen) && clen == 4);
+  // Incompressible input costs one byte per 128 literals
+  CHECK(test_lz_round(buf, 65536, &clen) && clen >= 65536 && clen <= 65536 + 512);
+  // A repeat 70000 bytes back is out of reach of the 16 bit distance
+  memcpy(buf + 70000, buf, 70000);
+  CHECK(test_lz_round(buf, n, &clen) && clen >= n);
+  // but a recent one is found
+  memcpy(buf + 256, buf, 256);
+  CHECK(test_lz_round(buf, 512, &clen) && clen < 400);
+  memset(buf, 'a', 65536);
+  CHECK(test_lz_round(buf, 65536, &clen) && clen < 2048);
+  memcpy(buf, "hello hello hello hello", 23);
+  CHECK(test_lz_round(buf, 23, &clen) && clen < 23);
+  free(buf);
+  // Literal run past the end of the input
+  CHECK(hex_mrb_lz_decompress((const unsigned char *)"\x04" "abc", 4, out, sizeof(out)) == -1);
+  // Literal run past the end of the output
+  CHECK(hex_mrb_lz_decompress((const unsigned char *)"\x04" "abcde", 6, out, 4) == -1);
+  // Match with its distance cut off
+  CHECK(hex_mrb_lz_decompress((const unsigned char *)"\x00" "a\x80\x01", 4, out, sizeof(out)) == -1);
+  // Distance of zero, and one reaching before the start
+  CHECK(hex_mrb_lz_decompress((const unsigned char *)"\x00" "a\x80\x00\x00", 5, out, sizeof(out)) == -1);
+  CHECK(hex_mrb_lz_decompress((const unsigned char *)"\x00" "a\x80\x02\x00", 5, out, sizeof(out)) == -1);
+  // Match past the end of the output
+  CHECK(hex_mrb_lz_decompress((const unsigned char *)"\x00" "a\x80\x01\x00", 5, out, 4) == -1);
+  CHECK(hex_mrb_lz_decompress((const unsigned char *)"\x00" "a\x80\x01\x00", 5, out, 5) == 5 && memcmp(out, "aaaaa", 5) == 0);
+}
+
+// Object heap pages are charged to core, other blocks to the running plugin
+static void
+test_mem_heap_page(void)
+{
+  uint32_t owner = hex_mrb_mem_owner("TestPlugin");
+  uint64_t core = hex_mem_owners[0].live;
+  void *page, *str;
+  CHECK(owner > 0);
+  hex_mem_current = owner;
+  page = hex_mrb_allocf(NULL, NULL, HEX_MRB_HEAP_PAGE_BYTES, NULL);
+  str = hex_mrb_allocf(NULL, NULL, 1000, NULL);
+  hex_mem_current = 0;
+  CHECK(page != NULL && str != NULL);
+  CHECK(hex_mem_owners[0].live == core + HEX_MRB_HEAP_PAGE_BYTES);
+  CHECK(hex_mem_owners[owner].live == 1000);
+  hex_mrb_allocf(NULL, page, 0, NULL);
+  hex_mrb_allocf(NULL, str, 0, NULL);
+  CHECK(hex_mem_owners[0].live == core && hex_mem_owners[owner].live == 0);
+}
+
+// Small blocks come from the pool of their size class and move between
+// classes and malloc as they are resized
+static void
+test_pool_blocks(void)
+{
+  struct hex_mrb_mem_head *h, *blocks[4096];
+  uint32_t per_page = (HEX_MRB_POOL_PAGE - HEX_MRB_POOL_HEAD) / hex_pool_sizes[3];
+  uint32_t n = per_page * 3 + 1;
+  int ok = 1;
+  hex_mrb_pool_init();
+  for (uint32_t cls = 0; cls < HEX_MRB_POOL_CLASSES; cls++) {
+    size_t size = hex_pool_sizes[cls] - sizeof(struct hex_mrb_mem_head);
+    h = hex_mrb_block_alloc(size);
+    ok &= h != NULL && h->pool == cls + 1 && ((uintptr_t)(h + 1) & 15) == 0;
+    memset(h + 1, 0xab, size);
+    hex_mrb_block_free(h);
+    ok &= hex_pool[cls].used == 0 && hex_pool[cls].requested == 0;
+  }
+  CHECK(ok);
+  h = hex_mrb_block_alloc(HEX_MRB_POOL_MAX);
+  CHECK(h != NULL && h->pool == 0 && hex_pool_large == 1);
+  hex_mrb_block_free(h);
+  CHECK(hex_pool_large == 0 && hex_pool_large_bytes == 0);
+  // Pages emptied again are given back, but for one kept for reuse
+  for (uint32_t i = 0; i < n; i++) {
+    blocks[i] = hex_mrb_block_alloc(hex_pool_sizes[3] - sizeof(struct hex_mrb_mem_head));
+  }
+  CHECK(hex_pool[3].pages == 4 && hex_pool[3].used == n);
+  for (uint32_t i = 0; i < n; i += 2) {
+    hex_mrb_block_free(blocks[i]);
+  }
+  for (uint32_t i = 1; i < n; i += 2) {
+    hex_mrb_block_free(blocks[i]);
+  }
+  CHECK(hex_pool[3].pages == 1 && hex_pool[3].used == 0);
+  // Resizing keeps the contents across classes and to and from malloc
+  h = hex_mrb_block_alloc(10);
+  memcpy(h + 1, "0123456789", 10);
+  h->owner = 7;
+  h = hex_mrb_block_realloc(h, 12);
+  CHECK(h->pool == 1 && h->size == 12 && hex_pool[0].requested == 12);
+  h = hex_mrb_block_realloc(h, 200);
+  CHECK(h->pool != 1 && h->owner == 7 && memcmp(h + 1, "0123456789", 10) == 0);
+  CHECK(hex_pool[0].used == 0 && hex_pool[0].requested == 0);
+  h = hex_mrb_block_realloc(h, 5000);
+  CHECK(h->pool == 0 && hex_pool_large_bytes == 5000 && memcmp(h + 1, "0123456789", 10) == 0);
+  h = hex_mrb_block_realloc(h, 40);
+  CHECK(h->pool == 3 && hex_pool_large == 0 && h->owner == 7 && memcmp(h + 1, "0123456789", 10) == 0);
+  // Switching the pool off sends new blocks to malloc, live ones stay put
+  hex_pool_on = 0;
+  blocks[0] = hex_mrb_block_alloc(40);
+  CHECK(blocks[0]->pool == 0 && hex_pool[2].used == 1);
+  h = hex_mrb_block_realloc(h, 44);
+  CHECK(h->pool == 3 && hex_pool[2].requested == 44);
+  h = hex_mrb_block_realloc(h, 100);
+  CHECK(h->pool == 0 && hex_pool[2].used == 0 && memcmp(h + 1, "0123456789", 10) == 0);
+  hex_mrb_block_free(h);
+  hex_mrb_block_free(blocks[0]);
+  CHECK(hex_pool_large == 0 && hex_pool_large_bytes == 0);
+  hex_pool_on = 1;
+}
+
+int
+main(void)
+{
+  test_queue_shift();
+  test_queue_refill();
+  test_queue_remove();
+  test_casefold();
+  test_mask_fold();
+  test_history_arena();
+  test_archive_range();
+  test_log_rotate();
+  test_metrics_helpers();
+  test_socket_frame();
+  test_socket_echo();
+  test_process_split();
+  test_whois_parse();
+  test_queue_has();
+  test_rate_window();
+  test_lz_codec();
+  test_mem_heap_page();
+  test_pool_blocks();
+  printf("%d checks, %d failed\n", test_checks, test_failures);
+  return test_failures == 0 ? 0 : 1;
+}
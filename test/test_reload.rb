@@ -0,0 +1,147 @@
+# Tests of /mrb reload, run with CRuby against a stand-in for the C side:
+#   ruby test/test_reload.rb
+require 'tmpdir'
+
+module HexChat
+  PRI_NORM = 0
+
+  class Internal
+    @stubs = {}
+    @fail_stubs = 0
+    class << self
+      attr_reader :stubs
+      attr_accessor :fail_stubs
+
+      def stub(klass, *)
+        if @fail_stubs > 0
+          @fail_stubs -= 1
+          fail 'cannot hook'
+        end
+        @stubs[klass] = (@stubs[klass] || 0) + 1
+      end
+
+      def unstub(klass)
+        @stubs.delete(klass)
+      end
+
+      def load(file)
+        Kernel.load(file)
+        true
+      rescue => e
+        print("load: #{e.message}")
+        false
+      end
+
+      def print(_); end
+
+      def state_dump(v)
+        Marshal.dump(v)
+      end
+
+      def state_load(s)
+        Marshal.load(s)
+      end
+
+      def mem_owner(*); end
+
+      def method_missing(*); end
+
+      def respond_to_missing?(*)
+        true
+      end
+    end
+  end
+end
+
+load File.expand_path('../hexchat_mrb_lib.rb', __dir__)
+
+$checks = 0
+$failures = 0
+
+def check(ok, what)
+  $checks += 1
+  return if ok
+  $failures += 1
+  $stdout.puts "#{caller(1, 1).first}: check failed: #{what}"
+end
+
+Registry = HexChat::Plugin::Registry
+$events = []
+
+def write_plugin(file, body)
+  File.write(file, body)
+end
+
+def lazy_plugin(extra = '')
+  <<-RUBY
+    class TestLazy < HexChat::Plugin
+      on :command, 'lz' do |*| $events << :lz end
+      #{extra}
+      register lazy: true
+    end
+  RUBY
+end
+
+def plain_plugin(version, extra = '')
+  <<-RUBY
+    class TestPlain < HexChat::Plugin
+      setup { $events << [:setup, #{version}]; #{extra} }
+      cleanup { $events << [:cleanup, #{version}] }
+      snapshot { #{version} }
+      restore { |v| $events << [:restore, v] }
+      register
+    end
+  RUBY
+end
+
+# A lazy plugin that never fired keeps one set of declarations and stubs
+def test_reload_lazy(dir)
+  file = "#{dir}/lazy.rb"
+  write_plugin(file, lazy_plugin)
+  check(Registry.load(file), 'lazy plugin loads')
+  check(Registry.deferred_hooks(TestLazy).size == 1, 'one declaration')
+  check(Registry.reload_file(file), 'lazy plugin reloads')
+  check(Registry.deferred_hooks(TestLazy).size == 1, 'declarations not doubled by a reload')
+  check(HexChat::Internal.stubs[TestLazy] == 1 && Registry.lazy?(TestLazy), 'stubbed once')
+  # A file failing part way keeps the old declarations and stubs
+  write_plugin(file, lazy_plugin("fail 'broken'"))
+  check(!Registry.reload_file(file), 'broken file fails')
+  check(Registry.deferred_hooks(TestLazy).size == 1, 'old declarations kept after a failed load')
+  check(HexChat::Internal.stubs[TestLazy] == 1 && Registry.lazy?(TestLazy), 'still stubbed after a failed load')
+  # A failed swap puts the stubs back
+  write_plugin(file, lazy_plugin)
+  HexChat::Internal.fail_stubs = 1
+  check(!Registry.reload_file(file), 'failed swap fails')
+  check(Registry.deferred_hooks(TestLazy).size == 1, 'old declarations kept after a failed swap')
+  check(HexChat::Internal.stubs[TestLazy] == 1 && Registry.lazy?(TestLazy), 'stubs put back after a failed swap')
+  Registry.unregister(TestLazy)
+end
+
+# The new instance starts before the old one is cleaned up, and the old
+# one keeps running if it fails
+def test_reload_swap(dir)
+  file = "#{dir}/plain.rb"
+  write_plugin(file, plain_plugin(1))
+  check(Registry.load(file), 'plain plugin loads')
+  old = Registry.instance_variable_get(:@registry)[TestPlain]
+  $events.clear
+  write_plugin(file, plain_plugin(2))
+  check(Registry.reload_file(file), 'plain plugin reloads')
+  check($events == [[:setup, 2], [:restore, 1], [:cleanup, 1]], "swap order #{$events.inspect}")
+  check(Registry.instance_variable_get(:@registry)[TestPlain] != old, 'new instance registered')
+  old = Registry.instance_variable_get(:@registry)[TestPlain]
+  $events.clear
+  write_plugin(file, plain_plugin(3, "fail 'no'"))
+  check(!Registry.reload_file(file), 'failing setup fails the reload')
+  check($events == [[:setup, 3]], "old instance not cleaned up #{$events.inspect}")
+  check(Registry.instance_variable_get(:@registry)[TestPlain].equal?(old), 'old instance still registered')
+  check(Registry.deferred_hooks(TestPlain).empty?, 'no declarations left behind')
+  Registry.unregister(TestPlain)
+end
+
+Dir.mktmpdir do |dir|
+  test_reload_lazy(dir)
+  test_reload_swap(dir)
+end
+$stdout.puts "#{$checks} checks, #{$failures} failed"
+exit($failures == 0 ? 0 : 1)